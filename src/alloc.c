@@ -0,0 +1,333 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Allocators for metadata.
+
+  Slabs.  The caches keyed by object (directory ids, pagecache
+  generations, the immutable attribute table) hold many small records
+  of one size each, made and dropped at the rate metadata calls come
+  in.  A struct kvfs_slab hands them out of SLAB_PAGE pages carved
+  into equal slots, keeping freed slots on a list for the next
+  allocation; a record costs no malloc header and no trip into the
+  general allocator's size classes.  Pages go back only when the slab
+  is destroyed, so a slab that once held many more records than it
+  does now shows up as free space in the report.
+
+  Arenas.  Every call into kvfs.c needs the key of its path, and the
+  ones making two need both until they return.  Those come from a
+  bump arena of the calling thread's: kvfs_arena_alloc() moves a
+  pointer along a chunk, and kvfs_arena_reset(), when the call
+  returns, takes it back to the start of the first chunk and frees
+  any further chunks a big call needed.  So scratch is neither locked
+  nor freed piece by piece, and cannot leak past the call.  A
+  thread's arena is freed when the thread exits.
+
+  Both are in the statistics report: records in use and the share of
+  slots free per slab, and calls, allocations, chunks added and the
+  most scratch any one call used for the arenas.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "log.h"
+#include "stats.h"
+
+#define SLAB_PAGE	65536		// bytes carved up at a time
+#define ARENA_CHUNK	4096		// a thread's first chunk; bigger calls add more
+#define ARENA_ALIGN	16
+
+struct slab_page {
+    struct slab_page *next;
+};
+
+// the header takes a slot's worth of room at the start of each page
+#define PAGE_HEADER(size) (((sizeof(struct slab_page) + (size) - 1) / (size)) * (size))
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+    struct arena_chunk *head;		// the chunk being bumped along
+    struct arena_chunk *first;		// kept over resets
+    size_t bytes;			// handed out since the last reset
+    uint64_t allocs;			// likewise
+};
+
+static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kvfs_slab *slabs;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static uint64_t arenas, arena_calls, arena_allocs, arena_chunks, arena_peak;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+/////////////////////////////////////////////////////////////////////
+// slabs
+
+void kvfs_slab_init(struct kvfs_slab *slab, const char *name, size_t size)
+{
+    memset(slab, 0, sizeof(*slab));
+    slab->name = name;
+    // every slot starts suitably aligned for what it holds, and can
+    // hold the free list's link
+    if (size < sizeof(void *))
+	size = sizeof(void *);
+    slab->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    slab->per_page = (SLAB_PAGE - PAGE_HEADER(slab->size)) / slab->size;
+    pthread_mutex_init(&slab->lock, NULL);
+
+    pthread_mutex_lock(&slabs_lock);
+    slab->next = slabs;
+    slabs = slab;
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+// with slab->lock held
+static int add_page(struct kvfs_slab *slab)
+{
+    struct slab_page *page;
+    char *slot;
+    size_t i;
+
+    page = malloc(SLAB_PAGE);
+    if (page == NULL)
+	return -ENOMEM;
+    page->next = slab->pages;
+    slab->pages = page;
+    slab->npages++;
+    slot = (char *) page + PAGE_HEADER(slab->size);
+    for (i = 0; i < slab->per_page; i++, slot += slab->size) {
+	*(void **) slot = slab->free;
+	slab->free = slot;
+    }
+    return 0;
+}
+
+void *kvfs_slab_alloc(struct kvfs_slab *slab)
+{
+    void *p;
+
+    pthread_mutex_lock(&slab->lock);
+    if (slab->free == NULL && add_page(slab) < 0) {
+	pthread_mutex_unlock(&slab->lock);
+	return NULL;
+    }
+    p = slab->free;
+    slab->free = *(void **) p;
+    slab->in_use++;
+    slab->allocs++;
+    pthread_mutex_unlock(&slab->lock);
+    return p;
+}
+
+void *kvfs_slab_zalloc(struct kvfs_slab *slab)
+{
+    void *p = kvfs_slab_alloc(slab);
+
+    if (p != NULL)
+	memset(p, 0, slab->size);
+    return p;
+}
+
+void kvfs_slab_free(struct kvfs_slab *slab, void *p)
+{
+    if (p == NULL)
+	return;
+    pthread_mutex_lock(&slab->lock);
+    *(void **) p = slab->free;
+    slab->free = p;
+    slab->in_use--;
+    slab->frees++;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+void kvfs_slab_destroy(struct kvfs_slab *slab)
+{
+    struct kvfs_slab **sp;
+    struct slab_page *page, *next;
+
+    pthread_mutex_lock(&slabs_lock);
+    for (sp = &slabs; *sp != NULL; sp = &(*sp)->next) {
+	if (*sp == slab) {
+	    *sp = slab->next;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&slabs_lock);
+
+    pthread_mutex_lock(&slab->lock);
+    for (page = slab->pages; page != NULL; page = next) {
+	next = page->next;
+	free(page);
+    }
+    slab->pages = NULL;
+    slab->free = NULL;
+    slab->npages = slab->in_use = 0;
+    pthread_mutex_unlock(&slab->lock);
+    pthread_mutex_destroy(&slab->lock);
+}
+
+/////////////////////////////////////////////////////////////////////
+// arenas
+
+static void free_chunks(struct arena_chunk *c, struct arena_chunk *upto)
+{
+    struct arena_chunk *next;
+
+    for (; c != upto; c = next) {
+	next = c->next;
+	free(c);
+    }
+}
+
+static void free_arena(void *arg)
+{
+    struct arena *a = arg;
+
+    free_chunks(a->head, NULL);
+    free(a);
+    __atomic_fetch_sub(&arenas, 1, __ATOMIC_RELAXED);
+}
+
+static void make_arena_key(void)
+{
+    pthread_key_create(&arena_key, free_arena);
+}
+
+static struct arena_chunk *new_chunk(size_t size)
+{
+    struct arena_chunk *c;
+
+    c = malloc(sizeof(*c) + size);
+    if (c == NULL)
+	return NULL;
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+static struct arena *thread_arena(void)
+{
+    struct arena *a;
+
+    pthread_once(&arena_once, make_arena_key);
+    a = pthread_getspecific(arena_key);
+    if (a != NULL)
+	return a;
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+	return NULL;
+    a->head = a->first = new_chunk(ARENA_CHUNK);
+    if (a->head == NULL) {
+	free(a);
+	return NULL;
+    }
+    pthread_setspecific(arena_key, a);
+    COUNT(arenas, 1);
+    return a;
+}
+
+void *kvfs_arena_alloc(size_t size)
+{
+    struct arena *a = thread_arena();
+    struct arena_chunk *c;
+    void *p;
+
+    if (a == NULL)
+	return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    c = a->head;
+    if (c->size - c->used < size) {
+	// chunks after the first are newest first, so a reset can
+	// free everything ahead of it
+	c = new_chunk(size > ARENA_CHUNK ? size : ARENA_CHUNK);
+	if (c == NULL)
+	    return NULL;
+	c->next = a->head;
+	a->head = c;
+	COUNT(arena_chunks, 1);
+    }
+    p = c->data + c->used;
+    c->used += size;
+    a->bytes += size;
+    a->allocs++;
+    return p;
+}
+
+void kvfs_arena_reset(void)
+{
+    struct arena *a;
+    uint64_t peak;
+
+    pthread_once(&arena_once, make_arena_key);
+    a = pthread_getspecific(arena_key);
+    if (a == NULL || a->allocs == 0)
+	return;
+    free_chunks(a->head, a->first);
+    a->head = a->first;
+    a->first->used = 0;
+
+    COUNT(arena_calls, 1);
+    COUNT(arena_allocs, a->allocs);
+    peak = __atomic_load_n(&arena_peak, __ATOMIC_RELAXED);
+    while (a->bytes > peak &&
+	   !__atomic_compare_exchange_n(&arena_peak, &peak, a->bytes, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+    a->bytes = 0;
+    a->allocs = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+static void alloc_report(FILE *out)
+{
+    struct kvfs_slab *s;
+    size_t slots;
+
+    pthread_mutex_lock(&slabs_lock);
+    for (s = slabs; s != NULL; s = s->next) {
+	pthread_mutex_lock(&s->lock);
+	slots = s->npages * s->per_page;
+	fprintf(out, "    slab %s: %zu record(s) of %zu bytes in use, %zu page(s), %.1f%% free; "
+		"%llu alloc(s), %llu free(s)\n",
+		s->name, s->in_use, s->size, s->npages,
+		slots > 0 ? 100.0 * (slots - s->in_use) / slots : 0.0,
+		(unsigned long long) s->allocs, (unsigned long long) s->frees);
+	pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    fprintf(out, "    arenas: %llu thread(s), %llu call(s), %llu alloc(s), %llu chunk(s) added, "
+	    "at most %llu bytes a call\n",
+	    (unsigned long long) arenas, (unsigned long long) arena_calls,
+	    (unsigned long long) arena_allocs, (unsigned long long) arena_chunks,
+	    (unsigned long long) arena_peak);
+}
+
+int kvfs_alloc_init(struct kvfs_state *state)
+{
+    (void) state;
+
+    kvfs_stats_register("alloc", alloc_report);
+    return 0;
+}
+
+void kvfs_alloc_destroy(struct kvfs_state *state)
+{
+    (void) state;
+
+    kvfs_stats_unregister("alloc");
+}
@@ -0,0 +1,47 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Slabs of fixed-size metadata records, and per-thread scratch arenas
+  for the calls, see alloc.c.
+*/
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct kvfs_state;
+
+struct kvfs_slab {
+    const char *name;			// in the statistics report
+    size_t size;			// of a slot
+    size_t per_page;
+    pthread_mutex_t lock;
+    void *free;				// free slots, linked through their first word
+    struct slab_page *pages;
+    size_t npages, in_use;
+    uint64_t allocs, frees;
+    struct kvfs_slab *next;		// on the list of slabs reported
+};
+
+int  kvfs_alloc_init(struct kvfs_state *state);
+void kvfs_alloc_destroy(struct kvfs_state *state);
+
+// A slab of records of size bytes.  Records are not zeroed unless
+// asked for; destroying the slab frees all of them at once.
+void kvfs_slab_init(struct kvfs_slab *slab, const char *name, size_t size);
+void kvfs_slab_destroy(struct kvfs_slab *slab);
+void *kvfs_slab_alloc(struct kvfs_slab *slab);
+void *kvfs_slab_zalloc(struct kvfs_slab *slab);
+void kvfs_slab_free(struct kvfs_slab *slab, void *p);
+
+// Scratch for the call the thread is in: good until the call's
+// kvfs_arena_reset(), never freed on its own.
+void *kvfs_arena_alloc(size_t size);
+void kvfs_arena_reset(void);
+
+#endif
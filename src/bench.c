@@ -0,0 +1,696 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  kvfs-bench: measure kvfs without mounting it.
+
+  This is linked against the same objects as kvfs and calls through
+  kvfs_oper exactly as the FUSE library would (see harness.c).  No
+  /dev/fuse, no kernel round trips: what is left is the cost of kvfs
+  itself and of the filesystem under rootdir.
+
+  Each client thread runs the chosen workload against its own files
+  and times every operation; at the end the latencies of all threads
+  are merged for percentiles.
+
+  usage: kvfs-bench [options] rootdir[:rootdir...]
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "harness.h"
+#include "stats.h"
+
+struct bench_config {
+    const char *workload;
+    int threads;
+    long ops;			// per thread
+    double seconds;		// stop early after this long, 0 = no limit
+    size_t file_size;
+    size_t io_size;
+    int files;			// per thread, for the file-set workloads
+    int do_fsync;
+    unsigned int seed;
+};
+
+// one client's results
+struct client {
+    pthread_t thread;
+    int id;
+    struct bench_config *cfg;
+    uint64_t *lat;		// nanoseconds, one per op
+    long nlat, caplat;
+    uint64_t bytes;
+    long errors;
+    unsigned int rand;
+    char *buf;
+};
+
+struct workload {
+    const char *name;
+    const char *help;
+    int  (*setup)(struct client *c);		// untimed, may be NULL
+    int  (*op)(struct client *c, long i);	// one timed unit of work
+};
+
+static struct bench_config cfg = {
+    .workload = "create",
+    .threads = 1,
+    .ops = 10000,
+    .file_size = 1 << 20,
+    .io_size = 4096,
+    .files = 100,
+    .seed = 1,
+};
+static volatile int stop;
+static pthread_barrier_t start_line;
+
+/////////////////////////////////////////////////////////////////////
+// helpers
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void file_path(char *path, size_t len, struct client *c, const char *kind, long i)
+{
+    snprintf(path, len, "/bench-%d-%s%ld", c->id, kind, i);
+}
+
+static int check(struct client *c, int retstat)
+{
+    if (retstat < 0)
+	c->errors++;
+    return retstat;
+}
+
+static int create_file(struct client *c, const char *path, size_t size, int do_fsync)
+{
+    struct fuse_file_info fi;
+    size_t off, n;
+    int retstat;
+
+    retstat = kvfs_oper.mknod(path, S_IFREG | 0644, 0);
+    if (retstat < 0 && retstat != -EEXIST)
+	return check(c, retstat);
+
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    retstat = kvfs_oper.open(path, &fi);
+    if (retstat < 0)
+	return check(c, retstat);
+    for (off = 0; off < size && retstat >= 0; off += n) {
+	n = size - off < c->cfg->io_size ? size - off : c->cfg->io_size;
+	retstat = check(c, kvfs_oper.write(path, c->buf, n, off, &fi));
+	if (retstat > 0)
+	    c->bytes += retstat;
+    }
+    if (do_fsync && retstat >= 0)
+	check(c, kvfs_oper.fsync(path, 0, &fi));
+    kvfs_oper.flush(path, &fi);
+    kvfs_oper.release(path, &fi);
+    return retstat < 0 ? retstat : 0;
+}
+
+static uint64_t random_offset(struct client *c)
+{
+    uint64_t blocks = c->cfg->file_size / c->cfg->io_size;
+
+    if (blocks == 0)
+	return 0;
+    return (rand_r(&c->rand) % blocks) * c->cfg->io_size;
+}
+
+// each data workload works on one big file per client, kept open
+struct data_file {
+    char path[64];
+    struct fuse_file_info fi;
+};
+
+static __thread struct data_file data_file;
+
+static int open_data_file(struct client *c, int create)
+{
+    int retstat;
+
+    file_path(data_file.path, sizeof(data_file.path), c, "data", 0);
+    if (create) {
+	retstat = create_file(c, data_file.path, c->cfg->file_size, 0);
+	if (retstat < 0)
+	    return retstat;
+    }
+    memset(&data_file.fi, 0, sizeof(data_file.fi));
+    data_file.fi.flags = O_RDWR;
+    return check(c, kvfs_oper.open(data_file.path, &data_file.fi));
+}
+
+/////////////////////////////////////////////////////////////////////
+// workloads
+
+// create, stat, chmod, rename, stat and unlink a file
+static int meta_op(struct client *c, long i)
+{
+    char path[64], path2[64];
+    struct stat st;
+
+    file_path(path, sizeof(path), c, "m", i);
+    file_path(path2, sizeof(path2), c, "n", i);
+    if (check(c, kvfs_oper.mknod(path, S_IFREG | 0644, 0)) < 0)
+	return -1;
+    check(c, kvfs_oper.getattr(path, &st));
+    check(c, kvfs_oper.chmod(path, 0600));
+    check(c, kvfs_oper.rename(path, path2));
+    check(c, kvfs_oper.getattr(path2, &st));
+    return check(c, kvfs_oper.unlink(path2));
+}
+
+// create a small file and write it
+static int create_op(struct client *c, long i)
+{
+    char path[64];
+
+    file_path(path, sizeof(path), c, "c", i);
+    return create_file(c, path, c->cfg->io_size, c->cfg->do_fsync);
+}
+
+// a source-tree-like set of files: a directory per 16 files, sizes
+// spread between 512 bytes and io_size
+static void tree_path(char *path, size_t len, struct client *c, long i)
+{
+    snprintf(path, len, "/bench-%d-dir%ld/file%ld.c", c->id, i / 16, i);
+}
+
+static size_t tree_size(long i, size_t max)
+{
+    return 512 + (size_t) (i * 2654435761u) % (max > 512 ? max - 512 : 1);
+}
+
+static int tree_setup(struct client *c)
+{
+    char path[64];
+    long i;
+
+    for (i = 0; i < c->cfg->files; i++) {
+	if (i % 16 == 0) {
+	    snprintf(path, sizeof(path), "/bench-%d-dir%ld", c->id, i / 16);
+	    kvfs_oper.mkdir(path, 0755);
+	}
+	tree_path(path, sizeof(path), c, i);
+	if (create_file(c, path, tree_size(i, c->cfg->io_size), 0) < 0)
+	    return -1;
+    }
+    c->bytes = 0;
+    return 0;
+}
+
+// stat, open, read whole and close one file of the tree, the way a
+// build or a grep walks a source tree
+static int tree_op(struct client *c, long i)
+{
+    struct fuse_file_info fi;
+    struct stat st;
+    char path[64];
+    int retstat;
+
+    tree_path(path, sizeof(path), c, i % c->cfg->files);
+    if (check(c, kvfs_oper.getattr(path, &st)) < 0)
+	return -1;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    if (check(c, kvfs_oper.open(path, &fi)) < 0)
+	return -1;
+    retstat = check(c, kvfs_oper.read(path, c->buf, c->cfg->io_size, 0, &fi));
+    if (retstat > 0)
+	c->bytes += retstat;
+    kvfs_oper.release(path, &fi);
+    return retstat;
+}
+
+static int data_setup(struct client *c)
+{
+    int retstat = open_data_file(c, 1);
+
+    c->bytes = 0;
+    return retstat;
+}
+
+static int rw_op(struct client *c, uint64_t off, int write)
+{
+    int retstat;
+
+    if (write)
+	retstat = kvfs_oper.write(data_file.path, c->buf, c->cfg->io_size, off, &data_file.fi);
+    else
+	retstat = kvfs_oper.read(data_file.path, c->buf, c->cfg->io_size, off, &data_file.fi);
+    if (check(c, retstat) > 0)
+	c->bytes += retstat;
+    if (write && c->cfg->do_fsync && retstat >= 0)
+	retstat = check(c, kvfs_oper.fsync(data_file.path, 1, &data_file.fi));
+    return retstat;
+}
+
+static int seqread_op(struct client *c, long i)
+{
+    uint64_t blocks = c->cfg->file_size / c->cfg->io_size;
+
+    return rw_op(c, (i % (blocks ? blocks : 1)) * c->cfg->io_size, 0);
+}
+
+static int seqwrite_op(struct client *c, long i)
+{
+    uint64_t blocks = c->cfg->file_size / c->cfg->io_size;
+
+    return rw_op(c, (i % (blocks ? blocks : 1)) * c->cfg->io_size, 1);
+}
+
+static int randread_op(struct client *c, long i)
+{
+    (void) i;
+    return rw_op(c, random_offset(c), 0);
+}
+
+static int randwrite_op(struct client *c, long i)
+{
+    (void) i;
+    return rw_op(c, random_offset(c), 1);
+}
+
+// 70% random reads, 20% random writes, 10% getattr
+static int mixed_op(struct client *c, long i)
+{
+    struct stat st;
+    int dice = rand_r(&c->rand) % 10;
+
+    (void) i;
+    if (dice < 7)
+	return rw_op(c, random_offset(c), 0);
+    if (dice < 9)
+	return rw_op(c, random_offset(c), 1);
+    return check(c, kvfs_oper.getattr(data_file.path, &st));
+}
+
+// a small write followed by fsync, from every client at once: what
+// group commit is for
+static int fsync_op(struct client *c, long i)
+{
+    uint64_t off = (i * c->cfg->io_size) % (c->cfg->file_size ? c->cfg->file_size : 1);
+    int retstat;
+
+    retstat = check(c, kvfs_oper.write(data_file.path, c->buf, c->cfg->io_size, off, &data_file.fi));
+    if (retstat > 0)
+	c->bytes += retstat;
+    if (retstat >= 0)
+	retstat = check(c, kvfs_oper.fsync(data_file.path, 1, &data_file.fi));
+    return retstat;
+}
+
+// a sparse file_size file: one io_size block of data in every eight,
+// holes in between, like a thinly provisioned VM image
+static int sparse_setup(struct client *c)
+{
+    struct fuse_file_info fi;
+    char path[64];
+    uint64_t off;
+    int retstat;
+
+    file_path(path, sizeof(path), c, "sparse", 0);
+    retstat = kvfs_oper.mknod(path, S_IFREG | 0644, 0);
+    if (retstat < 0 && retstat != -EEXIST)
+	return check(c, retstat);
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    retstat = check(c, kvfs_oper.open(path, &fi));
+    if (retstat < 0)
+	return retstat;
+    for (off = 0; off < c->cfg->file_size && retstat >= 0; off += 8 * c->cfg->io_size)
+	retstat = check(c, kvfs_oper.write(path, c->buf, c->cfg->io_size, off, &fi));
+    if (retstat >= 0)
+	retstat = check(c, kvfs_oper.ftruncate(path, c->cfg->file_size, &fi));
+    kvfs_oper.release(path, &fi);
+    c->bytes = 0;
+    return retstat < 0 ? retstat : 0;
+}
+
+// with offload set, the way cp does: copy_file_range() first, and
+// read/write once kvfs turns it down for these files
+static int copy_range(struct client *c, const char *src, struct fuse_file_info *sfi,
+		      const char *dst, struct fuse_file_info *dfi, off_t off, off_t end,
+		      int offload)
+{
+    ssize_t copied;
+    size_t n;
+    int retstat = 0;
+
+    while (offload && off < end) {
+	copied = kvfs_copy_file_range(src, sfi, off, dst, dfi, off, end - off, 0);
+	if (copied == -EOPNOTSUPP)
+	    break;
+	if (check(c, copied < 0 ? copied : 0) < 0)
+	    return copied;
+	if (copied == 0)
+	    return 0;
+	off += copied;
+	c->bytes += copied;
+    }
+    for (; off < end; off += n) {
+	n = end - off < (off_t) c->cfg->io_size ? end - off : c->cfg->io_size;
+	retstat = check(c, kvfs_oper.read(src, c->buf, n, off, sfi));
+	if (retstat <= 0)
+	    break;
+	n = retstat;
+	retstat = check(c, kvfs_oper.write(dst, c->buf, n, off, dfi));
+	if (retstat < 0)
+	    break;
+	c->bytes += n;
+    }
+    return retstat;
+}
+
+// copy the sparse file to a fresh destination; with holes set, the
+// way cp --sparse=always does: only the runs SEEK_DATA/SEEK_HOLE find
+// are copied, and the destination's size makes the rest holes
+static int copy_sparse(struct client *c, int holes, int offload)
+{
+    struct fuse_file_info sfi, dfi;
+    char src[64], dst[64];
+    off_t size = c->cfg->file_size, data, hole;
+    int retstat;
+
+    file_path(src, sizeof(src), c, "sparse", 0);
+    file_path(dst, sizeof(dst), c, "sparsecopy", 0);
+    retstat = kvfs_oper.mknod(dst, S_IFREG | 0644, 0);
+    if (retstat < 0 && retstat != -EEXIST)
+	return check(c, retstat);
+    memset(&sfi, 0, sizeof(sfi));
+    sfi.flags = O_RDONLY;
+    memset(&dfi, 0, sizeof(dfi));
+    dfi.flags = O_WRONLY;
+    if (check(c, kvfs_oper.open(src, &sfi)) < 0)
+	return -1;
+    if (check(c, kvfs_oper.open(dst, &dfi)) < 0) {
+	kvfs_oper.release(src, &sfi);
+	return -1;
+    }
+
+    retstat = check(c, kvfs_oper.ftruncate(dst, 0, &dfi));
+    if (!holes) {
+	if (retstat >= 0)
+	    retstat = copy_range(c, src, &sfi, dst, &dfi, 0, size, offload);
+    } else {
+	for (data = 0; retstat >= 0 && data < size; data = hole) {
+	    data = kvfs_lseek(src, data, SEEK_DATA, &sfi);
+	    if (data < 0)
+		break;		// ENXIO: only a hole is left
+	    hole = kvfs_lseek(src, data, SEEK_HOLE, &sfi);
+	    if (hole < 0)
+		hole = size;
+	    retstat = copy_range(c, src, &sfi, dst, &dfi, data, hole, offload);
+	}
+	if (retstat >= 0)
+	    retstat = check(c, kvfs_oper.ftruncate(dst, size, &dfi));
+    }
+
+    kvfs_oper.release(dst, &dfi);
+    kvfs_oper.release(src, &sfi);
+    return retstat;
+}
+
+static int sparsecopy_op(struct client *c, long i)
+{
+    (void) i;
+    return copy_sparse(c, 1, 0);
+}
+
+static int fullcopy_op(struct client *c, long i)
+{
+    (void) i;
+    return copy_sparse(c, 0, 0);
+}
+
+// server-side: reflinked or copied in the kernel below kvfs
+static int rangecopy_op(struct client *c, long i)
+{
+    (void) i;
+    return copy_sparse(c, 1, 1);
+}
+
+// what df and monitoring agents do; compare -o statfs_interval=0
+static int statfs_op(struct client *c, long i)
+{
+    struct statvfs sv;
+
+    (void) i;
+    return check(c, kvfs_oper.statfs("/", &sv));
+}
+
+// the probes ls -Z and ACL aware tools make on every file
+static int xattr_op(struct client *c, long i)
+{
+    static const char *names[] = { "security.selinux", "system.posix_acl_access", "user.mime_type" };
+    char value[256];
+    int retstat;
+
+    retstat = kvfs_oper.getxattr(data_file.path, names[i % 3], value, sizeof(value));
+    return check(c, retstat == -ENODATA ? 0 : retstat);
+}
+
+static struct workload workloads[] = {
+    { "meta",      "create/stat/chmod/rename/stat/unlink one file",	NULL,		  meta_op },
+    { "create",    "create and write an io_size file (-F: and fsync it)", NULL,		  create_op },
+    { "tree",      "stat+open+read+close files of a source-like tree",	tree_setup,	  tree_op },
+    { "seqread",   "sequential io_size reads of a file_size file",	data_setup,	  seqread_op },
+    { "seqwrite",  "sequential io_size writes",				data_setup,	  seqwrite_op },
+    { "randread",  "random io_size reads",				data_setup,	  randread_op },
+    { "randwrite", "random io_size writes",				data_setup,	  randwrite_op },
+    { "mixed",     "70% random read, 20% random write, 10% getattr",	data_setup,	  mixed_op },
+    { "fsync",     "io_size write + fdatasync per op",			data_setup,	  fsync_op },
+    { "sparsecopy", "copy a 1/8-full sparse file, skipping holes",	sparse_setup,	  sparsecopy_op },
+    { "fullcopy",  "copy the same sparse file byte for byte",		sparse_setup,	  fullcopy_op },
+    { "rangecopy", "copy its data runs with copy_file_range, like cp",	sparse_setup,	  rangecopy_op },
+    { "statfs",    "statfs the root, like a df poller",		NULL,		  statfs_op },
+    { "xattr",     "getxattr probes for attributes the file lacks",	data_setup,	  xattr_op },
+    { NULL, NULL, NULL, NULL }
+};
+
+/////////////////////////////////////////////////////////////////////
+// driver
+
+static void *client_main(void *arg)
+{
+    struct client *c = arg;
+    struct workload *w;
+    uint64_t t0, t1, deadline = 0;
+    long i;
+
+    harness_enter(c->id);
+    for (w = workloads; strcmp(w->name, c->cfg->workload) != 0; w++)
+	;
+    if (w->setup != NULL && w->setup(c) < 0)
+	stop = 1;
+
+    pthread_barrier_wait(&start_line);
+    if (c->cfg->seconds > 0)
+	deadline = now_nsec() + (uint64_t) (c->cfg->seconds * 1e9);
+
+    for (i = 0; i < c->cfg->ops && !stop; i++) {
+	if (c->nlat == c->caplat) {
+	    uint64_t *more = realloc(c->lat, 2 * c->caplat * sizeof(*more));
+
+	    if (more == NULL)
+		break;
+	    c->lat = more;
+	    c->caplat *= 2;
+	}
+	t0 = now_nsec();
+	w->op(c, i);
+	t1 = now_nsec();
+	c->lat[c->nlat++] = t1 - t0;
+	if (deadline && t1 >= deadline)
+	    break;
+    }
+
+    pthread_barrier_wait(&start_line);
+    if (data_file.path[0] != '\0')
+	kvfs_oper.release(data_file.path, &data_file.fi);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t *lat, long n, double p)
+{
+    long i = (long) (p / 100.0 * (n - 1) + 0.5);
+
+    return n ? lat[i] / 1000.0 : 0.0;
+}
+
+static void report(struct client *clients, uint64_t wall)
+{
+    uint64_t *all, bytes = 0, sum = 0;
+    long n = 0, errors = 0, i;
+    int t;
+
+    for (t = 0; t < cfg.threads; t++)
+	n += clients[t].nlat;
+    all = malloc((n + 1) * sizeof(*all));
+    if (all == NULL) {
+	perror("kvfs-bench: malloc");
+	return;
+    }
+    n = 0;
+    for (t = 0; t < cfg.threads; t++) {
+	memcpy(all + n, clients[t].lat, clients[t].nlat * sizeof(*all));
+	n += clients[t].nlat;
+	bytes += clients[t].bytes;
+	errors += clients[t].errors;
+    }
+    for (i = 0; i < n; i++)
+	sum += all[i];
+    qsort(all, n, sizeof(*all), cmp_u64);
+
+    printf("workload %s, %d thread(s), %ld op(s) in %.3f s\n",
+	   cfg.workload, cfg.threads, n, wall / 1e9);
+    printf("  throughput  %.0f ops/s", n * 1e9 / wall);
+    if (bytes > 0)
+	printf(", %.1f MB/s", bytes * 1e3 / wall);
+    printf("\n");
+    printf("  latency us  avg %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+	   n ? sum / 1000.0 / n : 0.0, percentile(all, n, 50), percentile(all, n, 90),
+	   percentile(all, n, 99), percentile(all, n, 99.9), n ? all[n - 1] / 1000.0 : 0.0);
+    if (errors > 0)
+	printf("  %ld operation(s) failed, see the log\n", errors);
+    free(all);
+}
+
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t n = strtoull(s, &end, 0);
+
+    switch (*end) {
+    case 'g': case 'G': n <<= 10;	// fall through
+    case 'm': case 'M': n <<= 10;	// fall through
+    case 'k': case 'K': n <<= 10;
+    }
+    return n;
+}
+
+static void usage(void)
+{
+    struct workload *w;
+
+    fprintf(stderr, "usage:  kvfs-bench [options] rootDir[:rootDir...]\n\n");
+    fprintf(stderr, "    -w WORKLOAD   what to run (default create):\n");
+    for (w = workloads; w->name != NULL; w++)
+	fprintf(stderr, "                    %-10s %s\n", w->name, w->help);
+    fprintf(stderr, "    -t N          client threads (default 1)\n");
+    fprintf(stderr, "    -n N          operations per thread (default 10000)\n");
+    fprintf(stderr, "    -d SECONDS    stop after this long\n");
+    fprintf(stderr, "    -s SIZE       data file size per thread (default 1M)\n");
+    fprintf(stderr, "    -b SIZE       I/O size, and file size for create (default 4K)\n");
+    fprintf(stderr, "    -f N          files per thread for tree (default 100)\n");
+    fprintf(stderr, "    -F            fsync after writes\n");
+    fprintf(stderr, "    -S SEED       random seed (default 1)\n");
+    fprintf(stderr, "    -o OPTS       kvfs mount options, as for kvfs -o\n");
+    fprintf(stderr, "\nrootDir should be a scratch directory; the log goes to ./kvfs.log.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct client *clients;
+    struct workload *w;
+    uint64_t t0, wall;
+    int opt, t;
+
+    if (harness_setup("kvfs-bench") < 0)
+	return EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "w:t:n:d:s:b:f:FS:o:h")) != -1) {
+	switch (opt) {
+	case 'w': cfg.workload = optarg; break;
+	case 't': cfg.threads = atoi(optarg); break;
+	case 'n': cfg.ops = atol(optarg); break;
+	case 'd': cfg.seconds = atof(optarg); break;
+	case 's': cfg.file_size = parse_size(optarg); break;
+	case 'b': cfg.io_size = parse_size(optarg); break;
+	case 'f': cfg.files = atoi(optarg); break;
+	case 'F': cfg.do_fsync = 1; break;
+	case 'S': cfg.seed = strtoul(optarg, NULL, 0); break;
+	case 'o':
+	    if (harness_options(optarg) < 0)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1 || cfg.threads < 1 || cfg.io_size == 0 || cfg.files < 1)
+	usage();
+    for (w = workloads; w->name != NULL; w++)
+	if (strcmp(w->name, cfg.workload) == 0)
+	    break;
+    if (w->name == NULL)
+	usage();
+    if (cfg.seconds > 0 && cfg.ops == 10000)
+	cfg.ops = 1L << 40;		// -d alone: run until the clock says stop
+
+    if (harness_mount(argv[optind]) < 0)
+	return EXIT_FAILURE;
+
+    clients = calloc(cfg.threads, sizeof(*clients));
+    if (clients == NULL) {
+	perror("kvfs-bench: calloc");
+	return EXIT_FAILURE;
+    }
+    pthread_barrier_init(&start_line, NULL, cfg.threads + 1);
+    for (t = 0; t < cfg.threads; t++) {
+	clients[t].id = t;
+	clients[t].cfg = &cfg;
+	clients[t].rand = cfg.seed + t;
+	clients[t].caplat = cfg.ops < 65536 ? cfg.ops : 65536;
+	clients[t].lat = malloc(clients[t].caplat * sizeof(uint64_t));
+	clients[t].buf = malloc(cfg.io_size);
+	if (clients[t].lat == NULL || clients[t].buf == NULL) {
+	    perror("kvfs-bench: malloc");
+	    return EXIT_FAILURE;
+	}
+	memset(clients[t].buf, 'a' + t % 26, cfg.io_size);
+	pthread_create(&clients[t].thread, NULL, client_main, &clients[t]);
+    }
+
+    // everyone has done their setup once the barrier opens
+    pthread_barrier_wait(&start_line);
+    t0 = now_nsec();
+    pthread_barrier_wait(&start_line);
+    wall = now_nsec() - t0;
+    for (t = 0; t < cfg.threads; t++)
+	pthread_join(clients[t].thread, NULL);
+
+    report(clients, wall);
+    kvfs_stats_dump(stdout);
+    harness_unmount();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+#
+# Key Value System
+# This program can be distributed under the terms of the GNU GPLv3.
+# See the file COPYING.
+#
+# Compare two kvfs-microbench JSON files (make bench writes bench.json)
+# and flag benchmarks that got slower by more than a threshold.
+#
+#   bench_compare.py [-t PCT] [-m real_time|cpu_time] baseline.json contender.json
+#
+# With repetitions the median aggregate is compared, otherwise the
+# mean of the iteration runs.  Exits 1 if anything regressed, so it
+# can gate a CI job.
+
+import argparse
+import json
+import sys
+
+UNITS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load(path, metric):
+    with open(path) as f:
+        doc = json.load(f)
+    runs, medians = {}, {}
+    for b in doc.get("benchmarks", []):
+        t = b[metric] * UNITS[b.get("time_unit", "ns")]
+        name = b.get("run_name", b["name"])
+        if b.get("run_type") == "aggregate":
+            if b.get("aggregate_name") == "median":
+                medians[name] = t
+        else:
+            runs.setdefault(name, []).append(t)
+    times = {name: sum(ts) / len(ts) for name, ts in runs.items()}
+    times.update(medians)
+    # keep the order the benchmarks ran in
+    order = list(dict.fromkeys(b.get("run_name", b["name"]) for b in doc.get("benchmarks", [])))
+    return times, order
+
+
+def main():
+    ap = argparse.ArgumentParser(description="compare two kvfs-microbench JSON files")
+    ap.add_argument("-t", "--threshold", type=float, default=5.0,
+                    help="percent slowdown that counts as a regression (default 5)")
+    ap.add_argument("-m", "--metric", choices=["real_time", "cpu_time"], default="cpu_time",
+                    help="which time to compare (default cpu_time)")
+    ap.add_argument("baseline")
+    ap.add_argument("contender")
+    args = ap.parse_args()
+
+    old, order = load(args.baseline, args.metric)
+    new, new_order = load(args.contender, args.metric)
+    order += [n for n in new_order if n not in old]
+
+    regressions = 0
+    print("%-36s %12s %12s %9s" % ("Benchmark", "Old ns", "New ns", "Change"))
+    for name in order:
+        if name not in new:
+            print("%-36s %12.1f %12s %9s" % (name, old[name], "-", "removed"))
+            continue
+        if name not in old:
+            print("%-36s %12s %12.1f %9s" % (name, "-", new[name], "new"))
+            continue
+        change = (new[name] - old[name]) / old[name] * 100 if old[name] > 0 else 0.0
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif change < -args.threshold:
+            flag = "  improved"
+        print("%-36s %12.1f %12.1f %+8.1f%%%s" % (name, old[name], new[name], change, flag))
+
+    if regressions:
+        print("\n%d benchmark(s) slower by more than %g%%" % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
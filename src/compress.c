@@ -0,0 +1,574 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Transparent compression (-o compress=lz4 or -o compress=zstd).
+
+  This is not a backend of its own but a layer in front of whichever
+  object store backend is in use.  A value is cut into fixed blocks of
+  BLOCK_SIZE bytes and each block is compressed on its own; blocks
+  that do not shrink by at least an eighth are kept as they are.  The
+  stored value is
+
+	struct zheader, nblocks x struct zblock, the blocks
+
+  so a read only has to fetch and decompress the blocks it covers.
+  Block tables are cached in memory, which also keeps getattr() (that
+  has to report the uncompressed size) from reading the header every
+  time.
+
+  Values that were stored before compression was turned on have no
+  header and are passed through untouched, so the option can be added
+  to an existing mount.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "log.h"
+#include "stats.h"
+#include "store.h"
+
+#define ZMAGIC		0x5a46564b	// "KVFZ"
+#define BLOCK_SIZE	(64 * 1024)
+#define ZCACHE_MAX	4096		// cached block tables
+
+#define ZBLOCK_RAW	1		// stored uncompressed
+
+enum { CODEC_LZ4 = 1, CODEC_ZSTD };
+
+struct zheader {
+    uint32_t magic;
+    uint32_t codec;
+    uint32_t block_size;
+    uint32_t nblocks;
+    uint64_t size;		// uncompressed
+};
+
+struct zblock {
+    uint32_t len;		// stored bytes
+    uint32_t flags;
+};
+
+// a value's block table, as cached
+struct ztable {
+    struct hnode node;		// keyed by object key, must be first
+    int refs;
+    int cached;
+    int plain;			// no header: pass reads straight through
+    struct zheader hdr;
+    uint64_t *offs;		// offs[i]: where block i starts in the value
+    uint32_t *flags;
+};
+
+static struct kvfs_store_ops *inner;
+static int codec;
+
+static pthread_mutex_t zcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable zcache;
+
+// for the statistics report, under zcache_lock
+static uint64_t bytes_in, bytes_out;
+static uint64_t blocks_packed, blocks_raw;
+
+static const char *codec_name(int c)
+{
+    return c == CODEC_LZ4 ? "lz4" : c == CODEC_ZSTD ? "zstd" : "none";
+}
+
+static size_t codec_bound(int c, size_t len)
+{
+#ifdef HAVE_LZ4
+    if (c == CODEC_LZ4)
+	return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_ZSTD
+    if (c == CODEC_ZSTD)
+	return ZSTD_compressBound(len);
+#endif
+    return len;
+}
+
+// returns the compressed length, or 0 if the block should stay raw
+static size_t codec_compress(int c, const char *src, size_t len, char *dst, size_t cap)
+{
+    size_t n = 0;
+
+#ifdef HAVE_LZ4
+    if (c == CODEC_LZ4) {
+	int r = LZ4_compress_default(src, dst, len, cap);
+	n = r > 0 ? (size_t) r : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (c == CODEC_ZSTD) {
+	n = ZSTD_compress(dst, cap, src, len, ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(n))
+	    n = 0;
+    }
+#endif
+    (void) src;
+    (void) dst;
+    (void) cap;
+    return n > 0 && n < len - len / 8 ? n : 0;
+}
+
+// returns the decompressed length, or -EIO
+static int codec_decompress(int c, const char *src, size_t len, char *dst, size_t cap)
+{
+#ifdef HAVE_LZ4
+    if (c == CODEC_LZ4) {
+	int r = LZ4_decompress_safe(src, dst, len, cap);
+	return r >= 0 ? r : -EIO;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (c == CODEC_ZSTD) {
+	size_t r = ZSTD_decompress(dst, cap, src, len);
+	return ZSTD_isError(r) ? -EIO : (int) r;
+    }
+#endif
+    (void) src;
+    (void) len;
+    (void) dst;
+    (void) cap;
+    return -EIO;
+}
+
+static void free_table(struct ztable *t)
+{
+    free(t->offs);
+    free(t->flags);
+    free(t);
+}
+
+static void free_table_node(struct hnode *node)
+{
+    struct ztable *t = (struct ztable *) node;
+
+    // tables still in use by a reader are freed when it lets go
+    t->cached = 0;
+    if (t->refs == 0)
+	free_table(t);
+}
+
+static void put_table(struct ztable *t)
+{
+    pthread_mutex_lock(&zcache_lock);
+    if (--t->refs == 0 && !t->cached)
+	free_table(t);
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+// caller holds zcache_lock
+static void cache_table(struct ztable *t)
+{
+    struct hnode *old;
+
+    // crude, but block tables are cheap to read back in
+    if (zcache.count >= ZCACHE_MAX) {
+	htable_free(&zcache, free_table_node);
+	htable_init(&zcache, 1024);
+    }
+    old = htable_remove(&zcache, t->node.key);
+    if (old != NULL)
+	free_table_node(old);
+    t->cached = 1;
+    htable_insert(&zcache, &t->node);
+}
+
+static void forget_table(const char *key)
+{
+    struct hnode *old;
+
+    pthread_mutex_lock(&zcache_lock);
+    old = htable_remove(&zcache, key);
+    if (old != NULL)
+	free_table_node(old);
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+static struct ztable *new_table(const char *key, const struct zheader *hdr)
+{
+    struct ztable *t = calloc(1, sizeof(*t));
+
+    if (t == NULL)
+	return NULL;
+    strcpy(t->node.key, key);
+    t->hdr = *hdr;
+    t->offs = malloc((hdr->nblocks + 1) * sizeof(*t->offs));
+    t->flags = malloc((hdr->nblocks + 1) * sizeof(*t->flags));
+    if (t->offs == NULL || t->flags == NULL) {
+	free_table(t);
+	return NULL;
+    }
+    return t;
+}
+
+// Read the block table of key.  stored is the size of the value as
+// the backend has it, used to tell our values from raw ones.
+static int load_table(const char *key, off_t stored, struct ztable **tp)
+{
+    struct zheader hdr;
+    struct zblock *blocks;
+    struct ztable *t;
+    uint64_t off;
+    size_t tlen;
+    uint32_t i;
+    int retstat;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (stored >= (off_t) sizeof(hdr)) {
+	retstat = inner->read(key, (char *) &hdr, sizeof(hdr), 0);
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    tlen = (size_t) hdr.nblocks * sizeof(*blocks);
+    if (hdr.magic != ZMAGIC || hdr.block_size != BLOCK_SIZE ||
+	sizeof(hdr) + tlen > (uint64_t) stored ||
+	(uint64_t) hdr.nblocks != (hdr.size + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.size = stored;
+	t = new_table(key, &hdr);
+	if (t == NULL)
+	    return -ENOMEM;
+	t->plain = 1;
+	*tp = t;
+	return 0;
+    }
+
+    blocks = malloc(tlen + 1);
+    t = new_table(key, &hdr);
+    if (blocks == NULL || t == NULL) {
+	free(blocks);
+	if (t != NULL)
+	    free_table(t);
+	return -ENOMEM;
+    }
+    retstat = inner->read(key, (char *) blocks, tlen, sizeof(hdr));
+    if (retstat >= 0 && (size_t) retstat != tlen)
+	retstat = -EIO;
+    if (retstat < 0) {
+	free(blocks);
+	free_table(t);
+	return retstat;
+    }
+
+    off = sizeof(hdr) + tlen;
+    for (i = 0; i < hdr.nblocks; i++) {
+	t->offs[i] = off;
+	t->flags[i] = blocks[i].flags;
+	off += blocks[i].len;
+    }
+    t->offs[i] = off;
+    free(blocks);
+    *tp = t;
+    return 0;
+}
+
+// the block table of key with a reference held, from the cache if
+// possible
+static int get_table(const char *key, struct kvfs_meta *meta, struct ztable **tp)
+{
+    struct kvfs_meta m;
+    struct ztable *t;
+    int retstat;
+
+    retstat = inner->lookup(key, &m);
+    if (retstat < 0)
+	return retstat;
+
+    pthread_mutex_lock(&zcache_lock);
+    t = (struct ztable *) htable_lookup(&zcache, key);
+    if (t != NULL) {
+	t->refs++;
+	pthread_mutex_unlock(&zcache_lock);
+    } else {
+	pthread_mutex_unlock(&zcache_lock);
+	retstat = load_table(key, m.size, &t);
+	if (retstat < 0)
+	    return retstat;
+	pthread_mutex_lock(&zcache_lock);
+	t->refs = 1;
+	if (htable_lookup(&zcache, key) == NULL)
+	    cache_table(t);
+	pthread_mutex_unlock(&zcache_lock);
+    }
+
+    if (meta != NULL) {
+	*meta = m;
+	meta->size = t->hdr.size;
+    }
+    *tp = t;
+    return 0;
+}
+
+static void compress_report(FILE *out)
+{
+    pthread_mutex_lock(&zcache_lock);
+    fprintf(out, "    codec %s, %.1f MiB in, %.1f MiB stored, ratio %.2f\n",
+	    codec_name(codec), bytes_in / 1048576.0, bytes_out / 1048576.0,
+	    bytes_out ? (double) bytes_in / bytes_out : 1.0);
+    fprintf(out, "    %llu block(s) compressed, %llu kept raw\n",
+	    (unsigned long long) blocks_packed, (unsigned long long) blocks_raw);
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+static int compress_open(struct kvfs_state *state)
+{
+    int retstat;
+
+    if (htable_init(&zcache, 1024) < 0)
+	return -ENOMEM;
+    retstat = inner->open(state);
+    if (retstat < 0) {
+	htable_free(&zcache, NULL);
+	return retstat;
+    }
+    kvfs_stats_register("compress", compress_report);
+    return 0;
+}
+
+static void compress_close(void)
+{
+    kvfs_stats_unregister("compress");
+    inner->close();
+    pthread_mutex_lock(&zcache_lock);
+    htable_free(&zcache, free_table_node);
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+static int compress_lookup(const char *key, struct kvfs_meta *meta)
+{
+    struct ztable *t;
+    int retstat;
+
+    retstat = get_table(key, meta, &t);
+    if (retstat == 0)
+	put_table(t);
+    return retstat;
+}
+
+static int compress_read(const char *key, char *buf, size_t size, off_t offset)
+{
+    struct ztable *t;
+    char *packed = NULL, *block = NULL;
+    uint64_t len, skip, n;
+    uint32_t b;
+    size_t done = 0;
+    int retstat;
+
+    retstat = get_table(key, NULL, &t);
+    if (retstat < 0)
+	return retstat;
+    if (t->plain) {
+	put_table(t);
+	return inner->read(key, buf, size, offset);
+    }
+
+    if ((uint64_t) offset >= t->hdr.size)
+	size = 0;
+    else if (size > t->hdr.size - offset)
+	size = t->hdr.size - offset;
+
+    for (b = offset / BLOCK_SIZE; done < size; b++) {
+	len = t->offs[b + 1] - t->offs[b];
+	skip = (offset + done) - (uint64_t) b * BLOCK_SIZE;
+	n = (b + 1 == t->hdr.nblocks ? t->hdr.size - (uint64_t) b * BLOCK_SIZE : BLOCK_SIZE) - skip;
+	if (n > size - done)
+	    n = size - done;
+
+	if (t->flags[b] & ZBLOCK_RAW) {
+	    retstat = inner->read(key, buf + done, n, t->offs[b] + skip);
+	    if (retstat >= 0 && (uint64_t) retstat != n)
+		retstat = -EIO;
+	    if (retstat < 0)
+		break;
+	    done += n;
+	    continue;
+	}
+
+	if (packed == NULL) {
+	    packed = malloc(codec_bound(codec, BLOCK_SIZE));
+	    block = malloc(BLOCK_SIZE);
+	    if (packed == NULL || block == NULL) {
+		retstat = -ENOMEM;
+		break;
+	    }
+	}
+	retstat = inner->read(key, packed, len, t->offs[b]);
+	if (retstat >= 0 && (uint64_t) retstat != len)
+	    retstat = -EIO;
+	if (retstat < 0)
+	    break;
+	// a whole block decompresses straight into the caller's buffer
+	if (skip == 0 && n == BLOCK_SIZE) {
+	    retstat = codec_decompress(t->hdr.codec, packed, len, buf + done, BLOCK_SIZE);
+	} else {
+	    retstat = codec_decompress(t->hdr.codec, packed, len, block, BLOCK_SIZE);
+	    if (retstat >= 0)
+		memcpy(buf + done, block + skip, n);
+	}
+	if (retstat < 0) {
+	    log_msg("    compress: block %u of %s is damaged\n", b, key);
+	    break;
+	}
+	done += n;
+	retstat = 0;
+    }
+
+    free(packed);
+    free(block);
+    put_table(t);
+    return retstat < 0 ? retstat : (int) done;
+}
+
+static int compress_put(const char *key, const struct kvfs_meta *meta, const char *data)
+{
+    struct zheader hdr;
+    struct zblock *blocks;
+    struct ztable *t;
+    struct kvfs_meta m;
+    char *out, *p;
+    size_t cap, n, len;
+    uint32_t i;
+    int retstat;
+
+    if (data == NULL)
+	return inner->put(key, meta, NULL);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = ZMAGIC;
+    hdr.codec = codec;
+    hdr.block_size = BLOCK_SIZE;
+    hdr.size = meta->size;
+    hdr.nblocks = (meta->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    cap = sizeof(hdr) + hdr.nblocks * (sizeof(*blocks) + codec_bound(codec, BLOCK_SIZE));
+    out = malloc(cap + 1);
+    t = new_table(key, &hdr);
+    if (out == NULL || t == NULL) {
+	free(out);
+	if (t != NULL)
+	    free_table(t);
+	return -ENOMEM;
+    }
+    memcpy(out, &hdr, sizeof(hdr));
+    blocks = (struct zblock *) (out + sizeof(hdr));
+    p = (char *) (blocks + hdr.nblocks);
+
+    for (i = 0; i < hdr.nblocks; i++) {
+	len = meta->size - (off_t) i * BLOCK_SIZE;
+	if (len > BLOCK_SIZE)
+	    len = BLOCK_SIZE;
+	n = codec_compress(codec, data + (size_t) i * BLOCK_SIZE, len, p, out + cap - p);
+	if (n == 0) {
+	    // not worth it: the block goes in as it is
+	    memcpy(p, data + (size_t) i * BLOCK_SIZE, len);
+	    n = len;
+	    blocks[i].flags = ZBLOCK_RAW;
+	} else {
+	    blocks[i].flags = 0;
+	}
+	blocks[i].len = n;
+	t->offs[i] = p - out;
+	t->flags[i] = blocks[i].flags;
+	p += n;
+    }
+    t->offs[i] = p - out;
+
+    m = *meta;
+    m.size = p - out;
+    retstat = inner->put(key, &m, out);
+    free(out);
+
+    pthread_mutex_lock(&zcache_lock);
+    if (retstat == 0) {
+	bytes_in += meta->size;
+	bytes_out += m.size;
+	for (i = 0; i < hdr.nblocks; i++) {
+	    if (t->flags[i] & ZBLOCK_RAW)
+		blocks_raw++;
+	    else
+		blocks_packed++;
+	}
+	cache_table(t);
+    } else {
+	free_table(t);
+	t = NULL;
+    }
+    pthread_mutex_unlock(&zcache_lock);
+    if (t == NULL)
+	forget_table(key);
+
+    return retstat;
+}
+
+static int compress_remove(const char *key)
+{
+    forget_table(key);
+    return inner->remove(key);
+}
+
+static int compress_rename(const char *key, const char *newkey)
+{
+    int retstat = inner->rename(key, newkey);
+
+    forget_table(key);
+    forget_table(newkey);
+    return retstat;
+}
+
+static int compress_sync(int datasync)
+{
+    return inner->sync(datasync);
+}
+
+static struct kvfs_store_ops kvfs_compress_store = {
+    .name = "compress",
+    .open = compress_open,
+    .close = compress_close,
+    .lookup = compress_lookup,
+    .read = compress_read,
+    .put = compress_put,
+    .remove = compress_remove,
+    .rename = compress_rename,
+    .sync = compress_sync
+};
+
+struct kvfs_store_ops *kvfs_compress_wrap(struct kvfs_store_ops *backend, const char *name)
+{
+    if (strcmp(name, "lz4") == 0)
+	codec = CODEC_LZ4;
+    else if (strcmp(name, "zstd") == 0)
+	codec = CODEC_ZSTD;
+    else
+	return NULL;
+
+#ifndef HAVE_LZ4
+    if (codec == CODEC_LZ4)
+	return NULL;
+#endif
+#ifndef HAVE_ZSTD
+    if (codec == CODEC_ZSTD)
+	return NULL;
+#endif
+
+    inner = backend;
+    return &kvfs_compress_store;
+}
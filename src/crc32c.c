@@ -0,0 +1,135 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  CRC32C, for the block checksums of integrity.c.
+
+  On x86 with SSE4.2 the crc32 instruction does eight bytes at a time;
+  the choice is made once, from cpuid, the first time a checksum is
+  asked for.  Elsewhere a slicing-by-8 table does the same eight
+  bytes per step in software.
+*/
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78			// Castagnoli, reflected
+
+static uint32_t table[8][256];
+static uint32_t (*crc32c_fn)(uint32_t crc, const void *buf, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void make_table(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	crc = i;
+	for (j = 0; j < 8; j++)
+	    crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+	table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+	for (j = 1; j < 8; j++)
+	    table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+}
+
+uint32_t kvfs_crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t word;
+
+    pthread_once(&crc32c_once, make_table);
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+	crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	len--;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // the first byte is the low one
+    while (len >= 8) {
+	memcpy(&word, p, 8);
+	word ^= crc;
+	crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+	      table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+	      table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+	      table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+	p += 8;
+	len -= 8;
+    }
+#endif
+    while (len-- > 0)
+	crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+	crc = _mm_crc32_u8(crc, *p++);
+	len--;
+    }
+#ifdef __x86_64__
+    {
+	uint64_t crc64 = crc, word;
+
+	while (len >= 8) {
+	    memcpy(&word, p, 8);
+	    crc64 = _mm_crc32_u64(crc64, word);
+	    p += 8;
+	    len -= 8;
+	}
+	crc = (uint32_t) crc64;
+    }
+#endif
+    while (len >= 4) {
+	uint32_t word;
+
+	memcpy(&word, p, 4);
+	crc = _mm_crc32_u32(crc, word);
+	p += 4;
+	len -= 4;
+    }
+    while (len-- > 0)
+	crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+#endif
+
+static void choose(void)
+{
+    crc32c_fn = kvfs_crc32c_sw;
+#ifdef CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+	crc32c_fn = crc32c_sse42;
+#endif
+}
+
+static pthread_once_t choose_once = PTHREAD_ONCE_INIT;
+
+uint32_t kvfs_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&choose_once, choose);
+    return crc32c_fn(crc, buf, len);
+}
+
+const char *kvfs_crc32c_impl(void)
+{
+    pthread_once(&choose_once, choose);
+    return crc32c_fn == kvfs_crc32c_sw ? "table" : "sse4.2";
+}
@@ -0,0 +1,23 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of buf, continuing from crc; start with 0.
+// Runs can be chained: crc32c(crc32c(0, a), b) == crc32c(0, a b).
+uint32_t kvfs_crc32c(uint32_t crc, const void *buf, size_t len);
+
+// the table-driven version kvfs_crc32c() uses without SSE4.2
+uint32_t kvfs_crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+// "sse4.2" or "table"
+const char *kvfs_crc32c_impl(void);
+
+#endif
@@ -0,0 +1,807 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Deduplicating object store (-o backend=dedup).
+
+  Every value is cut into content-defined chunks with FastCDC: a gear
+  rolling hash picks the cut points, so an insertion only changes the
+  chunks around it and identical runs of data chunk identically no
+  matter where in which file they sit.  Chunks are named by their
+  SHA-256 digest (the first 128 bits, as hex) and stored once, in
+  rootdir/.kvfs_dedup/chunks, with a reference count; a file is just
+  its metadata plus the list of chunks that make it up.
+
+  File maps go to a journal (rootdir/.kvfs_dedup/journal) that is
+  replayed at mount and rewritten compactly afterwards.  Reference
+  counts are not journaled: they follow from the file maps.  When a
+  chunk's count drops to zero its space in the chunk file is punched
+  out.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <openssl/sha.h>
+
+#include "log.h"
+#include "stats.h"
+#include "store.h"
+#include "sync.h"
+
+#define DEDUP_DIR	".kvfs_dedup"
+#define DEDUP_NAME_MAX	16	// room for "/journal.tmp"
+#define JOURNAL_MAGIC	0x4a44564b	// "KVDJ"
+
+// FastCDC with normalized chunking, level 2: cut points are harder to
+// hit below CHUNK_AVG and easier above it, which keeps chunk sizes
+// close to the average
+#define CHUNK_MIN	2048
+#define CHUNK_AVG	8192
+#define CHUNK_MAX	65536
+#define MASK_S		0x0003590703530000ULL	// 15 bits
+#define MASK_L		0x0000d90003530000ULL	// 11 bits
+
+#define WRITE_BATCH	64		// iovecs per pwritev() of new chunks
+
+enum { REC_FILE = 1, REC_META, REC_DEL, REC_RENAME };
+
+struct journal_record {
+    uint32_t magic;
+    uint32_t type;
+    char key[32];
+    char newkey[32];		// REC_RENAME
+    struct kvfs_disk_meta meta;	// REC_FILE, REC_META
+    uint32_t nchunks;		// REC_FILE: chunk_refs that follow
+    uint32_t sum;		// over the record and what follows
+};
+
+// where a chunk lives in the chunk file
+struct chunk_ref {
+    char digest[32];
+    uint64_t off;
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct chunk {
+    struct hnode node;		// keyed by digest, must be first
+    uint64_t off;
+    uint32_t len;
+    uint32_t refs;
+};
+
+struct dedup_file {
+    struct hnode node;		// keyed by object key, must be first
+    struct kvfs_meta meta;
+    uint32_t nchunks;
+    struct chunk **chunks;
+    uint64_t *ends;		// ends[i]: offset just past chunk i
+};
+
+// short enough that every file name below it still fits in PATH_MAX
+static char dedup_dir[PATH_MAX - DEDUP_NAME_MAX];
+static uint64_t gear[256];
+
+// dedup_lock is taken for reading across chunk preads, so a chunk
+// cannot be punched out from under a reader
+static pthread_rwlock_t dedup_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct htable files;
+static struct htable chunks;
+static int chunk_fd = -1;
+static int journal_fd = -1;
+static uint64_t chunk_end;
+
+// for the statistics report, under dedup_lock
+static uint64_t logical_bytes;	// sum of live file sizes
+static uint64_t stored_bytes;	// sum of live chunk sizes
+static uint64_t ingest_bytes;	// bytes handed to put()
+static uint64_t ingest_new;	// of those, bytes that were new chunks
+static uint64_t ingest_chunks, ingest_dups;
+static uint64_t ingest_nsec;	// time spent in put()
+static uint64_t chunk_nsec;	// of that, chunking and hashing
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The gear table must never change, or the same data would chunk
+// differently across mounts; fill it from a fixed-seed splitmix64
+static void init_gear(void)
+{
+    uint64_t x = 0x6b766673646564ULL, z;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+	z = (x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	gear[i] = z ^ (z >> 31);
+    }
+}
+
+// length of the chunk starting at p, n bytes left
+static size_t cdc_cut(const unsigned char *p, size_t n)
+{
+    uint64_t fp = 0;
+    size_t i, normal = CHUNK_AVG;
+
+    if (n <= CHUNK_MIN)
+	return n;
+    if (n > CHUNK_MAX)
+	n = CHUNK_MAX;
+    if (n < normal)
+	normal = n;
+
+    // nothing before CHUNK_MIN can be a cut point, so skip hashing it;
+    // the 64-bit fingerprint only remembers the last 64 bytes anyway
+    i = CHUNK_MIN - 64;
+    for (; i < CHUNK_MIN; i++)
+	fp = (fp << 1) + gear[p[i]];
+    for (; i + 1 < normal; i += 2) {
+	fp = (fp << 1) + gear[p[i]];
+	if (!(fp & MASK_S))
+	    return i + 1;
+	fp = (fp << 1) + gear[p[i + 1]];
+	if (!(fp & MASK_S))
+	    return i + 2;
+    }
+    for (; i < n; i++) {
+	fp = (fp << 1) + gear[p[i]];
+	if (!(fp & (i < normal ? MASK_S : MASK_L)))
+	    return i + 1;
+    }
+    return n;
+}
+
+// the digest as 32 hex characters, not terminated
+static void chunk_digest(const char *data, size_t len, char out[32])
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    int i;
+
+    SHA256((const unsigned char *) data, len, md);
+    for (i = 0; i < 16; i++) {
+	out[2 * i] = hex[md[i] >> 4];
+	out[2 * i + 1] = hex[md[i] & 15];
+    }
+}
+
+// drop one reference; caller holds dedup_lock for writing
+static void chunk_unref(struct chunk *c)
+{
+    if (--c->refs > 0)
+	return;
+    stored_bytes -= c->len;
+    htable_remove(&chunks, c->node.key);
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    fallocate(chunk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, c->off, c->len);
+#endif
+    free(c);
+}
+
+// take a reference on the chunk at ref, creating it if it is new;
+// caller holds dedup_lock for writing
+static struct chunk *chunk_ref(const struct chunk_ref *ref)
+{
+    char digest[KVFS_KEY_LEN];
+    struct chunk *c;
+
+    memcpy(digest, ref->digest, 32);
+    digest[32] = '\0';
+    c = (struct chunk *) htable_lookup(&chunks, digest);
+    if (c == NULL) {
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+	    return NULL;
+	strcpy(c->node.key, digest);
+	c->off = ref->off;
+	c->len = ref->len;
+	htable_insert(&chunks, &c->node);
+	stored_bytes += c->len;
+    }
+    c->refs++;
+    return c;
+}
+
+static void free_file(struct dedup_file *f)
+{
+    uint32_t i;
+
+    for (i = 0; i < f->nchunks; i++)
+	chunk_unref(f->chunks[i]);
+    logical_bytes -= f->meta.size;
+    free(f->chunks);
+    free(f->ends);
+    free(f);
+}
+
+// caller holds dedup_lock for writing
+static void drop_file(const char *key)
+{
+    struct hnode *node = htable_remove(&files, key);
+
+    if (node != NULL)
+	free_file((struct dedup_file *) node);
+}
+
+// Build a file from its chunk list and install it under key,
+// replacing any previous version.  Caller holds dedup_lock for writing.
+static int install_file(const char *key, const struct kvfs_meta *meta,
+			const struct chunk_ref *refs, uint32_t n)
+{
+    struct dedup_file *f;
+    uint64_t end = 0;
+    uint32_t i;
+
+    f = calloc(1, sizeof(*f));
+    if (f == NULL)
+	return -ENOMEM;
+    f->chunks = malloc((n + 1) * sizeof(*f->chunks));
+    f->ends = malloc((n + 1) * sizeof(*f->ends));
+    if (f->chunks == NULL || f->ends == NULL) {
+	free(f->chunks);
+	free(f->ends);
+	free(f);
+	return -ENOMEM;
+    }
+    strcpy(f->node.key, key);
+    f->meta = *meta;
+
+    for (i = 0; i < n; i++) {
+	f->chunks[i] = chunk_ref(&refs[i]);
+	if (f->chunks[i] == NULL) {
+	    f->nchunks = i;
+	    f->meta.size = 0;
+	    free_file(f);
+	    return -ENOMEM;
+	}
+	end += refs[i].len;
+	f->ends[i] = end;
+    }
+    f->nchunks = n;
+    f->meta.size = end;
+    logical_bytes += end;
+
+    // after taking the new references, so shared chunks survive
+    drop_file(key);
+    htable_insert(&files, &f->node);
+    return 0;
+}
+
+// caller holds dedup_lock for writing
+static int journal_append(struct journal_record *rec, const struct chunk_ref *refs)
+{
+    struct iovec iov[2];
+    ssize_t len = sizeof(*rec);
+
+    rec->magic = JOURNAL_MAGIC;
+    rec->sum = 0;
+    rec->sum = kvfs_store_sum(KVFS_SUM_INIT, rec, sizeof(*rec));
+    iov[0].iov_base = rec;
+    iov[0].iov_len = sizeof(*rec);
+    iov[1].iov_base = (void *) refs;
+    iov[1].iov_len = rec->type == REC_FILE ? rec->nchunks * sizeof(*refs) : 0;
+    if (iov[1].iov_len > 0)
+	rec->sum = kvfs_store_sum(rec->sum, refs, iov[1].iov_len);
+    len += iov[1].iov_len;
+
+    if (writev(journal_fd, iov, 2) != len)
+	return log_error("dedup journal writev");
+    return 0;
+}
+
+static void replay_journal(int fd)
+{
+    char key[KVFS_KEY_LEN], newkey[KVFS_KEY_LEN];
+    struct journal_record rec;
+    struct chunk_ref *refs = NULL;
+    struct dedup_file *f;
+    struct kvfs_meta meta;
+    struct hnode *node;
+    uint32_t sum;
+    size_t len;
+    int nrecs = 0;
+
+    while (read(fd, &rec, sizeof(rec)) == sizeof(rec) && rec.magic == JOURNAL_MAGIC) {
+	len = rec.type == REC_FILE ? rec.nchunks * sizeof(*refs) : 0;
+	free(refs);
+	refs = malloc(len + 1);
+	if (refs == NULL || (size_t) read(fd, refs, len) != len)
+	    break;
+	sum = rec.sum;
+	rec.sum = 0;
+	if (kvfs_store_sum(kvfs_store_sum(KVFS_SUM_INIT, &rec, sizeof(rec)), refs, len) != sum)
+	    break;			// torn at the tail
+
+	memcpy(key, rec.key, 32);
+	key[32] = '\0';
+	kvfs_meta_unpack(&rec.meta, &meta);
+	switch (rec.type) {
+	case REC_FILE:
+	    install_file(key, &meta, refs, rec.nchunks);
+	    break;
+	case REC_META:
+	    f = (struct dedup_file *) htable_lookup(&files, key);
+	    if (f != NULL) {
+		meta.size = f->meta.size;
+		f->meta = meta;
+	    }
+	    break;
+	case REC_DEL:
+	    drop_file(key);
+	    break;
+	case REC_RENAME:
+	    memcpy(newkey, rec.newkey, 32);
+	    newkey[32] = '\0';
+	    node = htable_remove(&files, key);
+	    if (node != NULL) {
+		drop_file(newkey);
+		strcpy(node->key, newkey);
+		htable_insert(&files, node);
+	    }
+	    break;
+	}
+	nrecs++;
+    }
+    free(refs);
+    log_msg("    dedup: replayed %d journal record(s)\n", nrecs);
+}
+
+static int file_record(struct dedup_file *f, struct journal_record *rec,
+		       struct chunk_ref **refsp)
+{
+    struct chunk_ref *refs;
+    uint32_t i;
+
+    refs = calloc(f->nchunks + 1, sizeof(*refs));
+    if (refs == NULL)
+	return -ENOMEM;
+    for (i = 0; i < f->nchunks; i++) {
+	memcpy(refs[i].digest, f->chunks[i]->node.key, 32);
+	refs[i].off = f->chunks[i]->off;
+	refs[i].len = f->chunks[i]->len;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->type = REC_FILE;
+    memcpy(rec->key, f->node.key, 32);
+    kvfs_meta_pack(&f->meta, &rec->meta);
+    rec->nchunks = f->nchunks;
+    *refsp = refs;
+    return 0;
+}
+
+static int rewrite_one(struct hnode *node, void *arg)
+{
+    struct journal_record rec;
+    struct chunk_ref *refs = NULL;
+    int retstat;
+
+    (void) arg;
+    retstat = file_record((struct dedup_file *) node, &rec, &refs);
+    if (retstat == 0)
+	retstat = journal_append(&rec, refs);
+    free(refs);
+    return retstat;
+}
+
+// Replace the journal with one record per live file.  Caller holds
+// dedup_lock for writing.
+static int rewrite_journal(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    int old_fd = journal_fd, retstat;
+
+    snprintf(path, PATH_MAX, "%s/journal", dedup_dir);
+    snprintf(tmp, PATH_MAX, "%s/journal.tmp", dedup_dir);
+    journal_fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0600);
+    if (journal_fd < 0) {
+	journal_fd = old_fd;
+	return log_error("dedup journal open");
+    }
+
+    retstat = htable_foreach(&files, rewrite_one, NULL);
+    if (retstat == 0 && fdatasync(journal_fd) < 0)
+	retstat = log_error("dedup journal fdatasync");
+    if (retstat == 0 && rename(tmp, path) < 0)
+	retstat = log_error("dedup journal rename");
+
+    if (retstat < 0) {
+	close(journal_fd);
+	unlink(tmp);
+	journal_fd = old_fd;
+	return retstat;
+    }
+    if (old_fd >= 0)
+	close(old_fd);
+    return 0;
+}
+
+static void dedup_report(FILE *out)
+{
+    double mib = 1024.0 * 1024.0;
+
+    pthread_rwlock_rdlock(&dedup_lock);
+    fprintf(out, "    %zu file(s), %zu chunk(s), %.1f MiB logical, %.1f MiB stored, ratio %.2f\n",
+	    files.count, chunks.count, logical_bytes / mib, stored_bytes / mib,
+	    stored_bytes ? (double) logical_bytes / stored_bytes : 1.0);
+    fprintf(out, "    ingest %.1f MiB in %llu chunk(s), %llu duplicate, %.1f MiB new\n",
+	    ingest_bytes / mib, (unsigned long long) ingest_chunks,
+	    (unsigned long long) ingest_dups, ingest_new / mib);
+    if (ingest_nsec > 0)
+	fprintf(out, "    ingest %.1f MB/s overall, %.1f MB/s chunking and hashing\n",
+		ingest_bytes * 1e3 / ingest_nsec,
+		chunk_nsec ? ingest_bytes * 1e3 / chunk_nsec : 0.0);
+    pthread_rwlock_unlock(&dedup_lock);
+}
+
+static int dedupstore_open(struct kvfs_state *state)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int fd, retstat;
+
+    init_gear();
+    if (snprintf(dedup_dir, sizeof(dedup_dir), "%s/%s", state->rootdir, DEDUP_DIR) >=
+	(int) sizeof(dedup_dir))
+	return -ENAMETOOLONG;
+    if (mkdir(dedup_dir, 0700) < 0 && errno != EEXIST)
+	return log_error("dedup mkdir");
+
+    snprintf(path, PATH_MAX, "%s/chunks", dedup_dir);
+    chunk_fd = open(path, O_CREAT | O_RDWR, 0600);
+    if (chunk_fd < 0 || fstat(chunk_fd, &st) < 0)
+	return log_error("dedup open chunks");
+    chunk_end = st.st_size;
+
+    if (htable_init(&files, 1024) < 0 || htable_init(&chunks, 4096) < 0)
+	return -ENOMEM;
+
+    pthread_rwlock_wrlock(&dedup_lock);
+    logical_bytes = stored_bytes = 0;
+    snprintf(path, PATH_MAX, "%s/journal", dedup_dir);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+	replay_journal(fd);
+	close(fd);
+    }
+    retstat = rewrite_journal();
+    log_msg("    dedup: %zu file(s) in %zu chunk(s)\n", files.count, chunks.count);
+    pthread_rwlock_unlock(&dedup_lock);
+    if (retstat < 0)
+	return retstat;
+
+    kvfs_stats_register("dedup", dedup_report);
+    return 0;
+}
+
+// at unmount, where no reference counting is wanted
+static void free_file_node(struct hnode *node)
+{
+    struct dedup_file *f = (struct dedup_file *) node;
+
+    free(f->chunks);
+    free(f->ends);
+    free(f);
+}
+
+static void free_chunk_node(struct hnode *node)
+{
+    free(node);
+}
+
+static void dedupstore_close(void)
+{
+    kvfs_stats_unregister("dedup");
+
+    pthread_rwlock_wrlock(&dedup_lock);
+    rewrite_journal();
+    close(journal_fd);
+    close(chunk_fd);
+    journal_fd = chunk_fd = -1;
+    htable_free(&files, free_file_node);
+    htable_free(&chunks, free_chunk_node);
+    pthread_rwlock_unlock(&dedup_lock);
+}
+
+static int dedupstore_lookup(const char *key, struct kvfs_meta *meta)
+{
+    struct dedup_file *f;
+    int retstat = -ENOENT;
+
+    pthread_rwlock_rdlock(&dedup_lock);
+    f = (struct dedup_file *) htable_lookup(&files, key);
+    if (f != NULL) {
+	*meta = f->meta;
+	retstat = 0;
+    }
+    pthread_rwlock_unlock(&dedup_lock);
+
+    return retstat;
+}
+
+static int dedupstore_read(const char *key, char *buf, size_t size, off_t offset)
+{
+    struct dedup_file *f;
+    struct chunk *c;
+    uint64_t start, skip, n;
+    uint32_t lo, hi, mid;
+    size_t done = 0;
+    int retstat = 0;
+
+    pthread_rwlock_rdlock(&dedup_lock);
+    f = (struct dedup_file *) htable_lookup(&files, key);
+    if (f == NULL) {
+	pthread_rwlock_unlock(&dedup_lock);
+	return -ENOENT;
+    }
+
+    // first chunk that ends past offset
+    lo = 0;
+    hi = f->nchunks;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (f->ends[mid] <= (uint64_t) offset)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    for (; lo < f->nchunks && done < size; lo++) {
+	c = f->chunks[lo];
+	start = f->ends[lo] - c->len;
+	skip = offset + done - start;
+	n = c->len - skip;
+	if (n > size - done)
+	    n = size - done;
+	retstat = pread(chunk_fd, buf + done, n, c->off + skip);
+	if (retstat != (ssize_t) n) {
+	    retstat = retstat < 0 ? log_error("dedup pread") : -EIO;
+	    break;
+	}
+	done += n;
+	retstat = 0;
+    }
+    pthread_rwlock_unlock(&dedup_lock);
+
+    return retstat < 0 ? retstat : (int) done;
+}
+
+// Write out the chunks of a batch that are not stored yet.  They go
+// into the chunk table straight away, with no references, so a chunk
+// repeated later in the same value is found there.  Caller holds
+// dedup_lock for writing.
+static int store_new_chunks(const char *data, struct chunk_ref *refs,
+			    const uint64_t *offs, uint32_t first, uint32_t n)
+{
+    struct iovec iov[WRITE_BATCH];
+    char digest[KVFS_KEY_LEN];
+    struct chunk *c;
+    uint64_t len = 0;
+    uint32_t i, niov = 0;
+
+    for (i = first; i < first + n; i++) {
+	memcpy(digest, refs[i].digest, 32);
+	digest[32] = '\0';
+	c = (struct chunk *) htable_lookup(&chunks, digest);
+	if (c != NULL) {
+	    refs[i].off = c->off;
+	    ingest_dups++;
+	    continue;
+	}
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+	    return -ENOMEM;
+	strcpy(c->node.key, digest);
+	c->off = refs[i].off = chunk_end + len;
+	c->len = refs[i].len;
+	htable_insert(&chunks, &c->node);
+	stored_bytes += c->len;
+
+	iov[niov].iov_base = (void *) (data + offs[i]);
+	iov[niov].iov_len = refs[i].len;
+	niov++;
+	len += refs[i].len;
+    }
+
+    if (niov > 0 && pwritev(chunk_fd, iov, niov, chunk_end) != (ssize_t) len)
+	return log_error("dedup chunk pwritev");
+    chunk_end += len;
+    ingest_new += len;
+    return 0;
+}
+
+// forget chunks that a failed put created but never referenced;
+// caller holds dedup_lock for writing
+static void drop_unreferenced(const struct chunk_ref *refs, uint32_t n)
+{
+    char digest[KVFS_KEY_LEN];
+    struct chunk *c;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+	memcpy(digest, refs[i].digest, 32);
+	digest[32] = '\0';
+	c = (struct chunk *) htable_lookup(&chunks, digest);
+	if (c != NULL && c->refs == 0) {
+	    c->refs = 1;
+	    chunk_unref(c);
+	}
+    }
+}
+
+static int dedupstore_put(const char *key, const struct kvfs_meta *meta, const char *data)
+{
+    struct journal_record rec;
+    struct chunk_ref *refs = NULL;
+    struct dedup_file *f;
+    struct kvfs_meta m;
+    uint64_t *offs = NULL, pos, t0, t1;
+    uint32_t n = 0, cap = 0, i, batch;
+    size_t len;
+    int retstat = 0;
+
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.key, key, 32);
+    kvfs_meta_pack(meta, &rec.meta);
+
+    if (data == NULL) {
+	rec.type = REC_META;
+	pthread_rwlock_wrlock(&dedup_lock);
+	f = (struct dedup_file *) htable_lookup(&files, key);
+	if (f == NULL) {
+	    retstat = -ENOENT;
+	} else {
+	    retstat = journal_append(&rec, NULL);
+	    if (retstat == 0) {
+		// the chunks do not change, only what we say about them
+		m = *meta;
+		m.size = f->meta.size;
+		f->meta = m;
+	    }
+	}
+	pthread_rwlock_unlock(&dedup_lock);
+	return retstat;
+    }
+
+    // chunking and hashing need no lock, which is where the time goes
+    t0 = now_nsec();
+    for (pos = 0; pos < (uint64_t) meta->size; pos += len) {
+	if (n == cap) {
+	    struct chunk_ref *r;
+	    uint64_t *o;
+
+	    cap = cap ? cap * 2 : 64;
+	    r = realloc(refs, cap * sizeof(*refs));
+	    if (r != NULL)
+		refs = r;
+	    o = realloc(offs, cap * sizeof(*offs));
+	    if (o != NULL)
+		offs = o;
+	    if (r == NULL || o == NULL) {
+		retstat = -ENOMEM;
+		goto out;
+	    }
+	}
+	len = cdc_cut((const unsigned char *) data + pos, meta->size - pos);
+	memset(&refs[n], 0, sizeof(refs[n]));
+	chunk_digest(data + pos, len, refs[n].digest);
+	refs[n].len = len;
+	offs[n] = pos;
+	n++;
+    }
+    t1 = now_nsec();
+
+    rec.type = REC_FILE;
+    rec.nchunks = n;
+    pthread_rwlock_wrlock(&dedup_lock);
+    for (i = 0; i < n && retstat == 0; i += batch) {
+	batch = n - i < WRITE_BATCH ? n - i : WRITE_BATCH;
+	retstat = store_new_chunks(data, refs, offs, i, batch);
+    }
+    if (retstat == 0)
+	retstat = journal_append(&rec, refs);
+    if (retstat == 0)
+	retstat = install_file(key, meta, refs, n);
+    if (retstat < 0)
+	drop_unreferenced(refs, n);
+    ingest_bytes += meta->size;
+    ingest_chunks += n;
+    chunk_nsec += t1 - t0;
+    ingest_nsec += now_nsec() - t0;
+    pthread_rwlock_unlock(&dedup_lock);
+
+out:
+    free(refs);
+    free(offs);
+    return retstat;
+}
+
+static int dedupstore_remove(const char *key)
+{
+    struct journal_record rec;
+    int retstat;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = REC_DEL;
+    memcpy(rec.key, key, 32);
+
+    pthread_rwlock_wrlock(&dedup_lock);
+    if (htable_lookup(&files, key) == NULL) {
+	retstat = -ENOENT;
+    } else {
+	retstat = journal_append(&rec, NULL);
+	if (retstat == 0)
+	    drop_file(key);
+    }
+    pthread_rwlock_unlock(&dedup_lock);
+
+    return retstat;
+}
+
+static int dedupstore_rename(const char *key, const char *newkey)
+{
+    struct journal_record rec;
+    struct hnode *node;
+    int retstat;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = REC_RENAME;
+    memcpy(rec.key, key, 32);
+    memcpy(rec.newkey, newkey, 32);
+
+    pthread_rwlock_wrlock(&dedup_lock);
+    if (htable_lookup(&files, key) == NULL) {
+	retstat = -ENOENT;
+    } else {
+	retstat = journal_append(&rec, NULL);
+	if (retstat == 0) {
+	    node = htable_remove(&files, key);
+	    drop_file(newkey);
+	    strcpy(node->key, newkey);
+	    htable_insert(&files, node);
+	}
+    }
+    pthread_rwlock_unlock(&dedup_lock);
+
+    return retstat;
+}
+
+static int dedupstore_sync(int datasync)
+{
+    int retstat;
+
+    // chunks first, so the journal never points at data that is not there
+    retstat = kvfs_sync_commit(chunk_fd, 1);
+    if (retstat == 0)
+	retstat = kvfs_sync_commit(journal_fd, datasync);
+    return retstat;
+}
+
+struct kvfs_store_ops kvfs_dedup_store = {
+    .name = "dedup",
+    .open = dedupstore_open,
+    .close = dedupstore_close,
+    .lookup = dedupstore_lookup,
+    .read = dedupstore_read,
+    .put = dedupstore_put,
+    .remove = dedupstore_remove,
+    .rename = dedupstore_rename,
+    .sync = dedupstore_sync
+};
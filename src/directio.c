@@ -0,0 +1,241 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Direct I/O for big files.  A multi-GB file read from start to end
+  is cached twice, in the kernel's page cache above kvfs and the
+  backing filesystem's below it, and pushes the small files that are
+  read again and again out of both.  An open can be told to skip
+  either cache:
+
+  - fi->direct_io, for files of at least -o direct_io_mb when they
+    are opened, or whatever their user.kvfs.direct_io attribute says
+    with -o direct_io_xattr=1: "1" always, "0" never, whatever their
+    size.  Reads and writes then come to kvfs as the application made
+    them, and nothing of the file stays in the page cache above.
+
+  - with -o direct_io_backing=1 as well, the backing file of such an
+    open is put in O_DIRECT mode, so it is not cached below either.
+    O_DIRECT wants offsets, lengths and buffers aligned to the
+    backing device's blocks, which reads from the kernel need not
+    be; each read goes through an aligned buffer of its thread's,
+    rounded out to DIRECT_ALIGN.  Only read-only opens of plain
+    backing files get it: checksummed, striped and mirrored files do
+    their own I/O on fds of their own, and a write would have to read
+    around any unaligned edge.  A backing filesystem without O_DIRECT
+    (tmpfs, for one) just keeps caching.
+
+  Objects in an object store (-o backend) can be opened direct_io by
+  size, but have no attribute and no backing file of their own.
+  Mapping a file opened direct_io shared and writable fails on older
+  kernels.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#include "directio.h"
+#include "log.h"
+#include "stats.h"
+#include "store.h"
+#include "xattr.h"
+
+#define DIRECT_ALIGN	4096		// offsets, lengths and buffers of O_DIRECT I/O
+#define DIRECT_XATTR	"user.kvfs.direct_io"
+
+struct bounce {
+    char *buf;
+    size_t size;
+};
+
+static off_t min_size;			// bytes; 0 is no size rule
+static int by_xattr, backing, dio_on;
+static pthread_once_t bounce_once = PTHREAD_ONCE_INIT;
+static pthread_key_t bounce_key;
+
+static uint64_t opens, by_size, forced, refused, direct_fds, no_direct;
+static uint64_t bounced, bounce_bytes;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// what the attribute of key says: 1 or 0, or -1 if it says nothing
+static int xattr_policy(const char *key, int fd)
+{
+    char value[8];
+    ssize_t len = -ENODATA;
+    uint64_t gen;
+
+    if (!by_xattr || fd < 0)
+	return -1;
+#ifdef HAVE_SYS_XATTR_H
+    if (!kvfs_xattr_get(key, DIRECT_XATTR, value, sizeof(value) - 1, &len, &gen)) {
+	len = fgetxattr(fd, DIRECT_XATTR, value, sizeof(value) - 1);
+	if (len < 0)
+	    len = -errno;
+	if (len >= 0 || len == -ENODATA)
+	    kvfs_xattr_put(key, DIRECT_XATTR, value, len, gen);
+    }
+#endif
+    if (len <= 0)
+	return -1;
+    value[len] = '\0';
+    return strtol(value, NULL, 10) != 0;
+}
+
+int kvfs_directio_want(const char *key, int fd, struct kvfs_object *obj)
+{
+    struct stat st;
+    int policy;
+
+    if (!dio_on)
+	return 0;
+    COUNT(opens, 1);
+    policy = xattr_policy(key, fd);
+    if (policy == 1) {
+	COUNT(forced, 1);
+	return 1;
+    }
+    if (policy == 0) {
+	COUNT(refused, 1);
+	return 0;
+    }
+    if (min_size == 0)
+	return 0;
+    if ((obj != NULL ? kvfs_store_fgetattr(obj, &st) : fstat(fd, &st)) < 0)
+	return 0;
+    if (!S_ISREG(st.st_mode) || st.st_size < min_size)
+	return 0;
+    COUNT(by_size, 1);
+    return 1;
+}
+
+int kvfs_directio_backing(int fd, int flags)
+{
+    int fl;
+
+    if (!backing || (flags & O_ACCMODE) != O_RDONLY)
+	return 0;
+    fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fcntl(fd, F_SETFL, fl | O_DIRECT) < 0) {
+	COUNT(no_direct, 1);
+	return 0;
+    }
+    COUNT(direct_fds, 1);
+    return 1;
+}
+
+static void free_bounce(void *arg)
+{
+    struct bounce *b = arg;
+
+    free(b->buf);
+    free(b);
+}
+
+// this thread's aligned buffer, of at least size bytes
+static char *bounce_buf(size_t size)
+{
+    struct bounce *b = pthread_getspecific(bounce_key);
+    char *buf;
+
+    if (b == NULL) {
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+	    return NULL;
+	pthread_setspecific(bounce_key, b);
+    }
+    if (b->size < size) {
+	if (posix_memalign((void **) &buf, DIRECT_ALIGN, size) != 0)
+	    return NULL;
+	free(b->buf);
+	b->buf = buf;
+	b->size = size;
+    }
+    return b->buf;
+}
+
+ssize_t kvfs_directio_pread(int fd, char *buf, size_t size, off_t offset)
+{
+    off_t start = offset & ~((off_t) DIRECT_ALIGN - 1);
+    size_t skip = offset - start;
+    size_t len = (skip + size + DIRECT_ALIGN - 1) & ~((size_t) DIRECT_ALIGN - 1);
+    char *aligned;
+    ssize_t n;
+
+    aligned = bounce_buf(len);
+    if (aligned == NULL)
+	return -ENOMEM;
+    n = log_syscall("pread", pread(fd, aligned, len, start), 0);
+    if (n < 0)
+	return n;
+    // a short read is the end of the file
+    if ((size_t) n <= skip)
+	return 0;
+    n -= skip;
+    if ((size_t) n > size)
+	n = size;
+    memcpy(buf, aligned + skip, n);
+    COUNT(bounced, 1);
+    COUNT(bounce_bytes, n);
+    return n;
+}
+
+static void directio_report(FILE *out)
+{
+    fprintf(out, "    %llu open(s) looked at: %llu direct by size, %llu by attribute, "
+	    "%llu kept cached by attribute\n",
+	    (unsigned long long) opens, (unsigned long long) by_size,
+	    (unsigned long long) forced, (unsigned long long) refused);
+    if (backing)
+	fprintf(out, "    %llu backing file(s) O_DIRECT, %llu could not be; "
+		"%llu read(s), %.1f MiB through aligned buffers\n",
+		(unsigned long long) direct_fds, (unsigned long long) no_direct,
+		(unsigned long long) bounced, bounce_bytes / 1048576.0);
+}
+
+// made once and kept, so every thread's buffer is freed when it exits
+static void make_bounce_key(void)
+{
+    pthread_key_create(&bounce_key, free_bounce);
+}
+
+int kvfs_directio_init(struct kvfs_state *state)
+{
+    dio_on = 0;
+    if (state->direct_io_mb == 0 && !state->direct_io_xattr)
+	return 0;
+    pthread_once(&bounce_once, make_bounce_key);
+    min_size = (off_t) state->direct_io_mb << 20;
+    by_xattr = state->direct_io_xattr != 0;
+    backing = state->direct_io_backing != 0;
+    opens = by_size = forced = refused = direct_fds = no_direct = 0;
+    bounced = bounce_bytes = 0;
+    dio_on = 1;
+
+    log_msg("    directio: files of %u MiB and up (0 = none)%s%s\n", state->direct_io_mb,
+	    by_xattr ? ", or by " DIRECT_XATTR : "", backing ? ", O_DIRECT below" : "");
+    kvfs_stats_register("directio", directio_report);
+    return 0;
+}
+
+void kvfs_directio_destroy(struct kvfs_state *state)
+{
+    (void) state;
+
+    if (!dio_on)
+	return;
+    dio_on = 0;
+    kvfs_stats_unregister("directio");
+}
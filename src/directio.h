@@ -0,0 +1,32 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Keeping big files out of the page caches (-o direct_io_mb and
+  friends), see directio.c.
+*/
+
+#ifndef _DIRECTIO_H_
+#define _DIRECTIO_H_
+
+#include <sys/types.h>
+
+struct kvfs_object;
+struct kvfs_state;
+
+int  kvfs_directio_init(struct kvfs_state *state);
+void kvfs_directio_destroy(struct kvfs_state *state);
+
+// whether the open of key, on backing file fd or store object obj,
+// should be direct_io
+int  kvfs_directio_want(const char *key, int fd, struct kvfs_object *obj);
+
+// put fd, a direct_io open's backing file opened with flags, in
+// O_DIRECT mode if asked to and it can be; 1 if it was
+int  kvfs_directio_backing(int fd, int flags);
+
+// pread() for an O_DIRECT fd, through an aligned buffer
+ssize_t kvfs_directio_pread(int fd, char *buf, size_t size, off_t offset);
+
+#endif
@@ -0,0 +1,678 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Directory ids and object keys.
+
+  Objects used to be named md5(full path), so renaming a directory
+  left every key below it hashing the old path.  Now an object's key
+  is md5(<parent id> "/" <name>): each directory is given a number
+  when it is made, written in hex to a .kvfs_id file inside its
+  backing directory.  Renaming a directory carries that file along,
+  so nothing below it changes key, and the rename is a single
+  rename() however big the subtree is.
+
+  The root's id is the empty string, so "/name" hashes exactly as it
+  did before and top-level objects keep their keys.  Deeper objects
+  made by older versions would not be found under their new keys,
+  and md5(full path) cannot be turned back into a path to move them.
+  So every root is marked with .kvfs_format, and kvfs_dirid_check()
+  refuses to mount a root with objects in it but no mark and nothing
+  else of kvfs's own, as an older kvfs leaves it: copy its files out
+  through that kvfs, or mount it with -o format_upgrade=1 if it is
+  known to have nothing below the top level.  A root marked by a
+  newer kvfs is refused too.
+
+  Objects are stored flat, so a directory's backing directory would
+  hold nothing but its id and rmdir() of it would never fail.  So it
+  holds an empty file for each name in the directory as well, made
+  before the object and removed after it (kvfs_dirid_enter() and
+  kvfs_dirid_leave()); rmdir() and rename() over a directory with
+  anything in it fail with ENOTEMPTY, and readdir lists its names.  An
+  entry a crash left without its object is swept when rmdir finds it
+  (kvfs_dirid_sweep()).  The root has no entries: it is never
+  removed.  Mirrors are not sent entries, only copied them by a
+  resync.  A directory without an id file is not given one, as that
+  would hide what it held; only those an older kvfs left at the top
+  level get theirs, as the root is marked.
+
+  Ids come from a counter in rootdir/.kvfs_dirid, which is advanced a
+  block at a time and synced before any id of the block is used; a
+  crash can skip ids but never hand one out twice.  Ids of recently
+  used directories are cached, so resolving a path costs one md5 per
+  component, no syscalls and no malloc: the key is made in the
+  calling thread's arena (see alloc.c), and cached ids are records
+  of a slab.  On an immutable mount the ids of all
+  directories are loaded at mount (kvfs_dirid_preload()) and the
+  cache is never cleared.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "dirid.h"
+#include "htable.h"
+#include "log.h"
+#include "mirror.h"
+#include "roots.h"
+#include "stats.h"
+
+#define DIRID_LEN	17		// 64 bits in hex, and a null
+#define DIRID_BATCH	1024		// ids reserved per counter update
+#define DIRID_CACHE_MAX	65536		// directories; the cache is cleared when full
+
+// the id of a missing directory; never a valid hex id
+#define DIRID_NONE	"-"
+
+struct dir_node {
+    struct hnode node;
+    char id[DIRID_LEN];
+};
+
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable dir_cache;
+static struct kvfs_slab dir_slab;
+static size_t cache_max;
+static uint64_t hits, misses, stale;
+// bumped whenever a directory goes away or moves, so an id read
+// before that is not cached after it
+static uint64_t cache_gen;
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int counter_fd = -1;
+static uint64_t next_id, reserved_end;
+
+static int alloc_id(char id[DIRID_LEN])
+{
+    char buf[DIRID_LEN + 1];
+    int len, retstat = 0;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (next_id == reserved_end) {
+	len = snprintf(buf, sizeof(buf), "%016llx\n", (unsigned long long) reserved_end + DIRID_BATCH);
+	if (pwrite(counter_fd, buf, len, 0) != len || fdatasync(counter_fd) < 0) {
+	    retstat = log_error("dirid counter");
+	} else {
+	    reserved_end += DIRID_BATCH;
+	    // a mirror put first must not hand out these ids again
+	    kvfs_mirror_copy(KVFS_DIRID_COUNTER);
+	}
+    }
+    if (retstat == 0)
+	snprintf(id, DIRID_LEN, "%llx", (unsigned long long) next_id++);
+    pthread_mutex_unlock(&alloc_lock);
+    return retstat;
+}
+
+static int write_id(const char *actual_path, const char *id)
+{
+    char path[PATH_MAX], buf[DIRID_LEN + 1];
+    int fd, len, retstat = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", actual_path, KVFS_DIRID_FILE);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0)
+	return log_error("dirid open");
+    len = snprintf(buf, sizeof(buf), "%s\n", id);
+    if (write(fd, buf, len) != len)
+	retstat = log_error("dirid write");
+    close(fd);
+    return retstat;
+}
+
+// the id in the .kvfs_id of the backing directory dir; -ENOENT if it
+// has none
+static int load_id(const char *dir, char id[DIRID_LEN])
+{
+    char path[PATH_MAX], buf[DIRID_LEN + 1];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, KVFS_DIRID_FILE);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+	return -ENOENT;
+    buf[n] = '\0';
+    snprintf(id, DIRID_LEN, "%llx", strtoull(buf, NULL, 16));
+    return 0;
+}
+
+// the id of the backing directory at key, from its .kvfs_id.  One
+// without is being removed, or was damaged; giving it a new id would
+// hide what it held from then on.
+static int read_id(const char *key, char id[DIRID_LEN])
+{
+    char dir[PATH_MAX];
+    struct stat st;
+    int retstat;
+
+    kvfs_root_path(dir, key);
+    retstat = load_id(dir, id);
+    if (retstat == -ENOENT && lstat(dir, &st) == 0 && S_ISDIR(st.st_mode))
+	log_msg("    dirid: %s has no %s\n", dir, KVFS_DIRID_FILE);
+    return retstat;
+}
+
+static int drop_node(struct hnode *node, void *arg)
+{
+    (void) arg;
+    htable_remove(&dir_cache, node->key);
+    kvfs_slab_free(&dir_slab, node);
+    return 0;
+}
+
+// with cache_lock held
+static void cache_id(const char *key, const char *id)
+{
+    struct dir_node *d;
+
+    if (htable_lookup(&dir_cache, key) != NULL)
+	return;
+    if (dir_cache.count >= cache_max)
+	htable_foreach(&dir_cache, drop_node, NULL);
+    d = kvfs_slab_alloc(&dir_slab);
+    if (d == NULL)
+	return;
+    strcpy(d->node.key, key);
+    strcpy(d->id, id);
+    htable_insert(&dir_cache, &d->node);
+}
+
+static void forget_id(const char *key)
+{
+    struct hnode *node;
+
+    pthread_mutex_lock(&cache_lock);
+    node = htable_remove(&dir_cache, key);
+    cache_gen++;
+    pthread_mutex_unlock(&cache_lock);
+    kvfs_slab_free(&dir_slab, node);
+}
+
+static int dir_id(const char *key, char id[DIRID_LEN])
+{
+    struct dir_node *d;
+    uint64_t gen;
+    int retstat;
+
+    pthread_mutex_lock(&cache_lock);
+    d = (struct dir_node *) htable_lookup(&dir_cache, key);
+    if (d != NULL) {
+	strcpy(id, d->id);
+	hits++;
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+    }
+    misses++;
+    gen = cache_gen;
+    pthread_mutex_unlock(&cache_lock);
+
+    // read without the lock; an rmdir or rename meanwhile may have
+    // made it some other directory's id, good for this call only
+    retstat = read_id(key, id);
+    if (retstat < 0)
+	return retstat;
+    pthread_mutex_lock(&cache_lock);
+    if (cache_gen == gen)
+	cache_id(key, id);
+    else
+	stale++;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+static void component_key(char key[KVFS_KEY_LEN], const char *id, const char *name, size_t len)
+{
+    char buf[DIRID_LEN + PATH_MAX];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "%s/%.*s", id, (int) len, name);
+    str2md5_buf(buf, n < (int) sizeof(buf) ? n : (int) sizeof(buf) - 1, key);
+}
+
+// the id of the directory path is in, and in dir that directory's
+// key, or "" if it is the root; returns path's last component
+static const char *walk(const char *path, char id[DIRID_LEN], char dir[KVFS_KEY_LEN])
+{
+    const char *name, *slash;
+
+    id[0] = dir[0] = '\0';
+    for (name = path + 1; (slash = strchr(name, '/')) != NULL; name = slash + 1) {
+	if (strcmp(id, DIRID_NONE) == 0)
+	    continue;
+	component_key(dir, id, name, slash - name);
+	if (dir_id(dir, id) < 0)
+	    strcpy(id, DIRID_NONE);
+    }
+    return name;
+}
+
+char *kvfs_path2key(const char *path)
+{
+    char id[DIRID_LEN], dir[KVFS_KEY_LEN];
+    const char *name;
+    char *key;
+
+    key = kvfs_arena_alloc(KVFS_KEY_LEN);
+    if (key == NULL)
+	return NULL;
+    if (strcmp(path, "/") == 0) {
+	str2md5_buf(path, 1, key);
+	return key;
+    }
+
+    name = walk(path, id, dir);
+    component_key(key, id, name, strlen(name));
+    return key;
+}
+
+// The entry of path in its parent's backing directory; 0 if path is
+// top-level and has none.  A name that could be taken for one of
+// kvfs's own files there is given the prefix twice.
+static int entry_path(char entry[PATH_MAX], const char *path)
+{
+    char id[DIRID_LEN], dir[KVFS_KEY_LEN], backing[PATH_MAX];
+    const char *name, *escape = "";
+
+    name = walk(path, id, dir);
+    if (dir[0] == '\0')
+	return 0;
+    if (strcmp(id, DIRID_NONE) == 0)
+	return -ENOENT;
+    if (strncmp(name, KVFS_PRIVATE_PREFIX, strlen(KVFS_PRIVATE_PREFIX)) == 0)
+	escape = KVFS_PRIVATE_PREFIX;
+    kvfs_root_path(backing, dir);
+    if (snprintf(entry, PATH_MAX, "%s/%s%s", backing, escape, name) >= PATH_MAX)
+	return -ENAMETOOLONG;
+    return 1;
+}
+
+// op on path, in a backing directory made writable for it if it was
+// made read-only, as mkdir does
+static int in_dir(const char *path, int (*op)(const char *path))
+{
+    char dir[PATH_MAX];
+    struct stat st;
+    int retstat;
+
+    retstat = op(path);
+    if (retstat != -EACCES)
+	return retstat;
+    snprintf(dir, sizeof(dir), "%.*s", (int) (strrchr(path, '/') - path), path);
+    if (lstat(dir, &st) < 0 || chmod(dir, st.st_mode | S_IWUSR | S_IXUSR) < 0)
+	return retstat;
+    retstat = op(path);
+    chmod(dir, st.st_mode);
+    return retstat;
+}
+
+static int make_entry(const char *path)
+{
+    int fd;
+
+    fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0600);
+    if (fd < 0)
+	return errno == EEXIST ? 0 : -errno;
+    close(fd);
+    return 1;
+}
+
+static int drop_entry(const char *path)
+{
+    return unlink(path) < 0 ? -errno : 0;
+}
+
+int kvfs_dirid_enter(const char *path)
+{
+    char entry[PATH_MAX];
+    int retstat;
+
+    retstat = entry_path(entry, path);
+    if (retstat > 0)
+	retstat = in_dir(entry, make_entry);
+    return retstat;
+}
+
+int kvfs_dirid_leave(const char *path)
+{
+    char entry[PATH_MAX];
+    int retstat;
+
+    retstat = entry_path(entry, path);
+    if (retstat > 0)
+	retstat = in_dir(entry, drop_entry);
+    return retstat;
+}
+
+int kvfs_dirid_sweep(const char *key, const char *actual_path, int (*exists)(const char *key))
+{
+    char id[DIRID_LEN], child[KVFS_KEY_LEN], path[PATH_MAX];
+    size_t plen = strlen(KVFS_PRIVATE_PREFIX);
+    struct dirent *de;
+    const char *name;
+    DIR *dp;
+    int scratch, dropped = 0;
+
+    if (dir_id(key, id) < 0)
+	return 0;
+    dp = opendir(actual_path);
+    if (dp == NULL)
+	return log_error("dirid sweep opendir");
+    while ((de = readdir(dp)) != NULL) {
+	name = de->d_name;
+	scratch = 0;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, KVFS_DIRID_FILE) == 0)
+	    continue;
+	// besides escaped names, anything of kvfs's own is scratch a
+	// crash left behind
+	if (strncmp(name, KVFS_PRIVATE_PREFIX, plen) == 0) {
+	    scratch = strncmp(name + plen, KVFS_PRIVATE_PREFIX, plen) != 0;
+	    name += plen;
+	}
+	if (!scratch) {
+	    component_key(child, id, name, strlen(name));
+	    if (exists(child))
+		continue;
+	}
+	snprintf(path, sizeof(path), "%s/%s", actual_path, de->d_name);
+	if (in_dir(path, drop_entry) == 0)
+	    dropped++;
+    }
+    closedir(dp);
+    return dropped;
+}
+
+int kvfs_dirid_preload(const char *key)
+{
+    char dir[PATH_MAX], id[DIRID_LEN];
+    int retstat;
+
+    kvfs_root_path(dir, key);
+    retstat = load_id(dir, id);
+    if (retstat < 0)
+	return retstat;
+    pthread_mutex_lock(&cache_lock);
+    cache_id(key, id);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+int kvfs_dirid_create(const char *key, const char *actual_path)
+{
+    char id[DIRID_LEN];
+    int retstat;
+
+    retstat = alloc_id(id);
+    if (retstat == 0)
+	retstat = write_id(actual_path, id);
+    if (retstat < 0)
+	return retstat;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_id(key, id);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// does the backing directory dir hold entries, not just its id?
+static int has_entries(const char *dir)
+{
+    struct dirent *de;
+    DIR *dp;
+    int found = 0;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+	return 0;
+    while (!found && (de = readdir(dp)) != NULL)
+	found = strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+	    strcmp(de->d_name, KVFS_DIRID_FILE) != 0;
+    closedir(dp);
+    return found;
+}
+
+int kvfs_dirid_rmdir(const char *key, const char *actual_path)
+{
+    char id[DIRID_LEN], path[PATH_MAX];
+    struct stat st;
+    int retstat, have_id, opened = 0;
+
+    // without the id, what is below would be gone for a moment
+    if (has_entries(actual_path))
+	return -ENOTEMPTY;
+
+    // the id file is all the backing directory of an empty directory
+    // holds; put it back if the rmdir fails after all.  A read-only
+    // directory is made writable for the unlink, as mkdir does.
+    have_id = dir_id(key, id) == 0;
+    snprintf(path, sizeof(path), "%s/%s", actual_path, KVFS_DIRID_FILE);
+    if (have_id && unlink(path) < 0 && errno == EACCES && lstat(actual_path, &st) == 0) {
+	opened = chmod(actual_path, st.st_mode | S_IWUSR | S_IXUSR) == 0;
+	unlink(path);
+    }
+
+    retstat = log_syscall("rmdir", rmdir(actual_path), 0);
+    if (retstat < 0 && have_id)
+	write_id(actual_path, id);
+    if (retstat < 0 && opened)
+	chmod(actual_path, st.st_mode);
+    if (retstat == 0)
+	forget_id(key);
+    return retstat;
+}
+
+int kvfs_dirid_rename(const char *key, const char *actual_path,
+		      const char *newkey, const char *actual_newpath)
+{
+    char id[DIRID_LEN], path[PATH_MAX];
+    struct stat st;
+    struct dir_node *d;
+    int retstat, replaced = 0;
+
+    // an empty directory being replaced still holds its id file,
+    // which would make rename() fail with ENOTEMPTY
+    if (lstat(actual_newpath, &st) == 0 && S_ISDIR(st.st_mode) && dir_id(newkey, id) == 0) {
+	snprintf(path, sizeof(path), "%s/%s", actual_newpath, KVFS_DIRID_FILE);
+	replaced = unlink(path) == 0;
+    }
+
+    retstat = kvfs_roots_rename(key, actual_path, newkey, actual_newpath);
+    if (retstat < 0) {
+	if (replaced)
+	    write_id(actual_newpath, id);
+	return retstat;
+    }
+
+    // the id went with the directory; so does its cache entry
+    pthread_mutex_lock(&cache_lock);
+    cache_gen++;
+    kvfs_slab_free(&dir_slab, htable_remove(&dir_cache, newkey));
+    d = (struct dir_node *) htable_remove(&dir_cache, key);
+    if (d != NULL) {
+	strcpy(d->node.key, newkey);
+	htable_insert(&dir_cache, &d->node);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// the format root dir is marked with; 0 if it has no mark
+static int read_format(const char *dir)
+{
+    char path[PATH_MAX], buf[16];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, KVFS_FORMAT_FILE);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return atoi(buf);
+}
+
+static void write_format(const char *dir)
+{
+    char path[PATH_MAX], buf[16];
+    int fd, len;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, KVFS_FORMAT_FILE);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0) {
+	log_error("dirid format open");
+	return;
+    }
+    len = snprintf(buf, sizeof(buf), "%d\n", KVFS_FORMAT);
+    if (write(fd, buf, len) != len || fsync(fd) < 0)
+	log_error("dirid format write");
+    close(fd);
+}
+
+// does dir hold objects keyed by full path?  Only an older kvfs
+// leaves objects without any bookkeeping of its own next to them.
+static int old_format(const char *dir)
+{
+    struct dirent *de;
+    DIR *dp;
+    int objects = 0, ours = 0;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+	return 0;
+    while (!ours && (de = readdir(dp)) != NULL) {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	if (strncmp(de->d_name, KVFS_PRIVATE_PREFIX, strlen(KVFS_PRIVATE_PREFIX)) == 0)
+	    ours = 1;
+	else
+	    objects = 1;
+    }
+    closedir(dp);
+    return objects && !ours;
+}
+
+// An older kvfs gave directories no ids; they get them as the root is
+// marked.  Only top-level ones can be there, see kvfs_dirid_check().
+static void give_ids(const char *root)
+{
+    char path[PATH_MAX], id[DIRID_LEN];
+    struct dirent *de;
+    struct stat st;
+    DIR *dp;
+
+    dp = opendir(root);
+    if (dp == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL) {
+	if (de->d_name[0] == '.')
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+	if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode) || load_id(path, id) != -ENOENT)
+	    continue;
+	if (alloc_id(id) < 0)
+	    break;
+	chmod(path, st.st_mode | S_IWUSR | S_IXUSR);
+	write_id(path, id);
+	chmod(path, st.st_mode);
+    }
+    closedir(dp);
+}
+
+// before kvfs_roots_check(), which leaves files of its own in the
+// roots
+int kvfs_dirid_check(struct kvfs_state *state)
+{
+    const char *dir;
+    int r, format;
+
+    for (r = 0; r < state->nroots; r++) {
+	dir = state->roots[r];
+	format = read_format(dir);
+	if (format > KVFS_FORMAT) {
+	    fprintf(stderr, "kvfs: %s was made by a newer kvfs (key format %d, this one knows %d)\n",
+		    dir, format, KVFS_FORMAT);
+	    return -1;
+	}
+	if (format == 0 && !state->format_upgrade && old_format(dir)) {
+	    fprintf(stderr, "kvfs: %s was made by an older kvfs, which keyed objects by full path;\n"
+		    "      objects below the top level would not be found.  Copy them out through\n"
+		    "      that kvfs, or mount with -o format_upgrade=1 if there are none.\n", dir);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static void dirid_report(FILE *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    fprintf(out, "    %zu directory id(s) cached, %llu hit(s), %llu miss(es) (%llu not cached, "
+	    "raced), next id %llx\n",
+	    dir_cache.count, (unsigned long long) hits, (unsigned long long) misses,
+	    (unsigned long long) stale, (unsigned long long) next_id);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int kvfs_dirid_init(struct kvfs_state *state)
+{
+    char path[PATH_MAX], buf[DIRID_LEN + 1];
+    ssize_t n;
+    int r;
+
+    hits = misses = stale = 0;
+    cache_max = state->immutable ? SIZE_MAX : DIRID_CACHE_MAX;
+    if (htable_init(&dir_cache, 1024) < 0)
+	return -ENOMEM;
+    kvfs_slab_init(&dir_slab, "dirid", sizeof(struct dir_node));
+
+    snprintf(path, sizeof(path), "%s/%s", state->rootdir, KVFS_DIRID_COUNTER);
+    counter_fd = open(path, O_CREAT | O_RDWR, 0600);
+    if (counter_fd < 0)
+	return log_error("dirid counter open");
+    n = pread(counter_fd, buf, sizeof(buf) - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    next_id = reserved_end = n > 0 ? strtoull(buf, NULL, 16) : 0;
+
+    // an immutable tree is not written to, not even to mark it
+    for (r = 0; r < kvfs_roots_count() && !state->immutable; r++)
+	if (read_format(kvfs_root_dir(r)) != KVFS_FORMAT) {
+	    give_ids(kvfs_root_dir(r));
+	    write_format(kvfs_root_dir(r));
+	}
+
+    log_msg("    dirid: next id %llx\n", (unsigned long long) next_id);
+    kvfs_stats_register("dirid", dirid_report);
+    return 0;
+}
+
+void kvfs_dirid_destroy(struct kvfs_state *state)
+{
+    (void) state;
+
+    kvfs_stats_unregister("dirid");
+    pthread_mutex_lock(&cache_lock);
+    htable_free(&dir_cache, NULL);
+    kvfs_slab_destroy(&dir_slab);
+    pthread_mutex_unlock(&cache_lock);
+    if (counter_fd >= 0)
+	close(counter_fd);
+    counter_fd = -1;
+}
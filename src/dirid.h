@@ -0,0 +1,63 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _DIRID_H_
+#define _DIRID_H_
+
+// every name under rootdir that starts with this is kvfs's own
+// bookkeeping, not an object; readdir leaves them out
+#define KVFS_PRIVATE_PREFIX	".kvfs_"
+
+// kept in each directory's backing directory
+#define KVFS_DIRID_FILE		".kvfs_id"
+
+// the next free id, in rootdir
+#define KVFS_DIRID_COUNTER	".kvfs_dirid"
+
+// in every root: how its keys are made, KVFS_FORMAT
+#define KVFS_FORMAT_FILE	".kvfs_format"
+#define KVFS_FORMAT		2	// md5(<parent id> "/" <name>)
+
+struct kvfs_state;
+
+// before mounting: refuse roots whose keys are made another way
+int  kvfs_dirid_check(struct kvfs_state *state);
+
+int  kvfs_dirid_init(struct kvfs_state *state);
+void kvfs_dirid_destroy(struct kvfs_state *state);
+
+// The key of the object at path, in the calling thread's arena: good
+// until the call it is for returns (kvfs_arena_reset()).  A path
+// below a directory that does not exist gets a key nothing is stored
+// under, so the call it is for fails with ENOENT.
+char *kvfs_path2key(const char *path);
+
+// cache the id of the directory at key, if it has one, without
+// giving it one; 0 if it was cached
+int  kvfs_dirid_preload(const char *key);
+
+// give the directory just made at key its id
+int  kvfs_dirid_create(const char *key, const char *actual_path);
+
+// Put path in, or take it out of, the backing directory of its
+// parent: before the object is made, after it is gone.  Entering
+// returns 1 if it was entered now, 0 if it already was or is
+// top-level, -ENOENT if the parent is gone.
+int  kvfs_dirid_enter(const char *path);
+int  kvfs_dirid_leave(const char *path);
+
+// drop the entries of the directory at key whose objects exists()
+// does not find; how many
+int  kvfs_dirid_sweep(const char *key, const char *actual_path,
+		      int (*exists)(const char *key));
+
+// rmdir() and rename() of backing directories, keeping the id files
+// and the id cache straight
+int  kvfs_dirid_rmdir(const char *key, const char *actual_path);
+int  kvfs_dirid_rename(const char *key, const char *actual_path,
+		       const char *newkey, const char *actual_newpath);
+
+#endif
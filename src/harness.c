@@ -0,0 +1,133 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The part of the FUSE library kvfs needs, for the tools that call it
+  in-process.  See harness.h.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dirid.h"
+#include "harness.h"
+#include "log.h"
+#include "mirror.h"
+#include "roots.h"
+
+extern struct fuse_opt kvfs_opts[];
+
+struct kvfs_state *harness_state;
+static const char *harness_prog;
+
+static __thread struct fuse_context harness_context;
+
+struct fuse_context *fuse_get_context(void)
+{
+    return &harness_context;
+}
+
+void harness_enter(int id)
+{
+    harness_context.private_data = harness_state;
+    harness_context.uid = getuid();
+    harness_context.gid = getgid();
+    harness_context.pid = getpid() + 1 + id;
+}
+
+int harness_setup(const char *prog)
+{
+    harness_prog = prog;
+    harness_state = calloc(1, sizeof(*harness_state));
+    if (harness_state == NULL) {
+	fprintf(stderr, "%s: calloc: %s\n", prog, strerror(errno));
+	return -1;
+    }
+    kvfs_set_defaults(harness_state);
+    return 0;
+}
+
+int harness_options(char *opts)
+{
+    struct fuse_opt *o;
+    char *opt, *save = NULL;
+    size_t len;
+
+    for (opt = strtok_r(opts, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+	for (o = kvfs_opts; o->templ != NULL; o++) {
+	    len = strchr(o->templ, '=') - o->templ + 1;
+	    if (strncmp(opt, o->templ, len) == 0)
+		break;
+	}
+	if (o->templ == NULL) {
+	    fprintf(stderr, "%s: unknown option %s\n", harness_prog, opt);
+	    return -1;
+	}
+	if (strcmp(o->templ + len, "%s") == 0)
+	    *(char **) ((char *) harness_state + o->offset) = strdup(opt + len);
+	else
+	    *(unsigned int *) ((char *) harness_state + o->offset) = strtoul(opt + len, NULL, 0);
+    }
+    return 0;
+}
+
+int harness_mount(const char *rootdirs)
+{
+    struct fuse_conn_info conn;
+    sigset_t sigs;
+    char *list, *dir, *save;
+    int n;
+
+    // "a:b:c" is kvfs a b c mountpoint
+    list = strdup(rootdirs);
+    harness_state->roots = calloc(strlen(rootdirs) / 2 + 1, sizeof(char *));
+    if (list == NULL || harness_state->roots == NULL) {
+	fprintf(stderr, "%s: out of memory\n", harness_prog);
+	return -1;
+    }
+    n = 0;
+    for (dir = strtok_r(list, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+	harness_state->roots[n] = realpath(dir, NULL);
+	if (harness_state->roots[n] == NULL) {
+	    fprintf(stderr, "%s: %s: %s\n", harness_prog, dir, strerror(errno));
+	    return -1;
+	}
+	n++;
+    }
+    free(list);
+    if (n == 0) {
+	fprintf(stderr, "%s: no rootdir\n", harness_prog);
+	return -1;
+    }
+    harness_state->nroots = n;
+    harness_state->rootdir = harness_state->roots[0];
+    if (kvfs_dirid_check(harness_state) < 0 || kvfs_roots_check(harness_state) < 0 ||
+	kvfs_mirror_check(harness_state) < 0)
+	return -1;
+    harness_state->logfile = log_open();
+
+    // as in kvfs's main(): SIGUSR1 is for the stats thread only
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    harness_enter(-1);
+    memset(&conn, 0, sizeof(conn));
+    kvfs_oper.init(&conn);
+    return 0;
+}
+
+void harness_unmount(void)
+{
+    harness_enter(-1);
+    kvfs_oper.destroy(harness_state);
+}
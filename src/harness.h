@@ -0,0 +1,46 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  What kvfs-bench, kvfs-replay, kvfs-microbench and kvfs-resync
+  share: enough of the FUSE library to call kvfs_oper directly,
+  without a mount.  All are built with -DKVFS_BENCH, which leaves out
+  kvfs's main().
+*/
+
+#ifndef _HARNESS_H_
+#define _HARNESS_H_
+
+#include "kvfs.h"
+
+#include <fuse.h>
+
+extern struct fuse_operations kvfs_oper;
+
+// helpers of kvfs.c the tools time or use
+void kvfs_bench_real_path(char actual_path[PATH_MAX], const char *path);
+// not in kvfs_oper under FUSE 2, but callable all the same
+off_t kvfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi);
+ssize_t kvfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
+			     const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
+			     size_t len, int flags);
+
+// the state harness_mount() hands to kvfs
+extern struct kvfs_state *harness_state;
+
+// allocate the state with kvfs's defaults; before anything else
+int harness_setup(const char *prog);
+
+// -o name=value[,name=value...] against kvfs's own option table
+int harness_options(char *opts);
+
+// what kvfs's main() and kvfs_init do, for rootdirs, a ':'
+// separated list of roots
+int harness_mount(const char *rootdirs);
+void harness_unmount(void);
+
+// make the calling thread look like FUSE is serving client id
+void harness_enter(int id);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htable.h"
+
+// FNV-1a; good enough for hex digests and short names alike
+static size_t hash_key(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*key) {
+	h ^= (unsigned char) *key++;
+	h *= 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+int htable_init(struct htable *ht, size_t nbuckets)
+{
+    if (nbuckets < 16)
+	nbuckets = 16;
+    ht->buckets = calloc(nbuckets, sizeof(struct hnode *));
+    if (ht->buckets == NULL)
+	return -1;
+    ht->nbuckets = nbuckets;
+    ht->count = 0;
+    return 0;
+}
+
+void htable_free(struct htable *ht, void (*free_node)(struct hnode *node))
+{
+    size_t i;
+    struct hnode *node, *next;
+
+    for (i = 0; i < ht->nbuckets; i++) {
+	for (node = ht->buckets[i]; node != NULL; node = next) {
+	    next = node->next;
+	    if (free_node)
+		free_node(node);
+	}
+    }
+    free(ht->buckets);
+    ht->buckets = NULL;
+    ht->nbuckets = ht->count = 0;
+}
+
+// double the bucket array once the average chain is longer than one
+static void htable_grow(struct htable *ht)
+{
+    size_t i, nbuckets = ht->nbuckets * 2;
+    struct hnode **buckets, *node, *next;
+
+    buckets = calloc(nbuckets, sizeof(struct hnode *));
+    if (buckets == NULL)
+	return;			// keep working with longer chains
+
+    for (i = 0; i < ht->nbuckets; i++) {
+	for (node = ht->buckets[i]; node != NULL; node = next) {
+	    size_t b = hash_key(node->key) % nbuckets;
+	    next = node->next;
+	    node->next = buckets[b];
+	    buckets[b] = node;
+	}
+    }
+    free(ht->buckets);
+    ht->buckets = buckets;
+    ht->nbuckets = nbuckets;
+}
+
+struct hnode *htable_lookup(struct htable *ht, const char *key)
+{
+    struct hnode *node;
+
+    for (node = ht->buckets[hash_key(key) % ht->nbuckets]; node != NULL; node = node->next)
+	if (strcmp(node->key, key) == 0)
+	    return node;
+    return NULL;
+}
+
+void htable_insert(struct htable *ht, struct hnode *node)
+{
+    size_t b;
+
+    if (ht->count >= ht->nbuckets)
+	htable_grow(ht);
+
+    b = hash_key(node->key) % ht->nbuckets;
+    node->next = ht->buckets[b];
+    ht->buckets[b] = node;
+    ht->count++;
+}
+
+struct hnode *htable_remove(struct htable *ht, const char *key)
+{
+    struct hnode **pp, *node;
+
+    for (pp = &ht->buckets[hash_key(key) % ht->nbuckets]; (node = *pp) != NULL; pp = &node->next) {
+	if (strcmp(node->key, key) == 0) {
+	    *pp = node->next;
+	    ht->count--;
+	    return node;
+	}
+    }
+    return NULL;
+}
+
+int htable_foreach(struct htable *ht, int (*fn)(struct hnode *node, void *arg), void *arg)
+{
+    size_t i;
+    int ret;
+    struct hnode *node, *next;
+
+    for (i = 0; i < ht->nbuckets; i++) {
+	for (node = ht->buckets[i]; node != NULL; node = next) {
+	    next = node->next;
+	    if ((ret = fn(node, arg)) != 0)
+		return ret;
+	}
+    }
+    return 0;
+}
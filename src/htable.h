@@ -0,0 +1,42 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A small chained hash table keyed by strings (normally the md5
+  digests kvfs uses as object names).  Entries are intrusive: embed a
+  struct hnode as the first member of your own record and cast back.
+  The table does no locking of its own.
+*/
+
+#ifndef _HTABLE_H_
+#define _HTABLE_H_
+
+#include <stddef.h>
+
+// digests are 32 hex characters plus the terminating null
+#define KVFS_KEY_LEN 33
+
+struct hnode {
+    struct hnode *next;
+    char key[KVFS_KEY_LEN];
+};
+
+struct htable {
+    struct hnode **buckets;
+    size_t nbuckets;
+    size_t count;
+};
+
+int  htable_init(struct htable *ht, size_t nbuckets);
+void htable_free(struct htable *ht, void (*free_node)(struct hnode *node));
+
+struct hnode *htable_lookup(struct htable *ht, const char *key);
+void htable_insert(struct htable *ht, struct hnode *node);
+struct hnode *htable_remove(struct htable *ht, const char *key);
+
+// call fn on every node; fn may not insert, but may remove the node
+// it was handed.  Stops early and returns fn's value if it is nonzero.
+int htable_foreach(struct htable *ht, int (*fn)(struct hnode *node, void *arg), void *arg);
+
+#endif
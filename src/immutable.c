@@ -0,0 +1,327 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Immutable mounts.  With -o immutable=1 kvfs is told that nothing
+  under the roots changes for as long as it is mounted (a published
+  dataset, an image served to many readers), and caches accordingly:
+
+  - every call that would change something fails with EROFS before a
+    key is even worked out, and main() mounts read-only;
+  - opens set keep_cache, so the kernel keeps a file's pages from one
+    open to the next instead of dropping them on every open;
+  - main() makes the attribute, entry and negative timeouts a day
+    long, unless other ones are given;
+  - kvfs_immutable_init() reads the whole index at mount: the id of
+    every directory, so resolving a path never reads a .kvfs_id, and
+    the attributes of every object, so getattr never leaves memory.
+    Once all of the index is in, a key that is not in it does not
+    exist, and getattr says so without looking.
+
+  Objects only an object store (-o backend) holds are not in the
+  roots' listing, so with a store only directories and links are
+  loaded and getattr falls back on the usual lookup after a miss; so
+  it does once more than MAX_ATTRS objects are found.  Nothing checks
+  the promise: a change made under the roots while mounted is not
+  seen until the next mount.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "dirid.h"
+#include "htable.h"
+#include "immutable.h"
+#include "log.h"
+#include "roots.h"
+#include "stats.h"
+#include "stripe.h"
+
+#define MAX_ATTRS	(1 << 22)	// objects whose attributes are loaded
+
+struct attr_node {
+    struct hnode node;
+    struct stat st;
+};
+
+static struct fuse_operations next, immutable;
+
+// filled in by kvfs_immutable_init() before any other call is
+// served, and only read after that, so lookups need no lock
+static struct htable attrs;
+static struct kvfs_slab attr_slab;
+static int loaded, complete, with_store;
+static uint64_t dirs, refused, hits, misses;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+static int refuse(void)
+{
+    COUNT(refused, 1);
+    return -EROFS;
+}
+
+static int immutable_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    return refuse();
+}
+
+static int immutable_mkdir(const char *path, mode_t mode)
+{
+    return refuse();
+}
+
+static int immutable_unlink(const char *path)
+{
+    return refuse();
+}
+
+static int immutable_rmdir(const char *path)
+{
+    return refuse();
+}
+
+static int immutable_symlink(const char *path, const char *link)
+{
+    return refuse();
+}
+
+static int immutable_rename(const char *path, const char *newpath)
+{
+    return refuse();
+}
+
+static int immutable_link(const char *path, const char *newpath)
+{
+    return refuse();
+}
+
+static int immutable_chmod(const char *path, mode_t mode)
+{
+    return refuse();
+}
+
+static int immutable_chown(const char *path, uid_t uid, gid_t gid)
+{
+    return refuse();
+}
+
+static int immutable_truncate(const char *path, off_t newsize)
+{
+    return refuse();
+}
+
+static int immutable_utime(const char *path, struct utimbuf *ubuf)
+{
+    return refuse();
+}
+
+static int immutable_write(const char *path, const char *buf, size_t size, off_t offset,
+			   struct fuse_file_info *fi)
+{
+    return refuse();
+}
+
+static int immutable_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+			       struct fuse_file_info *fi)
+{
+    return refuse();
+}
+
+static int immutable_setxattr(const char *path, const char *name, const char *value,
+			      size_t size, int flags)
+{
+    return refuse();
+}
+
+static int immutable_removexattr(const char *path, const char *name)
+{
+    return refuse();
+}
+
+static int immutable_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    return refuse();
+}
+
+static int immutable_fallocate(const char *path, int mode, off_t offset, off_t len,
+			       struct fuse_file_info *fi)
+{
+    return refuse();
+}
+
+static int immutable_open(const char *path, struct fuse_file_info *fi)
+{
+    int retstat;
+
+    // the kernel turns these away on a read-only mount already; not
+    // if -o rw was given after all
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & (O_CREAT | O_TRUNC)) != 0)
+	return refuse();
+    retstat = next.open(path, fi);
+    if (retstat == 0)
+	fi->keep_cache = 1;
+    return retstat;
+}
+
+// with -o immutable, everything that changes the tree is refused
+#define REFUSE(op) immutable.op = next.op != NULL ? immutable_##op : NULL
+
+struct fuse_operations *kvfs_immutable_wrap(const struct fuse_operations *ops)
+{
+    next = *ops;
+    immutable = *ops;
+
+    REFUSE(mknod);
+    REFUSE(mkdir);
+    REFUSE(unlink);
+    REFUSE(rmdir);
+    REFUSE(symlink);
+    REFUSE(rename);
+    REFUSE(link);
+    REFUSE(chmod);
+    REFUSE(chown);
+    REFUSE(truncate);
+    REFUSE(utime);
+    REFUSE(write);
+    REFUSE(write_buf);
+    REFUSE(setxattr);
+    REFUSE(removexattr);
+    REFUSE(ftruncate);
+    REFUSE(fallocate);
+    immutable.open = immutable_open;
+#if FUSE_MAJOR_VERSION > 3 || (FUSE_MAJOR_VERSION == 3 && FUSE_MINOR_VERSION >= 4)
+    // its destination is written
+    immutable.copy_file_range = NULL;
+#endif
+    return &immutable;
+}
+
+int kvfs_immutable_getattr(const char *key, struct stat *statbuf)
+{
+    struct attr_node *a;
+
+    if (!loaded)
+	return KVFS_IMMUTABLE_UNKNOWN;
+    a = (struct attr_node *) htable_lookup(&attrs, key);
+    if (a != NULL) {
+	COUNT(hits, 1);
+	*statbuf = a->st;
+	return 0;
+    }
+    COUNT(misses, 1);
+    return complete ? -ENOENT : KVFS_IMMUTABLE_UNKNOWN;
+}
+
+// the attributes getattr would give for key, whose backing file is at
+// path
+static void load_attr(const char *key, const char *path)
+{
+    struct attr_node *a;
+
+    if (attrs.count >= MAX_ATTRS) {
+	complete = 0;
+	return;
+    }
+    a = kvfs_slab_alloc(&attr_slab);
+    if (a == NULL) {
+	complete = 0;
+	return;
+    }
+    // a store's regular files are looked for there first
+    if (lstat(path, &a->st) < 0 || (with_store && S_ISREG(a->st.st_mode))) {
+	kvfs_slab_free(&attr_slab, a);
+	return;
+    }
+    kvfs_stripe_stat(key, &a->st);
+    strcpy(a->node.key, key);
+    htable_insert(&attrs, &a->node);
+
+    if (S_ISDIR(a->st.st_mode) && kvfs_dirid_preload(key) == 0)
+	dirs++;
+}
+
+static int is_key(const char *name)
+{
+    return strlen(name) == KVFS_KEY_LEN - 1 && strspn(name, "0123456789abcdef") == KVFS_KEY_LEN - 1;
+}
+
+// every object is named by its key in its root's directory; read
+// them all, as readdir of "/" lists them
+static void load_root(int r)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dp;
+
+    dp = opendir(kvfs_root_dir(r));
+    if (dp == NULL) {
+	log_error("immutable opendir");
+	complete = 0;
+	return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+	if (!is_key(de->d_name) || !kvfs_roots_listed(r, de->d_name))
+	    continue;
+	kvfs_root_path(path, de->d_name);
+	load_attr(de->d_name, path);
+    }
+    closedir(dp);
+}
+
+static void immutable_report(FILE *out)
+{
+    fprintf(out, "    %zu object(s) and %llu directory id(s) loaded%s; %llu getattr(s) answered, "
+	    "%llu missed, %llu change(s) refused\n",
+	    attrs.count, (unsigned long long) dirs, complete ? "" : " (not all)",
+	    (unsigned long long) hits, (unsigned long long) misses,
+	    (unsigned long long) refused);
+}
+
+int kvfs_immutable_init(struct kvfs_state *state)
+{
+    char *key;
+    int r;
+
+    loaded = 0;
+    if (!state->immutable)
+	return 0;
+    if (htable_init(&attrs, 4096) < 0)
+	return -ENOMEM;
+    kvfs_slab_init(&attr_slab, "immutable", sizeof(struct attr_node));
+    dirs = refused = hits = misses = 0;
+    with_store = state->store != NULL;
+    complete = !with_store;
+
+    key = str2md5("/", 1);
+    if (key != NULL)
+	load_attr(key, state->rootdir);
+    free(key);
+    for (r = 0; r < kvfs_roots_count(); r++)
+	load_root(r);
+    loaded = 1;
+
+    log_msg("    immutable: %zu objects, %llu directory ids loaded\n",
+	    attrs.count, (unsigned long long) dirs);
+    kvfs_stats_register("immutable", immutable_report);
+    return 0;
+}
+
+void kvfs_immutable_destroy(struct kvfs_state *state)
+{
+    if (!state->immutable || !loaded)
+	return;
+    kvfs_stats_unregister("immutable");
+    loaded = 0;
+    htable_free(&attrs, NULL);
+    kvfs_slab_destroy(&attr_slab);
+}
@@ -0,0 +1,31 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Read-only mounts of a tree that does not change (-o immutable=1),
+  see immutable.c.
+*/
+
+#ifndef _IMMUTABLE_H_
+#define _IMMUTABLE_H_
+
+struct fuse_operations;
+struct kvfs_state;
+struct stat;
+
+// what kvfs_immutable_getattr() returns when it cannot tell
+#define KVFS_IMMUTABLE_UNKNOWN	1
+
+int  kvfs_immutable_init(struct kvfs_state *state);
+void kvfs_immutable_destroy(struct kvfs_state *state);
+
+// Return an operations table that refuses every change with EROFS
+// and has the kernel keep the pages of opened files.
+struct fuse_operations *kvfs_immutable_wrap(const struct fuse_operations *ops);
+
+// The attributes of key as loaded at mount: 0, -ENOENT if the whole
+// index was loaded and key is not in it, or KVFS_IMMUTABLE_UNKNOWN.
+int  kvfs_immutable_getattr(const char *key, struct stat *statbuf);
+
+#endif
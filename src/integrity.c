@@ -0,0 +1,717 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Block checksums for backing files (-o checksum=KB).
+
+  Every backing file under rootdir is split into checksum blocks of
+  -o checksum KiB, and the CRC32C of each block is kept in a sidecar,
+  rootdir/.kvfs_csum/<key>, as an array of 32-bit values indexed by
+  block number.  A block is checksummed as if zero-padded to the full
+  block size.  That way extending the file, whether by writing past
+  EOF or by truncating up, never changes the checksum of the block
+  that held the old EOF.
+
+  Writes record the checksums of the blocks they cover; blocks only
+  partly covered are read back to be summed whole.  Reads are widened
+  to whole blocks and verified, and a mismatch is -EIO.  A zero entry
+  means "not recorded" (holes, files from before checksums were on),
+  and such a block is not verified.  The one block in 2^32 whose CRC
+  really is zero goes unverified too.
+
+  Names of the same inode share a lock stripe, so a read never checks
+  a block against the sum of a write still in flight.
+
+  A write's data and its sums go to two files, in no particular order
+  as far as the disk is concerned, so a crash can leave a block that
+  was written since its last fsync next to a sum that does not match.
+  A clean unmount syncs the roots and leaves .kvfs_csum/.clean behind.
+  The first mount without it, or one with -o checksum_rebuild=1,
+  takes a block that does not match as right: its sum is re-recorded
+  and logged instead of failing the read, until the scrubber has been
+  over every file once.  Only then is a mismatch -EIO again; without
+  the scrubber, not before the next mount.
+
+  A scrubber thread re-reads every file with a sidecar, at most
+  -o scrub_rate MB/s, and logs any block that no longer matches.  It
+  also removes sidecars whose file has gone.  Store objects are left
+  out: they have no backing file of their own.  So are files striped
+  over several roots, which are off altogether.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "crc32c.h"
+#include "integrity.h"
+#include "log.h"
+#include "mirror.h"
+#include "roots.h"
+#include "stats.h"
+#include "stripe.h"
+
+#define CSUM_DIR	".kvfs_csum"
+#define CSUM_NAME_MAX	40	// room for "/" and a key
+#define NLOCKS		64
+#define BATCH		64		// checksums read or written at once
+#define SCRUB_CHUNK	(1 << 20)
+#define SCRUB_PAUSE	60		// seconds between scrub passes
+#define CLEAN_FILE	".clean"	// in csum_dir: the last unmount was clean
+
+struct kvfs_csum_file {
+    int fd;				// the sidecar
+    int rfd;				// to read blocks back if the file's fd is write-only;
+					// -1 if it is not, -2 if we may not read the file
+    pthread_rwlock_t *lock;		// shared by every name of the inode
+};
+
+// short enough that every sidecar below it still fits in PATH_MAX
+static char csum_dir[PATH_MAX - CSUM_NAME_MAX];
+static size_t block_size;		// bytes; 0 when checksums are off
+static pthread_rwlock_t locks[NLOCKS];
+static const char zero_page[4096];
+
+static pthread_t scrub_thread;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wake = PTHREAD_COND_INITIALIZER;
+static int scrub_running, scrub_stop;
+static uint64_t scrub_rate;		// bytes per second
+
+static uint64_t blocks_verified, blocks_recorded, mismatches, rebuilt;
+
+// nonzero until the sums a crash may have left behind are known good
+static int rebuilding;
+static uint64_t scrub_passes, scrub_bytes, scrub_mismatches, scrub_orphans;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+static void sidecar_path(char path[PATH_MAX], const char *key)
+{
+    snprintf(path, PATH_MAX, "%s/%s", csum_dir, key);
+}
+
+static pthread_rwlock_t *lock_for(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+	return &locks[0];
+    return &locks[st.st_ino % NLOCKS];
+}
+
+// the sum of a block of len bytes, zero-padded to block_size
+static uint32_t block_sum(const char *data, size_t len)
+{
+    uint32_t crc = kvfs_crc32c(0, data, len);
+    size_t pad, n;
+
+    for (pad = block_size - len; pad > 0; pad -= n) {
+	n = pad < sizeof(zero_page) ? pad : sizeof(zero_page);
+	crc = kvfs_crc32c(crc, zero_page, n);
+    }
+    return crc;
+}
+
+// sum block blk as it is in fd now; buf is block_size bytes.  A file
+// kvfs cannot read gets no sum (zero, not recorded).
+static int read_block_sum(struct kvfs_csum_file *cs, int fd, uint64_t blk, char *buf, uint32_t *sum)
+{
+    ssize_t got;
+
+    if (cs->rfd == -2) {
+	*sum = 0;
+	return 0;
+    }
+    got = pread(cs->rfd >= 0 ? cs->rfd : fd, buf, block_size, blk * block_size);
+    if (got < 0)
+	return log_error("checksum pread");
+    *sum = block_sum(buf, got);
+    return 0;
+}
+
+// check the n bytes at data, read from block-aligned offset start
+static int verify(int cfd, const char *data, size_t n, off_t start, uint64_t *counter)
+{
+    uint32_t sums[BATCH], sum;
+    uint64_t blk = start / block_size;
+    size_t done = 0, len = 0, i, count;
+    ssize_t got;
+
+    while (done < n) {
+	count = (n - done + block_size - 1) / block_size;
+	if (count > BATCH)
+	    count = BATCH;
+	got = pread(cfd, sums, count * sizeof(uint32_t), blk * sizeof(uint32_t));
+	if (got < 0)
+	    return log_error("checksum pread");
+	memset((char *) sums + got, 0, count * sizeof(uint32_t) - got);
+
+	for (i = 0; i < count; i++, blk++, done += len) {
+	    len = n - done < block_size ? n - done : block_size;
+	    if (sums[i] == 0)
+		continue;
+	    sum = block_sum(data + done, len);
+	    if (sum != sums[i] && __atomic_load_n(&rebuilding, __ATOMIC_RELAXED)) {
+		// maybe torn by a crash: the data wins
+		if (pwrite(cfd, &sum, sizeof(sum), blk * sizeof(uint32_t)) != sizeof(sum))
+		    return log_error("checksum pwrite");
+		log_msg("    checksum of block %llu re-recorded\n", (unsigned long long) blk);
+		COUNT(rebuilt, 1);
+		continue;
+	    }
+	    if (sum != sums[i]) {
+		log_msg("    ERROR checksum mismatch in block %llu\n", (unsigned long long) blk);
+		COUNT(*counter, 1);
+		return -EIO;
+	    }
+	    COUNT(blocks_verified, 1);
+	}
+    }
+    return 0;
+}
+
+// record the sums of blocks [from, to) as they are in fd now
+static int rehash(struct kvfs_csum_file *cs, int fd, uint64_t from, uint64_t to)
+{
+    uint32_t sums[BATCH];
+    uint64_t blk;
+    size_t i, count;
+    char *buf;
+    int retstat = 0;
+
+    buf = malloc(block_size);
+    if (buf == NULL)
+	return -ENOMEM;
+    for (blk = from; blk < to && retstat == 0; blk += count) {
+	count = to - blk < BATCH ? to - blk : BATCH;
+	for (i = 0; i < count && retstat == 0; i++)
+	    retstat = read_block_sum(cs, fd, blk + i, buf, &sums[i]);
+	if (retstat == 0 && pwrite(cs->fd, sums, count * sizeof(uint32_t),
+				   blk * sizeof(uint32_t)) != (ssize_t) (count * sizeof(uint32_t)))
+	    retstat = log_error("checksum pwrite");
+    }
+    free(buf);
+    return retstat;
+}
+
+int kvfs_csum_open(const char *key, int fd, int flags, struct kvfs_csum_file **csp)
+{
+    struct kvfs_csum_file *cs;
+    char path[PATH_MAX];
+
+    *csp = NULL;
+    if (block_size == 0)
+	return 0;
+
+    cs = malloc(sizeof(*cs));
+    if (cs == NULL)
+	return -ENOMEM;
+    sidecar_path(path, key);
+    cs->fd = open(path, O_RDWR | O_CREAT | ((flags & O_TRUNC) ? O_TRUNC : 0), 0600);
+    if (cs->fd < 0) {
+	free(cs);
+	return log_error("checksum open");
+    }
+    cs->rfd = -1;
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+	kvfs_root_path(path, key);
+	cs->rfd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (cs->rfd < 0)
+	    cs->rfd = -2;
+    }
+    cs->lock = lock_for(fd);
+    *csp = cs;
+    return 0;
+}
+
+void kvfs_csum_close(struct kvfs_csum_file *cs)
+{
+    if (cs == NULL)
+	return;
+    if (cs->rfd >= 0)
+	close(cs->rfd);
+    close(cs->fd);
+    free(cs);
+}
+
+int kvfs_csum_fsync(struct kvfs_csum_file *cs)
+{
+    if (cs == NULL)
+	return 0;
+    return log_syscall("checksum fdatasync", fdatasync(cs->fd), 0);
+}
+
+ssize_t kvfs_csum_pread(struct kvfs_csum_file *cs, int fd, char *buf, size_t size, off_t offset)
+{
+    off_t start = offset - offset % block_size;
+    off_t end = (offset + size + block_size - 1) / block_size * block_size;
+    char *data = buf;
+    ssize_t got;
+    int retstat;
+
+    // widen to whole blocks; an aligned read goes straight to buf
+    if (start != offset || end != offset + (off_t) size) {
+	data = malloc(end - start);
+	if (data == NULL)
+	    return -ENOMEM;
+    }
+
+    pthread_rwlock_rdlock(cs->lock);
+    got = log_syscall("pread", pread(fd, data, end - start, start), 0);
+    retstat = got < 0 ? got : verify(cs->fd, data, got, start, &mismatches);
+    pthread_rwlock_unlock(cs->lock);
+
+    if (retstat == 0 && data != buf) {
+	got -= offset - start;
+	if (got < 0)
+	    got = 0;
+	if (got > (ssize_t) size)
+	    got = size;
+	memcpy(buf, data + (offset - start), got);
+    }
+    if (data != buf)
+	free(data);
+    return retstat < 0 ? retstat : got;
+}
+
+ssize_t kvfs_csum_pwrite(struct kvfs_csum_file *cs, int fd, const char *buf, size_t size, off_t offset)
+{
+    uint32_t sums[BATCH];
+    uint64_t first, last, blk;
+    off_t bstart;
+    size_t i, count;
+    ssize_t n;
+    char *edge = NULL;
+    int retstat = 0;
+
+    pthread_rwlock_wrlock(cs->lock);
+    n = log_syscall("pwrite", pwrite(fd, buf, size, offset), 0);
+    if (n <= 0) {
+	pthread_rwlock_unlock(cs->lock);
+	return n;
+    }
+
+    first = offset / block_size;
+    last = (offset + n - 1) / block_size;
+    for (blk = first; blk <= last && retstat == 0; blk += count) {
+	count = last - blk + 1 < BATCH ? last - blk + 1 : BATCH;
+	for (i = 0; i < count && retstat == 0; i++) {
+	    bstart = (blk + i) * block_size;
+	    if (bstart >= offset && bstart + (off_t) block_size <= offset + n) {
+		sums[i] = block_sum(buf + (bstart - offset), block_size);
+		continue;
+	    }
+	    // only partly written: sum what the block holds now
+	    if (edge == NULL && (edge = malloc(block_size)) == NULL)
+		retstat = -ENOMEM;
+	    else
+		retstat = read_block_sum(cs, fd, blk + i, edge, &sums[i]);
+	}
+	if (retstat == 0 && pwrite(cs->fd, sums, count * sizeof(uint32_t),
+				   blk * sizeof(uint32_t)) != (ssize_t) (count * sizeof(uint32_t)))
+	    retstat = log_error("checksum pwrite");
+	if (retstat == 0)
+	    COUNT(blocks_recorded, count);
+    }
+    pthread_rwlock_unlock(cs->lock);
+    free(edge);
+    return retstat < 0 ? retstat : n;
+}
+
+// with the file now size bytes long: drop the sums past the end, and
+// resum the block the new end falls in
+static int trim(struct kvfs_csum_file *cs, int fd, off_t size)
+{
+    uint64_t blocks = (size + block_size - 1) / block_size;
+
+    if (ftruncate(cs->fd, blocks * sizeof(uint32_t)) < 0)
+	return log_error("checksum ftruncate");
+    if (size % block_size == 0)
+	return 0;
+    return rehash(cs, fd, blocks - 1, blocks);
+}
+
+int kvfs_csum_ftruncate(struct kvfs_csum_file *cs, int fd, off_t size)
+{
+    int retstat;
+
+    pthread_rwlock_wrlock(cs->lock);
+    retstat = log_syscall("ftruncate", ftruncate(fd, size), 0);
+    if (retstat == 0)
+	retstat = trim(cs, fd, size);
+    pthread_rwlock_unlock(cs->lock);
+    return retstat;
+}
+
+int kvfs_csum_truncate(const char *key, const char *actual_path, off_t size)
+{
+    struct kvfs_csum_file cs;
+    char path[PATH_MAX];
+    int fd, retstat;
+
+    if (block_size == 0)
+	return log_syscall("truncate", truncate(actual_path, size), 0);
+
+    // a file without a sidecar has nothing to keep straight
+    sidecar_path(path, key);
+    cs.fd = open(path, O_RDWR);
+    if (cs.fd < 0)
+	return log_syscall("truncate", truncate(actual_path, size), 0);
+
+    // read access is only needed to resum the last block; without it
+    // that block is left unrecorded
+    fd = open(actual_path, O_RDONLY | O_NOFOLLOW);
+    cs.rfd = -1;
+    cs.lock = fd >= 0 ? lock_for(fd) : &locks[0];
+    pthread_rwlock_wrlock(cs.lock);
+    retstat = log_syscall("truncate", truncate(actual_path, size), 0);
+    if (retstat == 0 && fd >= 0)
+	retstat = trim(&cs, fd, size);
+    else if (retstat == 0 && ftruncate(cs.fd, size / block_size * sizeof(uint32_t)) < 0)
+	retstat = log_error("checksum ftruncate");
+    pthread_rwlock_unlock(cs.lock);
+
+    if (fd >= 0)
+	close(fd);
+    close(cs.fd);
+    return retstat;
+}
+
+#ifdef HAVE_FALLOCATE
+int kvfs_csum_fallocate(struct kvfs_csum_file *cs, int fd, int mode, off_t offset, off_t len)
+{
+    off_t end = offset + len;
+    int retstat;
+
+    pthread_rwlock_wrlock(cs->lock);
+    retstat = log_syscall("fallocate", fallocate(fd, mode, offset, len), 0);
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+    // everything after offset moved
+    if (retstat == 0 && (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE))) {
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+	    retstat = log_error("fstat");
+	else
+	    retstat = trim(cs, fd, st.st_size);
+	end = st.st_size;
+    }
+#endif
+    // zeroed ranges read back differently; plain allocation doesn't
+    // change a byte
+    if (retstat == 0 && (mode & ~FALLOC_FL_KEEP_SIZE) != 0 && end > offset)
+	retstat = rehash(cs, fd, offset / block_size, (end + block_size - 1) / block_size);
+    pthread_rwlock_unlock(cs->lock);
+    return retstat;
+}
+#endif
+
+void kvfs_csum_unlink(const char *key)
+{
+    char path[PATH_MAX];
+
+    if (block_size == 0)
+	return;
+    sidecar_path(path, key);
+    unlink(path);
+}
+
+void kvfs_csum_rename(const char *key, const char *newkey)
+{
+    char path[PATH_MAX], newpath[PATH_MAX];
+
+    if (block_size == 0)
+	return;
+    sidecar_path(path, key);
+    sidecar_path(newpath, newkey);
+    if (rename(path, newpath) < 0 && errno == ENOENT)
+	unlink(newpath);
+}
+
+void kvfs_csum_link(const char *key, const char *newkey)
+{
+    char path[PATH_MAX], newpath[PATH_MAX];
+
+    if (block_size == 0)
+	return;
+    sidecar_path(path, key);
+    sidecar_path(newpath, newkey);
+    link(path, newpath);
+}
+
+/////////////////////////////////////////////////////////////////////
+// the scrubber
+
+// sleep until bytes done since t0 are within scrub_rate; nonzero if
+// asked to stop meanwhile
+static int throttle(const struct timespec *t0, uint64_t bytes)
+{
+    struct timespec now, until;
+    double due, elapsed;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    due = (double) bytes / scrub_rate;
+    elapsed = (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+
+    pthread_mutex_lock(&scrub_lock);
+    if (due > elapsed && !scrub_stop) {
+	until.tv_sec = t0->tv_sec + (time_t) due;
+	until.tv_nsec = t0->tv_nsec + (long) ((due - (time_t) due) * 1e9);
+	if (until.tv_nsec >= 1000000000) {
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&scrub_wake, &scrub_lock, &until);
+    }
+    stop = scrub_stop;
+    pthread_mutex_unlock(&scrub_lock);
+    return stop;
+}
+
+static int scrub_file(const char *key, char *buf, const struct timespec *t0, uint64_t *bytes)
+{
+    struct kvfs_csum_file cs;
+    char path[PATH_MAX];
+    ssize_t got;
+    off_t off;
+    int fd, stop = 0;
+
+    kvfs_root_path(path, key);
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+	if (errno == ENOENT) {
+	    kvfs_csum_unlink(key);
+	    COUNT(scrub_orphans, 1);
+	}
+	return 0;
+    }
+    // read-write, for the sums it may have to re-record
+    sidecar_path(path, key);
+    cs.fd = open(path, O_RDWR);
+    if (cs.fd < 0) {
+	close(fd);
+	return 0;
+    }
+    cs.rfd = -1;
+    cs.lock = lock_for(fd);
+
+    for (off = 0; !stop; off += got) {
+	pthread_rwlock_rdlock(cs.lock);
+	got = pread(fd, buf, SCRUB_CHUNK, off);
+	if (got > 0 && verify(cs.fd, buf, got, off, &scrub_mismatches) < 0)
+	    log_msg("    scrub: %s has a bad block in [%lld, %lld)\n", key,
+		    (long long) off, (long long) off + got);
+	pthread_rwlock_unlock(cs.lock);
+	if (got <= 0)
+	    break;
+	*bytes += got;
+	COUNT(scrub_bytes, got);
+	stop = throttle(t0, *bytes);
+    }
+    close(cs.fd);
+    close(fd);
+    return stop;
+}
+
+static void *scrub_main(void *arg)
+{
+    struct timespec t0, until;
+    struct dirent *de;
+    uint64_t bytes;
+    char *buf;
+    DIR *dp;
+    int stop = 0;
+
+    (void) arg;
+    buf = malloc(SCRUB_CHUNK);
+    if (buf == NULL)
+	return NULL;
+
+    while (!stop) {
+	clock_gettime(CLOCK_REALTIME, &t0);
+	bytes = 0;
+	dp = opendir(csum_dir);
+	while (dp != NULL && !stop && (de = readdir(dp)) != NULL)
+	    if (de->d_name[0] != '.')
+		stop = scrub_file(de->d_name, buf, &t0, &bytes);
+	if (dp != NULL)
+	    closedir(dp);
+	COUNT(scrub_passes, 1);
+	if (!stop && __atomic_exchange_n(&rebuilding, 0, __ATOMIC_RELAXED))
+	    log_msg("    scrub: every file checked, %llu sum(s) re-recorded; mismatches are errors again\n",
+		    (unsigned long long) rebuilt);
+
+	pthread_mutex_lock(&scrub_lock);
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += SCRUB_PAUSE;
+	while (!scrub_stop && pthread_cond_timedwait(&scrub_wake, &scrub_lock, &until) != ETIMEDOUT)
+	    ;
+	stop = scrub_stop;
+	pthread_mutex_unlock(&scrub_lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void csum_report(FILE *out)
+{
+    fprintf(out, "    crc32c (%s), %zu byte blocks: %llu verified, %llu recorded, %llu mismatch(es)\n",
+	    kvfs_crc32c_impl(), block_size, (unsigned long long) blocks_verified,
+	    (unsigned long long) blocks_recorded, (unsigned long long) mismatches);
+    if (rebuilt > 0 || rebuilding)
+	fprintf(out, "    %llu sum(s) re-recorded%s\n", (unsigned long long) rebuilt,
+		rebuilding ? ", still rebuilding" : "");
+    if (scrub_running)
+	fprintf(out, "    scrub: %llu pass(es), %.1f MiB read, %llu mismatch(es), %llu orphan(s) removed\n",
+		(unsigned long long) scrub_passes, scrub_bytes / 1048576.0,
+		(unsigned long long) scrub_mismatches, (unsigned long long) scrub_orphans);
+}
+
+// fsync a file or directory by name
+static int sync_path(const char *path, int flags)
+{
+    int fd, retstat = 0;
+
+    fd = open(path, flags);
+    if (fd < 0)
+	return log_error("checksum open");
+    if (fsync(fd) < 0)
+	retstat = log_error("checksum fsync");
+    close(fd);
+    return retstat;
+}
+
+// Was the last unmount clean?  Either way the mark goes, so that a
+// crash from now on finds none.
+static int was_clean(void)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s/%s", csum_dir, CLEAN_FILE);
+    if (unlink(path) < 0)
+	return 0;
+    sync_path(csum_dir, O_RDONLY | O_DIRECTORY);
+    return 1;
+}
+
+// every data write and its sums on disk, then the mark that says so
+static void mark_clean(void)
+{
+    char path[PATH_MAX];
+    int r, fd;
+
+#ifdef HAVE_SYNCFS
+    for (r = 0; r < kvfs_roots_count(); r++) {
+	fd = open(kvfs_root_dir(r), O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || syncfs(fd) < 0) {
+	    log_error("checksum syncfs");
+	    if (fd >= 0)
+		close(fd);
+	    return;
+	}
+	close(fd);
+    }
+#else
+    (void) r;
+    sync();
+#endif
+    snprintf(path, PATH_MAX, "%s/%s", csum_dir, CLEAN_FILE);
+    fd = open(path, O_CREAT | O_WRONLY, 0600);
+    if (fd < 0) {
+	log_error("checksum clean mark");
+	return;
+    }
+    close(fd);
+    if (sync_path(path, O_RDONLY) == 0)
+	sync_path(csum_dir, O_RDONLY | O_DIRECTORY);
+}
+
+int kvfs_csum_init(struct kvfs_state *state)
+{
+    int i, fresh;
+
+    block_size = (size_t) state->checksum << 10;
+    if (block_size == 0)
+	return 0;
+    if (kvfs_striping()) {
+	// the sums would have to be taken across every root's piece
+	log_msg("    checksums: not kept for striped files, off\n");
+	block_size = 0;
+	return 0;
+    }
+    if (kvfs_mirroring()) {
+	// a copy that went bad is resynced from the first root, which
+	// has to be right; the sums would not say which one is
+	log_msg("    checksums: not kept for mirrored files, off\n");
+	block_size = 0;
+	return 0;
+    }
+
+    if (snprintf(csum_dir, sizeof(csum_dir), "%s/%s", state->rootdir, CSUM_DIR) >=
+	(int) sizeof(csum_dir)) {
+	block_size = 0;
+	return -ENAMETOOLONG;
+    }
+    fresh = mkdir(csum_dir, 0700) == 0;
+    if (!fresh && errno != EEXIST) {
+	block_size = 0;
+	return log_error("checksum mkdir");
+    }
+    for (i = 0; i < NLOCKS; i++)
+	pthread_rwlock_init(&locks[i], NULL);
+    blocks_verified = blocks_recorded = mismatches = rebuilt = 0;
+    rebuilding = 0;
+    if (!was_clean() && !fresh) {
+	log_msg("    checksums: last unmount was not clean, re-recording sums that do not match\n");
+	rebuilding = 1;
+    }
+    if (state->checksum_rebuild) {
+	log_msg("    checksums: checksum_rebuild, re-recording sums that do not match\n");
+	rebuilding = 1;
+    }
+    scrub_passes = scrub_bytes = scrub_mismatches = scrub_orphans = 0;
+
+    log_msg("    checksums: crc32c (%s), %zu byte blocks, scrub at %u MB/s\n",
+	    kvfs_crc32c_impl(), block_size, state->scrub_rate);
+    kvfs_stats_register("checksum", csum_report);
+
+    scrub_rate = (uint64_t) state->scrub_rate << 20;
+    scrub_stop = 0;
+    if (scrub_rate > 0) {
+	if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0)
+	    return log_error("scrub pthread_create");
+	scrub_running = 1;
+    }
+    return 0;
+}
+
+void kvfs_csum_destroy(struct kvfs_state *state)
+{
+    (void) state;
+
+    if (block_size == 0)
+	return;
+    if (scrub_running) {
+	pthread_mutex_lock(&scrub_lock);
+	scrub_stop = 1;
+	pthread_cond_broadcast(&scrub_wake);
+	pthread_mutex_unlock(&scrub_lock);
+	pthread_join(scrub_thread, NULL);
+	scrub_running = 0;
+    }
+    mark_clean();
+    kvfs_stats_unregister("checksum");
+    block_size = 0;
+}
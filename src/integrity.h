@@ -0,0 +1,46 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _INTEGRITY_H_
+#define _INTEGRITY_H_
+
+#include <sys/types.h>
+
+struct kvfs_state;
+
+// the checksums of one open backing file
+struct kvfs_csum_file;
+
+int  kvfs_csum_init(struct kvfs_state *state);
+void kvfs_csum_destroy(struct kvfs_state *state);
+
+// Open the checksums of the backing file at key, just opened as fd
+// with flags.  *csp is left NULL when checksums are off.
+int  kvfs_csum_open(const char *key, int fd, int flags, struct kvfs_csum_file **csp);
+void kvfs_csum_close(struct kvfs_csum_file *cs);
+
+// make the checksums as durable as an fsync just made the data
+int  kvfs_csum_fsync(struct kvfs_csum_file *cs);
+
+// pread/pwrite on fd that verify (-EIO on a mismatch) and record the
+// checksums of the blocks they cover
+ssize_t kvfs_csum_pread(struct kvfs_csum_file *cs, int fd, char *buf, size_t size, off_t offset);
+ssize_t kvfs_csum_pwrite(struct kvfs_csum_file *cs, int fd, const char *buf, size_t size, off_t offset);
+
+// the other ways a backing file's contents change, done here so the
+// checksums change with them
+int  kvfs_csum_ftruncate(struct kvfs_csum_file *cs, int fd, off_t size);
+int  kvfs_csum_truncate(const char *key, const char *actual_path, off_t size);
+#ifdef HAVE_FALLOCATE
+int  kvfs_csum_fallocate(struct kvfs_csum_file *cs, int fd, int mode, off_t offset, off_t len);
+#endif
+
+// the checksums follow their object's name
+void kvfs_csum_unlink(const char *key);
+void kvfs_csum_rename(const char *key, const char *newkey);
+void kvfs_csum_link(const char *key, const char *newkey);
+
+#endif
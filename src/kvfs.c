@@ -25,6 +25,9 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -35,7 +38,26 @@
 #include <sys/xattr.h>
 #endif
 
+#include "alloc.h"
+#include "directio.h"
+#include "dirid.h"
+#include "immutable.h"
+#include "integrity.h"
 #include "log.h"
+#include "mirror.h"
+#include "pagecache.h"
+#include "prefetch.h"
+#include "roots.h"
+#include "share.h"
+#include "statfs.h"
+#include "stats.h"
+#include "store.h"
+#include "stripe.h"
+#include "tier.h"
+#include "sync.h"
+#include "trace.h"
+#include "workers.h"
+#include "xattr.h"
 
 #if defined(__APPLE__)
 #  define COMMON_DIGEST_FOR_OPENSSL
@@ -45,11 +67,10 @@
 #  include <openssl/md5.h>
 #endif
 
-char *str2md5(const char *str, int length) {
+void str2md5_buf(const char *str, int length, char out[33]) {
     int n;
     MD5_CTX c;
     unsigned char digest[16];
-    char *out = (char*)malloc(33);
 
     MD5_Init(&c);
 
@@ -68,12 +89,45 @@ char *str2md5(const char *str, int length) {
     for (n = 0; n < 16; ++n) {
         snprintf(&(out[n*2]), 16*2, "%02x", (unsigned int)digest[n]);
     }
+}
 
+char *str2md5(const char *str, int length) {
+    char *out = (char*)malloc(33);
+
+    if (out != NULL)
+        str2md5_buf(str, length, out);
     return out;
 }
 
 #include "kvfs_functions.c"
 
+#ifdef KVFS_BENCH
+// kvfs-microbench times this helper of kvfs_functions.c
+void kvfs_bench_real_path(char actual_path[PATH_MAX], const char *path)
+{
+    real_path_inside_root(actual_path, path);
+}
+#endif
+
+// The keys the calls below make with kvfs_path2key() are scratch in
+// the thread's arena (see alloc.c), dropped as each call returns.
+static int done(int retstat)
+{
+    kvfs_arena_reset();
+    return retstat;
+}
+
+// A name is entered in its parent's backing directory before the
+// object is made (see dirid.c), so of an rmdir of the parent and a
+// call making something in it, one fails; the entry goes again if the
+// call does.
+static int entered(const char *path, int entry, int retstat)
+{
+    if (retstat < 0 && entry > 0)
+	kvfs_dirid_leave(path);
+    return done(retstat);
+}
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -88,7 +142,7 @@ char *str2md5(const char *str, int length) {
 int kvfs_getattr(const char *path, struct stat *statbuf)
 {
 //    log_msg("    kvfs_fullpath:  path = \"%s\"\n",path);
-    return kvfs_getattr_impl(str2md5(path, strlen(path)), statbuf);
+    return done(kvfs_getattr_impl(kvfs_path2key(path), statbuf));
 }
 
 /** Read the target of a symbolic link
@@ -105,7 +159,7 @@ int kvfs_getattr(const char *path, struct stat *statbuf)
 // kvfs_readlink() code by Bernardo F Costa (thanks!)
 int kvfs_readlink(const char *path, char *link, size_t size)
 {
-    return kvfs_readlink_impl(str2md5(path, strlen(path)), link, size);
+    return done(kvfs_readlink_impl(kvfs_path2key(path), link, size));
 }
 
 /** Create a file node
@@ -116,25 +170,41 @@ int kvfs_readlink(const char *path, char *link, size_t size)
 // shouldn't that comment be "if" there is no.... ?
 int kvfs_mknod(const char *path, mode_t mode, dev_t dev)
 {
-    return kvfs_mknod_impl(str2md5(path, strlen(path)), mode, dev);
+    int entry = kvfs_dirid_enter(path);
+
+    if (entry < 0)
+	return done(entry);
+    return entered(path, entry, kvfs_mknod_impl(kvfs_path2key(path), mode, dev));
 }
 
 /** Create a directory */
 int kvfs_mkdir(const char *path, mode_t mode)
 {
-    return kvfs_mkdir_impl(str2md5(path, strlen(path)), mode);
+    int entry = kvfs_dirid_enter(path);
+
+    if (entry < 0)
+	return done(entry);
+    return entered(path, entry, kvfs_mkdir_impl(kvfs_path2key(path), mode));
 }
 
 /** Remove a file */
 int kvfs_unlink(const char *path)
 {
-    return kvfs_unlink_impl(str2md5(path, strlen(path)));
+    int retstat = kvfs_unlink_impl(kvfs_path2key(path));
+
+    if (retstat == 0)
+	kvfs_dirid_leave(path);
+    return done(retstat);
 }
 
 /** Remove a directory */
 int kvfs_rmdir(const char *path)
 {
-    return kvfs_rmdir_impl(str2md5(path, strlen(path)));
+    int retstat = kvfs_rmdir_impl(kvfs_path2key(path));
+
+    if (retstat == 0)
+	kvfs_dirid_leave(path);
+    return done(retstat);
 }
 
 /** Create a symbolic link */
@@ -144,45 +214,60 @@ int kvfs_rmdir(const char *path)
 // unaltered, but insert the link into the mounted directory.
 int kvfs_symlink(const char *path, const char *link)
 {
-    return kvfs_symlink_impl(str2md5(path, strlen(path)),str2md5(link, strlen(link)));
+    int entry = kvfs_dirid_enter(link);
+
+    if (entry < 0)
+	return done(entry);
+    return entered(link, entry, kvfs_symlink_impl(path, kvfs_path2key(link)));
 }
 
 /** Rename a file */
 // both path and newpath are fs-relative
 int kvfs_rename(const char *path, const char *newpath)
 {
-    return kvfs_rename_impl(str2md5(path, strlen(path)),str2md5(newpath, strlen(newpath)));
+    int entry = kvfs_dirid_enter(newpath), retstat;
+
+    if (entry < 0)
+	return done(entry);
+    retstat = kvfs_rename_impl(kvfs_path2key(path),kvfs_path2key(newpath));
+    if (retstat == 0 && strcmp(path, newpath) != 0)
+	kvfs_dirid_leave(path);
+    return entered(newpath, entry, retstat);
 }
 
 /** Create a hard link to a file */
 int kvfs_link(const char *path, const char *newpath)
 {
-    return kvfs_link_impl(str2md5(path, strlen(path)),str2md5(newpath, strlen(newpath)));
+    int entry = kvfs_dirid_enter(newpath);
+
+    if (entry < 0)
+	return done(entry);
+    return entered(newpath, entry, kvfs_link_impl(kvfs_path2key(path),kvfs_path2key(newpath)));
 }
 
 /** Change the permission bits of a file */
 int kvfs_chmod(const char *path, mode_t mode)
 {
-    return kvfs_chmod_impl(str2md5(path, strlen(path)), mode);
+    return done(kvfs_chmod_impl(kvfs_path2key(path), mode));
 }
 
 /** Change the owner and group of a file */
 int kvfs_chown(const char *path, uid_t uid, gid_t gid)
 {
-    return kvfs_chown_impl(str2md5(path, strlen(path)), uid, gid);
+    return done(kvfs_chown_impl(kvfs_path2key(path), uid, gid));
 }
 
 /** Change the size of a file */
 int kvfs_truncate(const char *path, off_t newsize)
 {
-    return kvfs_truncate_impl(str2md5(path, strlen(path)), newsize);
+    return done(kvfs_truncate_impl(kvfs_path2key(path), newsize));
 }
 
 /** Change the access and/or modification times of a file */
 /* note -- I'll want to change this as soon as 2.6 is in debian testing */
 int kvfs_utime(const char *path, struct utimbuf *ubuf)
 {
-    return kvfs_utime_impl(str2md5(path, strlen(path)), ubuf);
+    return done(kvfs_utime_impl(kvfs_path2key(path), ubuf));
 }
 
 /** File open operation
@@ -197,7 +282,7 @@ int kvfs_utime(const char *path, struct utimbuf *ubuf)
  */
 int kvfs_open(const char *path, struct fuse_file_info *fi)
 {
-    return kvfs_open_impl(str2md5(path, strlen(path)), fi);
+    return done(kvfs_open_impl(kvfs_path2key(path), fi));
 }
 
 /** Read data from an open file
@@ -218,7 +303,7 @@ int kvfs_open(const char *path, struct fuse_file_info *fi)
 // returned by read.
 int kvfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    return kvfs_read_impl(str2md5(path, strlen(path)), buf, size, offset, fi);
+    return done(kvfs_read_impl(kvfs_path2key(path), buf, size, offset, fi));
 }
 
 /** Write data to an open file
@@ -234,7 +319,110 @@ int kvfs_read(const char *path, char *buf, size_t size, off_t offset, struct fus
 int kvfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
-    return kvfs_write_impl(str2md5(path, strlen(path)), buf, size, offset, fi);
+    int retstat = done(kvfs_write_impl(kvfs_path2key(path), buf, size, offset, fi));
+
+    kvfs_statfs_written(retstat);
+    return retstat;
+}
+
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and
+ * returned in a generic buffer.
+ *
+ * No actual copying of data has to take place, the source
+ * file descriptor may simply be stored in the buffer for
+ * later data transfer.
+ *
+ * The buffer must be allocated dynamically and stored at the
+ * location pointed to by bufp.  If the buffer contains memory
+ * regions, they too must be allocated using malloc().  The
+ * allocated memory will be freed by the caller.
+ *
+ * Introduced in version 2.9
+ */
+int kvfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		  struct fuse_file_info *fi)
+{
+    return done(kvfs_read_buf_impl(kvfs_path2key(path), bufp, size, offset, fi));
+}
+
+#ifndef KVFS_BENCH
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer.  Use fuse_buf_copy() to transfer data to
+ * the destination.
+ *
+ * Introduced in version 2.9
+ */
+int kvfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		   struct fuse_file_info *fi)
+{
+    int retstat = done(kvfs_write_buf_impl(kvfs_path2key(path), buf, offset, fi));
+
+    kvfs_statfs_written(retstat);
+    return retstat;
+}
+#endif
+
+#ifdef HAVE_FALLOCATE
+/**
+ * Allocates space for an open file
+ *
+ * This function ensures that required space is allocated for specified
+ * file.  If this function returns success then any subsequent write
+ * request to specified range is guaranteed not to fail because of lack
+ * of space on the file system media.
+ *
+ * Introduced in version 2.9.1
+ */
+int kvfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+{
+    int retstat = done(kvfs_fallocate_impl(kvfs_path2key(path), mode, offset, len, fi));
+
+    // allocating and punching both move the free space statfs reports
+    if (retstat == 0)
+	kvfs_statfs_written(len);
+    return retstat;
+}
+#endif
+
+/**
+ * Find next data or hole after the specified offset
+ *
+ * Introduced in FUSE 3.8, and only hooked up when built against it.
+ */
+off_t kvfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+    off_t retstat = kvfs_lseek_impl(kvfs_path2key(path), off, whence, fi);
+
+    kvfs_arena_reset();
+    return retstat;
+}
+
+/**
+ * Copy a range of data from one file to another
+ *
+ * Performs an optimized copy between two file descriptors without the
+ * additional cost of transferring data through the FUSE kernel module
+ * to user space (glibc) and then back into the FUSE filesystem again.
+ *
+ * Introduced in FUSE 3.4, and only hooked up when built against it
+ * (the FUSE 2 kernel path falls back to read and write).
+ */
+ssize_t kvfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
+			     const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
+			     size_t len, int flags)
+{
+    ssize_t retstat;
+
+    retstat = kvfs_copy_file_range_impl(kvfs_path2key(path_in), fi_in, off_in,
+					kvfs_path2key(path_out), fi_out, off_out,
+					len, flags);
+    kvfs_arena_reset();
+    kvfs_statfs_written(retstat);
+    return retstat;
 }
 
 /** Get file system statistics
@@ -246,7 +434,10 @@ int kvfs_write(const char *path, const char *buf, size_t size, off_t offset,
  */
 int kvfs_statfs(const char *path, struct statvfs *statv)
 {
-    return kvfs_statfs_impl(str2md5(path, strlen(path)), statv);
+    // the same for every path, so a cached answer needs no hashing
+    if (kvfs_statfs_cached(statv) == 0)
+	return 0;
+    return done(kvfs_statfs_impl(kvfs_path2key(path), statv));
 }
 
 /** Possibly flush cached data
@@ -275,7 +466,7 @@ int kvfs_statfs(const char *path, struct statvfs *statv)
 // this is a no-op in KVFS.  It just logs the call and returns success
 int kvfs_flush(const char *path, struct fuse_file_info *fi)
 {
-    return kvfs_flush_impl(str2md5(path, strlen(path)), fi);
+    return done(kvfs_flush_impl(kvfs_path2key(path), fi));
 }
 
 /** Release an open file
@@ -294,7 +485,7 @@ int kvfs_flush(const char *path, struct fuse_file_info *fi)
  */
 int kvfs_release(const char *path, struct fuse_file_info *fi)
 {
-    return kvfs_release_impl(str2md5(path, strlen(path)), fi);
+    return done(kvfs_release_impl(kvfs_path2key(path), fi));
 }
 
 /** Synchronize file contents
@@ -306,32 +497,32 @@ int kvfs_release(const char *path, struct fuse_file_info *fi)
  */
 int kvfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    return kvfs_fsync_impl(str2md5(path, strlen(path)), datasync, fi);
+    return done(kvfs_fsync_impl(kvfs_path2key(path), datasync, fi));
 }
 
 #ifdef HAVE_SYS_XATTR_H
 /** Set extended attributes */
 int kvfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
-    return kvfs_setxattr_impl(str2md5(path, strlen(path)), name, size, flag);
+    return done(kvfs_setxattr_impl(kvfs_path2key(path), name, value, size, flags));
 }
 
 /** Get extended attributes */
 int kvfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
-    return kvfs_getxattr_impl(str2md5(path, strlen(path)), name, size, flag);
+    return done(kvfs_getxattr_impl(kvfs_path2key(path), name, value, size));
 }
 
 /** List extended attributes */
 int kvfs_listxattr(const char *path, char *list, size_t size)
 {
-    return kvfs_listxattr_impl(str2md5(path, strlen(path)), list, size);
+    return done(kvfs_listxattr_impl(kvfs_path2key(path), list, size));
 }
 
 /** Remove extended attributes */
 int kvfs_removexattr(const char *path, const char *name)
 {
-    return kvfs_removexattr_impl(str2md5(path, strlen(path)), name);
+    return done(kvfs_removexattr_impl(kvfs_path2key(path), name));
 }
 #endif
 
@@ -344,7 +535,7 @@ int kvfs_removexattr(const char *path, const char *name)
  */
 int kvfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-    return kvfs_opendir_impl(str2md5(path, strlen(path)), fi);
+    return done(kvfs_opendir_impl(kvfs_path2key(path), fi));
 }
 
 /** Read directory
@@ -372,7 +563,7 @@ int kvfs_opendir(const char *path, struct fuse_file_info *fi)
 int kvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
-    return kvfs_readdir_impl(str2md5(path, strlen(path)), buf, filler, offset, fi);
+    return done(kvfs_readdir_impl(kvfs_path2key(path), buf, filler, offset, fi));
 }
 
 /** Release directory
@@ -381,7 +572,7 @@ int kvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
  */
 int kvfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
-    return kvfs_releasedir_impl(str2md5(path, strlen(path)), fi);
+    return done(kvfs_releasedir_impl(kvfs_path2key(path), fi));
 }
 
 /** Synchronize directory contents
@@ -395,7 +586,7 @@ int kvfs_releasedir(const char *path, struct fuse_file_info *fi)
 // happens to be a directory? ??? >>> I need to implement this...
 int kvfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    return kvfs_fsyncdir_impl(str2md5(path, strlen(path)), datasync, fi);
+    return done(kvfs_fsyncdir_impl(kvfs_path2key(path), datasync, fi));
 }
 
 /**
@@ -421,6 +612,35 @@ void *kvfs_init(struct fuse_conn_info *conn)
     
     log_conn(conn);
     log_fuse_context(fuse_get_context());
+
+#ifdef FUSE_CAP_SPLICE_READ
+    // let read_buf/write_buf move pages with splice() when the kernel
+    // can; -o no_splice_read etc. still turn it off
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+    // pages kept across opens (see pagecache.c) are dropped when a
+    // getattr shows the file changed
+    if (KVFS_DATA->keep_cache)
+	conn->want |= conn->capable & FUSE_CAP_AUTO_INVAL_DATA;
+#endif
+
+    kvfs_root_init();
+    kvfs_roots_init(KVFS_DATA);
+    kvfs_mirror_init(KVFS_DATA);
+    kvfs_tier_init(KVFS_DATA);
+    kvfs_stats_init(KVFS_DATA);
+    kvfs_alloc_init(KVFS_DATA);
+    kvfs_sync_init(KVFS_DATA);
+    kvfs_dirid_init(KVFS_DATA);
+    kvfs_store_init(KVFS_DATA);
+    kvfs_immutable_init(KVFS_DATA);
+    kvfs_statfs_init(KVFS_DATA);
+    kvfs_xattr_init(KVFS_DATA);
+    kvfs_directio_init(KVFS_DATA);
+    kvfs_pagecache_init(KVFS_DATA);
+    kvfs_csum_init(KVFS_DATA);
+    kvfs_prefetch_init(KVFS_DATA);
     
     return KVFS_DATA;
 }
@@ -435,6 +655,22 @@ void *kvfs_init(struct fuse_conn_info *conn)
 void kvfs_destroy(void *userdata)
 {
     log_msg("\nkvfs_destroy(userdata=0x%08x)\n", userdata);
+
+    kvfs_csum_destroy(userdata);
+    kvfs_pagecache_destroy(userdata);
+    kvfs_directio_destroy(userdata);
+    kvfs_xattr_destroy(userdata);
+    kvfs_statfs_destroy(userdata);
+    kvfs_stats_destroy(userdata);
+    kvfs_prefetch_destroy(userdata);
+    kvfs_immutable_destroy(userdata);
+    kvfs_store_destroy(userdata);
+    kvfs_dirid_destroy(userdata);
+    kvfs_sync_destroy(userdata);
+    kvfs_mirror_destroy(userdata);
+    kvfs_tier_destroy(userdata);
+    kvfs_roots_destroy(userdata);
+    kvfs_alloc_destroy(userdata);
 }
 
 /**
@@ -451,7 +687,7 @@ void kvfs_destroy(void *userdata)
 int kvfs_access(const char *path, int mask)
 {
     log_msg("    kvfs_fullpath:  path = \"%s\"\n",path);
-    return kvfs_access_impl(str2md5(path, strlen(path)), mask);
+    return done(kvfs_access_impl(kvfs_path2key(path), mask));
 }
 
 /**
@@ -468,7 +704,7 @@ int kvfs_access(const char *path, int mask)
  */
 int kvfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
-    return kvfs_ftruncate_impl(str2md5(path, strlen(path)), offset, fi);
+    return done(kvfs_ftruncate_impl(kvfs_path2key(path), offset, fi));
 }
 
 /**
@@ -485,7 +721,7 @@ int kvfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
  */
 int kvfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
-    return kvfs_fgetattr_impl(str2md5(path, strlen(path)), statbuf, fi);
+    return done(kvfs_fgetattr_impl(kvfs_path2key(path), statbuf, fi));
 }
 
 struct fuse_operations kvfs_oper = {
@@ -528,19 +764,149 @@ struct fuse_operations kvfs_oper = {
   .destroy = kvfs_destroy,
   .access = kvfs_access,
   .ftruncate = kvfs_ftruncate,
-  .fgetattr = kvfs_fgetattr
+  .fgetattr = kvfs_fgetattr,
+#ifndef KVFS_BENCH
+  .write_buf = kvfs_write_buf,
+#endif
+  .read_buf = kvfs_read_buf,
+#ifdef HAVE_FALLOCATE
+  .fallocate = kvfs_fallocate,
+#endif
+#if FUSE_MAJOR_VERSION > 3 || (FUSE_MAJOR_VERSION == 3 && FUSE_MINOR_VERSION >= 4)
+  .copy_file_range = kvfs_copy_file_range,
+#endif
+#if FUSE_MAJOR_VERSION > 3 || (FUSE_MAJOR_VERSION == 3 && FUSE_MINOR_VERSION >= 8)
+  .lseek = kvfs_lseek,
+#endif
 };
 
+// kvfs-specific mount options, given with -o like any FUSE option;
+// kvfs-bench parses its -o against the same table
+#define KVFS_OPT(t, p) { t, offsetof(struct kvfs_state, p), 0 }
+
+struct fuse_opt kvfs_opts[] = {
+    KVFS_OPT("group_commit=%u", group_commit_delay),
+    KVFS_OPT("group_commit_batch=%u", group_commit_batch),
+    KVFS_OPT("backend=%s", backend),
+    KVFS_OPT("segment_size=%u", segment_size),
+    KVFS_OPT("gc_ratio=%u", gc_ratio),
+    KVFS_OPT("inline_max=%u", inline_max),
+    KVFS_OPT("memtable_size=%u", memtable_size),
+    KVFS_OPT("fsync_promote=%u", fsync_promote),
+    KVFS_OPT("value_max=%u", value_max),
+    KVFS_OPT("compress=%s", compress),
+    KVFS_OPT("trace=%s", trace),
+    KVFS_OPT("immutable=%u", immutable),
+    KVFS_OPT("format_upgrade=%u", format_upgrade),
+    KVFS_OPT("share=%s", share),
+    KVFS_OPT("share_weights=%s", share_weights),
+    KVFS_OPT("share_rate=%u", share_rate),
+    KVFS_OPT("share_slots=%u", share_slots),
+    KVFS_OPT("statfs_interval=%u", statfs_interval),
+    KVFS_OPT("statfs_dirty=%u", statfs_dirty),
+    KVFS_OPT("xattr_cache=%u", xattr_cache),
+    KVFS_OPT("keep_cache=%u", keep_cache),
+    KVFS_OPT("direct_io_mb=%u", direct_io_mb),
+    KVFS_OPT("direct_io_xattr=%u", direct_io_xattr),
+    KVFS_OPT("direct_io_backing=%u", direct_io_backing),
+    KVFS_OPT("prefetch=%u", prefetch),
+    KVFS_OPT("prefetch_kb=%u", prefetch_kb),
+    KVFS_OPT("checksum=%u", checksum),
+    KVFS_OPT("scrub_rate=%u", scrub_rate),
+    KVFS_OPT("checksum_rebuild=%u", checksum_rebuild),
+    KVFS_OPT("stripe=%u", stripe),
+    KVFS_OPT("root_threads=%u", root_threads),
+    KVFS_OPT("mirror=%u", mirror),
+    KVFS_OPT("tier=%u", tier),
+    KVFS_OPT("tier_fast=%u", tier_fast),
+    KVFS_OPT("tier_budget=%u", tier_budget),
+    KVFS_OPT("tier_interval=%u", tier_interval),
+    KVFS_OPT("workers=%u", workers),
+    KVFS_OPT("workers_pin=%u", workers_pin),
+    FUSE_OPT_END
+};
+
+// defaults for everything kvfs_opts can set
+void kvfs_set_defaults(struct kvfs_state *kvfs_data)
+{
+    kvfs_data->rootfd = -1;
+    kvfs_data->group_commit_batch = 64;
+    kvfs_data->segment_size = 64;
+    kvfs_data->gc_ratio = 50;
+    kvfs_data->memtable_size = 4;
+    kvfs_data->fsync_promote = 4;
+    kvfs_data->value_max = 64;
+    kvfs_data->statfs_interval = 2;
+    kvfs_data->statfs_dirty = 64;
+    kvfs_data->xattr_cache = 4096;
+    kvfs_data->keep_cache = 4096;
+    kvfs_data->prefetch = 2;
+    kvfs_data->prefetch_kb = 128;
+    kvfs_data->scrub_rate = 4;
+    kvfs_data->root_threads = 2;
+    kvfs_data->tier_budget = 32;
+    kvfs_data->tier_interval = 60;
+    kvfs_data->workers_pin = 1;
+    kvfs_data->share_slots = 8;
+}
+
+// kvfs-bench (bench.c) links everything above and has a main() of its own
+#ifndef KVFS_BENCH
 void kvfs_usage()
 {
-    fprintf(stderr, "usage:  kvfs [FUSE and mount options] rootDir mountPoint\n");
+    fprintf(stderr, "usage:  kvfs [FUSE and mount options] rootDir [rootDir...] mountPoint\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "kvfs options:\n");
+    fprintf(stderr, "    -o group_commit=USEC       coalesce fsyncs arriving within USEC (default 0, off)\n");
+    fprintf(stderr, "    -o group_commit_batch=N    flush a batch once N fsyncs joined it (default 64)\n");
+    fprintf(stderr, "    -o backend=NAME            keep regular files in an object store: file (default), log, lsm, dedup\n");
+    fprintf(stderr, "    -o segment_size=MB         size of a log backend segment (default 64)\n");
+    fprintf(stderr, "    -o gc_ratio=PCT            compact log segments less than PCT%% live (default 50, 0 = never)\n");
+    fprintf(stderr, "    -o inline_max=BYTES        serve files up to BYTES from the in-memory index (default 0, off)\n");
+    fprintf(stderr, "    -o memtable_size=MB        memory buffered before an lsm backend flush (default 4)\n");
+    fprintf(stderr, "    -o fsync_promote=N         move a store value rewritten by N fsyncs to a backing file (default 4, 0 = never)\n");
+    fprintf(stderr, "    -o value_max=MB            move a store value over MB to a backing file before writing to it (default 64, 0 = never)\n");
+    fprintf(stderr, "    -o compress=CODEC          compress object store values with lz4 or zstd\n");
+    fprintf(stderr, "    -o trace=FILE              record every call to FILE, for kvfs-replay\n");
+    fprintf(stderr, "    -o immutable=1             mount read-only and cache everything, the tree never changes\n");
+    fprintf(stderr, "    -o format_upgrade=1        mount a root an older kvfs made; only its top level is found\n");
+    fprintf(stderr, "    -o share=uid|gid|pid       share reads and writes fairly between users, groups or processes\n");
+    fprintf(stderr, "    -o share_weights=ID=W:...  give those IDs W shares each instead of 1\n");
+    fprintf(stderr, "    -o share_rate=MB           limit each of them to MB/s (default 0, no limit)\n");
+    fprintf(stderr, "    -o share_slots=N           reads and writes in progress at once (default 8)\n");
+    fprintf(stderr, "    -o statfs_interval=SEC     refresh the cached statfs every SEC (default 2, 0 = no cache)\n");
+    fprintf(stderr, "    -o statfs_dirty=MB         refresh it early after MB written (default 64, 0 = never)\n");
+    fprintf(stderr, "    -o xattr_cache=N           cache the xattrs of up to N objects (default 4096, 0 = off)\n");
+    fprintf(stderr, "    -o keep_cache=N            keep the page cache of up to N unchanged files across opens (default 4096, 0 = off)\n");
+    fprintf(stderr, "    -o direct_io_mb=MB         open files of MB and up direct_io, bypassing the page cache (default 0, off)\n");
+    fprintf(stderr, "    -o direct_io_xattr=1       let user.kvfs.direct_io=1 or 0 on a file say so instead\n");
+    fprintf(stderr, "    -o direct_io_backing=1     read their backing files with O_DIRECT too\n");
+    fprintf(stderr, "    -o prefetch=N              warm the N files most often opened next (default 2, 0 = off)\n");
+    fprintf(stderr, "    -o prefetch_kb=KB          read KB of each ahead (default 128)\n");
+    fprintf(stderr, "    -o checksum=KB             keep a CRC32C per KB block of every file, verified on read\n");
+    fprintf(stderr, "    -o scrub_rate=MB           re-verify checksummed files in the background at MB/s (default 4, 0 = off)\n");
+    fprintf(stderr, "    -o checksum_rebuild=1      trust the data: re-record every checksum that does not match\n");
+    fprintf(stderr, "    -o stripe=KB               stripe files over the rootDirs in KB units (default 0, whole files)\n");
+    fprintf(stderr, "    -o root_threads=N          I/O threads per rootDir for striped or mirrored files (default 2)\n");
+    fprintf(stderr, "    -o mirror=1                keep a full copy on every rootDir; repair with kvfs-resync\n");
+    fprintf(stderr, "    -o tier=1                  two rootDirs: keep hot files on the first, cold ones on the second\n");
+    fprintf(stderr, "    -o tier_fast=MB            fill the first rootDir up to MB of files (default 0, its filesystem)\n");
+    fprintf(stderr, "    -o tier_budget=MB          move files between the tiers at MB/s (default 32, 0 = never)\n");
+    fprintf(stderr, "    -o tier_interval=SEC       look for files to move every SEC (default 60)\n");
+    fprintf(stderr, "    -o workers=N               serve requests with N workers (default 0, one per CPU)\n");
+    fprintf(stderr, "    -o workers_pin=0           let the workers run on any CPU instead of one each\n");
     abort();
 }
 
 int main(int argc, char *argv[])
 {
-    int fuse_stat;
+    int fuse_stat, first, i, multithreaded;
     struct kvfs_state *kvfs_data;
+    struct fuse_args args;
+    struct fuse *fuse;
+    char *mountpoint;
+    struct fuse_operations *ops = &kvfs_oper;
+    sigset_t sigs;
 
     // kvfs doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -567,25 +933,101 @@ int main(int argc, char *argv[])
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
 	kvfs_usage();
 
-    kvfs_data = malloc(sizeof(struct kvfs_state));
+    kvfs_data = calloc(1, sizeof(struct kvfs_state));
     if (kvfs_data == NULL) {
 	perror("main calloc");
 	abort();
     }
+    kvfs_set_defaults(kvfs_data);
+
+    // Pull the rootdirs out of the argument list and save them in my
+    // internal data.  They are the arguments before the mountpoint
+    // that are neither options nor the value of a -o.
+    first = argc-2;
+    while (first > 1 && argv[first-1][0] != '-' && (first < 3 || strcmp(argv[first-2], "-o") != 0))
+	first--;
+    kvfs_data->nroots = argc-1 - first;
+    kvfs_data->roots = calloc(kvfs_data->nroots, sizeof(char *));
+    if (kvfs_data->roots == NULL) {
+	perror("main calloc");
+	abort();
+    }
+    for (i = 0; i < kvfs_data->nroots; i++) {
+	kvfs_data->roots[i] = realpath(argv[first+i], NULL);
+	if (kvfs_data->roots[i] == NULL) {
+	    perror(argv[first+i]);
+	    return 1;
+	}
+    }
+    kvfs_data->rootdir = kvfs_data->roots[0];
+    argv[first] = argv[argc-1];
+    argv[first+1] = NULL;
+    argc = first+1;
+
+    // Pick our own -o options out; everything else goes on to fuse
+    args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, kvfs_data, kvfs_opts, NULL) == -1)
+	kvfs_usage();
 
-    // Pull the rootdir out of the argument list and save it in my
-    // internal data
-    kvfs_data->rootdir = realpath(argv[argc-2], NULL);
-    argv[argc-2] = argv[argc-1];
-    argv[argc-1] = NULL;
-    argc--;
+    // roots an older kvfs made are refused; which roots may come
+    // first depends on -o mirror
+    if (kvfs_dirid_check(kvfs_data) < 0 || kvfs_roots_check(kvfs_data) < 0 ||
+	kvfs_mirror_check(kvfs_data) < 0)
+	return 1;
     
     kvfs_data->logfile = log_open();
+
+    // an immutable tree is mounted read-only, and the kernel may
+    // cache its names and attributes for a day; options given on the
+    // command line come later and win
+    if (kvfs_data->immutable) {
+	if (fuse_opt_insert_arg(&args, 1, "-oro,attr_timeout=86400,entry_timeout=86400,negative_timeout=86400") == -1)
+	    return 1;
+	ops = kvfs_immutable_wrap(ops);
+    }
+
+    // SIGUSR1 asks for a statistics report; block it before fuse
+    // starts its threads so only the stats thread ever takes it
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    // queue reads and writes per class of caller; the trace, if
+    // any, sees how long they waited
+    if (kvfs_data->share != NULL) {
+	ops = kvfs_share_wrap(ops, kvfs_data);
+	if (ops == NULL)
+	    return 1;
+    }
+
+    // Open the trace before fuse daemonizes us, so a relative path
+    // means what the user thinks it means
+    if (kvfs_data->trace != NULL) {
+	FILE *trace = fopen(kvfs_data->trace, "w");
+
+	if (trace == NULL) {
+	    perror(kvfs_data->trace);
+	    return 1;
+	}
+	ops = kvfs_trace_wrap(ops, trace);
+    }
     
-    // turn over control to fuse
-    fprintf(stderr, "about to call fuse_main\n");
-    fuse_stat = fuse_main(argc, argv, &kvfs_oper, kvfs_data);
-    fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    // mount, and serve requests with our own workers (see workers.c)
+    // where fuse_main() would have run fuse_loop_mt()
+    fprintf(stderr, "about to call fuse_setup\n");
+    fuse = fuse_setup(args.argc, args.argv, ops, sizeof(*ops), &mountpoint, &multithreaded, kvfs_data);
+    if (fuse == NULL)
+	return 1;
+    if (multithreaded)
+	fuse_stat = kvfs_workers_loop(fuse, kvfs_data);
+    else
+	fuse_stat = fuse_loop(fuse);
+    fuse_teardown(fuse, mountpoint);
+    fprintf(stderr, "fuse loop returned %d\n", fuse_stat);
+    fuse_stat = fuse_stat < 0 ? 1 : 0;
+
+    fuse_opt_free_args(&args);
     
     return fuse_stat;
 }
+#endif
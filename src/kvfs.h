@@ -16,19 +16,126 @@
 // writing, the most current API version is 26
 #define FUSE_USE_VERSION 26
 
-// need this to get pwrite().  I have to use setvbuf() instead of
-// setlinebuf() later in consequence.
-#define _XOPEN_SOURCE 500
+// need this to get pwrite(), and syncfs()/fdatasync() for the group
+// commit code.  I have to use setvbuf() instead of setlinebuf() later
+// in consequence.
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 // maintain bbfs state in here
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/statvfs.h>
+
+struct kvfs_csum_file;
+struct kvfs_mirror_file;
+struct kvfs_object;
+struct kvfs_store_ops;
+struct kvfs_stripe_file;
+struct kvfs_tier_object;
+
 struct kvfs_state {
     FILE *logfile;
     char *rootdir;
+    int rootfd;
+
+    // every backing root, rootdir first, see roots.c
+    char **roots;
+    int nroots;
+    unsigned int stripe;		// KiB per stripe unit; 0 keeps files whole
+    unsigned int root_threads;		// I/O threads per root for striped files
+    unsigned int mirror;		// every root a full copy, see mirror.c
+
+    // a fast and a slow root, see tier.c
+    unsigned int tier;			// nonzero: the first root is the fast one
+    unsigned int tier_fast;		// MiB of objects the fast root holds; 0 is its filesystem
+    unsigned int tier_budget;		// MB/s the migrator may copy
+    unsigned int tier_interval;		// seconds between migrator passes
+
+    // group commit for fsync()/fdatasync(), see sync.c
+    unsigned int group_commit_delay;	// usec; 0 disables batching
+    unsigned int group_commit_batch;	// close a batch at this many waiters
+
+    // object store for regular files, see store.c; NULL keeps one
+    // backing file per object
+    char *backend;
+    unsigned int segment_size;		// MiB per log segment
+    unsigned int gc_ratio;		// compact segments less than this % live
+    unsigned int inline_max;		// bytes; smaller values are kept in the index
+    unsigned int memtable_size;		// MiB buffered before an LSM flush
+    unsigned int fsync_promote;		// rewriting fsyncs before a value gets a backing file; 0 is never
+    unsigned int value_max;		// MiB; a bigger value gets a backing file before it is written; 0 is never
+    char *compress;			// lz4 or zstd, see compress.c
+    struct kvfs_store_ops *store;
+
+    char *trace;			// record every call here, see trace.c
+
+    unsigned int immutable;		// nonzero: read-only, cached for good, see immutable.c
+    unsigned int format_upgrade;	// nonzero: mount roots an older kvfs made, see dirid.c
+
+    // fair sharing of reads and writes between callers, see share.c
+    char *share;			// uid, gid or pid; NULL shares nothing out
+    char *share_weights;		// ID=W:ID=W...; every other class weighs 1
+    unsigned int share_rate;		// MB/s per class; 0 is no limit
+    unsigned int share_slots;		// data calls in progress at once
+
+    // the FUSE session loop, see workers.c
+    unsigned int workers;		// request workers; 0 is one per CPU
+    unsigned int workers_pin;		// nonzero: pin each worker to its CPU
+
+    // statfs() is answered from this copy of the backing filesystem's
+    // statvfs, refreshed in the background, see statfs.c
+    unsigned int statfs_interval;	// seconds between refreshes; 0 disables the cache
+    unsigned int statfs_dirty;		// MiB written that bring a refresh forward
+    pthread_mutex_t statfs_lock;
+    struct statvfs statfs_cache;
+    int statfs_valid;
+
+    unsigned int xattr_cache;		// objects whose xattrs are cached, see xattr.c
+
+    unsigned int keep_cache;		// objects whose generations are kept, see pagecache.c
+
+    // keeping big files out of the page caches, see directio.c
+    unsigned int direct_io_mb;		// MiB from which files are opened direct_io; 0 is none
+    unsigned int direct_io_xattr;	// nonzero: user.kvfs.direct_io decides first
+    unsigned int direct_io_backing;	// nonzero: their backing files are O_DIRECT too
+
+    // warming the objects usually opened next, see prefetch.c
+    unsigned int prefetch;		// successors prefetched per open; 0 is off
+    unsigned int prefetch_kb;		// KiB read ahead of each
+
+    // block checksums for backing files, see integrity.c
+    unsigned int checksum;		// KiB per checksum block; 0 disables them
+    unsigned int scrub_rate;		// MB/s the scrubber may read; 0 disables it
+    unsigned int checksum_rebuild;	// nonzero: re-record sums that do not match, see integrity.c
 };
 #define KVFS_DATA ((struct kvfs_state *) fuse_get_context()->private_data)
 
+// a malloc'ed hex md5 of str; object keys are made with it, see dirid.c
+char *str2md5(const char *str, int length);
+// the same into out, for keys that are not to outlive the caller
+void str2md5_buf(const char *str, int length, char out[33]);
+
+void kvfs_set_defaults(struct kvfs_state *kvfs_data);
+
+// fi->fh of an open regular file points at one of these
+struct kvfs_handle {
+    int fd;				// backing file, -1 if obj is set
+    struct kvfs_object *obj;		// object store entry
+    struct kvfs_csum_file *csum;	// fd's block checksums, NULL if off
+    struct kvfs_stripe_file *stripe;	// fd's pieces on other roots, NULL if whole
+    struct kvfs_mirror_file *mirror;	// fd's copies on other roots, NULL if none
+    struct kvfs_tier_object *tier;	// fd's use counts, NULL if not tiering
+    int direct;				// fd is O_DIRECT, read through aligned buffers
+    struct kvfs_pagecache_object *pc;	// change generation, NULL if not tracked
+};
+#define KVFS_HANDLE(fi) ((struct kvfs_handle *) (uintptr_t) (fi)->fh)
+
 #endif
 
 #include <ctype.h>
@@ -38,8 +38,17 @@ https://linux.die.net/man/
   follow later to get a gentler introduction.
 */
 #include "kvfs.h"
+#include "dirid.h"
+#include "integrity.h"
 #include "log.h"
+#include "store.h"
+#include "sync.h"
+#include "xattr.h"
 #include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 #include <sys/types.h>
 #include <dirent.h>
 #include <stdio.h>
@@ -63,17 +72,37 @@ static void real_path(char actual_path[PATH_MAX], const char *path)
     strncat(actual_path, path, PATH_MAX);
 }
 
+// objects are spread over the roots by key, see roots.c
 static void real_path_inside_root(char actual_path[PATH_MAX], const char *path)
 {
-    strcpy(actual_path, KVFS_DATA->rootdir);
-    strcat(actual_path,"/");
-    strncat(actual_path, path, PATH_MAX);
+    kvfs_root_path(actual_path, path);
+}
+
+// is this object kept in the object store rather than under rootdir?
+static int in_store(const char *path)
+{
+    struct stat statbuf;
+
+    return KVFS_DATA->store != NULL && kvfs_store_getattr(path, &statbuf) == 0;
 }
 
 int kvfs_getattr_impl(const char *path, struct stat *statbuf)
 {
     int retstat;
     char actual_path[PATH_MAX],actual_path2[PATH_MAX];
+
+    // an immutable mount has everything in memory
+    retstat = kvfs_immutable_getattr(path, statbuf);
+    if (retstat <= 0)
+    {
+      return retstat;
+    }
+
+    if (KVFS_DATA->store != NULL && kvfs_store_getattr(path, statbuf) == 0)
+    {
+      log_stat(statbuf);
+      return 0;
+    }
     
      if(strcmp(root->hashedVal,path)==0){
       log_msg("INSIDE IF");
@@ -86,6 +115,10 @@ int kvfs_getattr_impl(const char *path, struct stat *statbuf)
     }
     	
     retstat = log_syscall("lstat", lstat(actual_path, statbuf), 0);
+    if (retstat == 0)
+    {
+      kvfs_stripe_stat(path, statbuf);
+    }
     
     log_stat(statbuf);
     
@@ -114,6 +147,12 @@ int kvfs_mknod_impl(const char *path, mode_t mode, dev_t dev)
   char actual_path[PATH_MAX];
   
   real_path_inside_root(actual_path, path);
+  kvfs_xattr_forget(path);
+
+  if (S_ISREG(mode) && KVFS_DATA->store != NULL)
+  {
+     return kvfs_store_create(path, mode);
+  }
 
   if (S_ISREG(mode)) 
   {
@@ -134,104 +173,360 @@ int kvfs_mknod_impl(const char *path, mode_t mode, dev_t dev)
          retstat = log_syscall("mknod", mknod(actual_path, mode, dev), 0);
       }
   }
+  if (retstat == 0)
+  {
+    kvfs_mirror_copy(path);
+  }
   return retstat;
 }
 
 int kvfs_mkdir_impl(const char *path, mode_t mode)
 {
   char actual_path[PATH_MAX];
+  int retstat;
+
   real_path_inside_root(actual_path,path);
-  return log_syscall("mkdir", mkdir(actual_path, mode), 0);
+  kvfs_xattr_forget(path);
+  // kvfs has to be able to write the id file even into a directory
+  // made read-only
+  retstat = log_syscall("mkdir", mkdir(actual_path, mode | S_IWUSR | S_IXUSR), 0);
+  if (retstat < 0)
+  {
+    return retstat;
+  }
+  retstat = kvfs_dirid_create(path, actual_path);
+  if (retstat < 0)
+  {
+    rmdir(actual_path);
+  }
+  else if ((mode & (S_IWUSR | S_IXUSR)) != (S_IWUSR | S_IXUSR))
+  {
+    retstat = log_syscall("chmod", chmod(actual_path, mode), 0);
+  }
+  if (retstat == 0)
+  {
+    kvfs_mirror_copy(path);
+  }
+  return retstat;
 }
 
 int kvfs_unlink_impl(const char *path)
 {
   char actual_path[PATH_MAX];
+  int retstat;
+
+  kvfs_xattr_forget(path);
+  if (in_store(path))
+  {
+    return kvfs_store_unlink(path);
+  }
+
   real_path_inside_root(actual_path, path);
 
-  return log_syscall("unlink", unlink(actual_path), 0);
+  if (KVFS_DATA->store != NULL)
+  {
+    kvfs_store_forget(path);
+  }
+
+  retstat = log_syscall("unlink", unlink(actual_path), 0);
+  if (retstat == 0)
+  {
+    kvfs_csum_unlink(path);
+    kvfs_stripe_unlink(path);
+    kvfs_mirror_remove(path);
+    kvfs_tier_unlink(path);
+  }
+  return retstat;
+}
+
+// for kvfs_dirid_sweep()
+static int exists(const char *key)
+{
+  struct stat st;
+
+  return kvfs_getattr_impl(key, &st) == 0;
 }
 
 int kvfs_rmdir_impl(const char *path)
 {
   char actual_path[PATH_MAX];
+  int retstat;
+
   real_path_inside_root(actual_path, path);
+  kvfs_xattr_forget(path);
 
-  return log_syscall("rmdir", rmdir(actual_path), 0);
+  retstat = kvfs_dirid_rmdir(path, actual_path);
+  // a crash can leave the entry of a name whose object is gone
+  if (retstat == -ENOTEMPTY && kvfs_dirid_sweep(path, actual_path, exists) > 0)
+  {
+    retstat = kvfs_dirid_rmdir(path, actual_path);
+  }
+  if (retstat == 0)
+  {
+    kvfs_mirror_remove(path);
+  }
+  return retstat;
 }
 
 int kvfs_symlink_impl(const char *path, const char *link)
 {
   char flink[PATH_MAX];
+  int retstat;
+
   real_path_inside_root(flink, link);
-  return log_syscall("symlink", symlink(path, flink), 0);
+  kvfs_xattr_forget(link);
+  retstat = log_syscall("symlink", symlink(path, flink), 0);
+  if (retstat == 0)
+  {
+    kvfs_mirror_copy(link);
+  }
+  return retstat;
 }
 int kvfs_rename_impl(const char *path, const char *newpath)
 {
+  int retstat;
   char actual_path[PATH_MAX];
   char fnewpath[PATH_MAX];
 
+  // a file renamed stays on its tier
+  kvfs_tier_follow(path, newpath);
   real_path_inside_root(actual_path, path);
   real_path_inside_root(fnewpath, newpath);
+  kvfs_xattr_forget(path);
+  kvfs_xattr_forget(newpath);
+
+  // whichever side the object lives on, the target must not survive
+  // on the other one and shadow it
+  if (in_store(path))
+  {
+    retstat = kvfs_store_rename(path, newpath);
+    if (retstat == 0 && unlink(fnewpath) == 0)
+    {
+      kvfs_csum_unlink(newpath);
+      kvfs_stripe_unlink(newpath);
+      kvfs_tier_unlink(newpath);
+    }
+    return retstat;
+  }
 
-  return log_syscall("rename", rename(actual_path, fnewpath), 0);
+  if (KVFS_DATA->store != NULL)
+  {
+    kvfs_store_forget(path);
+  }
+
+  // a directory's id moves with it, so nothing below changes key
+  retstat = kvfs_dirid_rename(path, actual_path, newpath, fnewpath);
+  if (retstat == 0)
+  {
+    kvfs_csum_rename(path, newpath);
+    kvfs_mirror_rename(path, newpath);
+    kvfs_tier_rename(path, newpath);
+  }
+  if (retstat == 0 && in_store(newpath))
+  {
+    kvfs_store_unlink(newpath);
+  }
+  return retstat;
 }
 
 int kvfs_link_impl(const char *path, const char *newpath)
 {
   char actual_path[PATH_MAX], fnewpath[PATH_MAX];
+  int retstat;
+
+  // a store object is a single record; it has nowhere to keep a
+  // second name
+  if (in_store(path))
+  {
+    return -EPERM;
+  }
+
+  // links cannot cross tiers any more than filesystems
+  kvfs_tier_follow(path, newpath);
   real_path_inside_root(actual_path, path);
   real_path_inside_root(fnewpath, newpath);
+  kvfs_xattr_forget(newpath);
 
-  return log_syscall("link", link(actual_path, fnewpath), 0);
+  // a striped file's pieces get the new name too
+  retstat = kvfs_roots_link(path, actual_path, newpath, fnewpath);
+  if (retstat == 0)
+  {
+    kvfs_csum_link(path, newpath);
+    kvfs_mirror_link(path, newpath);
+  }
+  return retstat;
 }
 
 int kvfs_chmod_impl(const char *path, mode_t mode)
 {
   char actual_path[PATH_MAX];
+  int retstat;
+
+  // the mode is part of the POSIX ACL attributes
+  kvfs_xattr_forget(path);
+  if (in_store(path))
+  {
+    return kvfs_store_chmod(path, mode);
+  }
   
   real_path_inside_root(actual_path, path);
 
-  return log_syscall("chmod", chmod(actual_path, mode), 0);
+  retstat = log_syscall("chmod", chmod(actual_path, mode), 0);
+  if (retstat == 0)
+  {
+    kvfs_mirror_chmod(path, mode);
+  }
+  return retstat;
 }
 
 int kvfs_chown_impl(const char *path, uid_t uid, gid_t gid)
 {
   char actual_path[PATH_MAX];
+  int retstat;
+
+  kvfs_xattr_forget(path);
+  if (in_store(path))
+  {
+    return kvfs_store_chown(path, uid, gid);
+  }
+
   real_path_inside_root(actual_path, path);
 
-  return log_syscall("chown", chown(actual_path, uid, gid), 0);
+  retstat = log_syscall("chown", chown(actual_path, uid, gid), 0);
+  if (retstat == 0)
+  {
+    kvfs_mirror_chown(path, uid, gid);
+  }
+  return retstat;
 }
 
 int kvfs_truncate_impl(const char *path, off_t newsize)
 {
   char actual_path[PATH_MAX];
+  int retstat;
+
+  if (in_store(path))
+  {
+    return kvfs_store_truncate(path, newsize);
+  }
+
   real_path_inside_root(actual_path, path);
-  return log_syscall("truncate", truncate(actual_path, newsize), 0);
+  if (kvfs_striping())
+  {
+    return kvfs_stripe_truncate(path, actual_path, newsize);
+  }
+  retstat = kvfs_csum_truncate(path, actual_path, newsize);
+  if (retstat == 0)
+  {
+    kvfs_mirror_truncate(path, newsize);
+  }
+  return retstat;
 }
 
 int kvfs_utime_impl(const char *path, struct utimbuf *ubuf)
 {
   char actual_path[PATH_MAX];
+  int retstat;
+
+  if (in_store(path))
+  {
+    time_t now = time(NULL);
+    return kvfs_store_utime(path, ubuf ? ubuf->actime : now, ubuf ? ubuf->modtime : now);
+  }
+
   real_path_inside_root(actual_path, path);
-  return log_syscall("utime", utime(actual_path, ubuf), 0);
+  retstat = log_syscall("utime", utime(actual_path, ubuf), 0);
+  if (retstat == 0)
+  {
+    kvfs_mirror_utime(path, ubuf);
+  }
+  return retstat;
 }
 
 int kvfs_open_impl(const char *path, struct fuse_file_info *fi)
 {
   int retstat = 0;
-  int fd;
+  int fd = -1;
+  struct kvfs_object *obj = NULL;
+  struct kvfs_tier_object *tier = NULL;
+  struct kvfs_handle *fh;
   char actual_path[PATH_MAX];
-  
-  real_path_inside_root(actual_path, path);
 
-  fd = log_syscall("open", open(actual_path, fi->flags), 0);
-  if (fd < 0) 
+  if (KVFS_DATA->store != NULL)
   {
-    retstat = log_error("open");
+    retstat = kvfs_store_open(path, &obj);
+    if (retstat < 0 && retstat != -ENOENT)
+    {
+      return retstat;
+    }
+    retstat = 0;
   }
 
-  fi->fh = fd;
+  if (obj == NULL)
+  {
+    // counted first, so the file stays on the tier looked up here
+    kvfs_tier_open(path, &tier);
+    real_path_inside_root(actual_path, path);
+
+    fd = log_syscall("open", open(actual_path, fi->flags), 0);
+    if (fd < 0) 
+    {
+      kvfs_tier_close(tier);
+      return fd;
+    }
+  }
+
+  fh = malloc(sizeof(*fh));
+  if (fh == NULL)
+  {
+    if (obj != NULL)
+      kvfs_store_release(obj);
+    else
+      close(fd);
+    kvfs_tier_close(tier);
+    return -ENOMEM;
+  }
+  fh->fd = fd;
+  fh->obj = obj;
+  fh->csum = NULL;
+  fh->stripe = NULL;
+  fh->mirror = NULL;
+  fh->tier = tier;
+  fh->direct = 0;
+  fh->pc = NULL;
+  if (obj == NULL)
+  {
+    retstat = kvfs_csum_open(path, fd, fi->flags, &fh->csum);
+    if (retstat == 0)
+    {
+      retstat = kvfs_stripe_open(path, fd, fi->flags, &fh->stripe);
+    }
+    if (retstat == 0)
+    {
+      retstat = kvfs_mirror_open(path, fd, fi->flags, &fh->mirror);
+    }
+    if (retstat < 0)
+    {
+      close(fd);
+      kvfs_tier_close(tier);
+      free(fh);
+      return retstat;
+    }
+  }
+  // big files skip the page cache, and maybe the backing one too
+  if (kvfs_directio_want(path, fd, obj))
+  {
+    fi->direct_io = 1;
+    if (obj == NULL && fh->csum == NULL && fh->stripe == NULL && fh->mirror == NULL)
+    {
+      fh->direct = kvfs_directio_backing(fd, fi->flags);
+    }
+  }
+  // what the kernel has cached of it is still right if nothing changed
+  // since it was last opened
+  fi->keep_cache = kvfs_pagecache_open(path, fd, obj, &fh->pc);
+  fi->fh = (uintptr_t) fh;
+  kvfs_prefetch_open(path);
 
   log_fi(fi);
   
@@ -240,21 +535,159 @@ int kvfs_open_impl(const char *path, struct fuse_file_info *fi)
 
 int kvfs_read_impl(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-  int retstat = 0;
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
   
   log_fi(fi);
 
-  return log_syscall("pread", pread(fi->fh, buf, size, offset), 0);
+  if (fh->obj != NULL)
+  {
+    return kvfs_store_read(fh->obj, buf, size, offset);
+  }
+  kvfs_tier_read(fh->tier);
+
+  if (fh->csum != NULL)
+  {
+    return kvfs_csum_pread(fh->csum, fh->fd, buf, size, offset);
+  }
+  if (fh->stripe != NULL)
+  {
+    return kvfs_stripe_pread(fh->stripe, buf, size, offset);
+  }
+  if (fh->mirror != NULL)
+  {
+    return kvfs_mirror_pread(fh->mirror, buf, size, offset);
+  }
+  if (fh->direct)
+  {
+    return kvfs_directio_pread(fh->fd, buf, size, offset);
+  }
+
+  return log_syscall("pread", pread(fh->fd, buf, size, offset), 0);
 }
 
 int kvfs_write_impl(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-  int retstat = 0;
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
   
   log_fi(fi);
+  kvfs_pagecache_wrote(fh->pc);
+
+  if (fh->obj != NULL)
+  {
+    return kvfs_store_write(fh->obj, buf, size, offset);
+  }
+
+  if (fh->csum != NULL)
+  {
+    return kvfs_csum_pwrite(fh->csum, fh->fd, buf, size, offset);
+  }
+  if (fh->stripe != NULL)
+  {
+    return kvfs_stripe_pwrite(fh->stripe, buf, size, offset);
+  }
+  if (fh->mirror != NULL)
+  {
+    return kvfs_mirror_pwrite(fh->mirror, buf, size, offset);
+  }
+
+  return log_syscall("pwrite", pwrite(fh->fd, buf, size, offset), 0);
+}
+
+// Rather than reading the data ourselves, hand FUSE the backing fd
+// and let it splice() straight from there into /dev/fuse.  Objects in
+// the store have no fd, checksummed files must be verified and
+// striped ones come from several, so those are read into a buffer as
+// before; the library frees it.  A mirrored file splices from
+// whichever copy is least busy.
+int kvfs_read_buf_impl(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
+  struct fuse_bufvec *src;
+  int retstat;
+
+  log_fi(fi);
+
+  src = malloc(sizeof(struct fuse_bufvec));
+  if (src == NULL)
+  {
+    return -ENOMEM;
+  }
+  *src = FUSE_BUFVEC_INIT(size);
+
+  if (fh->obj != NULL || fh->csum != NULL || fh->stripe != NULL || fh->direct)
+  {
+    src->buf[0].mem = malloc(size);
+    if (src->buf[0].mem == NULL)
+    {
+      free(src);
+      return -ENOMEM;
+    }
+    retstat = kvfs_read_impl(path, src->buf[0].mem, size, offset, fi);
+    if (retstat < 0)
+    {
+      free(src->buf[0].mem);
+      free(src);
+      return retstat;
+    }
+    src->buf[0].size = retstat;
+  }
+  else
+  {
+    kvfs_tier_read(fh->tier);
+    src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src->buf[0].fd = fh->mirror != NULL ? kvfs_mirror_read_fd(fh->mirror, NULL) : fh->fd;
+    src->buf[0].pos = offset;
+  }
+
+  *bufp = src;
+  return 0;
+}
+
+#ifndef KVFS_BENCH
+// The other direction: with splice enabled buf is a pipe full of the
+// kernel's pages, and fuse_buf_copy() splices them into the backing
+// file.  Store objects, and files being checksummed, striped or
+// mirrored, need the bytes in memory.  (Left out of the
+// in-process tools, which don't link libfuse.)
+int kvfs_write_buf_impl(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
+  size_t size = fuse_buf_size(buf);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  ssize_t copied;
+  int retstat;
+
+  log_fi(fi);
+  kvfs_pagecache_wrote(fh->pc);
+
+  if (fh->obj != NULL || fh->csum != NULL || fh->stripe != NULL || fh->mirror != NULL)
+  {
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+      return kvfs_write_impl(path, buf->buf[0].mem, size, offset, fi);
+    }
+    dst.buf[0].mem = malloc(size);
+    if (dst.buf[0].mem == NULL)
+    {
+      return -ENOMEM;
+    }
+    copied = fuse_buf_copy(&dst, buf, 0);
+    retstat = copied < 0 ? copied : kvfs_write_impl(path, dst.buf[0].mem, copied, offset, fi);
+    free(dst.buf[0].mem);
+    return retstat;
+  }
 
-  return log_syscall("pwrite", pwrite(fi->fh, buf, size, offset), 0);
+  dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  dst.buf[0].fd = fh->fd;
+  dst.buf[0].pos = offset;
+  copied = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+  if (copied < 0)
+  {
+    log_msg("    ERROR fuse_buf_copy: %s\n", strerror(-copied));
+  }
+  return copied;
 }
+#endif
 
 int kvfs_statfs_impl(const char *path, struct statvfs *statv)
 {
@@ -268,7 +701,14 @@ int kvfs_statfs_impl(const char *path, struct statvfs *statv)
     else{
       real_path_inside_root(actual_path,path);
     }
-  retstat = log_syscall("statvfs", statvfs(actual_path, statv), 0);
+  if (kvfs_roots_count() > 1)
+  {
+    retstat = kvfs_statfs_roots(statv);
+  }
+  else
+  {
+    retstat = log_syscall("statvfs", statvfs(actual_path, statv), 0);
+  }
   
   log_statvfs(statv);
   
@@ -277,70 +717,205 @@ int kvfs_statfs_impl(const char *path, struct statvfs *statv)
 
 int kvfs_flush_impl(const char *path, struct fuse_file_info *fi)
 {
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
+
   log_fi(fi);
+
+  // close() is where applications look for write errors, so hand
+  // buffered store writes to the backend here
+  if (fh->obj != NULL)
+  {
+    return kvfs_store_flush(fh->obj);
+  }
   return 0;
 }
 
 int kvfs_release_impl(const char *path, struct fuse_file_info *fi)
 {
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
+  int retstat;
+
   log_fi(fi);
 
-  return log_syscall("close", close(fi->fh), 0);
+  kvfs_pagecache_close(fh->pc);
+  if (fh->obj != NULL)
+  {
+    retstat = kvfs_store_release(fh->obj);
+  }
+  else
+  {
+    kvfs_csum_close(fh->csum);
+    kvfs_stripe_close(fh->stripe);
+    kvfs_mirror_close(fh->mirror);
+    kvfs_tier_close(fh->tier);
+    retstat = log_syscall("close", close(fh->fd), 0);
+  }
+  free(fh);
+
+  return retstat;
 }
 
 int kvfs_fsync_impl(const char *path, int datasync, struct fuse_file_info *fi)
 {
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
+  int retstat;
+
   log_fi(fi);
-#ifdef HAVE_FDATASYNC
-  if (datasync)
+
+  if (fh->obj != NULL)
   {
-    return log_syscall("fdatasync", fdatasync(fi->fh), 0);
-    else
+    return kvfs_store_fsync(fh->obj, datasync);
   }
-#endif  
-  return log_syscall("fsync", fsync(fi->fh), 0);
+
+  // batched with concurrent fsyncs on other files, see sync.c
+  retstat = kvfs_sync_commit(fh->fd, datasync);
+  if (retstat == 0)
+  {
+    retstat = kvfs_csum_fsync(fh->csum);
+  }
+  if (retstat == 0 && fh->stripe != NULL)
+  {
+    retstat = kvfs_stripe_fsync(fh->stripe, datasync);
+  }
+  if (retstat == 0 && fh->mirror != NULL)
+  {
+    retstat = kvfs_mirror_fsync(fh->mirror, datasync);
+  }
+  return retstat;
 }
 
 #ifdef HAVE_SYS_XATTR_H
+// Store objects have nowhere to keep attributes.  Backing files are
+// only ever asked with the l*xattr calls: FUSE hands the xattr
+// methods a path, not a file handle, and the name under rootdir may
+// be a symlink the caller did not mean to follow.
+static void xattr_path(char actual_path[PATH_MAX], const char *path)
+{
+  if (strcmp(root->hashedVal, path) == 0)
+  {
+    real_path(actual_path, "/");
+  }
+  else
+  {
+    real_path_inside_root(actual_path, path);
+  }
+}
+
 int kvfs_setxattr_impl(const char *path, const char *name, const char *value, size_t size, int flags)
 {
   char actual_path[PATH_MAX];
-  real_path(actual_path, path);
+  int retstat;
+
+  if (in_store(path))
+  {
+    return -ENOTSUP;
+  }
+  xattr_path(actual_path, path);
 
-  return log_syscall("lsetxattr", lsetxattr(actual_path, name, value, size, flags), 0);
+  retstat = log_syscall("lsetxattr", lsetxattr(actual_path, name, value, size, flags), 0);
+  kvfs_xattr_flush();
+  if (retstat == 0)
+  {
+    kvfs_mirror_setxattr(path, name, value, size, flags);
+  }
+  return retstat;
 }
 
 int kvfs_getxattr_impl(const char *path, const char *name, char *value, size_t size)
 {
-  int retstat = 0;
   char actual_path[PATH_MAX];
-  
-  real_path(actual_path, path);
+  char buf[256];
+  ssize_t retstat;
+  uint64_t gen;
 
-  retstat = log_syscall("lgetxattr", lgetxattr(actual_path, name, value, size), 0);
-  
+  if (kvfs_xattr_get(path, name, value, size, &retstat, &gen))
+  {
+    return retstat;
+  }
+  if (in_store(path))
+  {
+    return -ENOTSUP;
+  }
+  xattr_path(actual_path, path);
+
+  // read into buf whatever the caller asked for, so that a size probe
+  // caches the value too; only values too big for it go straight
+  // through uncached
+  retstat = lgetxattr(actual_path, name, buf, sizeof(buf));
+  if (retstat < 0 && errno == ERANGE)
+  {
+    return log_syscall("lgetxattr", lgetxattr(actual_path, name, value, size), 0);
+  }
+  retstat = log_syscall("lgetxattr", retstat, 0);
+  kvfs_xattr_put(path, name, buf, retstat, gen);
+
+  if (retstat < 0 || size == 0)
+  {
+    return retstat;
+  }
+  if (size < (size_t) retstat)
+  {
+    return -ERANGE;
+  }
+  memcpy(value, buf, retstat);
   return retstat;
 }
 
 int kvfs_listxattr_impl(const char *path, char *list, size_t size)
 {
-  int retstat = 0;
   char actual_path[PATH_MAX];
-  char *ptr;
-  
-  real_path(actual_path, path);
+  char buf[1024];
+  ssize_t retstat;
+  uint64_t gen;
 
-  retstat = log_syscall("llistxattr", llistxattr(actual_path, list, size), 0);
- 
+  if (kvfs_xattr_list(path, list, size, &retstat, &gen))
+  {
+    return retstat;
+  }
+  if (in_store(path))
+  {
+    return 0;
+  }
+  xattr_path(actual_path, path);
+
+  retstat = llistxattr(actual_path, buf, sizeof(buf));
+  if (retstat < 0 && errno == ERANGE)
+  {
+    return log_syscall("llistxattr", llistxattr(actual_path, list, size), 0);
+  }
+  retstat = log_syscall("llistxattr", retstat, 0);
+  kvfs_xattr_put_list(path, buf, retstat, gen);
+
+  if (retstat < 0 || size == 0)
+  {
+    return retstat;
+  }
+  if (size < (size_t) retstat)
+  {
+    return -ERANGE;
+  }
+  memcpy(list, buf, retstat);
   return retstat;
 }
 
 int kvfs_removexattr_impl(const char *path, const char *name)
 {
   char actual_path[PATH_MAX];
-  real_path(actual_path, path);
+  int retstat;
 
-  return log_syscall("lremovexattr", lremovexattr(actual_path, name), 0);
+  if (in_store(path))
+  {
+    return -ENOTSUP;
+  }
+  xattr_path(actual_path, path);
+
+  retstat = log_syscall("lremovexattr", lremovexattr(actual_path, name), 0);
+  kvfs_xattr_flush();
+  if (retstat == 0)
+  {
+    kvfs_mirror_removexattr(path, name);
+  }
+  return retstat;
 }
 #endif
 
@@ -368,9 +943,43 @@ int kvfs_opendir_impl(const char *path, struct fuse_file_info *fi)
   return retstat;
 }
 
+// "/" is the backing root itself, so with several roots it is the
+// union of all their listings; each object is listed by its home.
+static int kvfs_readdir_roots(void *buf, fuse_fill_dir_t filler)
+{
+    DIR *dp;
+    struct dirent *de;
+    int r, retstat = 0;
+
+    for (r = 1; r < kvfs_roots_count() && retstat == 0; r++)
+    {
+      dp = opendir(kvfs_root_dir(r));
+      if (dp == NULL)
+      {
+        return log_error("opendir");
+      }
+      while ((de = readdir(dp)) != NULL)
+      {
+        if (strncmp(de->d_name, KVFS_PRIVATE_PREFIX, strlen(KVFS_PRIVATE_PREFIX)) == 0 ||
+            !kvfs_roots_listed(r, de->d_name))
+        {
+          continue;
+        }
+        if (filler(buf, de->d_name, NULL, 0) != 0)
+        {
+          retstat = -ENOMEM;
+          break;
+        }
+      }
+      closedir(dp);
+    }
+    return retstat;
+}
+
 int kvfs_readdir_impl(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    int top = strcmp(root->hashedVal, path) == 0;
     DIR *dp;
     struct dirent *de;
     dp = (DIR *) (uintptr_t) fi->fh;
@@ -383,11 +992,24 @@ int kvfs_readdir_impl(const char *path, void *buf, fuse_fill_dir_t filler, off_t
     }
     do 
     {
+      if (strncmp(de->d_name, KVFS_PRIVATE_PREFIX, strlen(KVFS_PRIVATE_PREFIX)) == 0)
+      {
+        continue;
+      }
+      if (top && !kvfs_roots_listed(0, de->d_name))
+      {
+        continue;
+      }
       if (filler(buf, de->d_name, NULL, 0) != 0) 
       {
         return -ENOMEM;
       }
     } while ((de = readdir(dp)) != NULL);
+
+    if (top)
+    {
+      retstat = kvfs_readdir_roots(buf, filler);
+    }
     
     log_fi(fi);
     
@@ -406,18 +1028,15 @@ int kvfs_releasedir_impl(const char *path, struct fuse_file_info *fi)
 
 int kvfs_fsyncdir_impl(const char *path, int datasync, struct fuse_file_info *fi)
 {
-  int retstat = 0;
-  
   log_fi(fi);
-  
-  return retstat;
+
+  return kvfs_sync_commit(dirfd((DIR *) (uintptr_t) fi->fh), datasync);
 }
 
-int kvfs_access_impl(const char *path, int mask)
+// Called from kvfs_init(), so root is set before any callback that
+// compares against it can run
+void kvfs_root_init(void)
 {
-  int retstat = 0;
-  char actual_path[PATH_MAX],actual_path2[PATH_MAX];
-  
   if(first_run==0)
   {
   
@@ -428,6 +1047,13 @@ int kvfs_access_impl(const char *path, int mask)
 
    first_run=1;
   }
+}
+
+int kvfs_access_impl(const char *path, int mask)
+{
+  int retstat = 0;
+  char actual_path[PATH_MAX],actual_path2[PATH_MAX];
+  
    if(strcmp(root->hashedVal,path)==0){
       path = "/";
       real_path(actual_path,path);
@@ -435,6 +1061,12 @@ int kvfs_access_impl(const char *path, int mask)
     else{
       real_path_inside_root(actual_path,path);
     }
+  // kvfs does no permission checking of its own (see main()), so an
+  // object in the store is accessible as long as it exists
+  if (in_store(path))
+  {
+    return 0;
+  }
   retstat = access(actual_path, mask);
   
   if (retstat < 0)
@@ -446,10 +1078,29 @@ int kvfs_access_impl(const char *path, int mask)
 int kvfs_ftruncate_impl(const char *path, off_t offset, struct fuse_file_info *fi)
 {
   int retstat = 0;
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
   
   log_fi(fi);
+  kvfs_pagecache_wrote(fh->pc);
+
+  if (fh->obj != NULL)
+  {
+    return kvfs_store_ftruncate(fh->obj, offset);
+  }
+  if (fh->csum != NULL)
+  {
+    return kvfs_csum_ftruncate(fh->csum, fh->fd, offset);
+  }
+  if (fh->stripe != NULL)
+  {
+    return kvfs_stripe_ftruncate(fh->stripe, offset);
+  }
+  if (fh->mirror != NULL)
+  {
+    return kvfs_mirror_ftruncate(fh->mirror, offset);
+  }
   
-  retstat = ftruncate(fi->fh, offset);
+  retstat = ftruncate(fh->fd, offset);
   if (retstat < 0)
   {
     retstat = log_error("ftruncate");
@@ -458,6 +1109,66 @@ int kvfs_ftruncate_impl(const char *path, off_t offset, struct fuse_file_info *f
   return retstat;
 }
 
+#ifdef HAVE_FALLOCATE
+// Preallocation and hole punching go to the backing file, so a
+// database reserving space or a VM image dropping blocks costs no
+// data written through us.
+int kvfs_fallocate_impl(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+{
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
+
+  log_fi(fi);
+  kvfs_pagecache_wrote(fh->pc);
+
+  if (fh->obj != NULL)
+  {
+    return kvfs_store_fallocate(fh->obj, mode, offset, len);
+  }
+  if (fh->csum != NULL)
+  {
+    return kvfs_csum_fallocate(fh->csum, fh->fd, mode, offset, len);
+  }
+  if (fh->stripe != NULL)
+  {
+    return kvfs_stripe_fallocate(fh->stripe, mode, offset, len);
+  }
+  if (fh->mirror != NULL)
+  {
+    return kvfs_mirror_fallocate(fh->mirror, mode, offset, len);
+  }
+
+  return log_syscall("fallocate", fallocate(fh->fd, mode, offset, len), 0);
+}
+#endif
+
+// SEEK_DATA and SEEK_HOLE answered by the backing file, so cp
+// --sparse and friends can skip the holes.  Only FUSE 3.8 and later
+// pass lseek down.
+off_t kvfs_lseek_impl(const char *path, off_t offset, int whence, struct fuse_file_info *fi)
+{
+  struct kvfs_handle *fh = KVFS_HANDLE(fi);
+  off_t retstat;
+
+  log_fi(fi);
+
+  if (fh->obj != NULL)
+  {
+    return kvfs_store_lseek(fh->obj, offset, whence);
+  }
+  if (fh->stripe != NULL)
+  {
+    return kvfs_stripe_lseek(fh->stripe, offset, whence);
+  }
+
+  retstat = lseek(fh->fd, offset, whence);
+  if (retstat < 0)
+  {
+    // ENXIO just means no more data (or holes) after offset
+    return -errno;
+  }
+  return retstat;
+}
+
 int kvfs_fgetattr_impl(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
     int retstat = 0;
@@ -468,13 +1179,88 @@ int kvfs_fgetattr_impl(const char *path, struct stat *statbuf, struct fuse_file_
     {
       return kvfs_getattr_impl(path, statbuf);
     }
-    retstat = fstat(fi->fh, statbuf);
+    if (KVFS_HANDLE(fi)->obj != NULL)
+    {
+      return kvfs_store_fgetattr(KVFS_HANDLE(fi)->obj, statbuf);
+    }
+    retstat = fstat(KVFS_HANDLE(fi)->fd, statbuf);
     if (retstat < 0)
     {
       retstat = log_error("fstat");
     }
+    else if (KVFS_HANDLE(fi)->stripe != NULL)
+    {
+      kvfs_stripe_fstat(KVFS_HANDLE(fi)->stripe, statbuf);
+    }
 
     log_stat(statbuf);
     
     return retstat;
 }
+
+// Copy len bytes between two open files without the data passing
+// through kvfs: a reflink (FICLONERANGE) when the backing filesystem
+// can share extents, else copy_file_range(), which at least keeps the
+// copy inside the kernel.  Only FUSE 3.4 and later ask for this;
+// store objects, checksummed and striped files, copies into mirrored
+// ones and kernels without either fall back to read/write.
+ssize_t kvfs_copy_file_range_impl(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
+				  const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
+				  size_t len, int flags)
+{
+  struct kvfs_handle *in = KVFS_HANDLE(fi_in), *out = KVFS_HANDLE(fi_out);
+
+  log_fi(fi_in);
+  log_fi(fi_out);
+  // the copy bypasses the kernel's pages of the destination
+  kvfs_pagecache_wrote(out->pc);
+
+  if (in->obj != NULL || out->obj != NULL || in->csum != NULL || out->csum != NULL ||
+      in->stripe != NULL || out->stripe != NULL || out->mirror != NULL || in->direct || flags != 0)
+  {
+    return -EOPNOTSUPP;
+  }
+
+#ifdef FICLONERANGE
+  struct stat statbuf;
+
+  if (fstat(in->fd, &statbuf) == 0)
+  {
+    struct file_clone_range range;
+
+    if (off_in >= statbuf.st_size)
+    {
+      return 0;
+    }
+    if ((off_t) len > statbuf.st_size - off_in)
+    {
+      len = statbuf.st_size - off_in;
+    }
+    range.src_fd = in->fd;
+    range.src_offset = off_in;
+    // a clone that runs to the end of the source may end unaligned
+    range.src_length = off_in + (off_t) len == statbuf.st_size ? 0 : len;
+    range.dest_offset = off_out;
+    if (ioctl(out->fd, FICLONERANGE, &range) == 0)
+    {
+      log_msg("    cloned %zu bytes\n", len);
+      return len;
+    }
+    // EOPNOTSUPP, EXDEV, EINVAL for unaligned ranges: copy instead
+  }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  ssize_t copied = copy_file_range(in->fd, &off_in, out->fd, &off_out, len, 0);
+  if (copied >= 0)
+  {
+    return copied;
+  }
+  if (errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL)
+  {
+    return log_error("copy_file_range");
+  }
+#endif
+
+  return -EOPNOTSUPP;
+}
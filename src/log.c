@@ -25,6 +25,9 @@
 
 #include "log.h"
 
+// for threads of our own, which have no fuse context to find it in
+static FILE *log_file;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -40,15 +43,21 @@ FILE *log_open()
     // set logfile to line buffering
     setvbuf(logfile, NULL, _IOLBF, 0);
 
+    log_file = logfile;
     return logfile;
 }
 
 void log_msg(const char *format, ...)
 {
     va_list ap;
+    struct fuse_context *context = fuse_get_context();
     va_start(ap, format);
 
-    vfprintf(KVFS_DATA->logfile, format, ap);
+    if (context != NULL && context->private_data != NULL)
+	vfprintf(((struct kvfs_state *) context->private_data)->logfile, format, ap);
+    else if (log_file != NULL)
+	vfprintf(log_file, format, ap);
+    va_end(ap);
 }
 
 // Report errors to logfile and give -errno to caller
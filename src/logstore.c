@@ -0,0 +1,1158 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Log-structured object store (-o backend=log).
+
+  Instead of one backing file per object, values and metadata are
+  appended as records to large segment files in rootdir/.kvfs_log.
+  An in-memory index maps each digest to the segment and offset of
+  its current value, so a read is one pread() on an already open
+  segment and a create or write is one append.
+
+  Overwritten and deleted values leave dead bytes behind.  A
+  background thread copies the live records out of segments that have
+  become mostly dead (-o gc_ratio=PCT) and removes them.  A delete is
+  copied forward too for as long as an older segment is left that
+  may still hold the value it deleted.
+
+  Values of at most -o inline_max bytes are also kept in their index
+  entry, so reading a tiny file never touches a segment at all.
+
+  The index is checkpointed to rootdir/.kvfs_log/index on unmount and
+  after every compaction pass, with inline values stored right after
+  their entry.  On mount the checkpoint is loaded and
+  only the records appended after it are replayed, so remounting does
+  not have to scan every segment.  A record that does not check out
+  cuts the head segment short, as a write torn by a crash; in any
+  other segment replay steps over it to the next good record.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "store.h"
+#include "sync.h"
+
+#define LOG_DIR		".kvfs_log"
+#define LOG_NAME_MAX	16	// room for "/seg.%08x" and "/index.tmp"
+#define LOG_MAGIC	0x4c46564b	// "KVFL"
+#define CKPT_MAGIC	0x4346564b	// "KVFC"
+#define CKPT_VERSION	2
+
+#define CKPT_INLINE	1	// ckpt_entry is followed by its value
+
+// how often the compactor looks for mostly-dead segments
+#define GC_INTERVAL	5
+
+enum {
+    REC_PUT = 1,		// metadata and a new value
+    REC_META,			// metadata only, value unchanged
+    REC_DEL,
+    REC_RENAME			// key moves to newkey
+};
+
+struct log_record {
+    uint32_t magic;
+    uint32_t type;
+    char key[32];
+    char newkey[32];
+    struct kvfs_disk_meta meta;
+    uint64_t datalen;		// bytes of value following the header
+    uint32_t sum;		// over header (with sum = 0) and value
+    uint32_t pad;
+};
+
+struct ckpt_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nentries;
+    uint32_t replay_seg;	// records from here on are not in the index
+    uint32_t pad;
+    uint64_t replay_off;
+};
+
+struct ckpt_entry {
+    char key[32];
+    struct kvfs_disk_meta meta;
+    uint32_t seg;
+    uint32_t flags;
+    uint64_t off;
+    uint64_t len;
+};
+
+struct log_entry {
+    struct hnode node;		// must be first
+    struct kvfs_meta meta;
+    uint32_t seg;
+    uint64_t off;		// of the value within the segment
+    uint64_t len;
+    char *data;			// copy of the value if len <= inline_max
+};
+
+struct segment {
+    int fd;			// -1 once compacted away
+    uint64_t size;
+    uint64_t synced;		// bytes known to be on disk
+    uint64_t live;		// bytes of records the index still points at
+};
+
+// short enough that every file name below it still fits in PATH_MAX
+static char log_dir[PATH_MAX - LOG_NAME_MAX];
+static uint64_t segment_size;
+static unsigned int gc_ratio;
+static uint64_t inline_max;
+
+// log_lock covers the index and everything about segments except the
+// segment array itself, which seg_lock guards so readers can pread()
+// without holding log_lock
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t seg_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct htable index_table;
+static struct segment *segs;
+static uint32_t nsegs;
+static uint32_t head;
+
+static pthread_t gc_thread;
+static pthread_cond_t gc_wakeup = PTHREAD_COND_INITIALIZER;
+static int gc_stop;
+
+static uint32_t record_sum(struct log_record *rec, const char *data)
+{
+    uint32_t saved = rec->sum, h;
+
+    rec->sum = 0;
+    h = kvfs_store_sum(KVFS_SUM_INIT, rec, sizeof(*rec));
+    if (data != NULL)
+	h = kvfs_store_sum(h, data, rec->datalen);
+    rec->sum = saved;
+    return h;
+}
+
+static void segment_name(char path[PATH_MAX], uint32_t seg)
+{
+    snprintf(path, PATH_MAX, "%s/seg.%08x", log_dir, seg);
+}
+
+// make room for segment number seg; caller holds log_lock
+static int grow_segments(uint32_t seg)
+{
+    struct segment *more;
+    uint32_t n = nsegs ? nsegs : 16, i;
+
+    if (seg < nsegs)
+	return 0;
+    while (n <= seg)
+	n *= 2;
+
+    pthread_rwlock_wrlock(&seg_lock);
+    more = realloc(segs, n * sizeof(*segs));
+    if (more == NULL) {
+	pthread_rwlock_unlock(&seg_lock);
+	return -ENOMEM;
+    }
+    for (i = nsegs; i < n; i++) {
+	more[i].fd = -1;
+	more[i].size = more[i].synced = more[i].live = 0;
+    }
+    segs = more;
+    nsegs = n;
+    pthread_rwlock_unlock(&seg_lock);
+
+    return 0;
+}
+
+// caller holds log_lock
+static int open_segment(uint32_t seg, int flags)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int fd, retstat;
+
+    retstat = grow_segments(seg);
+    if (retstat < 0)
+	return retstat;
+
+    segment_name(path, seg);
+    fd = open(path, O_RDWR | flags, 0600);
+    if (fd < 0)
+	return log_error("logstore open segment");
+    if (fstat(fd, &st) < 0) {
+	retstat = log_error("logstore fstat segment");
+	close(fd);
+	return retstat;
+    }
+
+    segs[seg].fd = fd;
+    segs[seg].size = segs[seg].synced = st.st_size;
+    segs[seg].live = 0;
+    return 0;
+}
+
+// drop an index entry's claim on its segment; caller holds log_lock
+static void release_entry(struct log_entry *entry)
+{
+    segs[entry->seg].live -= sizeof(struct log_record) + entry->len;
+}
+
+static void free_entry(struct hnode *node)
+{
+    free(((struct log_entry *) node)->data);
+    free(node);
+}
+
+// data, if not NULL, is the value itself and is kept inline when it
+// is small enough; caller holds log_lock
+static void index_put(const char *key, const struct kvfs_meta *meta,
+		      uint32_t seg, uint64_t off, uint64_t len, const char *data)
+{
+    struct log_entry *entry = (struct log_entry *) htable_lookup(&index_table, key);
+
+    if (entry != NULL) {
+	release_entry(entry);
+	free(entry->data);
+    } else {
+	entry = malloc(sizeof(*entry));
+	if (entry == NULL)
+	    return;
+	strcpy(entry->node.key, key);
+	htable_insert(&index_table, &entry->node);
+    }
+    entry->meta = *meta;
+    entry->seg = seg;
+    entry->off = off;
+    entry->len = len;
+    entry->data = NULL;
+    if (data != NULL && len <= inline_max) {
+	entry->data = malloc(len + 1);
+	if (entry->data != NULL)
+	    memcpy(entry->data, data, len);
+    }
+    segs[seg].live += sizeof(struct log_record) + len;
+}
+
+// caller holds log_lock
+static void index_remove(const char *key)
+{
+    struct log_entry *entry = (struct log_entry *) htable_remove(&index_table, key);
+
+    if (entry != NULL) {
+	release_entry(entry);
+	free_entry(&entry->node);
+    }
+}
+
+// caller holds log_lock
+static void index_rename(const char *key, const char *newkey)
+{
+    struct log_entry *entry = (struct log_entry *) htable_remove(&index_table, key);
+
+    if (entry == NULL)
+	return;
+    index_remove(newkey);
+    strcpy(entry->node.key, newkey);
+    htable_insert(&index_table, &entry->node);
+}
+
+// Append a record to the head segment, starting a new one once it is
+// full.  *segp/*offp get where the value landed.  Caller holds log_lock.
+static int append_record(struct log_record *rec, const char *data,
+			 uint32_t *segp, uint64_t *offp)
+{
+    struct iovec iov[2];
+    ssize_t len = sizeof(*rec) + rec->datalen, ret;
+    int retstat;
+
+    if (segs[head].size > 0 && segs[head].size + len > segment_size) {
+	retstat = open_segment(head + 1, O_CREAT | O_EXCL);
+	if (retstat < 0)
+	    return retstat;
+	head++;
+    }
+
+    rec->magic = LOG_MAGIC;
+    rec->sum = record_sum(rec, data);
+
+    iov[0].iov_base = rec;
+    iov[0].iov_len = sizeof(*rec);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = rec->datalen;
+
+    ret = pwritev(segs[head].fd, iov, rec->datalen ? 2 : 1, segs[head].size);
+    if (ret != len) {
+	if (ret >= 0)
+	    errno = EIO;
+	return log_error("logstore pwritev");
+    }
+
+    if (segp != NULL)
+	*segp = head;
+    if (offp != NULL)
+	*offp = segs[head].size + sizeof(*rec);
+    segs[head].size += len;
+    return 0;
+}
+
+// Read the record at off into *rec and its value into *data, grown
+// as needed: 1 if it checks out, 0 if not, -errno if it could not be
+// read at all.
+static int read_record(int fd, uint64_t size, uint64_t off, struct log_record *rec,
+		       char **data, size_t *datacap)
+{
+    ssize_t n;
+
+    if (off + sizeof(*rec) > size)
+	return 0;
+    n = pread(fd, rec, sizeof(*rec), off);
+    if (n < 0)
+	return log_error("logstore pread");
+    if (n != sizeof(*rec) || rec->magic != LOG_MAGIC ||
+	rec->datalen > size - off - sizeof(*rec))
+	return 0;
+
+    if (rec->datalen > *datacap) {
+	char *more = realloc(*data, rec->datalen);
+	if (more == NULL)
+	    return -ENOMEM;
+	*data = more;
+	*datacap = rec->datalen;
+    }
+    if (rec->datalen > 0) {
+	n = pread(fd, *data, rec->datalen, off + sizeof(*rec));
+	if (n < 0)
+	    return log_error("logstore pread");
+	if (n != (ssize_t) rec->datalen)
+	    return 0;
+    }
+    return record_sum(rec, *data) == rec->sum;
+}
+
+// The offset of the first record at or after off that checks out, or
+// size if there is none; for stepping over damage inside a segment.
+static off_t next_record(int fd, uint64_t size, uint64_t off, struct log_record *rec,
+			 char **data, size_t *datacap)
+{
+    char buf[16384];
+    uint32_t magic;
+    ssize_t n, i;
+    int ret;
+
+    while (off + sizeof(*rec) <= size) {
+	n = pread(fd, buf, sizeof(buf), off);
+	if (n < 0)
+	    return log_error("logstore pread");
+	if (n < (ssize_t) sizeof(magic))
+	    break;
+	for (i = 0; i + (ssize_t) sizeof(magic) <= n; i++) {
+	    memcpy(&magic, buf + i, sizeof(magic));
+	    if (magic != LOG_MAGIC)
+		continue;
+	    ret = read_record(fd, size, off + i, rec, data, datacap);
+	    if (ret != 0)
+		return ret < 0 ? ret : (off_t) (off + i);
+	}
+	// a magic cut in two by the end of buf is looked at again
+	off += i;
+    }
+    return size;
+}
+
+// Replay one segment from offset off.  A record that does not check
+// out in the head segment is a write torn by a crash, and the head is
+// cut off there.  In an older segment, which was complete before the
+// next one was started, it is damage: replay skips to the next record
+// that checks out rather than throw away the records after it.
+// Caller holds log_lock.
+static int replay_segment(uint32_t seg, uint64_t off)
+{
+    struct log_record rec;
+    char key[KVFS_KEY_LEN], newkey[KVFS_KEY_LEN];
+    struct kvfs_meta meta;
+    struct log_entry *entry;
+    char *data = NULL;
+    size_t datacap = 0;
+    int nrecs = 0, ret;
+    off_t next;
+
+    while (off < segs[seg].size) {
+	ret = read_record(segs[seg].fd, segs[seg].size, off, &rec, &data, &datacap);
+	if (ret < 0) {
+	    free(data);
+	    return ret;
+	}
+	if (ret == 0) {
+	    if (seg == head)
+		break;
+	    next = next_record(segs[seg].fd, segs[seg].size, off + 1, &rec, &data, &datacap);
+	    if (next < 0) {
+		free(data);
+		return next;
+	    }
+	    log_msg("    logstore: segment %u has %llu bad bytes at %llu, skipped\n",
+		    seg, (unsigned long long) (next - off), (unsigned long long) off);
+	    off = next;
+	    continue;
+	}
+
+	memcpy(key, rec.key, 32);
+	key[32] = '\0';
+	kvfs_meta_unpack(&rec.meta, &meta);
+
+	switch (rec.type) {
+	case REC_PUT:
+	    index_put(key, &meta, seg, off + sizeof(rec), rec.datalen, data);
+	    break;
+	case REC_META:
+	    entry = (struct log_entry *) htable_lookup(&index_table, key);
+	    if (entry != NULL) {
+		entry->meta = meta;
+		entry->meta.size = entry->len;
+	    }
+	    break;
+	case REC_DEL:
+	    index_remove(key);
+	    break;
+	case REC_RENAME:
+	    memcpy(newkey, rec.newkey, 32);
+	    newkey[32] = '\0';
+	    index_rename(key, newkey);
+	    break;
+	}
+	off += sizeof(rec) + rec.datalen;
+	nrecs++;
+    }
+    free(data);
+
+    if (off < segs[seg].size) {
+	log_msg("    logstore: segment %u has %llu bad bytes at %llu, truncating\n",
+		seg, (unsigned long long) (segs[seg].size - off), (unsigned long long) off);
+	if (ftruncate(segs[seg].fd, off) == 0)
+	    segs[seg].size = off;
+    }
+    log_msg("    logstore: replayed %d record(s) from segment %u\n", nrecs, seg);
+    return 0;
+}
+
+// Load the checkpoint, if any; returns where replay has to start.
+// Caller holds log_lock.
+static void load_checkpoint(uint32_t *replay_seg, uint64_t *replay_off)
+{
+    char path[PATH_MAX];
+    struct ckpt_header hdr;
+    struct ckpt_entry ce;
+    struct kvfs_meta meta;
+    char key[KVFS_KEY_LEN];
+    char *data = NULL;
+    uint32_t sum, stored;
+    uint64_t i;
+    FILE *f;
+
+    *replay_seg = 0;
+    *replay_off = 0;
+
+    snprintf(path, PATH_MAX, "%s/index", log_dir);
+    f = fopen(path, "r");
+    if (f == NULL)
+	return;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CKPT_MAGIC ||
+	hdr.version != CKPT_VERSION)
+	goto bad;
+
+    sum = kvfs_store_sum(KVFS_SUM_INIT, &hdr, sizeof(hdr));
+    for (i = 0; i < hdr.nentries; i++) {
+	if (fread(&ce, sizeof(ce), 1, f) != 1)
+	    goto bad;
+	sum = kvfs_store_sum(sum, &ce, sizeof(ce));
+	if (ce.seg >= nsegs || segs[ce.seg].fd < 0)
+	    goto bad;
+	if (ce.flags & CKPT_INLINE) {
+	    data = malloc(ce.len + 1);
+	    if (data == NULL || fread(data, 1, ce.len, f) != ce.len)
+		goto bad;
+	    sum = kvfs_store_sum(sum, data, ce.len);
+	}
+	memcpy(key, ce.key, 32);
+	key[32] = '\0';
+	kvfs_meta_unpack(&ce.meta, &meta);
+	index_put(key, &meta, ce.seg, ce.off, ce.len, data);
+	free(data);
+	data = NULL;
+    }
+    if (fread(&stored, sizeof(stored), 1, f) != 1 || stored != sum)
+	goto bad;
+
+    fclose(f);
+    *replay_seg = hdr.replay_seg;
+    *replay_off = hdr.replay_off;
+    log_msg("    logstore: checkpoint has %llu object(s)\n", (unsigned long long) hdr.nentries);
+    return;
+
+bad:
+    // start over from the segments themselves
+    log_msg("    logstore: ignoring damaged checkpoint %s\n", path);
+    free(data);
+    fclose(f);
+    htable_free(&index_table, free_entry);
+    htable_init(&index_table, 1024);
+    for (i = 0; i < nsegs; i++)
+	segs[i].live = 0;
+}
+
+struct ckpt_snapshot {
+    struct ckpt_entry *entries;
+    char **data;		// inline values, parallel to entries
+    uint64_t n;
+};
+
+static int snapshot_entry(struct hnode *node, void *arg)
+{
+    struct ckpt_snapshot *snap = arg;
+    struct log_entry *entry = (struct log_entry *) node;
+    struct ckpt_entry *ce = &snap->entries[snap->n];
+
+    memset(ce, 0, sizeof(*ce));
+    memcpy(ce->key, entry->node.key, 32);
+    kvfs_meta_pack(&entry->meta, &ce->meta);
+    ce->seg = entry->seg;
+    ce->off = entry->off;
+    ce->len = entry->len;
+
+    snap->data[snap->n] = NULL;
+    if (entry->data != NULL) {
+	snap->data[snap->n] = malloc(entry->len + 1);
+	if (snap->data[snap->n] != NULL) {
+	    memcpy(snap->data[snap->n], entry->data, entry->len);
+	    ce->flags |= CKPT_INLINE;
+	}
+    }
+    snap->n++;
+    return 0;
+}
+
+static void free_snapshot(struct ckpt_snapshot *snap)
+{
+    uint64_t i;
+
+    for (i = 0; i < snap->n; i++)
+	free(snap->data[i]);
+    free(snap->data);
+    free(snap->entries);
+}
+
+// Sync every segment appended to since it was last synced.  The
+// syncs themselves run without log_lock (they may wait for a group
+// commit); seg_lock keeps the descriptors from being closed meanwhile.
+static int sync_segments(int datasync)
+{
+    uint32_t i, n = 0, *which;
+    uint64_t *upto;
+    int retstat = 0, ret;
+
+    pthread_mutex_lock(&log_lock);
+    which = malloc(nsegs * (sizeof(*which) + sizeof(*upto)));
+    if (which == NULL) {
+	pthread_mutex_unlock(&log_lock);
+	return -ENOMEM;
+    }
+    upto = (uint64_t *) (which + nsegs);
+    for (i = 0; i < nsegs; i++) {
+	if (segs[i].fd >= 0 && segs[i].synced < segs[i].size) {
+	    which[n] = i;
+	    upto[n++] = segs[i].size;
+	}
+    }
+    pthread_rwlock_rdlock(&seg_lock);
+    pthread_mutex_unlock(&log_lock);
+
+    for (i = 0; i < n; i++) {
+	ret = kvfs_sync_commit(segs[which[i]].fd, datasync);
+	if (ret < 0) {
+	    retstat = ret;
+	    upto[i] = 0;
+	}
+    }
+    pthread_rwlock_unlock(&seg_lock);
+
+    pthread_mutex_lock(&log_lock);
+    for (i = 0; i < n; i++)
+	if (upto[i] > segs[which[i]].synced)
+	    segs[which[i]].synced = upto[i];
+    pthread_mutex_unlock(&log_lock);
+
+    free(which);
+    return retstat;
+}
+
+// Write the index out so the next mount can skip everything before
+// the current head.  The snapshot is taken under log_lock, the file
+// is written without it.
+static int write_checkpoint(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct ckpt_snapshot snap;
+    struct ckpt_header hdr;
+    uint32_t sum;
+    uint64_t i;
+    FILE *f;
+    int retstat = 0;
+
+    pthread_mutex_lock(&log_lock);
+    snap.n = 0;
+    snap.entries = malloc((index_table.count + 1) * sizeof(struct ckpt_entry));
+    snap.data = malloc((index_table.count + 1) * sizeof(char *));
+    if (snap.entries == NULL || snap.data == NULL) {
+	pthread_mutex_unlock(&log_lock);
+	free(snap.entries);
+	free(snap.data);
+	return -ENOMEM;
+    }
+    htable_foreach(&index_table, snapshot_entry, &snap);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CKPT_MAGIC;
+    hdr.version = CKPT_VERSION;
+    hdr.nentries = snap.n;
+    hdr.replay_seg = head;
+    hdr.replay_off = segs[head].size;
+    pthread_mutex_unlock(&log_lock);
+
+    // everything the checkpoint points at has to be on disk first
+    retstat = sync_segments(1);
+    if (retstat < 0) {
+	free_snapshot(&snap);
+	return retstat;
+    }
+
+    snprintf(path, PATH_MAX, "%s/index", log_dir);
+    snprintf(tmp, PATH_MAX, "%s/index.tmp", log_dir);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+	free_snapshot(&snap);
+	return log_error("logstore checkpoint fopen");
+    }
+
+    sum = kvfs_store_sum(KVFS_SUM_INIT, &hdr, sizeof(hdr));
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+	retstat = -EIO;
+    for (i = 0; retstat == 0 && i < snap.n; i++) {
+	struct ckpt_entry *ce = &snap.entries[i];
+
+	sum = kvfs_store_sum(sum, ce, sizeof(*ce));
+	if (fwrite(ce, sizeof(*ce), 1, f) != 1)
+	    retstat = -EIO;
+	if (ce->flags & CKPT_INLINE) {
+	    sum = kvfs_store_sum(sum, snap.data[i], ce->len);
+	    if (fwrite(snap.data[i], 1, ce->len, f) != ce->len)
+		retstat = -EIO;
+	}
+    }
+    if (retstat < 0 || fwrite(&sum, sizeof(sum), 1, f) != 1 ||
+	fflush(f) != 0 || fsync(fileno(f)) < 0)
+	retstat = log_error("logstore checkpoint write");
+    fclose(f);
+    free_snapshot(&snap);
+
+    if (retstat == 0 && rename(tmp, path) < 0)
+	retstat = log_error("logstore checkpoint rename");
+    return retstat;
+}
+
+struct gc_victims {
+    uint32_t seg;
+    char (*keys)[KVFS_KEY_LEN];
+    size_t n;
+};
+
+static int collect_victim(struct hnode *node, void *arg)
+{
+    struct gc_victims *v = arg;
+
+    if (((struct log_entry *) node)->seg == v->seg)
+	strcpy(v->keys[v->n++], node->key);
+    return 0;
+}
+
+// Append entry's current value and metadata to the head and point the
+// index there.  Caller holds log_lock.
+static int copy_entry(struct log_entry *entry)
+{
+    struct log_record rec;
+    uint32_t newseg;
+    uint64_t newoff;
+    char *data;
+    int retstat;
+
+    data = malloc(entry->len + 1);
+    if (data == NULL)
+	return -ENOMEM;
+    if (entry->data != NULL)
+	memcpy(data, entry->data, entry->len);
+    else if (pread(segs[entry->seg].fd, data, entry->len, entry->off) != (ssize_t) entry->len) {
+	free(data);
+	return log_error("logstore compact pread");
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = REC_PUT;
+    memcpy(rec.key, entry->node.key, 32);
+    kvfs_meta_pack(&entry->meta, &rec.meta);
+    rec.datalen = entry->len;
+    retstat = append_record(&rec, data, &newseg, &newoff);
+    if (retstat == 0)
+	index_put(entry->node.key, &entry->meta, newseg, newoff, entry->len, data);
+    free(data);
+    return retstat;
+}
+
+// The records in seg other than values that still say something on a
+// replay from scratch (a damaged checkpoint) are appended to the head
+// before seg goes:
+//
+// - a delete, while any older segment is left that may hold a value
+//   of the key; without it that value would come back.  A rename
+//   deletes its old key the same way.
+// - a rename or metadata change of a value that stays behind in an
+//   older segment, which is copied forward with its name and
+//   metadata as they are now.
+//
+// Caller holds neither lock; only the compactor closes segments, so
+// seg's fd stays good.
+static int keep_tombstones(uint32_t seg, size_t *kept)
+{
+    struct log_record rec, del;
+    struct log_entry *entry;
+    char key[KVFS_KEY_LEN], newkey[KVFS_KEY_LEN];
+    char *data = NULL;
+    size_t datacap = 0;
+    uint64_t off = 0, size;
+    uint32_t i;
+    int fd, older = 0, retstat = 0;
+    off_t next;
+
+    pthread_mutex_lock(&log_lock);
+    fd = segs[seg].fd;
+    size = segs[seg].size;
+    for (i = 0; i < seg; i++)
+	if (segs[i].fd >= 0)
+	    older = 1;
+    pthread_mutex_unlock(&log_lock);
+
+    while (retstat == 0 && off < size) {
+	retstat = read_record(fd, size, off, &rec, &data, &datacap);
+	if (retstat == 0) {
+	    // damage replay skips as well
+	    next = next_record(fd, size, off + 1, &rec, &data, &datacap);
+	    if (next < 0)
+		retstat = next;
+	    off = next;
+	    continue;
+	}
+	if (retstat < 0)
+	    break;
+	retstat = 0;
+	off += sizeof(rec) + rec.datalen;
+	if (rec.type == REC_PUT)
+	    continue;
+
+	memcpy(key, rec.key, 32);
+	key[32] = '\0';
+	memcpy(newkey, rec.newkey, 32);
+	newkey[32] = '\0';
+
+	pthread_mutex_lock(&log_lock);
+	if (older && rec.type != REC_META && htable_lookup(&index_table, key) == NULL) {
+	    memset(&del, 0, sizeof(del));
+	    del.type = REC_DEL;
+	    memcpy(del.key, rec.key, 32);
+	    retstat = append_record(&del, NULL, NULL, NULL);
+	    (*kept)++;
+	}
+	entry = (struct log_entry *) htable_lookup(&index_table,
+						   rec.type == REC_RENAME ? newkey : key);
+	if (retstat == 0 && rec.type != REC_DEL && entry != NULL && entry->seg < seg) {
+	    retstat = copy_entry(entry);
+	    (*kept)++;
+	}
+	pthread_mutex_unlock(&log_lock);
+    }
+    free(data);
+    return retstat;
+}
+
+// Copy the live records out of segment seg.  One object at a time so
+// foreground requests only ever wait for a single copy.  Fails if
+// anything that has to outlive seg could not be copied.
+static int compact_segment(uint32_t seg)
+{
+    struct gc_victims v;
+    struct log_entry *entry;
+    size_t i, moved = 0, kept = 0;
+    int retstat;
+
+    pthread_mutex_lock(&log_lock);
+    v.seg = seg;
+    v.n = 0;
+    v.keys = malloc((index_table.count + 1) * KVFS_KEY_LEN);
+    if (v.keys == NULL) {
+	pthread_mutex_unlock(&log_lock);
+	return -ENOMEM;
+    }
+    htable_foreach(&index_table, collect_victim, &v);
+    pthread_mutex_unlock(&log_lock);
+
+    for (i = 0; i < v.n; i++) {
+	pthread_mutex_lock(&log_lock);
+	entry = (struct log_entry *) htable_lookup(&index_table, v.keys[i]);
+	if (entry != NULL && entry->seg == seg && copy_entry(entry) == 0)
+	    moved++;
+	pthread_mutex_unlock(&log_lock);
+    }
+    free(v.keys);
+
+    retstat = keep_tombstones(seg, &kept);
+    log_msg("    logstore: compacted segment %u, moved %zu object(s), kept %zu record(s)\n",
+	    seg, moved, kept);
+    return retstat;
+}
+
+// drop a segment nothing points at any more
+static void remove_segment(uint32_t seg)
+{
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&log_lock);
+    if (segs[seg].live == 0 && seg != head) {
+	pthread_rwlock_wrlock(&seg_lock);
+	close(segs[seg].fd);
+	segs[seg].fd = -1;
+	segs[seg].size = 0;
+	pthread_rwlock_unlock(&seg_lock);
+	segment_name(path, seg);
+	unlink(path);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+static int gc_pass(void)
+{
+    uint32_t *victims, nvictims = 0, i, n;
+
+    pthread_mutex_lock(&log_lock);
+    victims = malloc(nsegs * sizeof(uint32_t));
+    if (victims == NULL) {
+	pthread_mutex_unlock(&log_lock);
+	return 0;
+    }
+    for (i = 0; i < nsegs; i++) {
+	if (i == head || segs[i].fd < 0 || segs[i].size == 0)
+	    continue;
+	if (segs[i].live * 100 < segs[i].size * gc_ratio)
+	    victims[nvictims++] = i;
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    for (i = n = 0; i < nvictims; i++)
+	if (compact_segment(victims[i]) == 0)
+	    victims[n++] = victims[i];
+    nvictims = n;
+
+    // The old copies may only go once a checkpoint no longer needs
+    // them for replay.
+    if (nvictims > 0 && write_checkpoint() == 0)
+	for (i = 0; i < nvictims; i++)
+	    remove_segment(victims[i]);
+
+    free(victims);
+    return nvictims;
+}
+
+static void *gc_main(void *arg)
+{
+    struct timespec deadline;
+
+    (void) arg;
+    pthread_mutex_lock(&log_lock);
+    while (!gc_stop) {
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += GC_INTERVAL;
+	pthread_cond_timedwait(&gc_wakeup, &log_lock, &deadline);
+	if (gc_stop)
+	    break;
+	pthread_mutex_unlock(&log_lock);
+	gc_pass();
+	pthread_mutex_lock(&log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+static int logstore_open(struct kvfs_state *state)
+{
+    DIR *dp;
+    struct dirent *de;
+    uint32_t seg, replay_seg, i;
+    uint64_t replay_off;
+    int found = 0, retstat;
+
+    segment_size = (uint64_t) (state->segment_size ? state->segment_size : 64) << 20;
+    gc_ratio = state->gc_ratio;
+    inline_max = state->inline_max;
+
+    if (snprintf(log_dir, sizeof(log_dir), "%s/%s", state->rootdir, LOG_DIR) >=
+	(int) sizeof(log_dir))
+	return -ENAMETOOLONG;
+    if (mkdir(log_dir, 0700) < 0 && errno != EEXIST)
+	return log_error("logstore mkdir");
+
+    if (htable_init(&index_table, 1024) < 0)
+	return -ENOMEM;
+
+    pthread_mutex_lock(&log_lock);
+    dp = opendir(log_dir);
+    if (dp == NULL) {
+	pthread_mutex_unlock(&log_lock);
+	return log_error("logstore opendir");
+    }
+    while ((de = readdir(dp)) != NULL) {
+	if (sscanf(de->d_name, "seg.%08x", &seg) != 1)
+	    continue;
+	retstat = open_segment(seg, 0);
+	if (retstat < 0) {
+	    closedir(dp);
+	    pthread_mutex_unlock(&log_lock);
+	    return retstat;
+	}
+	if (!found || seg > head)
+	    head = seg;
+	found = 1;
+    }
+    closedir(dp);
+
+    if (!found) {
+	head = 0;
+	retstat = open_segment(0, O_CREAT | O_EXCL);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&log_lock);
+	    return retstat;
+	}
+    }
+
+    load_checkpoint(&replay_seg, &replay_off);
+    for (i = replay_seg; i <= head; i++) {
+	if (segs[i].fd < 0)
+	    continue;
+	retstat = replay_segment(i, i == replay_seg ? replay_off : 0);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&log_lock);
+	    return retstat;
+	}
+    }
+
+    log_msg("    logstore: %zu object(s), head segment %u\n", index_table.count, head);
+    pthread_mutex_unlock(&log_lock);
+
+    gc_stop = 0;
+    if (gc_ratio > 0 && pthread_create(&gc_thread, NULL, gc_main, NULL) != 0)
+	gc_ratio = 0;
+    return 0;
+}
+
+static void logstore_close(void)
+{
+    uint32_t i;
+
+    if (gc_ratio > 0) {
+	pthread_mutex_lock(&log_lock);
+	gc_stop = 1;
+	pthread_cond_signal(&gc_wakeup);
+	pthread_mutex_unlock(&log_lock);
+	pthread_join(gc_thread, NULL);
+    }
+
+    write_checkpoint();
+
+    pthread_mutex_lock(&log_lock);
+    for (i = 0; i < nsegs; i++)
+	if (segs[i].fd >= 0)
+	    close(segs[i].fd);
+    free(segs);
+    segs = NULL;
+    nsegs = 0;
+    htable_free(&index_table, free_entry);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static int logstore_lookup(const char *key, struct kvfs_meta *meta)
+{
+    struct log_entry *entry;
+    int retstat = -ENOENT;
+
+    pthread_mutex_lock(&log_lock);
+    entry = (struct log_entry *) htable_lookup(&index_table, key);
+    if (entry != NULL) {
+	*meta = entry->meta;
+	retstat = 0;
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    return retstat;
+}
+
+static int logstore_read(const char *key, char *buf, size_t size, off_t offset)
+{
+    struct log_entry *entry;
+    uint32_t seg;
+    uint64_t off, len;
+    int retstat;
+
+    pthread_mutex_lock(&log_lock);
+    entry = (struct log_entry *) htable_lookup(&index_table, key);
+    if (entry == NULL) {
+	pthread_mutex_unlock(&log_lock);
+	return -ENOENT;
+    }
+    seg = entry->seg;
+    off = entry->off;
+    len = entry->len;
+
+    if (entry->data != NULL) {
+	// small values are answered straight from the index
+	if ((uint64_t) offset >= len) {
+	    retstat = 0;
+	} else {
+	    if (size > len - offset)
+		size = len - offset;
+	    memcpy(buf, entry->data + offset, size);
+	    retstat = size;
+	}
+	pthread_mutex_unlock(&log_lock);
+	return retstat;
+    }
+
+    // hold the segment open across the pread, but not the index
+    pthread_rwlock_rdlock(&seg_lock);
+    pthread_mutex_unlock(&log_lock);
+
+    if ((uint64_t) offset >= len) {
+	retstat = 0;
+    } else {
+	if (size > len - offset)
+	    size = len - offset;
+	retstat = log_syscall("pread", pread(segs[seg].fd, buf, size, off + offset), 0);
+    }
+    pthread_rwlock_unlock(&seg_lock);
+
+    return retstat;
+}
+
+static int logstore_put(const char *key, const struct kvfs_meta *meta, const char *data)
+{
+    struct log_entry *entry;
+    struct log_record rec;
+    uint32_t seg;
+    uint64_t off;
+    int retstat;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = data != NULL ? REC_PUT : REC_META;
+    memcpy(rec.key, key, 32);
+    kvfs_meta_pack(meta, &rec.meta);
+    rec.datalen = data != NULL ? meta->size : 0;
+
+    pthread_mutex_lock(&log_lock);
+    if (data == NULL) {
+	entry = (struct log_entry *) htable_lookup(&index_table, key);
+	if (entry == NULL) {
+	    pthread_mutex_unlock(&log_lock);
+	    return -ENOENT;
+	}
+	retstat = append_record(&rec, NULL, NULL, NULL);
+	if (retstat == 0) {
+	    // the value does not move, only what we say about it
+	    entry->meta = *meta;
+	    entry->meta.size = entry->len;
+	}
+    } else {
+	retstat = append_record(&rec, data, &seg, &off);
+	if (retstat == 0)
+	    index_put(key, meta, seg, off, meta->size, data);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    return retstat;
+}
+
+static int logstore_remove(const char *key)
+{
+    struct log_record rec;
+    int retstat;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = REC_DEL;
+    memcpy(rec.key, key, 32);
+
+    pthread_mutex_lock(&log_lock);
+    if (htable_lookup(&index_table, key) == NULL) {
+	retstat = -ENOENT;
+    } else {
+	retstat = append_record(&rec, NULL, NULL, NULL);
+	if (retstat == 0)
+	    index_remove(key);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    return retstat;
+}
+
+static int logstore_rename(const char *key, const char *newkey)
+{
+    struct log_record rec;
+    int retstat;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = REC_RENAME;
+    memcpy(rec.key, key, 32);
+    memcpy(rec.newkey, newkey, 32);
+
+    pthread_mutex_lock(&log_lock);
+    if (htable_lookup(&index_table, key) == NULL) {
+	retstat = -ENOENT;
+    } else {
+	retstat = append_record(&rec, NULL, NULL, NULL);
+	if (retstat == 0)
+	    index_rename(key, newkey);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    return retstat;
+}
+
+static int logstore_sync(int datasync)
+{
+    return sync_segments(datasync);
+}
+
+struct kvfs_store_ops kvfs_log_store = {
+    .name = "log",
+    .open = logstore_open,
+    .close = logstore_close,
+    .lookup = logstore_lookup,
+    .read = logstore_read,
+    .put = logstore_put,
+    .remove = logstore_remove,
+    .rename = logstore_rename,
+    .sync = logstore_sync
+};
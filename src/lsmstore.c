@@ -0,0 +1,1358 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  LSM-tree object store (-o backend=lsm).
+
+  Puts go to a write-ahead log and into an in-memory skiplist (the
+  memtable).  Once the memtable holds -o memtable_size MiB it is
+  frozen and a background thread writes it out as a sorted table
+  (SSTable) in level 0; the log that backed it is then dropped.
+
+  An SSTable holds the values back to back, followed by an index of
+  (key, metadata, offset, length) sorted by key and a bloom filter
+  over the keys.  Index and filter are loaded into memory when the
+  table is opened, so a lookup costs a filter probe and a binary
+  search per table and never reads the disk; reading a value is one
+  pread().
+
+  Tables are merged with leveled compaction: when level 0 has
+  L0_TABLES tables they are merged with the overlapping part of
+  level 1, and when level N grows past its budget (ten times that of
+  the level above) one of its tables is merged into level N+1.
+  Deletions are carried as tombstones until they reach the bottom.
+
+  The set of live tables is recorded in rootdir/.kvfs_lsm/MANIFEST,
+  which is rewritten (write to a temporary, then rename) after every
+  flush or compaction.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "store.h"
+#include "sync.h"
+
+#define LSM_DIR		".kvfs_lsm"
+#define LSM_NAME_MAX	24	// room for "/sst.%08llx" and "/MANIFEST.tmp"
+#define WAL_MAGIC	0x4c57564b	// "KVWL"
+#define SST_MAGIC	0x5453564b	// "KVST"
+
+#define MAX_LEVELS	7
+#define L0_TABLES	4		// compact level 0 at this many tables
+#define LEVEL_RATIO	10
+#define SKIP_HEIGHT	16
+#define BLOOM_BITS	10		// per key
+#define BLOOM_HASHES	7
+
+// one key as it goes into the log, or as it sits in a table index
+struct lsm_disk_entry {
+    char key[32];
+    uint32_t deleted;
+    uint32_t pad;
+    struct kvfs_disk_meta meta;
+    uint64_t off;		// table only: where the value starts
+    uint64_t len;		// bytes of value
+};
+
+// a log record is a batch of entries, applied all or not at all
+struct wal_header {
+    uint32_t magic;
+    uint32_t nentries;
+    uint64_t len;		// bytes following this header
+    uint32_t sum;
+    uint32_t pad;
+};
+
+struct sst_footer {
+    uint32_t magic;
+    uint32_t nhashes;
+    uint64_t count;
+    uint64_t index_off;
+    uint64_t bloom_off;
+    uint64_t bloom_bits;
+};
+
+struct skipnode {
+    char key[KVFS_KEY_LEN];
+    struct kvfs_meta meta;
+    int deleted;
+    char *data;
+    struct skipnode *next[];
+};
+
+struct memtable {
+    struct skipnode *head;
+    int height;
+    size_t bytes;
+    uint64_t wal_upto;		// logs below this seq are all in here
+};
+
+struct sstable {
+    uint64_t seq;
+    int level;
+    int fd;
+    int refs;
+    int obsolete;		// compacted away; delete at last unref
+    uint64_t count;
+    uint64_t size;
+    struct lsm_disk_entry *index;
+    uint64_t *bloom;
+    uint64_t bloom_bits;
+    uint32_t nhashes;
+};
+
+struct level {
+    struct sstable **tables;	// level 0 newest first, others by key
+    int n;
+    uint64_t bytes;
+};
+
+// short enough that every file name below it still fits in PATH_MAX
+static char lsm_dir[PATH_MAX - LSM_NAME_MAX];
+static size_t memtable_size;
+
+// lsm_lock covers the memtables, the levels and the log; SSTable
+// contents are immutable and are read under a reference instead
+static pthread_mutex_t lsm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bg_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t imm_flushed = PTHREAD_COND_INITIALIZER;
+static struct memtable *mem, *imm;
+static struct level levels[MAX_LEVELS];
+static uint64_t next_seq;
+static uint64_t wal_seq;	// log the memtable is appending to
+static uint64_t oldest_wal;	// oldest log still needed
+static int wal_fd = -1;
+static unsigned int rand_state = 1;
+
+static pthread_t bg_thread;
+static int bg_stop;
+
+/////////////////////////////////////////////////////////////////////
+// memtable
+
+static struct skipnode *new_node(const char *key, int height)
+{
+    struct skipnode *node = calloc(1, sizeof(*node) + height * sizeof(struct skipnode *));
+
+    if (node != NULL)
+	strcpy(node->key, key);
+    return node;
+}
+
+static struct memtable *memtable_new(void)
+{
+    struct memtable *m = calloc(1, sizeof(*m));
+
+    if (m == NULL)
+	return NULL;
+    m->head = new_node("", SKIP_HEIGHT);
+    if (m->head == NULL) {
+	free(m);
+	return NULL;
+    }
+    m->height = 1;
+    return m;
+}
+
+static void memtable_free(struct memtable *m)
+{
+    struct skipnode *node, *next;
+
+    if (m == NULL)
+	return;
+    for (node = m->head; node != NULL; node = next) {
+	next = node->next[0];
+	free(node->data);
+	free(node);
+    }
+    free(m);
+}
+
+static struct skipnode *memtable_find(struct memtable *m, const char *key)
+{
+    struct skipnode *x = m->head;
+    int i;
+
+    for (i = m->height - 1; i >= 0; i--)
+	while (x->next[i] != NULL && strcmp(x->next[i]->key, key) < 0)
+	    x = x->next[i];
+    x = x->next[0];
+    return (x != NULL && strcmp(x->key, key) == 0) ? x : NULL;
+}
+
+// insert or replace; takes ownership of data.  Caller holds lsm_lock.
+static int memtable_put(struct memtable *m, const char *key, const struct kvfs_meta *meta,
+			int deleted, char *data)
+{
+    struct skipnode *update[SKIP_HEIGHT], *x = m->head;
+    int i, height;
+
+    for (i = m->height - 1; i >= 0; i--) {
+	while (x->next[i] != NULL && strcmp(x->next[i]->key, key) < 0)
+	    x = x->next[i];
+	update[i] = x;
+    }
+    x = x->next[0];
+
+    if (x == NULL || strcmp(x->key, key) != 0) {
+	for (height = 1; height < SKIP_HEIGHT && (rand_r(&rand_state) & 3) == 0; height++)
+	    ;
+	x = new_node(key, height);
+	if (x == NULL)
+	    return -ENOMEM;
+	for (i = m->height; i < height; i++)
+	    update[i] = m->head;
+	if (height > m->height)
+	    m->height = height;
+	for (i = 0; i < height; i++) {
+	    x->next[i] = update[i]->next[i];
+	    update[i]->next[i] = x;
+	}
+	m->bytes += sizeof(*x) + height * sizeof(struct skipnode *);
+    } else {
+	m->bytes -= x->deleted ? 0 : x->meta.size;
+	free(x->data);
+    }
+
+    x->meta = *meta;
+    x->deleted = deleted;
+    x->data = data;
+    m->bytes += deleted ? 0 : meta->size;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// tables
+
+static void table_name(char path[PATH_MAX], const char *prefix, uint64_t seq)
+{
+    snprintf(path, PATH_MAX, "%s/%s.%08llx", lsm_dir, prefix, (unsigned long long) seq);
+}
+
+// the digest is already uniformly spread, so its two halves serve
+// as the two hashes of the usual double-hashing scheme
+static void bloom_hashes(const char *key, uint64_t *h1, uint64_t *h2)
+{
+    char half[17];
+
+    memcpy(half, key, 16);
+    half[16] = '\0';
+    *h1 = strtoull(half, NULL, 16);
+    memcpy(half, key + 16, 16);
+    *h2 = strtoull(half, NULL, 16) | 1;
+}
+
+static int bloom_may_contain(struct sstable *t, const char *key)
+{
+    uint64_t h1, h2, bit;
+    uint32_t i;
+
+    if (t->bloom_bits == 0)
+	return 1;
+    bloom_hashes(key, &h1, &h2);
+    for (i = 0; i < t->nhashes; i++) {
+	bit = (h1 + i * h2) % t->bloom_bits;
+	if (!(t->bloom[bit / 64] & (1ULL << (bit % 64))))
+	    return 0;
+    }
+    return 1;
+}
+
+static struct lsm_disk_entry *table_find(struct sstable *t, const char *key)
+{
+    uint64_t lo = 0, hi = t->count, mid;
+    int c;
+
+    if (!bloom_may_contain(t, key))
+	return NULL;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	c = memcmp(t->index[mid].key, key, 32);
+	if (c == 0)
+	    return &t->index[mid];
+	if (c < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return NULL;
+}
+
+static void table_unref(struct sstable *t)
+{
+    char path[PATH_MAX];
+
+    if (--t->refs > 0)
+	return;
+    close(t->fd);
+    if (t->obsolete) {
+	table_name(path, "sst", t->seq);
+	unlink(path);
+    }
+    free(t->index);
+    free(t->bloom);
+    free(t);
+}
+
+static struct sstable *table_open(uint64_t seq, int level)
+{
+    char path[PATH_MAX];
+    struct sst_footer footer;
+    struct sstable *t;
+    struct stat st;
+    size_t index_bytes, bloom_bytes;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+	return NULL;
+    t->seq = seq;
+    t->level = level;
+    t->refs = 1;
+
+    table_name(path, "sst", seq);
+    t->fd = open(path, O_RDONLY);
+    if (t->fd < 0 || fstat(t->fd, &st) < 0 || st.st_size < (off_t) sizeof(footer) ||
+	pread(t->fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) != sizeof(footer) ||
+	footer.magic != SST_MAGIC)
+	goto bad;
+
+    t->size = st.st_size;
+    t->count = footer.count;
+    t->bloom_bits = footer.bloom_bits;
+    t->nhashes = footer.nhashes;
+    index_bytes = footer.count * sizeof(struct lsm_disk_entry);
+    bloom_bytes = (footer.bloom_bits + 63) / 64 * sizeof(uint64_t);
+
+    t->index = malloc(index_bytes + 1);
+    t->bloom = malloc(bloom_bytes + sizeof(uint64_t));
+    if (t->index == NULL || t->bloom == NULL ||
+	pread(t->fd, t->index, index_bytes, footer.index_off) != (ssize_t) index_bytes ||
+	pread(t->fd, t->bloom, bloom_bytes, footer.bloom_off) != (ssize_t) bloom_bytes)
+	goto bad;
+    return t;
+
+bad:
+    log_msg("    lsm: cannot open table %s\n", path);
+    if (t->fd >= 0)
+	close(t->fd);
+    free(t->index);
+    free(t->bloom);
+    free(t);
+    return NULL;
+}
+
+// writes one output table of a flush or compaction
+struct table_builder {
+    uint64_t seq;
+    int fd;
+    uint64_t off;
+    struct lsm_disk_entry *index;
+    uint64_t count;
+    uint64_t capacity;
+};
+
+static int builder_start(struct table_builder *b, uint64_t seq)
+{
+    char path[PATH_MAX];
+
+    memset(b, 0, sizeof(*b));
+    b->seq = seq;
+    table_name(path, "sst", seq);
+    b->fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (b->fd < 0)
+	return log_error("lsm create table");
+    return 0;
+}
+
+static int builder_add(struct table_builder *b, const struct lsm_disk_entry *e, const char *data)
+{
+    struct lsm_disk_entry *more;
+
+    if (b->count == b->capacity) {
+	b->capacity = b->capacity ? b->capacity * 2 : 256;
+	more = realloc(b->index, b->capacity * sizeof(*more));
+	if (more == NULL)
+	    return -ENOMEM;
+	b->index = more;
+    }
+    if (e->len > 0 && pwrite(b->fd, data, e->len, b->off) != (ssize_t) e->len)
+	return log_error("lsm table pwrite");
+
+    b->index[b->count] = *e;
+    b->index[b->count].off = b->off;
+    b->count++;
+    b->off += e->len;
+    return 0;
+}
+
+static int builder_finish(struct table_builder *b)
+{
+    struct sst_footer footer;
+    uint64_t *bloom, h1, h2, bit, i;
+    size_t bloom_bytes;
+    uint32_t k;
+    int retstat = 0;
+
+    memset(&footer, 0, sizeof(footer));
+    footer.magic = SST_MAGIC;
+    footer.nhashes = BLOOM_HASHES;
+    footer.count = b->count;
+    footer.bloom_bits = b->count * BLOOM_BITS + 64;
+    bloom_bytes = (footer.bloom_bits + 63) / 64 * sizeof(uint64_t);
+
+    bloom = calloc(1, bloom_bytes);
+    if (bloom == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+    for (i = 0; i < b->count; i++) {
+	char key[KVFS_KEY_LEN];
+
+	memcpy(key, b->index[i].key, 32);
+	key[32] = '\0';
+	bloom_hashes(key, &h1, &h2);
+	for (k = 0; k < BLOOM_HASHES; k++) {
+	    bit = (h1 + k * h2) % footer.bloom_bits;
+	    bloom[bit / 64] |= 1ULL << (bit % 64);
+	}
+    }
+
+    footer.index_off = b->off;
+    footer.bloom_off = b->off + b->count * sizeof(struct lsm_disk_entry);
+    if (pwrite(b->fd, b->index, b->count * sizeof(struct lsm_disk_entry), footer.index_off) < 0 ||
+	pwrite(b->fd, bloom, bloom_bytes, footer.bloom_off) != (ssize_t) bloom_bytes ||
+	pwrite(b->fd, &footer, sizeof(footer), footer.bloom_off + bloom_bytes) != sizeof(footer) ||
+	fdatasync(b->fd) < 0)
+	retstat = log_error("lsm table finish");
+    free(bloom);
+
+out:
+    close(b->fd);
+    free(b->index);
+    return retstat;
+}
+
+static void builder_abort(struct table_builder *b)
+{
+    char path[PATH_MAX];
+
+    close(b->fd);
+    free(b->index);
+    table_name(path, "sst", b->seq);
+    unlink(path);
+}
+
+/////////////////////////////////////////////////////////////////////
+// manifest and log
+
+// caller holds lsm_lock
+static int write_manifest(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    FILE *f;
+    int l, i, retstat = 0;
+
+    snprintf(path, PATH_MAX, "%s/MANIFEST", lsm_dir);
+    snprintf(tmp, PATH_MAX, "%s/MANIFEST.tmp", lsm_dir);
+    f = fopen(tmp, "w");
+    if (f == NULL)
+	return log_error("lsm manifest fopen");
+
+    fprintf(f, "kvfs-lsm 1\n");
+    fprintf(f, "next %llu\n", (unsigned long long) next_seq);
+    fprintf(f, "wal %llu\n", (unsigned long long) oldest_wal);
+    for (l = 0; l < MAX_LEVELS; l++)
+	for (i = 0; i < levels[l].n; i++)
+	    fprintf(f, "sst %d %llu\n", l, (unsigned long long) levels[l].tables[i]->seq);
+
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+	retstat = log_error("lsm manifest write");
+    fclose(f);
+    if (retstat == 0 && rename(tmp, path) < 0)
+	retstat = log_error("lsm manifest rename");
+    return retstat;
+}
+
+static int level_cmp(const void *a, const void *b)
+{
+    const struct sstable *x = *(struct sstable * const *) a;
+    const struct sstable *y = *(struct sstable * const *) b;
+
+    if (x->level == 0)		// newest first
+	return x->seq < y->seq ? 1 : x->seq > y->seq ? -1 : 0;
+    return memcmp(x->index[0].key, y->index[0].key, 32);
+}
+
+// caller holds lsm_lock
+static int level_add(struct sstable *t)
+{
+    struct level *lv = &levels[t->level];
+    struct sstable **more;
+
+    more = realloc(lv->tables, (lv->n + 1) * sizeof(*more));
+    if (more == NULL)
+	return -ENOMEM;
+    lv->tables = more;
+    lv->tables[lv->n++] = t;
+    lv->bytes += t->size;
+    qsort(lv->tables, lv->n, sizeof(*lv->tables), level_cmp);
+    return 0;
+}
+
+// caller holds lsm_lock
+static void level_remove(struct sstable *t)
+{
+    struct level *lv = &levels[t->level];
+    int i;
+
+    for (i = 0; i < lv->n; i++) {
+	if (lv->tables[i] == t) {
+	    memmove(&lv->tables[i], &lv->tables[i + 1], (lv->n - i - 1) * sizeof(*lv->tables));
+	    lv->n--;
+	    lv->bytes -= t->size;
+	    return;
+	}
+    }
+}
+
+// caller holds lsm_lock
+static int open_wal(uint64_t seq)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    table_name(path, "wal", seq);
+    fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0600);
+    if (fd < 0)
+	return log_error("lsm open wal");
+    if (wal_fd >= 0)
+	close(wal_fd);
+    wal_fd = fd;
+    wal_seq = seq;
+    return 0;
+}
+
+// Append a batch of entries to the log in one write().  Caller holds
+// lsm_lock.
+static int wal_append(struct lsm_disk_entry *entries, const char **data, int n)
+{
+    struct iovec iov[1 + 2 * 4];
+    struct wal_header hdr;
+    ssize_t total;
+    int i, niov = 1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = WAL_MAGIC;
+    hdr.nentries = n;
+    hdr.sum = KVFS_SUM_INIT;
+    for (i = 0; i < n; i++) {
+	hdr.len += sizeof(entries[i]) + entries[i].len;
+	hdr.sum = kvfs_store_sum(hdr.sum, &entries[i], sizeof(entries[i]));
+	iov[niov].iov_base = &entries[i];
+	iov[niov++].iov_len = sizeof(entries[i]);
+	if (entries[i].len > 0) {
+	    hdr.sum = kvfs_store_sum(hdr.sum, data[i], entries[i].len);
+	    iov[niov].iov_base = (void *) data[i];
+	    iov[niov++].iov_len = entries[i].len;
+	}
+    }
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    total = sizeof(hdr) + hdr.len;
+
+    if (writev(wal_fd, iov, niov) != total)
+	return log_error("lsm wal writev");
+    return 0;
+}
+
+// caller holds lsm_lock
+static void replay_wal(uint64_t seq)
+{
+    char path[PATH_MAX], key[KVFS_KEY_LEN];
+    struct wal_header hdr;
+    struct lsm_disk_entry *e;
+    struct kvfs_meta meta;
+    char *batch, *p, *data;
+    uint32_t i;
+    int fd, nbatches = 0;
+
+    table_name(path, "wal", seq);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return;
+
+    while (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == WAL_MAGIC) {
+	batch = malloc(hdr.len + 1);
+	if (batch == NULL || read(fd, batch, hdr.len) != (ssize_t) hdr.len ||
+	    kvfs_store_sum(KVFS_SUM_INIT, batch, hdr.len) != hdr.sum) {
+	    // a torn batch at the tail never happened
+	    free(batch);
+	    break;
+	}
+	for (i = 0, p = batch; i < hdr.nentries; i++) {
+	    e = (struct lsm_disk_entry *) p;
+	    p += sizeof(*e);
+	    memcpy(key, e->key, 32);
+	    key[32] = '\0';
+	    kvfs_meta_unpack(&e->meta, &meta);
+	    data = NULL;
+	    if (!e->deleted) {
+		data = malloc(e->len + 1);
+		if (data != NULL)
+		    memcpy(data, p, e->len);
+	    }
+	    memtable_put(mem, key, &meta, e->deleted, data);
+	    p += e->len;
+	}
+	free(batch);
+	nbatches++;
+    }
+    close(fd);
+    log_msg("    lsm: replayed %d batch(es) from wal %llu\n", nbatches, (unsigned long long) seq);
+}
+
+/////////////////////////////////////////////////////////////////////
+// flush and compaction, run by the background thread
+
+// write the frozen memtable out as a level 0 table
+static int flush_imm(void)
+{
+    struct table_builder b;
+    struct lsm_disk_entry e;
+    struct skipnode *node;
+    struct sstable *t;
+    uint64_t seq, upto, from, s;
+    char path[PATH_MAX];
+    int retstat;
+
+    pthread_mutex_lock(&lsm_lock);
+    seq = next_seq++;
+    upto = imm->wal_upto;
+    pthread_mutex_unlock(&lsm_lock);
+
+    // imm is frozen, so it can be walked without the lock
+    retstat = builder_start(&b, seq);
+    if (retstat < 0)
+	return retstat;
+    for (node = imm->head->next[0]; node != NULL; node = node->next[0]) {
+	memset(&e, 0, sizeof(e));
+	memcpy(e.key, node->key, 32);
+	e.deleted = node->deleted;
+	kvfs_meta_pack(&node->meta, &e.meta);
+	e.len = node->deleted ? 0 : node->meta.size;
+	retstat = builder_add(&b, &e, node->data);
+	if (retstat < 0) {
+	    builder_abort(&b);
+	    return retstat;
+	}
+    }
+    retstat = builder_finish(&b);
+    if (retstat < 0)
+	return retstat;
+
+    t = table_open(seq, 0);
+    if (t == NULL)
+	return -EIO;
+
+    pthread_mutex_lock(&lsm_lock);
+    level_add(t);
+    from = oldest_wal;
+    oldest_wal = upto;
+    retstat = write_manifest();
+    memtable_free(imm);
+    imm = NULL;
+    pthread_cond_broadcast(&imm_flushed);
+    pthread_mutex_unlock(&lsm_lock);
+
+    // the logs that backed it are not needed any more
+    for (s = from; s < upto; s++) {
+	table_name(path, "wal", s);
+	unlink(path);
+    }
+    log_msg("    lsm: flushed memtable to table %llu\n", (unsigned long long) seq);
+    return retstat;
+}
+
+static uint64_t level_budget(int l)
+{
+    uint64_t budget = (uint64_t) memtable_size * LEVEL_RATIO;
+
+    while (--l > 0)
+	budget *= LEVEL_RATIO;
+    return budget;
+}
+
+// caller holds lsm_lock
+static int pick_compaction(void)
+{
+    int l;
+
+    if (levels[0].n >= L0_TABLES)
+	return 0;
+    for (l = 1; l < MAX_LEVELS - 1; l++)
+	if (levels[l].bytes > level_budget(l))
+	    return l;
+    return -1;
+}
+
+static int overlaps(struct sstable *t, const char *lo, const char *hi)
+{
+    return memcmp(t->index[t->count - 1].key, lo, 32) >= 0 &&
+	   memcmp(t->index[0].key, hi, 32) <= 0;
+}
+
+// Merge inputs (highest priority first: a key found in several keeps
+// the first one's version) into new tables in level out.
+static int merge_tables(struct sstable **inputs, int ninputs, int out,
+			struct sstable ***outputs, int *noutputs)
+{
+    uint64_t *pos, target = memtable_size * 2;
+    struct table_builder b;
+    struct lsm_disk_entry e;
+    struct sstable *t, **outs = NULL;
+    int i, best, l, nouts = 0, building = 0, bottom, retstat = 0;
+    char *data = NULL;
+    size_t datacap = 0;
+
+    pos = calloc(ninputs, sizeof(*pos));
+    if (pos == NULL)
+	return -ENOMEM;
+
+    // tombstones can go once nothing older can be underneath them
+    pthread_mutex_lock(&lsm_lock);
+    bottom = 1;
+    for (l = out + 1; l < MAX_LEVELS; l++)
+	if (levels[l].n > 0)
+	    bottom = 0;
+    pthread_mutex_unlock(&lsm_lock);
+
+    for (;;) {
+	best = -1;
+	for (i = 0; i < ninputs; i++) {
+	    if (pos[i] >= inputs[i]->count)
+		continue;
+	    if (best < 0 || memcmp(inputs[i]->index[pos[i]].key,
+				   inputs[best]->index[pos[best]].key, 32) < 0)
+		best = i;
+	}
+	if (best < 0)
+	    break;
+
+	e = inputs[best]->index[pos[best]];
+	for (i = 0; i < ninputs; i++)
+	    if (pos[i] < inputs[i]->count && memcmp(inputs[i]->index[pos[i]].key, e.key, 32) == 0)
+		pos[i]++;
+	if (e.deleted && bottom)
+	    continue;
+
+	if (e.len + 1 > datacap) {
+	    char *more = realloc(data, e.len + 1);
+	    if (more == NULL) {
+		retstat = -ENOMEM;
+		break;
+	    }
+	    data = more;
+	    datacap = e.len + 1;
+	}
+	if (e.len > 0 && pread(inputs[best]->fd, data, e.len, e.off) != (ssize_t) e.len) {
+	    retstat = log_error("lsm compaction pread");
+	    break;
+	}
+
+	if (!building) {
+	    pthread_mutex_lock(&lsm_lock);
+	    retstat = builder_start(&b, next_seq++);
+	    pthread_mutex_unlock(&lsm_lock);
+	    if (retstat < 0)
+		break;
+	    building = 1;
+	}
+	retstat = builder_add(&b, &e, data);
+	if (retstat < 0)
+	    break;
+
+	if (b.off >= target) {
+	    building = 0;
+	    retstat = builder_finish(&b);
+	    if (retstat < 0)
+		break;
+	    t = table_open(b.seq, out);
+	    if (t == NULL) {
+		retstat = -EIO;
+		break;
+	    }
+	    outs = realloc(outs, (nouts + 1) * sizeof(*outs));
+	    outs[nouts++] = t;
+	}
+    }
+
+    if (building && retstat == 0) {
+	retstat = builder_finish(&b);
+	t = retstat == 0 ? table_open(b.seq, out) : NULL;
+	if (t != NULL) {
+	    outs = realloc(outs, (nouts + 1) * sizeof(*outs));
+	    outs[nouts++] = t;
+	} else if (retstat == 0) {
+	    retstat = -EIO;
+	}
+    } else if (building) {
+	builder_abort(&b);
+    }
+
+    free(data);
+    free(pos);
+    if (retstat < 0) {
+	for (i = 0; i < nouts; i++) {
+	    outs[i]->obsolete = 1;
+	    table_unref(outs[i]);
+	}
+	free(outs);
+	return retstat;
+    }
+    *outputs = outs;
+    *noutputs = nouts;
+    return 0;
+}
+
+static int compact_level(int l)
+{
+    struct sstable **inputs, **outputs = NULL;
+    char lo[32], hi[32];
+    int ninputs = 0, noutputs = 0, i, n, retstat;
+    static int next_pick[MAX_LEVELS];
+
+    pthread_mutex_lock(&lsm_lock);
+    inputs = malloc((levels[l].n + levels[l + 1].n) * sizeof(*inputs));
+    if (inputs == NULL) {
+	pthread_mutex_unlock(&lsm_lock);
+	return -ENOMEM;
+    }
+
+    if (l == 0) {
+	// level 0 tables overlap each other, so they all go
+	for (i = 0; i < levels[0].n; i++)
+	    inputs[ninputs++] = levels[0].tables[i];
+    } else {
+	// round robin through the level so every key range gets its turn
+	i = next_pick[l]++ % levels[l].n;
+	inputs[ninputs++] = levels[l].tables[i];
+    }
+
+    memcpy(lo, inputs[0]->index[0].key, 32);
+    memcpy(hi, inputs[0]->index[inputs[0]->count - 1].key, 32);
+    for (i = 1; i < ninputs; i++) {
+	if (memcmp(inputs[i]->index[0].key, lo, 32) < 0)
+	    memcpy(lo, inputs[i]->index[0].key, 32);
+	if (memcmp(inputs[i]->index[inputs[i]->count - 1].key, hi, 32) > 0)
+	    memcpy(hi, inputs[i]->index[inputs[i]->count - 1].key, 32);
+    }
+    n = ninputs;
+    for (i = 0; i < levels[l + 1].n; i++)
+	if (overlaps(levels[l + 1].tables[i], lo, hi))
+	    inputs[ninputs++] = levels[l + 1].tables[i];
+    for (i = 0; i < ninputs; i++)
+	inputs[i]->refs++;
+    pthread_mutex_unlock(&lsm_lock);
+
+    retstat = merge_tables(inputs, ninputs, l + 1, &outputs, &noutputs);
+
+    pthread_mutex_lock(&lsm_lock);
+    if (retstat == 0) {
+	for (i = 0; i < ninputs; i++) {
+	    level_remove(inputs[i]);
+	    inputs[i]->obsolete = 1;
+	    inputs[i]->refs--;		// the level's reference
+	}
+	for (i = 0; i < noutputs; i++)
+	    level_add(outputs[i]);
+	retstat = write_manifest();
+	log_msg("    lsm: compacted %d+%d table(s) from level %d into %d\n",
+		n, ninputs - n, l, noutputs);
+    }
+    for (i = 0; i < ninputs; i++)
+	table_unref(inputs[i]);
+    pthread_mutex_unlock(&lsm_lock);
+
+    free(inputs);
+    free(outputs);
+    return retstat;
+}
+
+static void *bg_main(void *arg)
+{
+    int l;
+
+    (void) arg;
+    pthread_mutex_lock(&lsm_lock);
+    while (!bg_stop) {
+	if (imm != NULL) {
+	    pthread_mutex_unlock(&lsm_lock);
+	    flush_imm();
+	    pthread_mutex_lock(&lsm_lock);
+	    continue;
+	}
+	l = pick_compaction();
+	if (l >= 0) {
+	    pthread_mutex_unlock(&lsm_lock);
+	    if (compact_level(l) < 0)
+		sleep(1);		// do not spin on a failing disk
+	    pthread_mutex_lock(&lsm_lock);
+	    continue;
+	}
+	pthread_cond_wait(&bg_wakeup, &lsm_lock);
+    }
+    pthread_mutex_unlock(&lsm_lock);
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// the store interface
+
+// Freeze a full memtable and hand it to the background thread,
+// waiting if the previous one is still being written.  Caller holds
+// lsm_lock.
+static int maybe_switch_memtable(void)
+{
+    struct memtable *m;
+    int retstat;
+
+    if (mem->bytes < memtable_size)
+	return 0;
+    while (imm != NULL)
+	pthread_cond_wait(&imm_flushed, &lsm_lock);
+    if (mem->bytes < memtable_size)
+	return 0;
+
+    m = memtable_new();
+    if (m == NULL)
+	return -ENOMEM;
+    retstat = open_wal(next_seq++);
+    if (retstat < 0) {
+	memtable_free(m);
+	return retstat;
+    }
+    mem->wal_upto = wal_seq;
+    imm = mem;
+    mem = m;
+    pthread_cond_signal(&bg_wakeup);
+    return 0;
+}
+
+// Find the newest version of key.  On success *node is set for a
+// memtable hit, or *table (with a reference) and *entry for a table
+// hit.  Caller holds lsm_lock.
+static int find_key(const char *key, struct skipnode **node,
+		    struct sstable **table, struct lsm_disk_entry **entry)
+{
+    struct lsm_disk_entry *e;
+    struct sstable *t;
+    int l, i, lo, hi, mid;
+
+    *node = NULL;
+    *table = NULL;
+
+    if ((*node = memtable_find(mem, key)) != NULL ||
+	(imm != NULL && (*node = memtable_find(imm, key)) != NULL))
+	return (*node)->deleted ? -ENOENT : 0;
+
+    for (i = 0; i < levels[0].n; i++) {
+	t = levels[0].tables[i];
+	if ((e = table_find(t, key)) != NULL)
+	    goto found;
+    }
+    for (l = 1; l < MAX_LEVELS; l++) {
+	// tables below level 0 do not overlap: binary search the level
+	lo = 0;
+	hi = levels[l].n;
+	while (lo < hi) {
+	    mid = (lo + hi) / 2;
+	    t = levels[l].tables[mid];
+	    if (memcmp(t->index[t->count - 1].key, key, 32) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	if (lo < levels[l].n) {
+	    t = levels[l].tables[lo];
+	    if ((e = table_find(t, key)) != NULL)
+		goto found;
+	}
+    }
+    return -ENOENT;
+
+found:
+    if (e->deleted)
+	return -ENOENT;
+    t->refs++;
+    *table = t;
+    *entry = e;
+    return 0;
+}
+
+// a copy of the whole value, for read-modify-write operations
+static int get_value(const char *key, struct kvfs_meta *meta, char **datap)
+{
+    struct skipnode *node;
+    struct sstable *t;
+    struct lsm_disk_entry *e;
+    char *data;
+    int retstat;
+
+    pthread_mutex_lock(&lsm_lock);
+    retstat = find_key(key, &node, &t, &e);
+    if (retstat < 0) {
+	pthread_mutex_unlock(&lsm_lock);
+	return retstat;
+    }
+    if (node != NULL) {
+	*meta = node->meta;
+	data = malloc(meta->size + 1);
+	if (data != NULL)
+	    memcpy(data, node->data, meta->size);
+	pthread_mutex_unlock(&lsm_lock);
+    } else {
+	kvfs_meta_unpack(&e->meta, meta);
+	pthread_mutex_unlock(&lsm_lock);
+	data = malloc(e->len + 1);
+	if (data != NULL && e->len > 0 && pread(t->fd, data, e->len, e->off) != (ssize_t) e->len) {
+	    free(data);
+	    data = NULL;
+	    errno = EIO;
+	}
+	pthread_mutex_lock(&lsm_lock);
+	table_unref(t);
+	pthread_mutex_unlock(&lsm_lock);
+    }
+    if (data == NULL)
+	return -ENOMEM;
+    *datap = data;
+    return 0;
+}
+
+// log a batch and apply it to the memtable; the memtable takes
+// ownership of the data buffers
+static int apply_batch(struct lsm_disk_entry *entries, char **data, int n)
+{
+    struct kvfs_meta meta;
+    char key[KVFS_KEY_LEN];
+    int i, retstat;
+
+    pthread_mutex_lock(&lsm_lock);
+    retstat = maybe_switch_memtable();
+    if (retstat == 0)
+	retstat = wal_append(entries, (const char **) data, n);
+    if (retstat == 0) {
+	for (i = 0; i < n; i++) {
+	    memcpy(key, entries[i].key, 32);
+	    key[32] = '\0';
+	    kvfs_meta_unpack(&entries[i].meta, &meta);
+	    memtable_put(mem, key, &meta, entries[i].deleted, data[i]);
+	    data[i] = NULL;
+	}
+    }
+    pthread_mutex_unlock(&lsm_lock);
+
+    for (i = 0; i < n; i++)
+	free(data[i]);
+    return retstat;
+}
+
+static void make_entry(struct lsm_disk_entry *e, const char *key,
+		       const struct kvfs_meta *meta, int deleted)
+{
+    memset(e, 0, sizeof(*e));
+    memcpy(e->key, key, 32);
+    e->deleted = deleted;
+    if (meta != NULL)
+	kvfs_meta_pack(meta, &e->meta);
+    e->len = deleted ? 0 : meta->size;
+}
+
+static int lsmstore_open(struct kvfs_state *state)
+{
+    char path[PATH_MAX], line[128];
+    struct sstable *t;
+    unsigned long long a, b;
+    int level, l, retstat;
+    uint64_t newest_wal = 0, seq;
+    DIR *dp;
+    struct dirent *de;
+    FILE *f;
+
+    memtable_size = (size_t) (state->memtable_size ? state->memtable_size : 4) << 20;
+    if (snprintf(lsm_dir, sizeof(lsm_dir), "%s/%s", state->rootdir, LSM_DIR) >=
+	(int) sizeof(lsm_dir))
+	return -ENAMETOOLONG;
+    if (mkdir(lsm_dir, 0700) < 0 && errno != EEXIST)
+	return log_error("lsm mkdir");
+
+    pthread_mutex_lock(&lsm_lock);
+    next_seq = 1;
+    oldest_wal = 0;
+
+    snprintf(path, PATH_MAX, "%s/MANIFEST", lsm_dir);
+    f = fopen(path, "r");
+    if (f != NULL) {
+	while (fgets(line, sizeof(line), f) != NULL) {
+	    if (sscanf(line, "next %llu", &a) == 1) {
+		next_seq = a;
+	    } else if (sscanf(line, "wal %llu", &a) == 1) {
+		oldest_wal = a;
+	    } else if (sscanf(line, "sst %d %llu", &level, &b) == 2 &&
+		       level >= 0 && level < MAX_LEVELS) {
+		t = table_open(b, level);
+		if (t != NULL)
+		    level_add(t);
+	    }
+	}
+	fclose(f);
+    }
+
+    // logs newer than the last flush hold the memtable that was lost;
+    // tables missing from the manifest are leftovers of a crash
+    mem = memtable_new();
+    if (mem == NULL) {
+	pthread_mutex_unlock(&lsm_lock);
+	return -ENOMEM;
+    }
+    dp = opendir(lsm_dir);
+    while (dp != NULL && (de = readdir(dp)) != NULL) {
+	if (sscanf(de->d_name, "wal.%llx", &a) == 1 && a >= oldest_wal && a + 1 > newest_wal)
+	    newest_wal = a + 1;
+    }
+    if (dp != NULL)
+	closedir(dp);
+    for (seq = oldest_wal; seq < newest_wal; seq++)
+	replay_wal(seq);
+    if (newest_wal > next_seq)
+	next_seq = newest_wal;
+
+    dp = opendir(lsm_dir);
+    while (dp != NULL && (de = readdir(dp)) != NULL) {
+	int live = 0;
+
+	if (sscanf(de->d_name, "sst.%llx", &a) != 1)
+	    continue;
+	for (l = 0; l < MAX_LEVELS && !live; l++)
+	    for (level = 0; level < levels[l].n; level++)
+		if (levels[l].tables[level]->seq == a)
+		    live = 1;
+	if (!live) {
+	    table_name(path, "sst", a);
+	    unlink(path);
+	}
+    }
+    if (dp != NULL)
+	closedir(dp);
+
+    retstat = open_wal(next_seq++);
+    if (retstat == 0)
+	retstat = write_manifest();
+    for (l = 0; l < MAX_LEVELS; l++)
+	if (levels[l].n > 0)
+	    log_msg("    lsm: level %d has %d table(s), %llu bytes\n",
+		    l, levels[l].n, (unsigned long long) levels[l].bytes);
+    pthread_mutex_unlock(&lsm_lock);
+    if (retstat < 0)
+	return retstat;
+
+    bg_stop = 0;
+    if (pthread_create(&bg_thread, NULL, bg_main, NULL) != 0)
+	return -EAGAIN;
+    return 0;
+}
+
+static void lsmstore_close(void)
+{
+    int l, i;
+
+    pthread_mutex_lock(&lsm_lock);
+    bg_stop = 1;
+    pthread_cond_signal(&bg_wakeup);
+    pthread_mutex_unlock(&lsm_lock);
+    pthread_join(bg_thread, NULL);
+
+    // a frozen memtable that never made it to a table is still in its
+    // log, and so is the live one; both get replayed on the next mount
+    pthread_mutex_lock(&lsm_lock);
+    if (wal_fd >= 0) {
+	fdatasync(wal_fd);
+	close(wal_fd);
+	wal_fd = -1;
+    }
+    memtable_free(mem);
+    memtable_free(imm);
+    mem = imm = NULL;
+    for (l = 0; l < MAX_LEVELS; l++) {
+	for (i = 0; i < levels[l].n; i++)
+	    table_unref(levels[l].tables[i]);
+	free(levels[l].tables);
+	levels[l].tables = NULL;
+	levels[l].n = 0;
+	levels[l].bytes = 0;
+    }
+    pthread_mutex_unlock(&lsm_lock);
+}
+
+static int lsmstore_lookup(const char *key, struct kvfs_meta *meta)
+{
+    struct skipnode *node;
+    struct sstable *t;
+    struct lsm_disk_entry *e;
+    int retstat;
+
+    pthread_mutex_lock(&lsm_lock);
+    retstat = find_key(key, &node, &t, &e);
+    if (retstat == 0) {
+	if (node != NULL) {
+	    *meta = node->meta;
+	} else {
+	    kvfs_meta_unpack(&e->meta, meta);
+	    table_unref(t);
+	}
+    }
+    pthread_mutex_unlock(&lsm_lock);
+
+    return retstat;
+}
+
+static int lsmstore_read(const char *key, char *buf, size_t size, off_t offset)
+{
+    struct skipnode *node;
+    struct sstable *t;
+    struct lsm_disk_entry *e;
+    uint64_t len, off;
+    int retstat;
+
+    pthread_mutex_lock(&lsm_lock);
+    retstat = find_key(key, &node, &t, &e);
+    if (retstat < 0) {
+	pthread_mutex_unlock(&lsm_lock);
+	return retstat;
+    }
+
+    len = node != NULL ? (uint64_t) node->meta.size : e->len;
+    if ((uint64_t) offset >= len) {
+	size = 0;
+    } else if (size > len - offset) {
+	size = len - offset;
+    }
+
+    if (node != NULL) {
+	memcpy(buf, node->data + offset, size);
+	pthread_mutex_unlock(&lsm_lock);
+	return size;
+    }
+
+    off = e->off;
+    pthread_mutex_unlock(&lsm_lock);
+    retstat = size ? log_syscall("pread", pread(t->fd, buf, size, off + offset), 0) : 0;
+
+    pthread_mutex_lock(&lsm_lock);
+    table_unref(t);
+    pthread_mutex_unlock(&lsm_lock);
+
+    return retstat;
+}
+
+static int lsmstore_put(const char *key, const struct kvfs_meta *meta, const char *data)
+{
+    struct lsm_disk_entry e;
+    struct kvfs_meta old;
+    off_t size;
+    char *copy;
+    int retstat;
+
+    if (data == NULL) {
+	// tables are immutable: new metadata means a new version
+	retstat = get_value(key, &old, &copy);
+	if (retstat < 0)
+	    return retstat;
+	size = old.size;
+	old = *meta;
+	old.size = size;	// the value itself is unchanged
+    } else {
+	copy = malloc(meta->size + 1);
+	if (copy == NULL)
+	    return -ENOMEM;
+	memcpy(copy, data, meta->size);
+	old = *meta;
+    }
+
+    make_entry(&e, key, &old, 0);
+    return apply_batch(&e, &copy, 1);
+}
+
+static int lsmstore_remove(const char *key)
+{
+    struct lsm_disk_entry e;
+    struct kvfs_meta meta;
+    char *data = NULL;
+    int retstat;
+
+    retstat = lsmstore_lookup(key, &meta);
+    if (retstat < 0)
+	return retstat;
+
+    make_entry(&e, key, &meta, 1);
+    return apply_batch(&e, &data, 1);
+}
+
+static int lsmstore_rename(const char *key, const char *newkey)
+{
+    struct lsm_disk_entry e[2];
+    struct kvfs_meta meta;
+    char *data[2];
+    int retstat;
+
+    retstat = get_value(key, &meta, &data[0]);
+    if (retstat < 0)
+	return retstat;
+    data[1] = NULL;
+
+    // one batch, so a crash cannot leave both names or neither
+    make_entry(&e[0], newkey, &meta, 0);
+    make_entry(&e[1], key, &meta, 1);
+    return apply_batch(e, data, 2);
+}
+
+static int lsmstore_sync(int datasync)
+{
+    int fd;
+
+    pthread_mutex_lock(&lsm_lock);
+    fd = dup(wal_fd);
+    pthread_mutex_unlock(&lsm_lock);
+    if (fd < 0)
+	return log_error("lsm sync dup");
+
+    // the log is all that has to reach the disk
+    datasync = kvfs_sync_commit(fd, 1);
+    close(fd);
+    return datasync;
+}
+
+struct kvfs_store_ops kvfs_lsm_store = {
+    .name = "lsm",
+    .open = lsmstore_open,
+    .close = lsmstore_close,
+    .lookup = lsmstore_lookup,
+    .read = lsmstore_read,
+    .put = lsmstore_put,
+    .remove = lsmstore_remove,
+    .rename = lsmstore_rename,
+    .sync = lsmstore_sync
+};
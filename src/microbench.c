@@ -0,0 +1,724 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  kvfs-microbench: time the primitives every call goes through, one
+  at a time.  "make bench" builds and runs it.
+
+  Each benchmark is run with a growing iteration count until it takes
+  --benchmark_min_time, as Google Benchmark does, and the flags and
+  the JSON written by --benchmark_out follow Google Benchmark's too,
+  so its tools can read our results.  Names and field order are
+  fixed; bench_compare.py compares two such files.
+
+  The store benchmarks open each backend directly (not through a
+  mount) in a scratch directory with a populated key set, so a
+  lookup exercises the backend's index: the log store's hash table,
+  the LSM tree's memtable, bloom filters and SSTable indexes, and the
+  dedup store's file map.
+
+  usage: kvfs-microbench [flags] [scratchdir]
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <math.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "crc32c.h"
+#include "harness.h"
+#include "htable.h"
+#include "log.h"
+#include "roots.h"
+#include "store.h"
+
+#define STORE_KEYS 10000
+#define STORE_VALUE 4096
+#define HTABLE_KEYS 100000
+
+// what a benchmark function is handed
+struct bm {
+    long n;				// iterations to run
+    void *arg;				// the fixture's data, else the benchmark's arg
+    uint64_t bytes;			// processed, for bytes_per_second
+};
+
+// shared state a run of benchmarks needs, set up once
+struct fixture {
+    const char *name;
+    int  (*setup)(struct fixture *fx);
+    void (*teardown)(struct fixture *fx);
+    void *data;
+    int ready;
+};
+
+struct benchmark {
+    const char *name;
+    void (*fn)(struct bm *b);
+    struct fixture *fixture;		// may be NULL
+    long arg;
+};
+
+// one timed run, per iteration
+struct run {
+    long iterations;
+    double real_ns, cpu_ns;
+    double bytes_per_second;
+};
+
+static double min_time = 0.5;
+static int repetitions = 1;
+static char scratch[PATH_MAX / 2];
+
+static uint64_t clock_ns(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// keep the compiler from dropping a result
+static volatile uintptr_t sink;
+
+/////////////////////////////////////////////////////////////////////
+// str2md5 and paths
+
+static const char *sample_path(long len)
+{
+    static char path[PATH_MAX];
+    long i;
+
+    for (i = 0; i < len; i++)
+	path[i] = i % 12 == 0 ? '/' : 'a' + i % 26;
+    path[len] = '\0';
+    return path;
+}
+
+static void bm_str2md5(struct bm *b)
+{
+    const char *path = sample_path((long) b->arg);
+    size_t len = strlen(path);
+    char *md5;
+    long i;
+
+    for (i = 0; i < b->n; i++) {
+	md5 = str2md5(path, len);
+	sink = (uintptr_t) md5[0];
+	free(md5);
+    }
+    b->bytes = len * b->n;
+}
+
+// the checksum of one -o checksum block; arg is its size
+static void bm_crc32c(struct bm *b)
+{
+    size_t len = (long) b->arg;
+    char *buf = calloc(1, len);
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	sink += kvfs_crc32c(i, buf, len);
+    free(buf);
+    b->bytes = len * b->n;
+}
+
+static void bm_crc32c_table(struct bm *b)
+{
+    size_t len = (long) b->arg;
+    char *buf = calloc(1, len);
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	sink += kvfs_crc32c_sw(i, buf, len);
+    free(buf);
+    b->bytes = len * b->n;
+}
+
+static void bm_real_path(struct bm *b)
+{
+    const char *path = sample_path((long) b->arg);
+    char actual_path[PATH_MAX];
+    long i;
+
+    for (i = 0; i < b->n; i++) {
+	kvfs_bench_real_path(actual_path, path);
+	sink = (uintptr_t) actual_path[0];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// the debug log; written to /dev/null, so this is formatting cost
+
+static void bm_log_msg(struct bm *b)
+{
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	log_msg("\nkvfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+		"d41d8cd98f00b204e9800998ecf8427e", 0x1000, 4096, (long long) i * 4096, 0x2000);
+}
+
+static void bm_log_stat(struct bm *b)
+{
+    struct stat st;
+    long i;
+
+    stat(".", &st);
+    for (i = 0; i < b->n; i++)
+	log_stat(&st);
+}
+
+/////////////////////////////////////////////////////////////////////
+// htable
+
+struct htable_fixture {
+    struct htable ht;
+    struct hnode *nodes;		// HTABLE_KEYS in the table
+    struct hnode *absent;		// HTABLE_KEYS more that are not
+};
+
+static int htable_setup(struct fixture *fx)
+{
+    struct htable_fixture *hf = calloc(1, sizeof(*hf));
+    char name[32], *md5;
+    long i;
+
+    if (hf == NULL || htable_init(&hf->ht, 1024) < 0)
+	return -1;
+    hf->nodes = calloc(2 * HTABLE_KEYS, sizeof(struct hnode));
+    if (hf->nodes == NULL)
+	return -1;
+    hf->absent = hf->nodes + HTABLE_KEYS;
+    for (i = 0; i < 2 * HTABLE_KEYS; i++) {
+	snprintf(name, sizeof(name), "/file%ld", i);
+	md5 = str2md5(name, strlen(name));
+	strcpy(hf->nodes[i].key, md5);
+	free(md5);
+	if (i < HTABLE_KEYS)
+	    htable_insert(&hf->ht, &hf->nodes[i]);
+    }
+    fx->data = hf;
+    return 0;
+}
+
+static void htable_teardown(struct fixture *fx)
+{
+    struct htable_fixture *hf = fx->data;
+
+    htable_free(&hf->ht, NULL);
+    free(hf->nodes);
+    free(hf);
+}
+
+static struct fixture htable_fx = { "htable", htable_setup, htable_teardown, NULL, 0 };
+
+static void bm_htable_lookup_hit(struct bm *b)
+{
+    struct htable_fixture *hf = b->arg;
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	sink = (uintptr_t) htable_lookup(&hf->ht, hf->nodes[i % HTABLE_KEYS].key);
+}
+
+static void bm_htable_lookup_miss(struct bm *b)
+{
+    struct htable_fixture *hf = b->arg;
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	sink = (uintptr_t) htable_lookup(&hf->ht, hf->absent[i % HTABLE_KEYS].key);
+}
+
+static void bm_htable_insert_remove(struct bm *b)
+{
+    struct htable_fixture *hf = b->arg;
+    struct hnode *node;
+    long i;
+
+    for (i = 0; i < b->n; i++) {
+	node = &hf->absent[i % HTABLE_KEYS];
+	htable_insert(&hf->ht, node);
+	sink = (uintptr_t) htable_remove(&hf->ht, node->key);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// object store backends
+
+struct store_fixture {
+    struct kvfs_store_ops *ops;
+    char (*keys)[KVFS_KEY_LEN];		// STORE_KEYS present, then as many absent
+};
+
+static int store_setup(struct fixture *fx, struct kvfs_store_ops *ops, const char *dir)
+{
+    struct store_fixture *sf;
+    struct kvfs_meta meta;
+    char name[32], *md5, *value;
+    long i;
+
+    if (ops == NULL)
+	return -1;		// codec not compiled in
+    sf = calloc(1, sizeof(*sf));
+    value = malloc(STORE_VALUE);
+    if (sf == NULL || value == NULL)
+	return -1;
+    sf->ops = ops;
+    sf->keys = calloc(2 * STORE_KEYS, KVFS_KEY_LEN);
+    if (sf->keys == NULL)
+	return -1;
+
+    free(harness_state->rootdir);
+    harness_state->rootdir = malloc(PATH_MAX);
+    if (harness_state->rootdir == NULL)
+	return -1;
+    snprintf(harness_state->rootdir, PATH_MAX, "%s/%s", scratch, dir);
+    if (mkdir(harness_state->rootdir, 0700) < 0 || ops->open(harness_state) < 0)
+	return -1;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.mode = S_IFREG | 0644;
+    meta.uid = getuid();
+    meta.gid = getgid();
+    meta.size = STORE_VALUE;
+    meta.atime = meta.mtime = meta.ctime = time(NULL);
+    for (i = 0; i < 2 * STORE_KEYS; i++) {
+	snprintf(name, sizeof(name), "/file%ld", i);
+	md5 = str2md5(name, strlen(name));
+	strcpy(sf->keys[i], md5);
+	free(md5);
+	if (i >= STORE_KEYS)
+	    continue;
+	// distinct, text-like values, so dedup and compression see
+	// something realistic
+	memset(value, ' ', STORE_VALUE);
+	snprintf(value, STORE_VALUE, "value of %s, number %ld\n", name, i);
+	if (ops->put(sf->keys[i], &meta, value) < 0) {
+	    ops->close();
+	    return -1;
+	}
+    }
+    ops->sync(0);
+    free(value);
+    fx->data = sf;
+    return 0;
+}
+
+static void store_teardown(struct fixture *fx)
+{
+    struct store_fixture *sf = fx->data;
+
+    sf->ops->close();
+    free(sf->keys);
+    free(sf);
+}
+
+static int log_setup(struct fixture *fx)
+{
+    return store_setup(fx, &kvfs_log_store, "log");
+}
+
+static int lsm_setup(struct fixture *fx)
+{
+    return store_setup(fx, &kvfs_lsm_store, "lsm");
+}
+
+static int dedup_setup(struct fixture *fx)
+{
+    return store_setup(fx, &kvfs_dedup_store, "dedup");
+}
+
+static int log_lz4_setup(struct fixture *fx)
+{
+    return store_setup(fx, kvfs_compress_wrap(&kvfs_log_store, "lz4"), "log-lz4");
+}
+
+static int log_zstd_setup(struct fixture *fx)
+{
+    return store_setup(fx, kvfs_compress_wrap(&kvfs_log_store, "zstd"), "log-zstd");
+}
+
+static struct fixture log_fx = { "log", log_setup, store_teardown, NULL, 0 };
+static struct fixture lsm_fx = { "lsm", lsm_setup, store_teardown, NULL, 0 };
+static struct fixture dedup_fx = { "dedup", dedup_setup, store_teardown, NULL, 0 };
+static struct fixture log_lz4_fx = { "log+lz4", log_lz4_setup, store_teardown, NULL, 0 };
+static struct fixture log_zstd_fx = { "log+zstd", log_zstd_setup, store_teardown, NULL, 0 };
+
+static void bm_store_lookup_hit(struct bm *b)
+{
+    struct store_fixture *sf = b->arg;
+    struct kvfs_meta meta;
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	sink = sf->ops->lookup(sf->keys[i % STORE_KEYS], &meta);
+}
+
+static void bm_store_lookup_miss(struct bm *b)
+{
+    struct store_fixture *sf = b->arg;
+    struct kvfs_meta meta;
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	sink = sf->ops->lookup(sf->keys[STORE_KEYS + i % STORE_KEYS], &meta);
+}
+
+static void bm_store_read(struct bm *b)
+{
+    struct store_fixture *sf = b->arg;
+    char buf[STORE_VALUE];
+    long i;
+
+    for (i = 0; i < b->n; i++)
+	sink = sf->ops->read(sf->keys[i % STORE_KEYS], buf, sizeof(buf), 0);
+    b->bytes = (uint64_t) b->n * sizeof(buf);
+}
+
+/////////////////////////////////////////////////////////////////////
+// the list; order and names are what the JSON is compared by
+
+#define STORE_BENCHMARKS(prefix, fx)				\
+    { prefix "/lookup_hit", bm_store_lookup_hit, &fx, 0 },	\
+    { prefix "/lookup_miss", bm_store_lookup_miss, &fx, 0 },	\
+    { prefix "/read_4k", bm_store_read, &fx, 0 }
+
+static struct benchmark benchmarks[] = {
+    { "str2md5/16", bm_str2md5, NULL, 16 },
+    { "str2md5/64", bm_str2md5, NULL, 64 },
+    { "str2md5/256", bm_str2md5, NULL, 256 },
+    { "real_path_inside_root/16", bm_real_path, NULL, 16 },
+    { "real_path_inside_root/256", bm_real_path, NULL, 256 },
+    { "crc32c/4k", bm_crc32c, NULL, 4096 },
+    { "crc32c_table/4k", bm_crc32c_table, NULL, 4096 },
+    { "log_msg", bm_log_msg, NULL, 0 },
+    { "log_stat", bm_log_stat, NULL, 0 },
+    { "htable/lookup_hit", bm_htable_lookup_hit, &htable_fx, 0 },
+    { "htable/lookup_miss", bm_htable_lookup_miss, &htable_fx, 0 },
+    { "htable/insert_remove", bm_htable_insert_remove, &htable_fx, 0 },
+    STORE_BENCHMARKS("store/log", log_fx),
+    STORE_BENCHMARKS("store/lsm", lsm_fx),
+    STORE_BENCHMARKS("store/dedup", dedup_fx),
+    STORE_BENCHMARKS("store/log+lz4", log_lz4_fx),
+    STORE_BENCHMARKS("store/log+zstd", log_zstd_fx),
+    { NULL, NULL, NULL, 0 }
+};
+
+/////////////////////////////////////////////////////////////////////
+// runner
+
+static void run_once(struct benchmark *bench, long n, struct run *run)
+{
+    struct bm b;
+    uint64_t r0, c0;
+
+    b.n = n;
+    b.arg = bench->fixture != NULL ? bench->fixture->data : (void *) bench->arg;
+    b.bytes = 0;
+    r0 = clock_ns(CLOCK_MONOTONIC);
+    c0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    bench->fn(&b);
+    run->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - c0;
+    run->real_ns = clock_ns(CLOCK_MONOTONIC) - r0;
+    run->iterations = n;
+    run->bytes_per_second = b.bytes && run->real_ns > 0 ? b.bytes * 1e9 / run->real_ns : 0;
+}
+
+// grow the iteration count until a run takes min_time
+static void measure(struct benchmark *bench, struct run *run)
+{
+    double target = min_time * 1e9, grow;
+    long n = 1;
+
+    for (;;) {
+	run_once(bench, n, run);
+	if (run->real_ns >= target || n >= 1000000000L)
+	    break;
+	grow = run->real_ns > 0 ? 1.4 * target / run->real_ns : 10;
+	if (grow > 10)
+	    grow = 10;
+	if (grow < 2)
+	    grow = 2;
+	n = (long) (n * grow);
+    }
+    run->real_ns /= run->iterations;
+    run->cpu_ns /= run->iterations;
+}
+
+static FILE *json;
+static int json_first = 1;
+
+static void json_context(const char *exe)
+{
+    char host[256], date[64];
+    time_t now = time(NULL);
+
+    if (gethostname(host, sizeof(host)) < 0)
+	strcpy(host, "unknown");
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    fprintf(json, "{\n  \"context\": {\n");
+    fprintf(json, "    \"date\": \"%s\",\n", date);
+    fprintf(json, "    \"host_name\": \"%s\",\n", host);
+    fprintf(json, "    \"executable\": \"%s\",\n", exe);
+    fprintf(json, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(json, "    \"kvfs_version\": \"%s\",\n", PACKAGE_VERSION);
+    fprintf(json, "    \"min_time\": %g,\n", min_time);
+    fprintf(json, "    \"repetitions\": %d\n", repetitions);
+    fprintf(json, "  },\n  \"benchmarks\": [");
+}
+
+static void json_run(const char *name, const char *aggregate, int rep, struct run *run)
+{
+    fprintf(json, "%s\n    {\n", json_first ? "" : ",");
+    json_first = 0;
+    if (aggregate != NULL)
+	fprintf(json, "      \"name\": \"%s_%s\",\n", name, aggregate);
+    else
+	fprintf(json, "      \"name\": \"%s\",\n", name);
+    fprintf(json, "      \"run_name\": \"%s\",\n", name);
+    fprintf(json, "      \"run_type\": \"%s\",\n", aggregate != NULL ? "aggregate" : "iteration");
+    fprintf(json, "      \"repetitions\": %d,\n", repetitions);
+    if (aggregate != NULL)
+	fprintf(json, "      \"aggregate_name\": \"%s\",\n", aggregate);
+    else
+	fprintf(json, "      \"repetition_index\": %d,\n", rep);
+    fprintf(json, "      \"threads\": 1,\n");
+    fprintf(json, "      \"iterations\": %ld,\n", run->iterations);
+    fprintf(json, "      \"real_time\": %.4f,\n", run->real_ns);
+    fprintf(json, "      \"cpu_time\": %.4f,\n", run->cpu_ns);
+    if (run->bytes_per_second > 0)
+	fprintf(json, "      \"bytes_per_second\": %.4f,\n", run->bytes_per_second);
+    fprintf(json, "      \"time_unit\": \"ns\"\n    }");
+}
+
+static void console_run(const char *name, const char *aggregate, struct run *run)
+{
+    char full[128];
+
+    snprintf(full, sizeof(full), aggregate != NULL ? "%s_%s" : "%s", name, aggregate);
+    printf("%-36s %12.1f ns %12.1f ns %12ld", full, run->real_ns, run->cpu_ns, run->iterations);
+    if (run->bytes_per_second > 0)
+	printf("  %.1f MB/s", run->bytes_per_second / 1e6);
+    printf("\n");
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// mean, median and stddev over the repetitions, as Google Benchmark
+// reports them
+static void aggregates(const char *name, struct run *runs)
+{
+    struct run agg;
+    double real[repetitions], cpu[repetitions], bps = 0, mean_real = 0, mean_cpu = 0, var = 0;
+    long iterations = 0;
+    int i;
+
+    for (i = 0; i < repetitions; i++) {
+	real[i] = runs[i].real_ns;
+	cpu[i] = runs[i].cpu_ns;
+	mean_real += real[i] / repetitions;
+	mean_cpu += cpu[i] / repetitions;
+	bps += runs[i].bytes_per_second / repetitions;
+	iterations += runs[i].iterations;
+    }
+
+    agg.iterations = iterations / repetitions;
+    agg.real_ns = mean_real;
+    agg.cpu_ns = mean_cpu;
+    agg.bytes_per_second = bps;
+    if (json != NULL)
+	json_run(name, "mean", 0, &agg);
+    if (json != stdout)
+	console_run(name, "mean", &agg);
+
+    qsort(real, repetitions, sizeof(double), cmp_double);
+    qsort(cpu, repetitions, sizeof(double), cmp_double);
+    agg.real_ns = (real[(repetitions - 1) / 2] + real[repetitions / 2]) / 2;
+    agg.cpu_ns = (cpu[(repetitions - 1) / 2] + cpu[repetitions / 2]) / 2;
+    if (json != NULL)
+	json_run(name, "median", 0, &agg);
+    if (json != stdout)
+	console_run(name, "median", &agg);
+
+    for (i = 0; i < repetitions; i++)
+	var += (real[i] - mean_real) * (real[i] - mean_real);
+    agg.real_ns = sqrt(var / (repetitions - 1));
+    var = 0;
+    for (i = 0; i < repetitions; i++)
+	var += (cpu[i] - mean_cpu) * (cpu[i] - mean_cpu);
+    agg.cpu_ns = sqrt(var / (repetitions - 1));
+    agg.bytes_per_second = 0;
+    if (json != NULL)
+	json_run(name, "stddev", 0, &agg);
+    if (json != stdout)
+	console_run(name, "stddev", &agg);
+}
+
+/////////////////////////////////////////////////////////////////////
+// scratch space
+
+static int remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+static int make_scratch(const char *parent)
+{
+    snprintf(scratch, sizeof(scratch), "%s/kvfs-microbench.XXXXXX", parent);
+    if (mkdtemp(scratch) == NULL) {
+	fprintf(stderr, "kvfs-microbench: %s: %s\n", scratch, strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  kvfs-microbench [flags] [scratchDir]\n\n");
+    fprintf(stderr, "    --benchmark_filter=REGEX       run the benchmarks whose names match\n");
+    fprintf(stderr, "    --benchmark_min_time=SECONDS   time each benchmark for at least this long (default 0.5)\n");
+    fprintf(stderr, "    --benchmark_repetitions=N      run each N times and report mean/median/stddev\n");
+    fprintf(stderr, "    --benchmark_out=FILE           write JSON results to FILE\n");
+    fprintf(stderr, "    --benchmark_format=json        write JSON to stdout instead of a table\n");
+    fprintf(stderr, "    --benchmark_list_tests         list the benchmark names and exit\n");
+    fprintf(stderr, "\nThe store benchmarks work in a temporary directory under scratchDir\n");
+    fprintf(stderr, "(default $TMPDIR or /tmp), removed afterwards.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct benchmark *bench;
+    struct fixture *current = NULL;
+    struct run *runs;
+    const char *filter = NULL, *out = NULL, *parent = NULL;
+    regex_t re;
+    int i, rep, list = 0, to_stdout = 0;
+    FILE *devnull;
+
+    for (i = 1; i < argc; i++) {
+	const char *arg = argv[i];
+
+	if (strncmp(arg, "--benchmark_filter=", 19) == 0)
+	    filter = arg + 19;
+	else if (strncmp(arg, "--benchmark_min_time=", 21) == 0)
+	    min_time = atof(arg + 21);
+	else if (strncmp(arg, "--benchmark_repetitions=", 24) == 0)
+	    repetitions = atoi(arg + 24);
+	else if (strncmp(arg, "--benchmark_out=", 16) == 0)
+	    out = arg + 16;
+	else if (strcmp(arg, "--benchmark_format=json") == 0)
+	    to_stdout = 1;
+	else if (strcmp(arg, "--benchmark_format=console") == 0)
+	    to_stdout = 0;
+	else if (strcmp(arg, "--benchmark_list_tests") == 0 || strcmp(arg, "--benchmark_list_tests=true") == 0)
+	    list = 1;
+	else if (arg[0] != '-' && parent == NULL)
+	    parent = arg;
+	else
+	    usage();
+    }
+    if (repetitions < 1 || min_time <= 0)
+	usage();
+    if (filter != NULL && regcomp(&re, filter, REG_EXTENDED | REG_NOSUB) != 0) {
+	fprintf(stderr, "kvfs-microbench: bad filter %s\n", filter);
+	return EXIT_FAILURE;
+    }
+
+    if (list) {
+	for (bench = benchmarks; bench->name != NULL; bench++)
+	    if (filter == NULL || regexec(&re, bench->name, 0, NULL, 0) == 0)
+		printf("%s\n", bench->name);
+	return EXIT_SUCCESS;
+    }
+
+    if (parent == NULL)
+	parent = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    if (make_scratch(parent) < 0 || harness_setup("kvfs-microbench") < 0)
+	return EXIT_FAILURE;
+    harness_state->rootdir = strdup(scratch);
+    // the log benchmarks time formatting, not the disk
+    devnull = fopen("/dev/null", "w");
+    if (devnull == NULL) {
+	perror("kvfs-microbench: /dev/null");
+	return EXIT_FAILURE;
+    }
+    setvbuf(devnull, NULL, _IOLBF, 0);
+    harness_state->logfile = devnull;
+    harness_enter(0);
+    // real_path finds each key's root
+    if (kvfs_roots_init(harness_state) < 0) {
+	fprintf(stderr, "kvfs-microbench: %s: cannot set up the root\n", scratch);
+	return EXIT_FAILURE;
+    }
+
+    if (to_stdout)
+	json = stdout;
+    else if (out != NULL && (json = fopen(out, "w")) == NULL) {
+	perror(out);
+	return EXIT_FAILURE;
+    }
+    if (json != NULL)
+	json_context(argv[0]);
+    if (!to_stdout)
+	printf("%-36s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+
+    runs = calloc(repetitions, sizeof(*runs));
+    if (runs == NULL)
+	return EXIT_FAILURE;
+    for (bench = benchmarks; bench->name != NULL; bench++) {
+	if (filter != NULL && regexec(&re, bench->name, 0, NULL, 0) != 0)
+	    continue;
+	if (bench->fixture != current) {
+	    if (current != NULL && current->ready)
+		current->teardown(current);
+	    current = bench->fixture;
+	    if (current != NULL)
+		current->ready = current->setup(current) == 0;
+	}
+	if (current != NULL && !current->ready) {
+	    fprintf(stderr, "kvfs-microbench: %s: %s unavailable, skipped\n", bench->name, current->name);
+	    continue;
+	}
+	for (rep = 0; rep < repetitions; rep++) {
+	    measure(bench, &runs[rep]);
+	    if (json != NULL)
+		json_run(bench->name, NULL, rep, &runs[rep]);
+	    if (!to_stdout)
+		console_run(bench->name, NULL, &runs[rep]);
+	}
+	if (repetitions > 1)
+	    aggregates(bench->name, runs);
+    }
+    if (current != NULL && current->ready)
+	current->teardown(current);
+
+    if (json != NULL) {
+	fprintf(json, "\n  ]\n}\n");
+	if (json != stdout)
+	    fclose(json);
+    }
+    kvfs_roots_destroy(harness_state);
+    nftw(scratch, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1049 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Mirrored roots (-o mirror=1).
+
+  Every root is a full copy of the first, so losing a disk loses
+  nothing.  Writes, truncates and fallocates of an open file go to
+  every copy at once, on the roots' I/O threads (see roots.c), and a
+  read goes to whichever copy has the shortest queue.  Everything else
+  is done on the first root as always and then repeated on all the
+  mirrors at once; the first root's answer is the one returned.
+
+  Each mirror is in one of three states, kept in .kvfs_mirror on
+  every root along with a generation bumped by each mount:
+
+    synced	a full copy: takes reads and writes
+    behind	missing some changes: takes writes, not reads
+    out		not there, or failing: takes nothing
+
+  A mirror that answers differently from the first root, or that is
+  not given when mounting, falls behind.  The key of every object
+  changed while a mirror is out, or that it got wrong, is appended to
+  .kvfs_mirror_dirty.<id> on the first root.  Keys are digests and
+  the backing namespace is flat, so kvfs-resync repairs a mirror from
+  that list alone, without walking anything.  A mirror that is new,
+  or whose list was lost, is marked "full": it is repaired from a
+  listing of the first root, one directory.
+
+  The first root has to be a synced copy from the latest generation;
+  put another one first if it dies.  Object stores and checksums keep
+  files of their own on the first root, which are not mirrored, so
+  they are off.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#include "dirid.h"
+#include "htable.h"
+#include "log.h"
+#include "mirror.h"
+#include "roots.h"
+#include "stats.h"
+
+#define STATE_FILE	".kvfs_mirror"
+#define DIRTY_PREFIX	".kvfs_mirror_dirty."
+#define ID_LEN		17
+#define LOGGED_MAX	(1 << 20)	// keys remembered as logged, per mirror
+#define MAX_ROOTS	64		// on the stack; more are malloc'ed
+
+enum { M_SYNCED, M_BEHIND, M_OUT };
+static const char *state_names[] = { "synced", "behind", "out" };
+
+struct member {
+    char id[ID_LEN];
+    int root;				// -1 if not given this mount
+    int state;				// M_*, read without mirror_lock
+    int full;				// needs a full copy, not just its list
+    int log_fd;				// its list on the first root
+    struct htable logged;		// keys on the list, this mount
+    uint64_t reads, writes, listed;	// atomic
+};
+
+struct kvfs_mirror_file {
+    char key[KVFS_KEY_LEN];
+    int fds[];				// one per root; fds[0] is the handle's own
+};
+
+enum {
+    OP_OPEN, OP_FTRUNCATE, OP_FALLOCATE, OP_FSYNC,
+    OP_COPY, OP_REMOVE, OP_RENAME, OP_LINK, OP_CHMOD, OP_CHOWN, OP_UTIME,
+    OP_TRUNCATE, OP_SETXATTR, OP_REMOVEXATTR,
+};
+
+struct mirror_op {
+    int type;
+    const char *key, *newkey;
+    int flags;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    const struct utimbuf *ubuf;
+    off_t off, len;
+    const char *name, *value;
+    size_t size;
+};
+
+static int mirror_on;
+static int nroots;
+static struct member *members;		// the roots first, then those not given
+static int nmembers;
+static struct member **of_root;
+static unsigned long long generation;
+static unsigned int nout;		// members out, atomic
+static unsigned int next_pick;		// tie breaker for reads, atomic
+static char *top_key;			// "/"'s, which is the root itself
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+int kvfs_mirroring(void)
+{
+    return mirror_on;
+}
+
+static int get_state(int root)
+{
+    return __atomic_load_n(&of_root[root]->state, __ATOMIC_ACQUIRE);
+}
+
+static void root_path(char path[PATH_MAX], int root, const char *key)
+{
+    if (top_key != NULL && strcmp(key, top_key) == 0)
+	snprintf(path, PATH_MAX, "%s", kvfs_root_dir(root));
+    else
+	snprintf(path, PATH_MAX, "%s/%s", kvfs_root_dir(root), key);
+}
+
+static int is_key(const char *name)
+{
+    int i;
+
+    for (i = 0; i < KVFS_KEY_LEN - 1; i++)
+	if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+	    return 0;
+    return name[i] == '\0';
+}
+
+/////////////////////////////////////////////////////////////////////
+// the state files
+
+struct state_file {
+    unsigned long long generation;
+    int n;
+    char (*ids)[ID_LEN];
+    int *states;
+    int *full;
+};
+
+static void free_state(struct state_file *sf)
+{
+    free(sf->ids);
+    free(sf->states);
+    free(sf->full);
+}
+
+// root's .kvfs_mirror; -ENOENT if it has none
+static int read_state(int root, struct state_file *sf)
+{
+    char path[PATH_MAX], line[64], id[ID_LEN], name[16];
+    int cap = 0, s;
+    void *a, *b, *c;
+    FILE *f;
+
+    memset(sf, 0, sizeof(*sf));
+    root_path(path, root, STATE_FILE);
+    f = fopen(path, "r");
+    if (f == NULL)
+	return -errno;
+    while (fgets(line, sizeof(line), f) != NULL) {
+	if (sscanf(line, "generation %llu", &sf->generation) == 1)
+	    continue;
+	if (sscanf(line, "%16s %15s", id, name) != 2)
+	    continue;
+	if (sf->n == cap) {
+	    cap = cap ? 2 * cap : 8;
+	    a = realloc(sf->ids, cap * ID_LEN);
+	    if (a != NULL)
+		sf->ids = a;
+	    b = realloc(sf->states, cap * sizeof(int));
+	    if (b != NULL)
+		sf->states = b;
+	    c = realloc(sf->full, cap * sizeof(int));
+	    if (c != NULL)
+		sf->full = c;
+	    if (a == NULL || b == NULL || c == NULL) {
+		fclose(f);
+		free_state(sf);
+		return -ENOMEM;
+	    }
+	}
+	s = strcmp(name, "synced") == 0 ? M_SYNCED : M_BEHIND;
+	snprintf(sf->ids[sf->n], ID_LEN, "%s", id);
+	sf->states[sf->n] = s;
+	sf->full[sf->n] = strcmp(name, "full") == 0;
+	sf->n++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int write_state_to(int root)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct member *m;
+    FILE *f;
+    int i;
+
+    root_path(path, root, STATE_FILE);
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+	return -ENAMETOOLONG;
+    f = fopen(tmp, "w");
+    if (f == NULL)
+	return -errno;
+    fprintf(f, "generation %llu\n", generation);
+    for (i = 0; i < nmembers; i++) {
+	m = &members[i];
+	fprintf(f, "%s %s\n", m->id,
+		m->state == M_SYNCED ? "synced" : m->full ? "full" : "behind");
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+	fclose(f);
+	return -errno;
+    }
+    fclose(f);
+    return rename(tmp, path) < 0 ? -errno : 0;
+}
+
+// every root still taking writes gets the new state; with mirror_lock
+// held once mounted
+static int write_state(void)
+{
+    int r, retstat = 0;
+
+    for (r = 0; r < nroots; r++) {
+	if (r > 0 && of_root[r]->state == M_OUT)
+	    continue;
+	if (write_state_to(r) < 0 && r == 0)
+	    retstat = log_error("mirror state write");
+    }
+    return retstat;
+}
+
+// does root hold any objects at all?
+static int has_objects(int root)
+{
+    struct dirent *de;
+    DIR *dp;
+    int found = 0;
+
+    dp = opendir(kvfs_root_dir(root));
+    if (dp == NULL)
+	return 1;
+    while (!found && (de = readdir(dp)) != NULL)
+	found = is_key(de->d_name);
+    closedir(dp);
+    return found;
+}
+
+int kvfs_mirror_check(struct kvfs_state *state)
+{
+    struct state_file sf;
+    unsigned long long newest = 0;
+    int r, first = -1, i, retstat = 0;
+
+    if (!state->mirror || kvfs_roots_count() < 2)
+	return 0;
+    for (r = 0; r < kvfs_roots_count(); r++) {
+	if (read_state(r, &sf) < 0)
+	    continue;
+	if (first < 0 || sf.generation > newest) {
+	    first = r;
+	    newest = sf.generation;
+	}
+	free_state(&sf);
+    }
+    if (first < 0)
+	return 0;			// a new mirror
+
+    if (read_state(0, &sf) < 0 || sf.generation < newest) {
+	fprintf(stderr, "kvfs: %s has a newer mirror than %s; put it first\n",
+		kvfs_root_dir(first), kvfs_root_dir(0));
+	retstat = -1;
+    } else {
+	for (i = 0; i < sf.n && strcmp(sf.ids[i], kvfs_root_id(0)) != 0; i++)
+	    ;
+	if (i == sf.n || sf.states[i] != M_SYNCED) {
+	    fprintf(stderr, "kvfs: %s is not a synced mirror; put one that is first, then run kvfs-resync\n",
+		    kvfs_root_dir(0));
+	    retstat = -1;
+	}
+    }
+    free_state(&sf);
+    return retstat;
+}
+
+/////////////////////////////////////////////////////////////////////
+// falling behind
+
+// put key on m's list; with mirror_lock held
+static void list_key(struct member *m, const char *key)
+{
+    char path[PATH_MAX], line[KVFS_KEY_LEN + 1];
+    struct hnode *node;
+    int len;
+
+    if (m->full || htable_lookup(&m->logged, key) != NULL)
+	return;
+    if (m->log_fd < 0) {
+	snprintf(path, sizeof(path), "%s/%s%s", kvfs_root_dir(0), DIRTY_PREFIX, m->id);
+	m->log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (m->log_fd < 0) {
+	    // without the list only a full copy will do
+	    log_error("mirror list open");
+	    m->full = 1;
+	    write_state();
+	    return;
+	}
+    }
+    len = snprintf(line, sizeof(line), "%s\n", key);
+    if (write(m->log_fd, line, len) != len) {
+	log_error("mirror list write");
+	m->full = 1;
+	write_state();
+	return;
+    }
+    m->listed++;
+    if (m->logged.count >= LOGGED_MAX) {
+	// listing a key twice does no harm
+	htable_free(&m->logged, (void (*)(struct hnode *)) free);
+	htable_init(&m->logged, 1024);
+    }
+    node = malloc(sizeof(*node));
+    if (node != NULL) {
+	snprintf(node->key, KVFS_KEY_LEN, "%s", key);
+	htable_insert(&m->logged, node);
+    }
+}
+
+// key (and newkey) changed on the first root; the mirrors that are
+// out have to hear of it
+static void changed(const char *key, const char *newkey)
+{
+    int i;
+
+    if (__atomic_load_n(&nout, __ATOMIC_RELAXED) == 0)
+	return;
+    pthread_mutex_lock(&mirror_lock);
+    for (i = 0; i < nmembers; i++) {
+	if (members[i].state != M_OUT)
+	    continue;
+	list_key(&members[i], key);
+	if (newkey != NULL)
+	    list_key(&members[i], newkey);
+    }
+    pthread_mutex_unlock(&mirror_lock);
+}
+
+// errors that mean the disk, not the object, is in trouble
+static int fatal(int err)
+{
+    return err == EIO || err == ENOSPC || err == EROFS || err == EDQUOT ||
+	err == ENODEV || err == ENXIO || err == ESTALE || err == ENOTCONN;
+}
+
+// root got key (and newkey) wrong: it falls behind, or out if it
+// looks broken
+static void diverged(int root, const char *key, const char *newkey, int err)
+{
+    struct member *m = of_root[root];
+    int state;
+
+    pthread_mutex_lock(&mirror_lock);
+    list_key(m, key);
+    if (newkey != NULL)
+	list_key(m, newkey);
+    state = fatal(err) ? M_OUT : M_BEHIND;
+    if (state > m->state) {
+	log_msg("    mirror: %s is %s after %s on %s\n", kvfs_root_dir(root),
+		state_names[state], strerror(err), key);
+	if (state == M_OUT)
+	    __atomic_fetch_add(&nout, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->state, state, __ATOMIC_RELEASE);
+	write_state();
+    }
+    pthread_mutex_unlock(&mirror_lock);
+}
+
+/////////////////////////////////////////////////////////////////////
+// fanning out
+
+static ssize_t do_op(struct kvfs_rootio *io)
+{
+    const struct mirror_op *op = io->arg;
+    char path[PATH_MAX], newpath[PATH_MAX];
+    struct stat st;
+    int retstat = 0;
+
+    root_path(path, io->root, op->key);
+    if (op->newkey != NULL)
+	root_path(newpath, io->root, op->newkey);
+
+    switch (op->type) {
+    case OP_OPEN:
+	retstat = open(path, op->flags);
+	break;
+    case OP_FTRUNCATE:
+	retstat = ftruncate(io->fd, op->off);
+	break;
+#ifdef HAVE_FALLOCATE
+    case OP_FALLOCATE:
+	retstat = fallocate(io->fd, op->flags, op->off, op->len);
+	break;
+#endif
+    case OP_FSYNC:
+#ifdef HAVE_FDATASYNC
+	if (op->flags)
+	    retstat = fdatasync(io->fd);
+	else
+#endif
+	    retstat = fsync(io->fd);
+	break;
+    case OP_COPY:
+	root_path(newpath, 0, op->key);
+	return kvfs_roots_sync(newpath, path);
+    case OP_REMOVE:
+	retstat = kvfs_roots_remove(path);
+	return retstat == -ENOENT ? 0 : retstat;
+    case OP_RENAME:
+	// a directory being replaced is empty on the first root; here
+	// it still holds its id, and any entries a resync copied
+	if (lstat(newpath, &st) == 0 && S_ISDIR(st.st_mode))
+	    kvfs_roots_remove(newpath);
+	retstat = rename(path, newpath);
+	break;
+    case OP_LINK:
+	retstat = link(path, newpath);
+	break;
+    case OP_CHMOD:
+	retstat = chmod(path, op->mode);
+	break;
+    case OP_CHOWN:
+	retstat = chown(path, op->uid, op->gid);
+	break;
+    case OP_UTIME:
+	retstat = utime(path, op->ubuf);
+	break;
+    case OP_TRUNCATE:
+	retstat = truncate(path, op->off);
+	break;
+#ifdef HAVE_SYS_XATTR_H
+    case OP_SETXATTR:
+	retstat = lsetxattr(path, op->name, op->value, op->size, op->flags);
+	break;
+    case OP_REMOVEXATTR:
+	retstat = lremovexattr(path, op->name);
+	break;
+#endif
+    default:
+	return -ENOSYS;
+    }
+    return retstat < 0 ? -errno : retstat;
+}
+
+// run op on the mirrors in state worst or better, all at once; fds
+// (or NULL) are the open file's.  Returns how many ran, with their
+// results in io[0..n-1].
+static int fan_out(struct mirror_op *op, const int *fds, struct kvfs_rootio *io, int worst)
+{
+    int r, n = 0;
+
+    for (r = 1; r < nroots; r++) {
+	if (get_state(r) > worst || (fds != NULL && fds[r] < 0))
+	    continue;
+	memset(&io[n], 0, sizeof(io[n]));
+	io[n].root = r;
+	io[n].fd = fds != NULL ? fds[r] : -1;
+	io[n].call = do_op;
+	io[n].arg = op;
+	n++;
+    }
+    if (n > 0)
+	kvfs_rootio_run(io, n);
+    return n;
+}
+
+// repeat a path operation that succeeded on the first root
+static void replay(struct mirror_op *op)
+{
+    struct kvfs_rootio stack[MAX_ROOTS], *io = stack;
+    int i, n;
+
+    if (!mirror_on)
+	return;
+    changed(op->key, op->newkey);
+    if (nroots > MAX_ROOTS && (io = malloc(nroots * sizeof(*io))) == NULL) {
+	for (i = 1; i < nroots; i++)
+	    if (get_state(i) != M_OUT)
+		diverged(i, op->key, op->newkey, ENOMEM);
+	return;
+    }
+    n = fan_out(op, NULL, io, M_BEHIND);
+    for (i = 0; i < n; i++) {
+	COUNT(of_root[io[i].root]->writes, 1);
+	if (io[i].result < 0)
+	    diverged(io[i].root, op->key, op->newkey, -io[i].result);
+    }
+    if (io != stack)
+	free(io);
+}
+
+void kvfs_mirror_copy(const char *key)
+{
+    struct mirror_op op = { .type = OP_COPY, .key = key };
+
+    replay(&op);
+}
+
+void kvfs_mirror_remove(const char *key)
+{
+    struct mirror_op op = { .type = OP_REMOVE, .key = key };
+
+    replay(&op);
+}
+
+void kvfs_mirror_rename(const char *key, const char *newkey)
+{
+    struct mirror_op op = { .type = OP_RENAME, .key = key, .newkey = newkey };
+
+    replay(&op);
+}
+
+void kvfs_mirror_link(const char *key, const char *newkey)
+{
+    struct mirror_op op = { .type = OP_LINK, .key = key, .newkey = newkey };
+
+    replay(&op);
+}
+
+void kvfs_mirror_chmod(const char *key, mode_t mode)
+{
+    struct mirror_op op = { .type = OP_CHMOD, .key = key, .mode = mode };
+
+    replay(&op);
+}
+
+void kvfs_mirror_chown(const char *key, uid_t uid, gid_t gid)
+{
+    struct mirror_op op = { .type = OP_CHOWN, .key = key, .uid = uid, .gid = gid };
+
+    replay(&op);
+}
+
+void kvfs_mirror_utime(const char *key, const struct utimbuf *ubuf)
+{
+    struct mirror_op op = { .type = OP_UTIME, .key = key, .ubuf = ubuf };
+
+    replay(&op);
+}
+
+void kvfs_mirror_truncate(const char *key, off_t size)
+{
+    struct mirror_op op = { .type = OP_TRUNCATE, .key = key, .off = size };
+
+    replay(&op);
+}
+
+void kvfs_mirror_setxattr(const char *key, const char *name, const char *value, size_t size, int flags)
+{
+    struct mirror_op op = { .type = OP_SETXATTR, .key = key, .name = name,
+			    .value = value, .size = size, .flags = flags };
+
+    replay(&op);
+}
+
+void kvfs_mirror_removexattr(const char *key, const char *name)
+{
+    struct mirror_op op = { .type = OP_REMOVEXATTR, .key = key, .name = name };
+
+    replay(&op);
+}
+
+/////////////////////////////////////////////////////////////////////
+// open files
+
+int kvfs_mirror_open(const char *key, int fd, int flags, struct kvfs_mirror_file **mp)
+{
+    struct kvfs_mirror_file *m;
+    struct mirror_op op = { .type = OP_OPEN, .key = key };
+    struct kvfs_rootio stack[MAX_ROOTS], *io = stack;
+    int i, r, n, writing = (flags & O_ACCMODE) != O_RDONLY;
+
+    *mp = NULL;
+    if (!mirror_on)
+	return 0;
+    m = malloc(sizeof(*m) + nroots * sizeof(int));
+    if (m == NULL || (nroots > MAX_ROOTS && (io = malloc(nroots * sizeof(*io))) == NULL)) {
+	free(m);
+	return -ENOMEM;
+    }
+    snprintf(m->key, sizeof(m->key), "%s", key);
+    m->fds[0] = fd;
+    for (r = 1; r < nroots; r++)
+	m->fds[r] = -1;
+
+    // the first root made or truncated it already
+    op.flags = (flags & ~(O_CREAT | O_EXCL)) | O_NOFOLLOW;
+    if (flags & O_TRUNC)
+	changed(key, NULL);
+    // only synced mirrors are read from
+    n = fan_out(&op, NULL, io, writing ? M_BEHIND : M_SYNCED);
+    for (i = 0; i < n; i++) {
+	r = io[i].root;
+	if (io[i].result >= 0)
+	    m->fds[r] = io[i].result;
+	else
+	    diverged(r, key, NULL, -io[i].result);
+    }
+    if (io != stack)
+	free(io);
+    *mp = m;
+    return 0;
+}
+
+void kvfs_mirror_close(struct kvfs_mirror_file *mp)
+{
+    int r;
+
+    if (mp == NULL)
+	return;
+    for (r = 1; r < nroots; r++)
+	if (mp->fds[r] >= 0)
+	    close(mp->fds[r]);
+    free(mp);
+}
+
+int kvfs_mirror_read_fd(struct kvfs_mirror_file *mp, int *root)
+{
+    unsigned int i, depth, best_depth = ~0U;
+    int r, c, best = 0;
+
+    // start somewhere different each time, so ties are spread out
+    i = __atomic_fetch_add(&next_pick, 1, __ATOMIC_RELAXED);
+    for (r = 0; r < nroots; r++, i++) {
+	c = i % nroots;
+
+	if (mp->fds[c] < 0 || (c > 0 && get_state(c) != M_SYNCED))
+	    continue;
+	depth = kvfs_rootio_depth(c);
+	if (depth < best_depth) {
+	    best = c;
+	    best_depth = depth;
+	}
+    }
+    if (root != NULL)
+	*root = best;
+    return mp->fds[best];
+}
+
+ssize_t kvfs_mirror_pread(struct kvfs_mirror_file *mp, char *buf, size_t size, off_t offset)
+{
+    struct kvfs_rootio io;
+
+    memset(&io, 0, sizeof(io));
+    io.fd = kvfs_mirror_read_fd(mp, &io.root);
+    io.buf = buf;
+    io.len = size;
+    io.off = offset;
+    kvfs_rootio_run(&io, 1);
+    COUNT(of_root[io.root]->reads, 1);
+    if (io.result < 0 && io.root != 0) {
+	// the first root is always there to fall back on
+	diverged(io.root, mp->key, NULL, -io.result);
+	io.root = 0;
+	io.fd = mp->fds[0];
+	kvfs_rootio_run(&io, 1);
+    }
+    return io.result;
+}
+
+// every copy at once: io[0] is the first root's, the rest the
+// mirrors'.  Mirrors not agreeing with the first root fall behind.
+static ssize_t fan_out_file(struct kvfs_mirror_file *mp, struct kvfs_rootio *io, int n)
+{
+    int i;
+
+    changed(mp->key, NULL);
+    kvfs_rootio_run(io, n);
+    for (i = 1; i < n; i++) {
+	COUNT(of_root[io[i].root]->writes, 1);
+	if (io[i].result != io[0].result)
+	    diverged(io[i].root, mp->key, NULL, io[i].result < 0 ? -io[i].result : EIO);
+    }
+    return io[0].result;
+}
+
+// io[0..] for op on every copy of mp still taking writes
+static int file_ios(struct kvfs_mirror_file *mp, struct kvfs_rootio *io, const struct kvfs_rootio *proto)
+{
+    int r, n = 0;
+
+    for (r = 0; r < nroots; r++) {
+	if (mp->fds[r] < 0 || (r > 0 && get_state(r) == M_OUT))
+	    continue;
+	io[n] = *proto;
+	io[n].root = r;
+	io[n].fd = mp->fds[r];
+	n++;
+    }
+    return n;
+}
+
+static ssize_t file_op(struct kvfs_mirror_file *mp, const struct kvfs_rootio *proto)
+{
+    struct kvfs_rootio stack[MAX_ROOTS], *io = stack;
+    ssize_t retstat;
+
+    if (nroots > MAX_ROOTS && (io = malloc(nroots * sizeof(*io))) == NULL)
+	return -ENOMEM;
+    retstat = fan_out_file(mp, io, file_ios(mp, io, proto));
+    if (io != stack)
+	free(io);
+    return retstat;
+}
+
+ssize_t kvfs_mirror_pwrite(struct kvfs_mirror_file *mp, const char *buf, size_t size, off_t offset)
+{
+    struct kvfs_rootio proto;
+
+    memset(&proto, 0, sizeof(proto));
+    proto.buf = (char *) buf;
+    proto.len = size;
+    proto.off = offset;
+    proto.write = 1;
+    return file_op(mp, &proto);
+}
+
+int kvfs_mirror_ftruncate(struct kvfs_mirror_file *mp, off_t size)
+{
+    struct mirror_op op = { .type = OP_FTRUNCATE, .key = mp->key, .off = size };
+    struct kvfs_rootio proto;
+
+    memset(&proto, 0, sizeof(proto));
+    proto.call = do_op;
+    proto.arg = &op;
+    return file_op(mp, &proto);
+}
+
+#ifdef HAVE_FALLOCATE
+int kvfs_mirror_fallocate(struct kvfs_mirror_file *mp, int mode, off_t offset, off_t len)
+{
+    struct mirror_op op = { .type = OP_FALLOCATE, .key = mp->key, .flags = mode,
+			    .off = offset, .len = len };
+    struct kvfs_rootio proto;
+
+    memset(&proto, 0, sizeof(proto));
+    proto.call = do_op;
+    proto.arg = &op;
+    return file_op(mp, &proto);
+}
+#endif
+
+int kvfs_mirror_fsync(struct kvfs_mirror_file *mp, int datasync)
+{
+    struct mirror_op op = { .type = OP_FSYNC, .key = mp->key, .flags = datasync };
+    struct kvfs_rootio stack[MAX_ROOTS], *io = stack;
+    int i, n;
+
+    // the lists of what the mirrors out missed have to last as long
+    // as the change itself
+    if (__atomic_load_n(&nout, __ATOMIC_RELAXED) > 0) {
+	pthread_mutex_lock(&mirror_lock);
+	for (i = 0; i < nmembers; i++)
+	    if (members[i].log_fd >= 0)
+		fdatasync(members[i].log_fd);
+	pthread_mutex_unlock(&mirror_lock);
+    }
+    if (nroots > MAX_ROOTS && (io = malloc(nroots * sizeof(*io))) == NULL)
+	return -ENOMEM;
+    n = fan_out(&op, mp->fds, io, M_BEHIND);
+    for (i = 0; i < n; i++)
+	if (io[i].result < 0)
+	    diverged(io[i].root, mp->key, NULL, -io[i].result);
+    if (io != stack)
+	free(io);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// kvfs-resync
+
+// make root's copy of key the same as the first root's
+static int resync_key(int root, const char *key)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+
+    root_path(src, 0, key);
+    root_path(dst, root, key);
+    if (access(src, F_OK) < 0 && errno == ENOENT) {
+	int retstat = kvfs_roots_remove(dst);
+	return retstat == -ENOENT ? 0 : retstat;
+    }
+    return kvfs_roots_sync(src, dst);
+}
+
+// the keys on m's list, each once
+static int resync_listed(struct member *m, int *copied, int verbose)
+{
+    char path[PATH_MAX], line[64];
+    struct htable seen;
+    struct hnode *node;
+    FILE *f;
+    int retstat = 0;
+
+    snprintf(path, sizeof(path), "%s/%s%s", kvfs_root_dir(0), DIRTY_PREFIX, m->id);
+    f = fopen(path, "r");
+    if (f == NULL)
+	return errno == ENOENT ? 0 : -errno;
+    if (htable_init(&seen, 1024) < 0) {
+	fclose(f);
+	return -ENOMEM;
+    }
+    while (retstat == 0 && fgets(line, sizeof(line), f) != NULL) {
+	line[strcspn(line, "\n")] = '\0';
+	if (line[0] == '\0' || strlen(line) >= KVFS_KEY_LEN || htable_lookup(&seen, line) != NULL)
+	    continue;
+	node = malloc(sizeof(*node));
+	if (node == NULL) {
+	    retstat = -ENOMEM;
+	    break;
+	}
+	strcpy(node->key, line);
+	htable_insert(&seen, node);
+	retstat = resync_key(m->root, line);
+	if (retstat == 0)
+	    (*copied)++;
+	if (verbose)
+	    fprintf(stderr, "  %s %s\n", line, retstat == 0 ? "" : strerror(-retstat));
+    }
+    fclose(f);
+    htable_free(&seen, (void (*)(struct hnode *)) free);
+    return retstat;
+}
+
+// every object, from a listing of the first root; then whatever the
+// mirror has that the first root does not
+static int resync_full(struct member *m, int *copied, int verbose)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    struct stat sst, dst_st;
+    struct dirent *de;
+    DIR *dp;
+    int pass, retstat = 0;
+
+    for (pass = 0; pass < 2 && retstat == 0; pass++) {
+	dp = opendir(kvfs_root_dir(pass == 0 ? 0 : m->root));
+	if (dp == NULL)
+	    return -errno;
+	while (retstat == 0 && (de = readdir(dp)) != NULL) {
+	    if (!is_key(de->d_name) && strcmp(de->d_name, KVFS_DIRID_COUNTER) != 0)
+		continue;
+	    root_path(src, 0, de->d_name);
+	    root_path(dst, m->root, de->d_name);
+	    if (pass == 1) {
+		if (lstat(src, &sst) < 0 && errno == ENOENT)
+		    retstat = kvfs_roots_remove(dst);
+		continue;
+	    }
+	    // files already the same size and age are taken as copied
+	    if (lstat(src, &sst) == 0 && lstat(dst, &dst_st) == 0 && S_ISREG(sst.st_mode) &&
+		S_ISREG(dst_st.st_mode) && sst.st_size == dst_st.st_size &&
+		sst.st_mtime == dst_st.st_mtime && sst.st_mode == dst_st.st_mode)
+		continue;
+	    retstat = kvfs_roots_sync(src, dst);
+	    if (retstat == 0)
+		(*copied)++;
+	    if (verbose)
+		fprintf(stderr, "  %s %s\n", de->d_name, retstat == 0 ? "" : strerror(-retstat));
+	}
+	closedir(dp);
+    }
+    return retstat;
+}
+
+int kvfs_mirror_resync(int verbose)
+{
+    char path[PATH_MAX];
+    struct member *m;
+    int i, copied, retstat, repaired = 0;
+
+    if (!mirror_on)
+	return 0;
+    for (i = 0; i < nmembers; i++) {
+	m = &members[i];
+	if (m->root < 0) {
+	    fprintf(stderr, "mirror %s is not here; give it to kvfs-resync to repair it\n", m->id);
+	    continue;
+	}
+	if (m->state == M_SYNCED)
+	    continue;
+
+	copied = 0;
+	fprintf(stderr, "%s: %s repair\n", kvfs_root_dir(m->root), m->full ? "full" : "listed");
+	retstat = m->full ? resync_full(m, &copied, verbose) : resync_listed(m, &copied, verbose);
+	if (retstat < 0) {
+	    fprintf(stderr, "%s: %s, left behind\n", kvfs_root_dir(m->root), strerror(-retstat));
+	    continue;
+	}
+	fprintf(stderr, "%s: %d object(s) repaired, synced\n", kvfs_root_dir(m->root), copied);
+
+	pthread_mutex_lock(&mirror_lock);
+	if (m->log_fd >= 0)
+	    close(m->log_fd);
+	m->log_fd = -1;
+	snprintf(path, sizeof(path), "%s/%s%s", kvfs_root_dir(0), DIRTY_PREFIX, m->id);
+	unlink(path);
+	m->full = 0;
+	__atomic_store_n(&m->state, M_SYNCED, __ATOMIC_RELEASE);
+	write_state();
+	pthread_mutex_unlock(&mirror_lock);
+	repaired++;
+    }
+    return repaired;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+static void mirror_report(FILE *out)
+{
+    struct member *m;
+    int i;
+
+    pthread_mutex_lock(&mirror_lock);
+    for (i = 0; i < nmembers; i++) {
+	m = &members[i];
+	fprintf(out, "    %s: %s%s, %llu read(s), %llu write(s), %llu key(s) listed\n",
+		m->root >= 0 ? kvfs_root_dir(m->root) : m->id, state_names[m->state],
+		m->full ? " (full copy needed)" : "",
+		(unsigned long long) m->reads, (unsigned long long) m->writes,
+		(unsigned long long) m->listed);
+    }
+    pthread_mutex_unlock(&mirror_lock);
+}
+
+static struct member *add_member(const char *id, int root, int state, int full)
+{
+    struct member *m = &members[nmembers++];
+
+    memset(m, 0, sizeof(*m));
+    snprintf(m->id, ID_LEN, "%s", id);
+    m->root = root;
+    m->state = state;
+    m->full = full;
+    m->log_fd = -1;
+    if (htable_init(&m->logged, 1024) < 0)
+	return NULL;
+    if (root >= 0)
+	of_root[root] = m;
+    if (state == M_OUT)
+	nout++;
+    return m;
+}
+
+int kvfs_mirror_init(struct kvfs_state *state)
+{
+    struct state_file sf;
+    int r, i, found, fresh;
+
+    mirror_on = 0;
+    nroots = kvfs_roots_count();
+    if (!state->mirror || nroots < 2)
+	return 0;
+    if (kvfs_mirror_check(state) < 0) {
+	log_msg("    mirror: the first root is not the latest synced copy\n");
+	return -EINVAL;
+    }
+
+    fresh = read_state(0, &sf) < 0;
+    members = calloc(nroots + sf.n, sizeof(*members));
+    of_root = calloc(nroots, sizeof(*of_root));
+    if (members == NULL || of_root == NULL) {
+	free_state(&sf);
+	return -ENOMEM;
+    }
+    nmembers = 0;
+    nout = 0;
+    generation = sf.generation + 1;
+
+    // the roots given, as the last mount left them; new ones need
+    // everything, unless there is nothing yet
+    for (r = 0; r < nroots; r++) {
+	for (i = 0; i < sf.n && strcmp(sf.ids[i], kvfs_root_id(r)) != 0; i++)
+	    ;
+	if (r == 0)
+	    add_member(kvfs_root_id(r), r, M_SYNCED, 0);
+	else if (i < sf.n)
+	    add_member(kvfs_root_id(r), r, sf.states[i], sf.full[i]);
+	else if (fresh && !has_objects(0) && !has_objects(r))
+	    add_member(kvfs_root_id(r), r, M_SYNCED, 0);
+	else
+	    add_member(kvfs_root_id(r), r, M_BEHIND, 1);
+    }
+    // and those not given, which miss everything from now on
+    for (i = 0; i < sf.n; i++) {
+	for (r = 0, found = 0; r < nroots && !found; r++)
+	    found = strcmp(sf.ids[i], kvfs_root_id(r)) == 0;
+	if (!found)
+	    add_member(sf.ids[i], -1, M_OUT, sf.full[i]);
+    }
+    free_state(&sf);
+
+    top_key = str2md5("/", 1);
+    mirror_on = 1;
+    write_state();
+    for (i = 0; i < nmembers; i++)
+	log_msg("    mirror: %s %s%s\n", members[i].root >= 0 ? kvfs_root_dir(members[i].root) : members[i].id,
+		state_names[members[i].state], members[i].full ? ", needs a full copy" : "");
+    kvfs_stats_register("mirror", mirror_report);
+    return 0;
+}
+
+void kvfs_mirror_destroy(struct kvfs_state *state)
+{
+    int i;
+
+    (void) state;
+    if (!mirror_on)
+	return;
+    kvfs_stats_unregister("mirror");
+    mirror_on = 0;
+    for (i = 0; i < nmembers; i++) {
+	if (members[i].log_fd >= 0) {
+	    fdatasync(members[i].log_fd);
+	    close(members[i].log_fd);
+	}
+	htable_free(&members[i].logged, (void (*)(struct hnode *)) free);
+    }
+    free(members);
+    free(of_root);
+    free(top_key);
+    top_key = NULL;
+    members = NULL;
+    of_root = NULL;
+    nmembers = 0;
+}
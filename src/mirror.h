@@ -0,0 +1,60 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _MIRROR_H_
+#define _MIRROR_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+
+struct kvfs_state;
+struct kvfs_mirror_file;
+
+// Make sure the first root is a synced copy from the latest mount,
+// before anything is mounted; complaints go to stderr.
+int  kvfs_mirror_check(struct kvfs_state *state);
+int  kvfs_mirror_init(struct kvfs_state *state);
+void kvfs_mirror_destroy(struct kvfs_state *state);
+
+// whether every root keeps a copy of everything on this mount
+int  kvfs_mirroring(void);
+
+// Open the mirrors of the backing file at key, just opened as fd on
+// the first root with flags.  *mp is left NULL when not mirroring.
+int  kvfs_mirror_open(const char *key, int fd, int flags, struct kvfs_mirror_file **mp);
+void kvfs_mirror_close(struct kvfs_mirror_file *mp);
+
+// the copy with the shortest queue, for reads
+int  kvfs_mirror_read_fd(struct kvfs_mirror_file *mp, int *root);
+ssize_t kvfs_mirror_pread(struct kvfs_mirror_file *mp, char *buf, size_t size, off_t offset);
+
+// on every copy at once; the first root's result is returned
+ssize_t kvfs_mirror_pwrite(struct kvfs_mirror_file *mp, const char *buf, size_t size, off_t offset);
+int  kvfs_mirror_ftruncate(struct kvfs_mirror_file *mp, off_t size);
+#ifdef HAVE_FALLOCATE
+int  kvfs_mirror_fallocate(struct kvfs_mirror_file *mp, int mode, off_t offset, off_t len);
+#endif
+// the mirrors only; the caller syncs the first root's copy
+int  kvfs_mirror_fsync(struct kvfs_mirror_file *mp, int datasync);
+
+// Repeat on the mirrors what just succeeded on the first root.  A
+// mirror that fails is left out until kvfs-resync repairs it.
+void kvfs_mirror_copy(const char *key);		// made: mknod, mkdir, symlink
+void kvfs_mirror_remove(const char *key);
+void kvfs_mirror_rename(const char *key, const char *newkey);
+void kvfs_mirror_link(const char *key, const char *newkey);
+void kvfs_mirror_chmod(const char *key, mode_t mode);
+void kvfs_mirror_chown(const char *key, uid_t uid, gid_t gid);
+void kvfs_mirror_utime(const char *key, const struct utimbuf *ubuf);
+void kvfs_mirror_truncate(const char *key, off_t size);
+void kvfs_mirror_setxattr(const char *key, const char *name, const char *value, size_t size, int flags);
+void kvfs_mirror_removexattr(const char *key, const char *name);
+
+// bring every mirror that is behind up to date; for kvfs-resync
+int  kvfs_mirror_resync(int verbose);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Keeping the kernel's page cache across opens.
+
+  Unless an open sets keep_cache the kernel drops every page it holds
+  of the file, so reading an unchanged file again goes all the way to
+  kvfs and the backing file.  Here each object gets a generation: the
+  inode, size, mtime and ctime of its backing file (or of its store
+  entry), and a count of the writes, truncates and fallocates made
+  through kvfs, which changes even when the timestamps are too coarse
+  to.  An open whose object's generation has not moved since its
+  previous open keeps the cache; one whose generation has, or which
+  is the first seen, lets the kernel drop it.  While a file is open,
+  FUSE_CAP_AUTO_INVAL_DATA has the kernel drop its pages whenever a
+  getattr shows the mtime or size moved.
+
+  Writes through the page cache keep it right anyway; the count is
+  for direct_io writes (see directio.c) and races with timestamps.
+  Objects changed below kvfs are caught by the timestamps, to their
+  resolution.  Up to -o keep_cache objects are remembered; when that
+  many are, the ones not open are forgotten, and open with a cold
+  cache next time.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "htable.h"
+#include "log.h"
+#include "pagecache.h"
+#include "stats.h"
+#include "store.h"
+
+struct kvfs_pagecache_object {
+    struct hnode node;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime, ctime;
+    uint64_t writes;			// made through kvfs, ever
+    uint64_t seen;			// writes as of the latest open
+    unsigned int users;			// open handles
+};
+
+static pthread_mutex_t pc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable objects;
+static struct kvfs_slab object_slab;
+static size_t max_objects;
+static int pc_on;
+
+static uint64_t kept, dropped, first, forgotten;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// with pc_lock held
+static int forget_unused(struct hnode *node, void *arg)
+{
+    struct kvfs_pagecache_object *o = (struct kvfs_pagecache_object *) node;
+
+    (void) arg;
+    if (o->users == 0) {
+	htable_remove(&objects, node->key);
+	kvfs_slab_free(&object_slab, o);
+	forgotten++;
+    }
+    return 0;
+}
+
+int kvfs_pagecache_open(const char *key, int fd, struct kvfs_object *obj,
+			struct kvfs_pagecache_object **pcp)
+{
+    struct kvfs_pagecache_object *o;
+    struct stat st;
+    int keep;
+
+    *pcp = NULL;
+    if (!pc_on)
+	return 0;
+    if ((obj != NULL ? kvfs_store_fgetattr(obj, &st) : fstat(fd, &st)) < 0)
+	return 0;
+
+    pthread_mutex_lock(&pc_lock);
+    o = (struct kvfs_pagecache_object *) htable_lookup(&objects, key);
+    if (o == NULL) {
+	if (objects.count >= max_objects)
+	    htable_foreach(&objects, forget_unused, NULL);
+	o = kvfs_slab_zalloc(&object_slab);
+	if (o == NULL) {
+	    pthread_mutex_unlock(&pc_lock);
+	    return 0;
+	}
+	strcpy(o->node.key, key);
+	htable_insert(&objects, &o->node);
+	keep = 0;
+	first++;
+    } else {
+	keep = o->dev == st.st_dev && o->ino == st.st_ino && o->size == st.st_size &&
+	    same_time(&o->mtime, &st.st_mtim) && same_time(&o->ctime, &st.st_ctim) &&
+	    __atomic_load_n(&o->writes, __ATOMIC_RELAXED) == o->seen;
+	if (keep)
+	    kept++;
+	else
+	    dropped++;
+    }
+    o->dev = st.st_dev;
+    o->ino = st.st_ino;
+    o->size = st.st_size;
+    o->mtime = st.st_mtim;
+    o->ctime = st.st_ctim;
+    o->seen = __atomic_load_n(&o->writes, __ATOMIC_RELAXED);
+    o->users++;
+    pthread_mutex_unlock(&pc_lock);
+
+    *pcp = o;
+    return keep;
+}
+
+void kvfs_pagecache_wrote(struct kvfs_pagecache_object *pc)
+{
+    if (pc != NULL)
+	COUNT(pc->writes, 1);
+}
+
+void kvfs_pagecache_close(struct kvfs_pagecache_object *pc)
+{
+    if (pc == NULL)
+	return;
+    pthread_mutex_lock(&pc_lock);
+    pc->users--;
+    pthread_mutex_unlock(&pc_lock);
+}
+
+static void pagecache_report(FILE *out)
+{
+    pthread_mutex_lock(&pc_lock);
+    fprintf(out, "    %zu object(s) remembered, %llu forgotten; %llu open(s) kept the cache, "
+	    "%llu dropped it after a change, %llu first seen\n",
+	    objects.count, (unsigned long long) forgotten, (unsigned long long) kept,
+	    (unsigned long long) dropped, (unsigned long long) first);
+    pthread_mutex_unlock(&pc_lock);
+}
+
+int kvfs_pagecache_init(struct kvfs_state *state)
+{
+    pc_on = 0;
+    if (state->keep_cache == 0)
+	return 0;
+    if (htable_init(&objects, 1024) < 0)
+	return -ENOMEM;
+    kvfs_slab_init(&object_slab, "pagecache", sizeof(struct kvfs_pagecache_object));
+    max_objects = state->keep_cache;
+    kept = dropped = first = forgotten = 0;
+    pc_on = 1;
+
+    log_msg("    pagecache: generations of up to %zu objects\n", max_objects);
+    kvfs_stats_register("pagecache", pagecache_report);
+    return 0;
+}
+
+void kvfs_pagecache_destroy(struct kvfs_state *state)
+{
+    (void) state;
+
+    if (!pc_on)
+	return;
+    pc_on = 0;
+    kvfs_stats_unregister("pagecache");
+    pthread_mutex_lock(&pc_lock);
+    htable_free(&objects, NULL);
+    kvfs_slab_destroy(&object_slab);
+    pthread_mutex_unlock(&pc_lock);
+}
@@ -0,0 +1,31 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Change generations deciding keep_cache (-o keep_cache), see
+  pagecache.c.
+*/
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+struct kvfs_object;
+struct kvfs_pagecache_object;
+struct kvfs_state;
+
+int  kvfs_pagecache_init(struct kvfs_state *state);
+void kvfs_pagecache_destroy(struct kvfs_state *state);
+
+// An open of key, on backing file fd or store object obj, is
+// starting.  Returns whether the kernel may keep the pages it has of
+// it; *pcp is for the calls below, NULL if nothing is tracked.
+int  kvfs_pagecache_open(const char *key, int fd, struct kvfs_object *obj,
+			 struct kvfs_pagecache_object **pcp);
+
+// the open file was written, truncated or allocated through kvfs
+void kvfs_pagecache_wrote(struct kvfs_pagecache_object *pc);
+
+void kvfs_pagecache_close(struct kvfs_pagecache_object *pc);
+
+#endif
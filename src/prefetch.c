@@ -0,0 +1,392 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Open-sequence prefetching.  Builds and data loaders open the same
+  files in the same order run after run; kvfs learns which objects
+  follow which and, when one is opened, warms the ones that usually
+  come next in the background.
+
+  Sequences are followed per process: the last object each pid opened
+  is kept (for NPIDS processes at once), and a pid's next open within
+  PID_WINDOW seconds counts as a transition from it.  What is learned
+  goes into one successor table for all processes, since a build runs
+  each step in a process of its own.  Every object keeps its NSUCC
+  most frequent successors; counts are halved once they add up to
+  AGE_AT, so a changed order is picked up again.
+
+  On an open, up to -o prefetch successors (default 2, 0 turns it
+  off) that were seen at least MIN_SEEN times and follow in at least
+  MIN_SHARE% of the transitions are queued for the prefetch thread.
+  It lstat()s the backing file, which brings its inode and attributes
+  into the backing filesystem's caches, and asks for the first
+  -o prefetch_kb with posix_fadvise(WILLNEED), which reads them into
+  the page cache without waiting.
+
+  The last NRECENT prefetches are remembered, and an object is not
+  prefetched again while its prefetch is.  One that is opened before
+  it drops out counts as used (and is forgotten, so the object's next
+  prefetch may come); one that drops out unopened counts as wasted,
+  with the bytes read ahead for it.  The statistics
+  report has both, to tune or turn off prefetching by.
+
+  Objects in an object store (-o backend) have no backing file to warm,
+  so prefetching is off with one.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "htable.h"
+#include "log.h"
+#include "prefetch.h"
+#include "roots.h"
+#include "stats.h"
+
+#define NSUCC		4	// successors kept per object
+#define AGE_AT		256	// halve an object's counts at this many transitions
+#define MIN_SEEN	2	// a successor is prefetched once seen this often
+#define MIN_SHARE	25	// and after this % of the object's transitions
+#define MAX_ENTRIES	65536	// objects with successors kept; the oldest go
+#define NPIDS		1024	// processes followed at once
+#define PID_WINDOW	10	// seconds; opens further apart are no sequence
+#define NRECENT		1024	// prefetches waiting to be used
+#define QUEUE		256	// prefetches waiting for the thread
+
+struct pf_succ {
+    char key[KVFS_KEY_LEN];
+    unsigned int count;
+};
+
+struct pf_entry {
+    struct hnode hnode;		// first, see htable.h
+    struct pf_succ succ[NSUCC];
+    unsigned int total;
+};
+
+struct pf_pid {
+    pid_t pid;
+    time_t when;
+    char key[KVFS_KEY_LEN];
+};
+
+struct pf_recent {
+    struct hnode hnode;
+    size_t bytes;		// read ahead for it
+    int used;
+};
+
+static int pf_on;
+static unsigned int pf_max;	// successors per open
+static off_t pf_bytes;
+
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable entries;
+static struct pf_entry **entry_ring;	// in the order they were made
+static unsigned int entry_next;
+static struct pf_pid pids[NPIDS];
+static struct htable recent;
+static struct pf_recent *recent_ring[NRECENT];
+static unsigned int recent_next;
+
+static pthread_t pf_thread;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_wake = PTHREAD_COND_INITIALIZER;
+static char queue[QUEUE][KVFS_KEY_LEN];
+static unsigned int queue_head, queue_len;
+static int pf_running, pf_stop;
+
+static uint64_t opens, transitions, issued, dropped, gone;
+static uint64_t used, wasted, read_bytes, wasted_bytes;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// with pf_lock held: count prev -> key
+static void learn(const char *prev, const char *key)
+{
+    struct pf_entry *e = (struct pf_entry *) htable_lookup(&entries, prev);
+    struct pf_entry *old;
+    int i, low = 0;
+
+    if (e == NULL) {
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+	    return;
+	strcpy(e->hnode.key, prev);
+	old = entry_ring[entry_next];
+	if (old != NULL) {
+	    htable_remove(&entries, old->hnode.key);
+	    free(old);
+	}
+	entry_ring[entry_next] = e;
+	entry_next = (entry_next + 1) % MAX_ENTRIES;
+	htable_insert(&entries, &e->hnode);
+    }
+
+    transitions++;
+    e->total++;
+    for (i = 0; i < NSUCC; i++) {
+	if (strcmp(e->succ[i].key, key) == 0) {
+	    e->succ[i].count++;
+	    break;
+	}
+	if (e->succ[i].count < e->succ[low].count)
+	    low = i;
+    }
+    if (i == NSUCC) {
+	// the least frequent successor makes room
+	e->total -= e->succ[low].count;
+	strcpy(e->succ[low].key, key);
+	e->succ[low].count = 1;
+    }
+    if (e->total >= AGE_AT) {
+	e->total = 0;
+	for (i = 0; i < NSUCC; i++) {
+	    e->succ[i].count /= 2;
+	    e->total += e->succ[i].count;
+	}
+    }
+}
+
+// with pf_lock held: remember that key is being prefetched
+static void add_recent(const char *key)
+{
+    struct pf_recent *r = recent_ring[recent_next];
+
+    if (r != NULL) {
+	// a used one already left the table
+	if (!r->used) {
+	    htable_remove(&recent, r->hnode.key);
+	    wasted++;
+	    wasted_bytes += r->bytes;
+	}
+    } else {
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+	    return;
+	recent_ring[recent_next] = r;
+    }
+    recent_next = (recent_next + 1) % NRECENT;
+    strcpy(r->hnode.key, key);
+    r->bytes = 0;
+    r->used = 0;
+    htable_insert(&recent, &r->hnode);
+}
+
+// with pf_lock held: the likely successors of key not prefetched
+// lately, most likely first; how many went into next
+static int predict(const char *key, char next[][KVFS_KEY_LEN])
+{
+    struct pf_entry *e = (struct pf_entry *) htable_lookup(&entries, key);
+    int taken[NSUCC] = { 0 };
+    unsigned int n = 0;
+    int i, best;
+
+    if (e == NULL)
+	return 0;
+    while (n < pf_max) {
+	best = -1;
+	for (i = 0; i < NSUCC; i++)
+	    if (!taken[i] && (best < 0 || e->succ[i].count > e->succ[best].count))
+		best = i;
+	if (best < 0 || e->succ[best].count < MIN_SEEN ||
+	    e->succ[best].count * 100 < e->total * MIN_SHARE)
+	    break;
+	taken[best] = 1;
+	if (htable_lookup(&recent, e->succ[best].key) != NULL)
+	    continue;
+	add_recent(e->succ[best].key);
+	strcpy(next[n++], e->succ[best].key);
+    }
+    return n;
+}
+
+void kvfs_prefetch_open(const char *key)
+{
+    char next[NSUCC][KVFS_KEY_LEN];
+    struct pf_recent *r;
+    struct pf_pid *p;
+    pid_t pid;
+    time_t now;
+    int n, i;
+
+    if (!pf_on)
+	return;
+    pid = fuse_get_context()->pid;
+    now = time(NULL);
+
+    pthread_mutex_lock(&pf_lock);
+    opens++;
+    // a prefetch that came true; the next one of key may come again
+    r = (struct pf_recent *) htable_lookup(&recent, key);
+    if (r != NULL) {
+	htable_remove(&recent, key);
+	r->used = 1;
+	used++;
+    }
+    p = &pids[(unsigned int) pid % NPIDS];
+    if (p->pid == pid && now - p->when <= PID_WINDOW && strcmp(p->key, key) != 0)
+	learn(p->key, key);
+    p->pid = pid;
+    p->when = now;
+    strcpy(p->key, key);
+    n = predict(key, next);
+    pthread_mutex_unlock(&pf_lock);
+
+    if (n == 0)
+	return;
+    pthread_mutex_lock(&queue_lock);
+    for (i = 0; i < n; i++) {
+	if (queue_len == QUEUE) {
+	    COUNT(dropped, n - i);
+	    break;
+	}
+	strcpy(queue[(queue_head + queue_len) % QUEUE], next[i]);
+	queue_len++;
+    }
+    pthread_cond_signal(&queue_wake);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void prefetch_one(const char *key)
+{
+    char path[PATH_MAX];
+    struct pf_recent *r;
+    struct stat st;
+    off_t len;
+    int fd;
+
+    kvfs_root_path(path, key);
+    if (lstat(path, &st) < 0) {
+	COUNT(gone, 1);
+	return;
+    }
+    COUNT(issued, 1);
+    if (!S_ISREG(st.st_mode) || st.st_size == 0 || pf_bytes == 0)
+	return;
+
+    len = st.st_size < pf_bytes ? st.st_size : pf_bytes;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return;
+    if (posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) == 0) {
+	COUNT(read_bytes, len);
+	pthread_mutex_lock(&pf_lock);
+	r = (struct pf_recent *) htable_lookup(&recent, key);
+	if (r != NULL)
+	    r->bytes = len;
+	pthread_mutex_unlock(&pf_lock);
+    }
+    close(fd);
+}
+
+static void *prefetch_main(void *arg)
+{
+    char key[KVFS_KEY_LEN];
+
+    (void) arg;
+    pthread_mutex_lock(&queue_lock);
+    while (!pf_stop) {
+	if (queue_len == 0) {
+	    pthread_cond_wait(&queue_wake, &queue_lock);
+	    continue;
+	}
+	strcpy(key, queue[queue_head]);
+	queue_head = (queue_head + 1) % QUEUE;
+	queue_len--;
+	pthread_mutex_unlock(&queue_lock);
+	prefetch_one(key);
+	pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+static void prefetch_report(FILE *out)
+{
+    uint64_t judged;
+
+    pthread_mutex_lock(&pf_lock);
+    judged = used + wasted;
+    fprintf(out, "    %llu open(s), %llu transition(s) learned, %zu object(s) with successors\n",
+	    (unsigned long long) opens, (unsigned long long) transitions, entries.count);
+    fprintf(out, "    %llu prefetch(es), %llu dropped, %llu gone; %llu used, %llu wasted (%.1f%% accurate)\n",
+	    (unsigned long long) issued, (unsigned long long) dropped, (unsigned long long) gone,
+	    (unsigned long long) used, (unsigned long long) wasted,
+	    judged ? 100.0 * used / judged : 0.0);
+    fprintf(out, "    %.1f MiB read ahead, %.1f MiB of it wasted\n",
+	    read_bytes / 1048576.0, wasted_bytes / 1048576.0);
+    pthread_mutex_unlock(&pf_lock);
+}
+
+int kvfs_prefetch_init(struct kvfs_state *state)
+{
+    pf_on = 0;
+    if (state->prefetch == 0 || state->store != NULL)
+	return 0;
+    if (htable_init(&entries, 4096) < 0 || htable_init(&recent, NRECENT) < 0)
+	return -ENOMEM;
+    entry_ring = calloc(MAX_ENTRIES, sizeof(*entry_ring));
+    if (entry_ring == NULL)
+	return -ENOMEM;
+    entry_next = recent_next = 0;
+    memset(pids, 0, sizeof(pids));
+    memset(recent_ring, 0, sizeof(recent_ring));
+    queue_head = queue_len = 0;
+    pf_max = state->prefetch < NSUCC ? state->prefetch : NSUCC;
+    pf_bytes = (off_t) state->prefetch_kb << 10;
+    opens = transitions = issued = dropped = gone = 0;
+    used = wasted = read_bytes = wasted_bytes = 0;
+
+    pf_stop = 0;
+    if (pthread_create(&pf_thread, NULL, prefetch_main, NULL) != 0)
+	return log_error("prefetch pthread_create");
+    pf_running = 1;
+    pf_on = 1;
+    log_msg("    prefetch: up to %u successor(s), %u KiB of each\n", pf_max, state->prefetch_kb);
+    kvfs_stats_register("prefetch", prefetch_report);
+    return 0;
+}
+
+static void free_node(struct hnode *node)
+{
+    free(node);
+}
+
+void kvfs_prefetch_destroy(struct kvfs_state *state)
+{
+    int i;
+
+    (void) state;
+
+    if (pf_running) {
+	pthread_mutex_lock(&queue_lock);
+	pf_stop = 1;
+	pthread_cond_signal(&queue_wake);
+	pthread_mutex_unlock(&queue_lock);
+	pthread_join(pf_thread, NULL);
+	pf_running = 0;
+    }
+    if (!pf_on)
+	return;
+    pf_on = 0;
+    kvfs_stats_unregister("prefetch");
+    htable_free(&entries, free_node);
+    free(entry_ring);
+    entry_ring = NULL;
+    // the used ones are in the ring only
+    htable_free(&recent, NULL);
+    for (i = 0; i < NRECENT; i++) {
+	free(recent_ring[i]);
+	recent_ring[i] = NULL;
+    }
+}
@@ -0,0 +1,19 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+struct kvfs_state;
+
+int  kvfs_prefetch_init(struct kvfs_state *state);
+void kvfs_prefetch_destroy(struct kvfs_state *state);
+
+// after an open() of key succeeded: learn from it, and prefetch what
+// usually gets opened next
+void kvfs_prefetch_open(const char *key);
+
+#endif
@@ -0,0 +1,787 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  kvfs-replay: run a trace recorded with -o trace=FILE against kvfs,
+  without mounting it (see harness.c), to reproduce a production load
+  when judging a change.
+
+  Calls are handed to worker threads by recorded pid, so each client
+  process's calls are replayed in their original order by a single
+  thread; with fewer workers than processes several clients share a
+  worker.  At -s 1 every call is issued at its recorded time, at -s 4
+  four times as fast, and at -s 0 as fast as the workers can go (which
+  can reorder calls of different clients relative to each other).
+
+  File handles in the trace are mapped to the handles the replay's own
+  open()s return.  A trace started on a live mount refers to files
+  opened before it began; those are opened on first use.  With -p the
+  files and directories the trace uses without creating them are made
+  before the clock starts, sized to cover the reads.
+
+  The report compares what each call returned against the recording;
+  a difference usually means the replay tree doesn't match the one
+  traced.
+
+  usage: kvfs-replay [options] tracefile rootdir[:rootdir...]
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "harness.h"
+#include "htable.h"
+#include "stats.h"
+#include "trace.h"
+
+#define MAX_WORKERS 256
+
+enum {
+    OP_GETATTR, OP_READLINK, OP_MKNOD, OP_MKDIR, OP_UNLINK, OP_RMDIR, OP_SYMLINK,
+    OP_RENAME, OP_LINK, OP_CHMOD, OP_CHOWN, OP_TRUNCATE, OP_UTIME, OP_OPEN, OP_READ,
+    OP_WRITE, OP_STATFS, OP_FLUSH, OP_RELEASE, OP_FSYNC, OP_SETXATTR, OP_GETXATTR,
+    OP_LISTXATTR, OP_REMOVEXATTR, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_FSYNCDIR,
+    OP_ACCESS, OP_FTRUNCATE, OP_FGETATTR, OP_FALLOCATE, NOPS
+};
+
+static const char *op_names[NOPS] = {
+    "getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir", "symlink",
+    "rename", "link", "chmod", "chown", "truncate", "utime", "open", "read",
+    "write", "statfs", "flush", "release", "fsync", "setxattr", "getxattr",
+    "listxattr", "removexattr", "opendir", "readdir", "releasedir", "fsyncdir",
+    "access", "ftruncate", "fgetattr", "fallocate",
+};
+
+// one traced call, see trace.c for the fields
+struct record {
+    uint64_t start, dur;		// usec
+    int pid;
+    int op;
+    int ret;
+    uint64_t fh;
+    char *path, *path2;			// NULL for none
+    long long off;
+    unsigned long long size;
+    long mode;
+};
+
+// what the replay did with it
+struct result {
+    uint64_t lat;			// nsec
+    int ret;
+    int done;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    long *calls;			// indexes into records, in order
+    long ncalls, capcalls;
+    char *buf;
+    uint64_t lag_sum, lag_max;		// nsec behind schedule
+};
+
+// recorded handle -> the replay's own
+struct handle {
+    struct hnode node;
+    struct fuse_file_info fi;
+    const char *path;			// as opened
+    int dir;
+};
+
+// recorded pid -> worker
+struct client {
+    struct hnode node;
+    int worker;
+};
+
+static struct record *records;
+static struct result *results;
+static long nrecords;
+static size_t max_size = 4096;
+
+static struct worker *workers;
+static int nworkers;
+static double speed = 1.0;
+static int verbose;
+static uint64_t replay_start;
+static pthread_barrier_t start_line;
+
+static struct htable handles;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/////////////////////////////////////////////////////////////////////
+// reading the trace
+
+static char *path_field(char *s)
+{
+    if (strcmp(s, "-") == 0)
+	return NULL;
+    kvfs_trace_unescape(s);
+    return strdup(s);
+}
+
+static int parse_line(char *line, struct record *r)
+{
+    char *field[11], *save = NULL;
+    int i;
+
+    for (i = 0; i < 11; i++) {
+	field[i] = strtok_r(i == 0 ? line : NULL, " \n", &save);
+	if (field[i] == NULL)
+	    return -1;
+    }
+    for (r->op = 0; r->op < NOPS; r->op++)
+	if (strcmp(field[3], op_names[r->op]) == 0)
+	    break;
+    if (r->op == NOPS)
+	return -1;
+    r->start = strtoull(field[0], NULL, 10);
+    r->dur = strtoull(field[1], NULL, 10);
+    r->pid = atoi(field[2]);
+    r->ret = atoi(field[4]);
+    r->fh = strtoull(field[5], NULL, 16);
+    r->path = path_field(field[6]);
+    r->path2 = path_field(field[7]);
+    r->off = strtoll(field[8], NULL, 10);
+    r->size = strtoull(field[9], NULL, 10);
+    r->mode = strtol(field[10], NULL, 8);
+    return 0;
+}
+
+static int load_trace(const char *tracefile)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t len = 0;
+    long cap = 0, lineno = 0;
+
+    f = fopen(tracefile, "r");
+    if (f == NULL) {
+	perror(tracefile);
+	return -1;
+    }
+    while (getline(&line, &len, f) != -1) {
+	lineno++;
+	if (lineno == 1 && strncmp(line, TRACE_HEADER, strlen(TRACE_HEADER)) != 0) {
+	    fprintf(stderr, "kvfs-replay: %s is not a kvfs trace\n", tracefile);
+	    return -1;
+	}
+	if (line[0] == '#' || line[0] == '\n')
+	    continue;
+	if (nrecords == cap) {
+	    cap = cap ? 2 * cap : 4096;
+	    records = realloc(records, cap * sizeof(*records));
+	    if (records == NULL) {
+		perror("kvfs-replay: realloc");
+		return -1;
+	    }
+	}
+	if (parse_line(line, &records[nrecords]) < 0) {
+	    fprintf(stderr, "kvfs-replay: %s:%ld: bad record, skipped\n", tracefile, lineno);
+	    continue;
+	}
+	if (records[nrecords].size > max_size)
+	    max_size = records[nrecords].size;
+	nrecords++;
+    }
+    free(line);
+    fclose(f);
+
+    results = calloc(nrecords + 1, sizeof(*results));
+    if (results == NULL) {
+	perror("kvfs-replay: calloc");
+	return -1;
+    }
+    return 0;
+}
+
+// spread the calls over the workers, keeping each pid on one
+static int assign_workers(int want)
+{
+    struct htable clients;
+    struct client *cl;
+    char key[KVFS_KEY_LEN];
+    int nclients = 0;
+    long i;
+
+    if (htable_init(&clients, 256) < 0)
+	return -1;
+    // first pass: how many clients are there
+    for (i = 0; i < nrecords; i++) {
+	snprintf(key, sizeof(key), "%d", records[i].pid);
+	if (htable_lookup(&clients, key) != NULL)
+	    continue;
+	cl = calloc(1, sizeof(*cl));
+	if (cl == NULL)
+	    return -1;
+	strcpy(cl->node.key, key);
+	cl->worker = nclients++;
+	htable_insert(&clients, &cl->node);
+    }
+    nworkers = want > 0 ? want : nclients;
+    if (nworkers > MAX_WORKERS)
+	nworkers = MAX_WORKERS;
+    if (nworkers < 1)
+	nworkers = 1;
+
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL)
+	return -1;
+    for (i = 0; i < nrecords; i++) {
+	struct worker *w;
+
+	snprintf(key, sizeof(key), "%d", records[i].pid);
+	cl = (struct client *) htable_lookup(&clients, key);
+	w = &workers[cl->worker % nworkers];
+	if (w->ncalls == w->capcalls) {
+	    w->capcalls = w->capcalls ? 2 * w->capcalls : 1024;
+	    w->calls = realloc(w->calls, w->capcalls * sizeof(*w->calls));
+	    if (w->calls == NULL)
+		return -1;
+	}
+	w->calls[w->ncalls++] = i;
+    }
+    htable_free(&clients, (void (*)(struct hnode *)) free);
+    return nclients;
+}
+
+/////////////////////////////////////////////////////////////////////
+// file handles
+
+static void handle_key(char *key, uint64_t fh)
+{
+    snprintf(key, KVFS_KEY_LEN, "%llx", (unsigned long long) fh);
+}
+
+static void handle_add(struct record *r, struct fuse_file_info *fi, int dir)
+{
+    struct handle *h = malloc(sizeof(*h));
+
+    if (h == NULL)
+	return;
+    handle_key(h->node.key, r->fh);
+    h->fi = *fi;
+    h->path = r->path;
+    h->dir = dir;
+    pthread_mutex_lock(&handles_lock);
+    htable_insert(&handles, &h->node);
+    pthread_mutex_unlock(&handles_lock);
+}
+
+// the replay's handle for recorded fh, opening path if the trace
+// began after it was opened; fills fi
+static int handle_get(struct record *r, struct fuse_file_info *fi, int dir)
+{
+    char key[KVFS_KEY_LEN];
+    struct handle *h;
+    int retstat;
+
+    handle_key(key, r->fh);
+    pthread_mutex_lock(&handles_lock);
+    h = (struct handle *) htable_lookup(&handles, key);
+    if (h != NULL)
+	*fi = h->fi;
+    pthread_mutex_unlock(&handles_lock);
+    if (h != NULL)
+	return 0;
+
+    memset(fi, 0, sizeof(*fi));
+    if (dir) {
+	retstat = kvfs_oper.opendir(r->path, fi);
+    } else {
+	fi->flags = O_RDWR;
+	retstat = kvfs_oper.open(r->path, fi);
+	if (retstat == -EACCES || retstat == -EISDIR) {
+	    fi->flags = O_RDONLY;
+	    retstat = kvfs_oper.open(r->path, fi);
+	}
+    }
+    if (retstat == 0)
+	handle_add(r, fi, dir);
+    return retstat;
+}
+
+// forget fh; returns 0 and fills fi if it was known
+static int handle_put(uint64_t fh, struct fuse_file_info *fi)
+{
+    char key[KVFS_KEY_LEN];
+    struct handle *h;
+
+    handle_key(key, fh);
+    pthread_mutex_lock(&handles_lock);
+    h = (struct handle *) htable_remove(&handles, key);
+    pthread_mutex_unlock(&handles_lock);
+    if (h == NULL)
+	return -1;
+    *fi = h->fi;
+    free(h);
+    return 0;
+}
+
+// close what the trace left open
+static void handle_release(struct hnode *node)
+{
+    struct handle *h = (struct handle *) node;
+
+    if (h->dir)
+	kvfs_oper.releasedir(h->path, &h->fi);
+    else
+	kvfs_oper.release(h->path, &h->fi);
+    free(h);
+}
+
+/////////////////////////////////////////////////////////////////////
+// replaying one call
+
+static int fill_dir(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    (void) name;
+    (void) st;
+    (void) off;
+    (*(long *) buf)++;
+    return 0;
+}
+
+static int replay_call(struct worker *w, struct record *r)
+{
+    struct fuse_file_info fi;
+    struct statvfs stv;
+    struct utimbuf ut;
+    struct stat st;
+    long entries = 0;
+    int retstat;
+
+    switch (r->op) {
+    case OP_GETATTR:	return kvfs_oper.getattr(r->path, &st);
+    case OP_READLINK:	return kvfs_oper.readlink(r->path, w->buf, r->size);
+    case OP_MKNOD:	return kvfs_oper.mknod(r->path, r->mode, r->off);
+    case OP_MKDIR:	return kvfs_oper.mkdir(r->path, r->mode);
+    case OP_UNLINK:	return kvfs_oper.unlink(r->path);
+    case OP_RMDIR:	return kvfs_oper.rmdir(r->path);
+    case OP_SYMLINK:	return kvfs_oper.symlink(r->path, r->path2);
+    case OP_RENAME:	return kvfs_oper.rename(r->path, r->path2);
+    case OP_LINK:	return kvfs_oper.link(r->path, r->path2);
+    case OP_CHMOD:	return kvfs_oper.chmod(r->path, r->mode);
+    case OP_CHOWN:	return kvfs_oper.chown(r->path, r->off, r->size);
+    case OP_TRUNCATE:	return kvfs_oper.truncate(r->path, r->off);
+    case OP_UTIME:
+	ut.actime = r->off;
+	ut.modtime = r->size;
+	return kvfs_oper.utime(r->path, &ut);
+    case OP_OPEN:
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = r->mode;
+	retstat = kvfs_oper.open(r->path, &fi);
+	if (retstat == 0 && r->ret == 0)
+	    handle_add(r, &fi, 0);
+	return retstat;
+    case OP_READ:
+	if ((retstat = handle_get(r, &fi, 0)) < 0)
+	    return retstat;
+	return kvfs_oper.read(r->path, w->buf, r->size, r->off, &fi);
+    case OP_WRITE:
+	if ((retstat = handle_get(r, &fi, 0)) < 0)
+	    return retstat;
+	return kvfs_oper.write(r->path, w->buf, r->size, r->off, &fi);
+    case OP_STATFS:	return kvfs_oper.statfs(r->path, &stv);
+    case OP_FLUSH:
+	if ((retstat = handle_get(r, &fi, 0)) < 0)
+	    return retstat;
+	return kvfs_oper.flush(r->path, &fi);
+    case OP_RELEASE:
+	// nothing to release if the trace began after the open
+	if (handle_put(r->fh, &fi) < 0)
+	    return r->ret;
+	return kvfs_oper.release(r->path, &fi);
+    case OP_FSYNC:
+	if ((retstat = handle_get(r, &fi, 0)) < 0)
+	    return retstat;
+	return kvfs_oper.fsync(r->path, r->mode, &fi);
+#ifdef HAVE_SYS_XATTR_H
+    case OP_SETXATTR:	return kvfs_oper.setxattr(r->path, r->path2, w->buf, r->size, r->mode);
+    case OP_GETXATTR:	return kvfs_oper.getxattr(r->path, r->path2, w->buf, r->size);
+    case OP_LISTXATTR:	return kvfs_oper.listxattr(r->path, w->buf, r->size);
+    case OP_REMOVEXATTR: return kvfs_oper.removexattr(r->path, r->path2);
+#endif
+    case OP_OPENDIR:
+	memset(&fi, 0, sizeof(fi));
+	retstat = kvfs_oper.opendir(r->path, &fi);
+	if (retstat == 0 && r->ret == 0)
+	    handle_add(r, &fi, 1);
+	return retstat;
+    case OP_READDIR:
+	if ((retstat = handle_get(r, &fi, 1)) < 0)
+	    return retstat;
+	return kvfs_oper.readdir(r->path, &entries, fill_dir, r->off, &fi);
+    case OP_RELEASEDIR:
+	if (handle_put(r->fh, &fi) < 0)
+	    return r->ret;
+	return kvfs_oper.releasedir(r->path, &fi);
+    case OP_FSYNCDIR:
+	if ((retstat = handle_get(r, &fi, 1)) < 0)
+	    return retstat;
+	return kvfs_oper.fsyncdir(r->path, r->mode, &fi);
+    case OP_ACCESS:	return kvfs_oper.access(r->path, r->mode);
+    case OP_FTRUNCATE:
+	if ((retstat = handle_get(r, &fi, 0)) < 0)
+	    return retstat;
+	return kvfs_oper.ftruncate(r->path, r->off, &fi);
+    case OP_FGETATTR:
+	if ((retstat = handle_get(r, &fi, 0)) < 0)
+	    return retstat;
+	return kvfs_oper.fgetattr(r->path, &st, &fi);
+#ifdef HAVE_FALLOCATE
+    case OP_FALLOCATE:
+	if ((retstat = handle_get(r, &fi, 0)) < 0)
+	    return retstat;
+	return kvfs_oper.fallocate(r->path, r->mode, r->off, r->size, &fi);
+#endif
+    }
+    return -ENOSYS;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct record *r;
+    struct timespec ts;
+    uint64_t due = 0, t0, t1;
+    long i;
+
+    harness_enter(w->id);
+    pthread_barrier_wait(&start_line);
+
+    for (i = 0; i < w->ncalls; i++) {
+	r = &records[w->calls[i]];
+	if (speed > 0) {
+	    due = replay_start + (uint64_t) (r->start * 1000 / speed);
+	    ts.tv_sec = due / 1000000000;
+	    ts.tv_nsec = due % 1000000000;
+	    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	}
+	// run as the traced process
+	fuse_get_context()->pid = r->pid;
+	t0 = now_nsec();
+	results[w->calls[i]].ret = replay_call(w, r);
+	t1 = now_nsec();
+	results[w->calls[i]].lat = t1 - t0;
+	results[w->calls[i]].done = 1;
+	if (speed > 0 && t0 > due) {
+	    w->lag_sum += t0 - due;
+	    if (t0 - due > w->lag_max)
+		w->lag_max = t0 - due;
+	}
+    }
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// -p: make what the trace expects to be there
+
+// does the call need path to exist beforehand, and does it make path2?
+static int needs_path(int op)
+{
+    return op != OP_MKNOD && op != OP_MKDIR && op != OP_SYMLINK;
+}
+
+static int makes_path2(int op)
+{
+    return op == OP_SYMLINK || op == OP_LINK || op == OP_RENAME;
+}
+
+static int is_dir_op(int op)
+{
+    return op == OP_OPENDIR || op == OP_READDIR || op == OP_RELEASEDIR ||
+	op == OP_FSYNCDIR || op == OP_RMDIR || op == OP_MKDIR;
+}
+
+// a path the trace uses, and what it first did with it
+struct seen {
+    struct hnode node;
+    char *path;
+    int create;				// 1 if it must exist before the trace
+    int dir;
+    uint64_t size;
+};
+
+static void make_parents(const char *path)
+{
+    char *dir = strdup(path), *slash;
+
+    if (dir == NULL)
+	return;
+    for (slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+	*slash = '\0';
+	kvfs_oper.mkdir(dir, 0755);
+	*slash = '/';
+    }
+    free(dir);
+}
+
+static int make_one(struct hnode *node, void *arg)
+{
+    struct seen *s = (struct seen *) node;
+    struct fuse_file_info fi;
+    struct stat st;
+    char *buf = arg;
+    uint64_t off;
+    size_t n;
+
+    if (!s->create || strcmp(s->path, "/") == 0 || kvfs_oper.getattr(s->path, &st) == 0)
+	return 0;
+    make_parents(s->path);
+    if (s->dir) {
+	kvfs_oper.mkdir(s->path, 0755);
+	return 0;
+    }
+    if (kvfs_oper.mknod(s->path, S_IFREG | 0644, 0) < 0)
+	return 0;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    if (kvfs_oper.open(s->path, &fi) < 0)
+	return 0;
+    for (off = 0; off < s->size; off += n) {
+	n = s->size - off < max_size ? s->size - off : max_size;
+	if (kvfs_oper.write(s->path, buf, n, off, &fi) < 0)
+	    break;
+    }
+    kvfs_oper.release(s->path, &fi);
+    return 0;
+}
+
+static void free_seen(struct hnode *node)
+{
+    free(((struct seen *) node)->path);
+    free(node);
+}
+
+static struct seen *see(struct htable *paths, const char *path, int create)
+{
+    char key[KVFS_KEY_LEN], *md5;
+    struct seen *s;
+
+    // paths can be longer than a key; go by their md5 as kvfs does
+    md5 = str2md5(path, strlen(path));
+    strcpy(key, md5);
+    free(md5);
+    s = (struct seen *) htable_lookup(paths, key);
+    if (s != NULL)
+	return s;
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+	return NULL;
+    strcpy(s->node.key, key);
+    s->path = strdup(path);
+    s->create = create;
+    htable_insert(paths, &s->node);
+    return s;
+}
+
+static int prepare(char *buf)
+{
+    struct htable paths;
+    struct record *r;
+    struct seen *s;
+    long i;
+
+    if (htable_init(&paths, 4096) < 0)
+	return -1;
+    for (i = 0; i < nrecords; i++) {
+	r = &records[i];
+	if (r->path != NULL) {
+	    s = see(&paths, r->path, needs_path(r->op) && r->ret >= 0);
+	    if (s == NULL)
+		return -1;
+	    if (is_dir_op(r->op))
+		s->dir = 1;
+	    if (r->op == OP_READ && r->ret > 0 && r->off + r->ret > s->size)
+		s->size = r->off + r->ret;
+	}
+	if (r->path2 != NULL && makes_path2(r->op) && see(&paths, r->path2, 0) == NULL)
+	    return -1;
+    }
+    harness_enter(-1);
+    htable_foreach(&paths, make_one, buf);
+    htable_free(&paths, free_seen);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// report
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t wall, int nclients)
+{
+    uint64_t *lat, recorded = 0, lag_sum = 0, lag_max = 0;
+    long i, n, done = 0, differ_total = 0;
+    int op, t;
+
+    lat = malloc((nrecords + 1) * sizeof(*lat));
+    if (lat == NULL) {
+	perror("kvfs-replay: malloc");
+	return;
+    }
+    for (i = 0; i < nrecords; i++) {
+	done += results[i].done;
+	if (records[i].start + records[i].dur > recorded)
+	    recorded = records[i].start + records[i].dur;
+    }
+    for (t = 0; t < nworkers; t++) {
+	lag_sum += workers[t].lag_sum;
+	if (workers[t].lag_max > lag_max)
+	    lag_max = workers[t].lag_max;
+    }
+
+    printf("replayed %ld call(s) of %d client(s) on %d thread(s) in %.3f s",
+	   done, nclients, nworkers, wall / 1e9);
+    printf(" (recorded %.3f s", recorded / 1e6);
+    if (speed > 0)
+	printf(", speed %gx)\n", speed);
+    else
+	printf(", unpaced)\n");
+    printf("  throughput  %.0f ops/s\n", done * 1e9 / (wall ? wall : 1));
+    if (speed > 0)
+	printf("  behind schedule  avg %.1f us  max %.1f us\n",
+	       done ? lag_sum / 1e3 / done : 0.0, lag_max / 1e3);
+
+    printf("  %-12s %8s %8s %8s %10s %10s %12s\n",
+	   "call", "count", "errors", "differ", "avg us", "p99 us", "recorded us");
+    for (op = 0; op < NOPS; op++) {
+	uint64_t sum = 0, rec_sum = 0;
+	long errors = 0, differ = 0;
+
+	for (i = 0, n = 0; i < nrecords; i++) {
+	    if (records[i].op != op || !results[i].done)
+		continue;
+	    lat[n++] = results[i].lat;
+	    sum += results[i].lat;
+	    rec_sum += records[i].dur;
+	    if (results[i].ret < 0)
+		errors++;
+	    if (results[i].ret != records[i].ret) {
+		differ++;
+		if (verbose)
+		    fprintf(stderr, "kvfs-replay: %s %s: returned %d, recorded %d\n", op_names[op],
+			    records[i].path ? records[i].path : "-", results[i].ret, records[i].ret);
+	    }
+	}
+	if (n == 0)
+	    continue;
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf("  %-12s %8ld %8ld %8ld %10.1f %10.1f %12.1f\n", op_names[op], n, errors, differ,
+	       sum / 1e3 / n, lat[(long) (0.99 * (n - 1) + 0.5)] / 1e3, (double) rec_sum / n);
+	differ_total += differ;
+    }
+    if (differ_total > 0)
+	printf("  %ld call(s) returned something other than recorded%s\n", differ_total,
+	       verbose ? "" : " (-v lists them)");
+    free(lat);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  kvfs-replay [options] traceFile rootDir[:rootDir...]\n\n");
+    fprintf(stderr, "    -c N          worker threads (default one per traced process)\n");
+    fprintf(stderr, "    -s SPEED      1 = recorded timing, 2 = twice as fast, 0 = unpaced (default 1)\n");
+    fprintf(stderr, "    -p            create the files and directories the trace expects first\n");
+    fprintf(stderr, "    -v            list calls that returned something other than recorded\n");
+    fprintf(stderr, "    -o OPTS       kvfs mount options, as for kvfs -o\n");
+    fprintf(stderr, "\nRecord traces with kvfs -o trace=FILE; the log goes to ./kvfs.log.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, t, threads = 0, do_prepare = 0, nclients;
+    uint64_t wall;
+
+    if (harness_setup("kvfs-replay") < 0)
+	return EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "c:s:pvo:h")) != -1) {
+	switch (opt) {
+	case 'c': threads = atoi(optarg); break;
+	case 's': speed = atof(optarg); break;
+	case 'p': do_prepare = 1; break;
+	case 'v': verbose = 1; break;
+	case 'o':
+	    if (harness_options(optarg) < 0)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 2 || threads < 0 || speed < 0)
+	usage();
+
+    if (load_trace(argv[optind]) < 0)
+	return EXIT_FAILURE;
+    nclients = assign_workers(threads);
+    if (nclients < 0 || htable_init(&handles, 1024) < 0) {
+	perror("kvfs-replay: malloc");
+	return EXIT_FAILURE;
+    }
+    for (t = 0; t < nworkers; t++) {
+	workers[t].id = t;
+	workers[t].buf = malloc(max_size);
+	if (workers[t].buf == NULL) {
+	    perror("kvfs-replay: malloc");
+	    return EXIT_FAILURE;
+	}
+	memset(workers[t].buf, 'a' + t % 26, max_size);
+    }
+
+    if (harness_mount(argv[optind + 1]) < 0)
+	return EXIT_FAILURE;
+    if (do_prepare && prepare(workers[0].buf) < 0) {
+	perror("kvfs-replay: prepare");
+	return EXIT_FAILURE;
+    }
+
+    pthread_barrier_init(&start_line, NULL, nworkers + 1);
+    for (t = 0; t < nworkers; t++)
+	pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+    replay_start = now_nsec();
+    pthread_barrier_wait(&start_line);
+    for (t = 0; t < nworkers; t++)
+	pthread_join(workers[t].thread, NULL);
+    wall = now_nsec() - replay_start;
+
+    report(wall, nclients);
+    kvfs_stats_dump(stdout);
+    harness_enter(-1);
+    htable_free(&handles, handle_release);
+    harness_unmount();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  kvfs-resync: bring the mirrors of a -o mirror=1 tree (see mirror.c)
+  back up to date, without mounting it (see harness.c).
+
+  Give it the roots in the order kvfs is mounted with.  Each mirror
+  that fell behind gets the objects on its list copied over from the
+  first root; one that is new, or lost its list, gets everything.
+  Run it while kvfs is not mounted on the same roots.
+
+  usage: kvfs-resync [-v] rootdir:rootdir[:rootdir...]
+*/
+
+#include "kvfs.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "harness.h"
+#include "mirror.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  kvfs-resync [-v] rootDir:rootDir[:rootDir...]\n\n");
+    fprintf(stderr, "    -v            name every object copied\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    char opts[] = "mirror=1";
+    int opt, verbose = 0, repaired;
+
+    if (harness_setup("kvfs-resync") < 0)
+	return EXIT_FAILURE;
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+	switch (opt) {
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind + 1 != argc)
+	usage();
+    if (harness_options(opts) < 0 || harness_mount(argv[optind]) < 0)
+	return EXIT_FAILURE;
+    if (!kvfs_mirroring()) {
+	fprintf(stderr, "kvfs-resync: nothing to do with a single root\n");
+	harness_unmount();
+	return EXIT_FAILURE;
+    }
+
+    harness_enter(-1);
+    repaired = kvfs_mirror_resync(verbose);
+    harness_unmount();
+    if (repaired < 0)
+	return EXIT_FAILURE;
+    printf("%d mirror(s) repaired\n", repaired);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1372 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Several backing roots.
+
+  "kvfs rootdir [rootdir...] mountpoint" spreads objects over every
+  rootdir given.  Each root carries an id of its own in .kvfs_root,
+  and each id is given VNODES points on a hash ring; an object lives
+  on the root owning the first point at or after the first 32 bits of
+  its key.  A root added later takes over only the keys just before
+  its points, about 1/n of them, and only those objects move.
+
+  With -o stripe=KB regular files are cut into units of that size:
+  unit u of a file is kept on the u-th root after the file's home, at
+  its own offset in a file of the same name there (see stripe.c).
+  Roots are ordered by id for this, so the order they are given in
+  does not matter.  Only the first root is special: it keeps the
+  ring's membership in .kvfs_roots and everything else kvfs keeps of
+  its own (directory ids, checksums, object stores), so it has to
+  stay first.  Roots cannot be taken away.
+
+  A mount that finds the roots or the stripe unit changed since the
+  last one moves what has to move before serving anything.  First it
+  copies each object, or each byte range of a striped file, to where
+  the new layout wants it; once .kvfs_roots names the new layout, it
+  drops the old copies.  A crash in either pass just repeats it.
+  Adding a root restripes every striped file, as growing a RAID does,
+  and hard links to a striped file come out of it as separate copies.
+
+  Objects are rename()d between roots that share a filesystem and
+  copied between those that don't.  Renaming a file can change its
+  home, so a rename may cost a copy, as mv between filesystems does.
+
+  With -o mirror=1 there is no ring: everything lives on the first
+  root and every other root is a full copy of it, see mirror.c.  With
+  -o tier=1 there is none either: of two roots, the first is a fast
+  tier and the second a slow one, and tier.c keeps each object on the
+  one its use calls for.  .kvfs_roots says "tier" then, and only a
+  tiered mount may have those roots again.
+
+  Each root has root_threads I/O threads, so a striped request that
+  touches several roots, or a mirrored one, runs on all of them at
+  once.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#include "dirid.h"
+#include "log.h"
+#include "roots.h"
+#include "stats.h"
+#include "tier.h"
+
+#define ROOT_ID_FILE	".kvfs_root"
+#define MEMBERS_FILE	".kvfs_roots"
+#define TMP_PREFIX	".kvfs_tmp."
+#define ID_LEN		17		// 64 bits in hex, and a null
+#define KEY_LEN		32		// hex md5
+#define VNODES		64		// ring points per root
+#define COPY_CHUNK	(1 << 20)
+#define OFF_MAX		((off_t) (~(uint64_t) 0 >> 1))
+
+struct point {
+    uint32_t pos;
+    int slot;				// the root's place in the layout
+};
+
+// where objects go: a hash ring over some of the roots, and a stripe
+// unit
+struct layout {
+    int n;
+    int *order;				// slot -> root, slots in id order
+    int *slot_of;			// root -> slot, -1 if not in the layout
+    size_t unit;			// bytes; 0 keeps files whole on their home
+    struct point *points;		// n * VNODES of them, by pos
+};
+
+struct rootq {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct kvfs_rootio *head, *tail;
+    pthread_t *threads;
+    int nthreads;
+    int stop;
+    unsigned int depth;			// queued or running, atomic
+    uint64_t ios, bytes;		// atomic
+};
+
+struct rootio_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+};
+
+static int nroots;
+static char **root_dirs;
+static char (*root_ids)[ID_LEN];
+static struct layout current;
+static struct rootq *queues;
+static int threads_running;
+static int tiered;			// -o tier=1: root 0 fast, root 1 slow
+
+static uint64_t moved_objects, moved_bytes, dropped;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+/////////////////////////////////////////////////////////////////////
+// the ring
+
+static int hex32(const char *s, uint32_t *pos)
+{
+    int i, d;
+
+    *pos = 0;
+    for (i = 0; i < 8; i++) {
+	if (s[i] >= '0' && s[i] <= '9')
+	    d = s[i] - '0';
+	else if (s[i] >= 'a' && s[i] <= 'f')
+	    d = s[i] - 'a' + 10;
+	else
+	    return -1;
+	*pos = *pos << 4 | d;
+    }
+    return 0;
+}
+
+static int is_key(const char *name)
+{
+    int i;
+
+    for (i = 0; i < KEY_LEN; i++)
+	if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+	    return 0;
+    return name[KEY_LEN] == '\0';
+}
+
+// the ring position of a key: its first 32 bits
+static uint32_t key_pos(const char *key)
+{
+    uint32_t pos, h = 2166136261u;
+    const char *p;
+
+    if (hex32(key, &pos) == 0)
+	return pos;
+    // not a key kvfs made, but it still needs a place
+    for (p = key; *p != '\0'; p++)
+	h = (h ^ (unsigned char) *p) * 16777619u;
+    return h;
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+    const struct point *x = a, *y = b;
+
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+static int cmp_root(const void *a, const void *b)
+{
+    return strcmp(root_ids[*(const int *) a], root_ids[*(const int *) b]);
+}
+
+static void free_layout(struct layout *l)
+{
+    free(l->order);
+    free(l->slot_of);
+    free(l->points);
+    memset(l, 0, sizeof(*l));
+}
+
+static int build_layout(struct layout *l, const int *roots, int n, size_t unit)
+{
+    char buf[ID_LEN + 16], *md5;
+    int s, v, i, len;
+
+    l->n = n;
+    l->unit = n > 1 ? unit : 0;
+    l->order = malloc(n * sizeof(int));
+    l->slot_of = malloc(nroots * sizeof(int));
+    l->points = malloc(n * VNODES * sizeof(struct point));
+    if (l->order == NULL || l->slot_of == NULL || l->points == NULL) {
+	free_layout(l);
+	return -ENOMEM;
+    }
+
+    memcpy(l->order, roots, n * sizeof(int));
+    qsort(l->order, n, sizeof(int), cmp_root);
+    for (i = 0; i < nroots; i++)
+	l->slot_of[i] = -1;
+    for (s = 0; s < n; s++)
+	l->slot_of[l->order[s]] = s;
+
+    for (s = 0, i = 0; s < n; s++) {
+	for (v = 0; v < VNODES; v++, i++) {
+	    len = snprintf(buf, sizeof(buf), "%s/%d", root_ids[l->order[s]], v);
+	    md5 = str2md5(buf, len);
+	    if (md5 == NULL) {
+		free_layout(l);
+		return -ENOMEM;
+	    }
+	    hex32(md5, &l->points[i].pos);
+	    l->points[i].slot = s;
+	    free(md5);
+	}
+    }
+    qsort(l->points, n * VNODES, sizeof(struct point), cmp_point);
+    return 0;
+}
+
+static int same_layout(const struct layout *a, const struct layout *b)
+{
+    return a->n == b->n && a->unit == b->unit &&
+	memcmp(a->order, b->order, a->n * sizeof(int)) == 0;
+}
+
+// the slot of key's home
+static int layout_home(const struct layout *l, const char *key)
+{
+    uint32_t pos;
+    int lo = 0, hi = l->n * VNODES, mid;
+
+    if (l->n == 1)
+	return 0;
+    pos = key_pos(key);
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (l->points[mid].pos < pos)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return l->points[lo == l->n * VNODES ? 0 : lo].slot;
+}
+
+// the slot holding byte off of a file homed on slot home
+static int layout_piece(const struct layout *l, int home, off_t off, off_t *end)
+{
+    off_t u;
+
+    if (l->unit == 0) {
+	*end = OFF_MAX;
+	return home;
+    }
+    u = off / l->unit;
+    *end = (u + 1) * l->unit;
+    return (home + u) % l->n;
+}
+
+int kvfs_roots_count(void)
+{
+    return nroots;
+}
+
+const char *kvfs_root_id(int root)
+{
+    return root_ids[root];
+}
+
+const char *kvfs_root_dir(int root)
+{
+    return root_dirs[root];
+}
+
+size_t kvfs_roots_stripe(void)
+{
+    return current.unit;
+}
+
+int kvfs_root_home(const char *key)
+{
+    if (nroots == 1)
+	return 0;
+    if (kvfs_tiering())
+	return kvfs_tier_home(key);
+    return current.order[layout_home(&current, key)];
+}
+
+void kvfs_root_path(char path[PATH_MAX], const char *key)
+{
+    snprintf(path, PATH_MAX, "%s/%s", root_dirs[kvfs_root_home(key)], key);
+}
+
+int kvfs_root_piece(int home, off_t off, off_t *end)
+{
+    return current.order[layout_piece(&current, current.slot_of[home], off, end)];
+}
+
+int kvfs_roots_listed(int root, const char *name)
+{
+    if (nroots == 1)
+	return 1;
+    // pieces of striped files are left to their home to list
+    if (!is_key(name))
+	return root == 0;
+    // not held up by a move: the copy it makes is not listed yet
+    if (kvfs_tiering())
+	return kvfs_tier_where(name) == root;
+    return kvfs_root_home(name) == root;
+}
+
+/////////////////////////////////////////////////////////////////////
+// root ids and membership
+
+// the id of the root at dir, made up now if it has none
+static int root_id(const char *dir, char id[ID_LEN], char *err, size_t errlen)
+{
+    char path[PATH_MAX], buf[ID_LEN + 1];
+    uint64_t r = 0;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, ROOT_ID_FILE);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n > 0) {
+	    buf[n] = '\0';
+	    snprintf(id, ID_LEN, "%016llx", strtoull(buf, NULL, 16));
+	    return 0;
+	}
+    }
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, &r, sizeof(r)) != sizeof(r))
+	r = (uint64_t) time(NULL) << 32 ^ (uint64_t) getpid() << 16 ^ (uintptr_t) dir;
+    if (fd >= 0)
+	close(fd);
+    snprintf(id, ID_LEN, "%016llx", (unsigned long long) r);
+
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    snprintf(buf, sizeof(buf), "%s\n", id);
+    if (fd < 0 || write(fd, buf, ID_LEN) != ID_LEN || fsync(fd) < 0) {
+	snprintf(err, errlen, "%s: %s", path, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int load_roots(struct kvfs_state *state, char *err, size_t errlen)
+{
+    char path[PATH_MAX];
+    int i, j;
+
+    if (state->roots == NULL) {
+	state->roots = &state->rootdir;
+	state->nroots = 1;
+    }
+    nroots = state->nroots;
+    root_dirs = state->roots;
+    if (state->tier && state->mirror) {
+	snprintf(err, errlen, "-o tier and -o mirror do not go together");
+	return -1;
+    }
+    if (state->tier && nroots != 2) {
+	snprintf(err, errlen, "-o tier=1 takes two roots, the fast one first");
+	return -1;
+    }
+    free(root_ids);
+    root_ids = calloc(nroots, ID_LEN);
+    if (root_ids == NULL) {
+	snprintf(err, errlen, "out of memory");
+	return -1;
+    }
+
+    for (i = 0; i < nroots; i++) {
+	if (root_id(root_dirs[i], root_ids[i], err, errlen) < 0)
+	    return -1;
+	for (j = 0; j < i; j++) {
+	    if (strcmp(root_ids[i], root_ids[j]) == 0) {
+		snprintf(err, errlen, "%s and %s are the same root", root_dirs[j], root_dirs[i]);
+		return -1;
+	    }
+	}
+	snprintf(path, sizeof(path), "%s/%s", root_dirs[i], MEMBERS_FILE);
+	// a mirror may have been first; any of them can be
+	if (i > 0 && !state->mirror && access(path, F_OK) == 0) {
+	    snprintf(err, errlen, "%s was the first root before; it has to stay first", root_dirs[i]);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+// the layout the roots were last left in, from .kvfs_roots; *clean
+// says whether the old copies of the move into it were all dropped,
+// *tier whether it was tiers rather than a ring
+static int read_members(char (**ids)[ID_LEN], int *n, size_t *unit, int *clean, int *tier)
+{
+    char path[PATH_MAX], line[64];
+    void *more;
+    FILE *f;
+    int cap = 0;
+
+    *ids = NULL;
+    *n = 0;
+    *unit = 0;
+    *clean = 0;
+    *tier = 0;
+    snprintf(path, sizeof(path), "%s/%s", root_dirs[0], MEMBERS_FILE);
+    f = fopen(path, "r");
+    if (f == NULL)
+	return -errno;
+    while (fgets(line, sizeof(line), f) != NULL) {
+	if (strncmp(line, "stripe ", 7) == 0) {
+	    *unit = strtoull(line + 7, NULL, 10);
+	} else if (strncmp(line, "root ", 5) == 0) {
+	    if (*n == cap) {
+		cap = cap ? 2 * cap : 8;
+		more = realloc(*ids, cap * ID_LEN);
+		if (more == NULL)
+		    break;
+		*ids = more;
+	    }
+	    snprintf((*ids)[(*n)++], ID_LEN, "%.16s", line + 5);
+	} else if (strcmp(line, "clean\n") == 0) {
+	    *clean = 1;
+	} else if (strcmp(line, "tier\n") == 0) {
+	    *tier = 1;
+	}
+    }
+    fclose(f);
+    return 0;
+}
+
+static int write_members(const struct layout *l, int clean)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    FILE *f;
+    int s;
+
+    snprintf(path, sizeof(path), "%s/%s", root_dirs[0], MEMBERS_FILE);
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+	return -ENAMETOOLONG;
+    f = fopen(tmp, "w");
+    if (f == NULL)
+	return log_error("roots fopen");
+    fprintf(f, "stripe %zu\n", l->unit);
+    for (s = 0; s < l->n; s++)
+	fprintf(f, "root %s\n", root_ids[l->order[s]]);
+    if (clean)
+	fprintf(f, "clean\n");
+    if (tiered)
+	fprintf(f, "tier\n");
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+	fclose(f);
+	return log_error("roots fsync");
+    }
+    fclose(f);
+    return log_syscall("rename", rename(tmp, path), 0);
+}
+
+// the roots of the last mount, as indexes into this one's
+static int find_members(char (*ids)[ID_LEN], int n, int *members)
+{
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < nroots && strcmp(ids[i], root_ids[j]) != 0; j++)
+	    ;
+	if (j == nroots)
+	    return i;
+	members[i] = j;
+    }
+    return -1;
+}
+
+int kvfs_roots_check(struct kvfs_state *state)
+{
+    char err[2 * PATH_MAX];
+    char (*ids)[ID_LEN];
+    int *members, n, clean, tier, missing;
+    size_t unit;
+
+    if (load_roots(state, err, sizeof(err)) < 0) {
+	fprintf(stderr, "kvfs: %s\n", err);
+	return -1;
+    }
+    if (read_members(&ids, &n, &unit, &clean, &tier) < 0)
+	return 0;
+    members = malloc((n + 1) * sizeof(int));
+    missing = members == NULL ? -1 : find_members(ids, n, members);
+    if (missing >= 0)
+	fprintf(stderr, "kvfs: the root with id %s is missing; the last mount had %d root(s)\n",
+		ids[missing], n);
+    free(members);
+    free(ids);
+    if (missing >= 0)
+	return -1;
+    // tiers put objects where the ring would not look for them
+    if (tier && !state->tier) {
+	fprintf(stderr, "kvfs: these roots are tiers; mount them with -o tier=1\n");
+	return -1;
+    }
+    if (state->tier && !tier && unit != 0) {
+	fprintf(stderr, "kvfs: files are striped over these roots; they cannot be tiers\n");
+	return -1;
+    }
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// moving objects between roots
+
+static void object_path(char path[PATH_MAX], int root, const char *key)
+{
+    snprintf(path, PATH_MAX, "%s/%s", root_dirs[root], key);
+}
+
+// the scratch name a copy to path is made under
+static void tmp_path(char tmp[PATH_MAX], const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    snprintf(tmp, PATH_MAX, "%.*s/%s%s", (int) (slash - path), path, TMP_PREFIX, slash + 1);
+}
+
+static void punch(int fd, off_t off, off_t len)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (len > 0)
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+#endif
+}
+
+// copy bytes [off, end) of from to the same place in to, leaving
+// holes where from has them
+static int copy_range(int from, int to, off_t off, off_t end)
+{
+    off_t data, hole, pos;
+    ssize_t n = 1;
+    char *buf;
+    int retstat = 0;
+
+    buf = malloc(COPY_CHUNK);
+    if (buf == NULL)
+	return -ENOMEM;
+    while (off < end && n > 0 && retstat == 0) {
+	data = lseek(from, off, SEEK_DATA);
+	if (data < 0)
+	    data = errno == ENXIO ? end : off;	// only a hole left, or no SEEK_DATA
+	if (data > end)
+	    data = end;
+	hole = data < end ? lseek(from, data, SEEK_HOLE) : end;
+	if (hole < 0 || hole > end)
+	    hole = end;
+	punch(to, off, data - off);
+	for (pos = data; pos < hole && retstat == 0; pos += n) {
+	    n = pread(from, buf, hole - pos < COPY_CHUNK ? hole - pos : COPY_CHUNK, pos);
+	    if (n <= 0) {
+		if (n < 0)
+		    retstat = log_error("copy pread");
+		break;
+	    }
+	    if (pwrite(to, buf, n, pos) != n)
+		retstat = log_error("copy pwrite");
+	    COUNT(moved_bytes, n);
+	}
+	off = hole;
+    }
+    free(buf);
+    return retstat;
+}
+
+static void copy_xattrs(const char *src, const char *dst)
+{
+#ifdef HAVE_SYS_XATTR_H
+    char names[4096], value[4096], *name;
+    ssize_t len, vlen;
+
+    len = llistxattr(src, names, sizeof(names));
+    for (name = names; len > 0 && name < names + len; name += strlen(name) + 1) {
+	vlen = lgetxattr(src, name, value, sizeof(value));
+	if (vlen >= 0 && lsetxattr(dst, name, value, vlen, 0) < 0)
+	    log_error("copy lsetxattr");
+    }
+#endif
+}
+
+static void copy_meta(const char *dst, const struct stat *st)
+{
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+    // ownership only sticks for root, as in promote_object()
+    if (lchown(dst, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+	log_error("copy lchown");
+    if (!S_ISLNK(st->st_mode))
+	chmod(dst, st->st_mode & 07777);
+    utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static int copy_object(const char *src, const char *dst, const struct stat *st);
+static int copy_replace(const char *src, const char *dst, const struct stat *st);
+
+// A backing directory holds its id and an empty file for each name in
+// it (see dirid.c); bring dst's in line with src's.  Only the id can
+// differ in what it holds.
+static int sync_entries(const char *src, const char *dst)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dp;
+    int retstat = 0;
+
+    dp = opendir(src);
+    if (dp == NULL)
+	return log_error("copy opendir");
+    while (retstat == 0 && (de = readdir(dp)) != NULL) {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	snprintf(from, sizeof(from), "%s/%s", src, de->d_name);
+	snprintf(to, sizeof(to), "%s/%s", dst, de->d_name);
+	if (lstat(from, &st) < 0)
+	    continue;
+	if (strcmp(de->d_name, KVFS_DIRID_FILE) == 0)
+	    retstat = copy_replace(from, to, &st);
+	else if (access(to, F_OK) < 0)
+	    retstat = copy_object(from, to, &st);
+    }
+    closedir(dp);
+
+    dp = opendir(dst);
+    if (dp == NULL)
+	return retstat;
+    while ((de = readdir(dp)) != NULL) {
+	snprintf(from, sizeof(from), "%s/%s", src, de->d_name);
+	snprintf(to, sizeof(to), "%s/%s", dst, de->d_name);
+	if (lstat(from, &st) < 0 && errno == ENOENT)
+	    unlink(to);
+    }
+    closedir(dp);
+    return retstat;
+}
+
+// make dst, which does not exist, a copy of src
+static int copy_object(const char *src, const char *dst, const struct stat *st)
+{
+    char target[PATH_MAX];
+    ssize_t n;
+    int in, out, retstat = 0;
+
+    if (S_ISREG(st->st_mode)) {
+	in = open(src, O_RDONLY | O_NOFOLLOW);
+	if (in < 0)
+	    return log_error("copy open");
+	out = open(dst, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	if (out < 0) {
+	    retstat = log_error("copy open");
+	    close(in);
+	    return retstat;
+	}
+	retstat = copy_range(in, out, 0, st->st_size);
+	if (retstat == 0 && ftruncate(out, st->st_size) < 0)
+	    retstat = log_error("copy ftruncate");
+	close(in);
+	close(out);
+    } else if (S_ISDIR(st->st_mode)) {
+	if (mkdir(dst, 0700) < 0)
+	    return log_error("copy mkdir");
+	retstat = sync_entries(src, dst);
+    } else if (S_ISLNK(st->st_mode)) {
+	n = readlink(src, target, sizeof(target) - 1);
+	if (n < 0)
+	    return log_error("copy readlink");
+	target[n] = '\0';
+	if (symlink(target, dst) < 0)
+	    return log_error("copy symlink");
+    } else if (mknod(dst, st->st_mode, st->st_rdev) < 0) {
+	return log_error("copy mknod");
+    }
+
+    if (retstat == 0) {
+	copy_xattrs(src, dst);
+	copy_meta(dst, st);
+    }
+    return retstat;
+}
+
+// a directory's entries are removed with it; the directory it stands
+// for is already gone
+static int remove_object(const char *path, const struct stat *st)
+{
+    char entry[PATH_MAX];
+    struct dirent *de;
+    DIR *dp;
+
+    if (!S_ISDIR(st->st_mode))
+	return log_syscall("unlink", unlink(path), 0);
+    chmod(path, st->st_mode | S_IWUSR | S_IXUSR);
+    dp = opendir(path);
+    while (dp != NULL && (de = readdir(dp)) != NULL) {
+	snprintf(entry, sizeof(entry), "%s/%s", path, de->d_name);
+	if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+	    unlink(entry);
+    }
+    if (dp != NULL)
+	closedir(dp);
+    return log_syscall("rmdir", rmdir(path), 0);
+}
+
+// copy src over dst in one rename(), so dst is never half there
+static int copy_replace(const char *src, const char *dst, const struct stat *st)
+{
+    char tmp[PATH_MAX];
+    struct stat tst;
+    int retstat;
+
+    tmp_path(tmp, dst);
+    if (lstat(tmp, &tst) == 0)
+	remove_object(tmp, &tst);
+    retstat = copy_object(src, tmp, st);
+    if (retstat == 0)
+	retstat = log_syscall("rename", rename(tmp, dst), 0);
+    if (retstat < 0 && lstat(tmp, &tst) == 0)
+	remove_object(tmp, &tst);
+    return retstat;
+}
+
+// rename(), or copy and remove when src and dst are on different
+// filesystems
+static int move_object(const char *src, const char *dst)
+{
+    struct stat st;
+    int retstat;
+
+    if (rename(src, dst) == 0)
+	return 0;
+    if (errno != EXDEV)
+	return log_error("rename");
+    if (lstat(src, &st) < 0)
+	return log_error("rename lstat");
+    retstat = copy_replace(src, dst, &st);
+    if (retstat == 0) {
+	remove_object(src, &st);
+	COUNT(moved_objects, 1);
+    }
+    return retstat;
+}
+
+int kvfs_roots_sync(const char *src, const char *dst)
+{
+    struct stat st, dst_st;
+    int retstat = 0;
+
+    if (lstat(src, &st) < 0)
+	return -errno;
+    if (lstat(dst, &dst_st) == 0) {
+	if (S_ISDIR(st.st_mode) && S_ISDIR(dst_st.st_mode)) {
+	    // a directory is its entries and its attributes
+	    chmod(dst, dst_st.st_mode | S_IWUSR | S_IXUSR);
+	    retstat = sync_entries(src, dst);
+	    copy_xattrs(src, dst);
+	    copy_meta(dst, &st);
+	    return retstat;
+	}
+	// rename() will not put one over the other
+	if (S_ISDIR(st.st_mode) || S_ISDIR(dst_st.st_mode))
+	    retstat = remove_object(dst, &dst_st);
+    }
+    return retstat < 0 ? retstat : copy_replace(src, dst, &st);
+}
+
+int kvfs_roots_remove(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) < 0)
+	return -errno;
+    return remove_object(path, &st);
+}
+
+int kvfs_roots_rename(const char *key, const char *actual_path,
+		      const char *newkey, const char *actual_newpath)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    struct stat st;
+    int home, newhome, slot, n = current.n, retstat;
+
+    if (nroots == 1)
+	return log_syscall("rename", rename(actual_path, actual_newpath), 0);
+    if (lstat(actual_path, &st) < 0)
+	return log_error("rename lstat");
+    if (!S_ISREG(st.st_mode) || current.unit == 0)
+	return move_object(actual_path, actual_newpath);
+
+    // a striped file's pieces keep their place relative to its home,
+    // so a new home turns them all round the ring
+    if (lstat(actual_newpath, &st) == 0 && S_ISDIR(st.st_mode))
+	return -EISDIR;
+    home = layout_home(&current, key);
+    newhome = layout_home(&current, newkey);
+    for (slot = 0; slot < n; slot++) {
+	if (slot == home)
+	    continue;
+	object_path(from, current.order[slot], key);
+	object_path(to, current.order[(slot - home + newhome + n) % n], newkey);
+	if (lstat(from, &st) == 0) {
+	    retstat = move_object(from, to);
+	    if (retstat < 0)
+		return retstat;
+	} else {
+	    // no piece here; the replaced file's must not stay
+	    unlink(to);
+	}
+    }
+    return move_object(actual_path, actual_newpath);
+}
+
+int kvfs_roots_link(const char *key, const char *actual_path,
+		    const char *newkey, const char *actual_newpath)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    struct stat st;
+    int home, newhome, i, n = current.n, fd, retstat = 0;
+
+    // links between roots on different filesystems fail with EXDEV,
+    // as they would anywhere
+    if (nroots == 1 || current.unit == 0 || lstat(actual_path, &st) < 0 || !S_ISREG(st.st_mode))
+	return log_syscall("link", link(actual_path, actual_newpath), 0);
+
+    // Every piece is linked, so both names share all the data.  A
+    // piece not written yet is made now; made later through one name,
+    // the other would never see it.
+    home = layout_home(&current, key);
+    newhome = layout_home(&current, newkey);
+    for (i = 1; i < n; i++) {
+	object_path(from, current.order[(home + i) % n], key);
+	object_path(to, current.order[(newhome + i) % n], newkey);
+	fd = open(from, O_CREAT | O_WRONLY | O_NOFOLLOW, 0600);
+	if (fd >= 0)
+	    close(fd);
+	retstat = log_syscall("link", link(from, to), 0);
+	if (retstat < 0)
+	    break;
+    }
+    if (retstat == 0)
+	retstat = log_syscall("link", link(actual_path, actual_newpath), 0);
+    if (retstat == 0)
+	return 0;
+
+    while (--i >= 1) {
+	object_path(to, current.order[(newhome + i) % n], newkey);
+	unlink(to);
+    }
+    return retstat;
+}
+
+/////////////////////////////////////////////////////////////////////
+// changing layout
+
+// root's copy of key, opened once; -1 is not tried yet, -2 missing
+static int piece_fd(int *fds, int root, const char *key, int flags)
+{
+    char path[PATH_MAX];
+
+    if (fds[root] == -2)
+	return -ENOENT;
+    if (fds[root] < 0) {
+	object_path(path, root, key);
+	fds[root] = open(path, flags | O_NOFOLLOW, 0600);
+	if (fds[root] < 0 && errno == ENOENT && !(flags & O_CREAT)) {
+	    fds[root] = -2;
+	    return -ENOENT;
+	}
+	if (fds[root] < 0)
+	    return log_error("relayout open");
+    }
+    return fds[root];
+}
+
+// Pieces link() shares between two names hold the same units, but
+// after a change of layout the names want different ones, and writing
+// or trimming them for one would wreck the other.  So each name gets
+// copies of its own, as between filesystems.
+static int unshare_pieces(const char *key)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int r, retstat;
+
+    for (r = 0; r < nroots; r++) {
+	object_path(path, r, key);
+	if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2)
+	    continue;
+	retstat = copy_replace(path, path, &st);
+	if (retstat < 0)
+	    return retstat;
+    }
+    return 0;
+}
+
+// pass 1 for one object, homed on root in the old layout: copy it, or
+// the byte ranges of it that change roots, to where the new layout
+// wants them
+static int relayout(const char *key, int root, const struct layout *from, const struct layout *to)
+{
+    char path[PATH_MAX], newpath[PATH_MAX];
+    struct stat st;
+    int *in, *out, oldhome, newhome, src, dst, i, retstat = 0;
+    off_t pos, end, e;
+
+    oldhome = layout_home(from, key);
+    newhome = layout_home(to, key);
+    object_path(path, root, key);
+    object_path(newpath, to->order[newhome], key);
+    if (lstat(path, &st) < 0)
+	return log_error("relayout lstat");
+
+    if (!S_ISREG(st.st_mode)) {
+	if (to->order[newhome] == root)
+	    return 0;
+	retstat = copy_replace(path, newpath, &st);
+	if (retstat == 0)
+	    COUNT(moved_objects, 1);
+	return retstat;
+    }
+    if (from->unit != 0 || to->unit != 0) {
+	retstat = unshare_pieces(key);
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    in = malloc(2 * nroots * sizeof(int));
+    if (in == NULL)
+	return -ENOMEM;
+    out = in + nroots;
+    for (i = 0; i < 2 * nroots; i++)
+	in[i] = -1;
+
+    for (pos = 0; pos < st.st_size && retstat >= 0; pos = end) {
+	src = from->order[layout_piece(from, oldhome, pos, &end)];
+	dst = to->order[layout_piece(to, newhome, pos, &e)];
+	if (e < end)
+	    end = e;
+	if (end > st.st_size)
+	    end = st.st_size;
+	if (src == dst)
+	    continue;
+	retstat = piece_fd(in, src, key, O_RDONLY);
+	if (retstat == -ENOENT) {
+	    retstat = 0;		// a piece never written is all hole
+	    continue;
+	}
+	if (retstat >= 0)
+	    retstat = piece_fd(out, dst, key, O_WRONLY | O_CREAT);
+	if (retstat >= 0)
+	    retstat = copy_range(in[src], out[dst], pos, end);
+    }
+
+    // the new home answers for the size and the attributes
+    if (retstat >= 0 && to->order[newhome] != root) {
+	retstat = piece_fd(out, to->order[newhome], key, O_WRONLY | O_CREAT);
+	if (retstat >= 0 && ftruncate(out[to->order[newhome]], st.st_size) < 0)
+	    retstat = log_error("relayout ftruncate");
+    }
+    for (i = 0; i < 2 * nroots; i++)
+	if (in[i] >= 0)
+	    close(in[i]);
+    free(in);
+
+    if (retstat >= 0 && to->order[newhome] != root) {
+	copy_xattrs(path, newpath);
+	copy_meta(newpath, &st);
+	COUNT(moved_objects, 1);
+    }
+    return retstat < 0 ? retstat : 0;
+}
+
+static int relayout_all(const struct layout *from, const struct layout *to)
+{
+    struct dirent *de;
+    DIR *dp;
+    int r, failed = 0;
+
+    for (r = 0; r < nroots; r++) {
+	if (from->slot_of[r] < 0)
+	    continue;			// a new root has nothing to give
+	dp = opendir(root_dirs[r]);
+	if (dp == NULL)
+	    return log_error("relayout opendir");
+	// what is copied in meanwhile is homed elsewhere and skipped
+	while ((de = readdir(dp)) != NULL)
+	    if (is_key(de->d_name) && from->order[layout_home(from, de->d_name)] == r &&
+		relayout(de->d_name, r, from, to) < 0)
+		failed++;
+	closedir(dp);
+    }
+    if (failed > 0)
+	log_msg("    roots: %d object(s) could not be moved\n", failed);
+    return failed > 0 ? -EIO : 0;
+}
+
+// punch out the units of the piece at path that belong to other roots
+// now; drop the piece if it keeps none
+static void trim_piece(const char *path, const struct layout *l, int slot, int home, off_t size)
+{
+    off_t pos, u, first = (slot - home + l->n) % l->n;
+    int fd;
+
+    if (slot != home && first * (off_t) l->unit >= size) {
+	unlink(path);
+	COUNT(dropped, 1);
+	return;
+    }
+    fd = open(path, O_WRONLY | O_NOFOLLOW);
+    if (fd < 0)
+	return;
+    for (pos = lseek(fd, 0, SEEK_DATA); pos >= 0; pos = lseek(fd, (u + 1) * l->unit, SEEK_DATA)) {
+	u = pos / l->unit;
+	if (u % l->n != first)
+	    punch(fd, u * l->unit, l->unit);
+    }
+    close(fd);
+}
+
+// pass 2: with .kvfs_roots naming the new layout, drop every old copy
+// remove name at path if it is a copy a crash left half made
+static int drop_scratch(const char *path, const char *name)
+{
+    struct stat st;
+
+    if (strncmp(name, TMP_PREFIX, strlen(TMP_PREFIX)) != 0)
+	return 0;
+    if (lstat(path, &st) == 0)
+	remove_object(path, &st);
+    return 1;
+}
+
+static void drop_old(const struct layout *l)
+{
+    char path[PATH_MAX], homepath[PATH_MAX];
+    struct stat st, hst;
+    struct dirent *de;
+    DIR *dp;
+    int r, home;
+
+    for (r = 0; r < nroots; r++) {
+	dp = opendir(root_dirs[r]);
+	if (dp == NULL) {
+	    log_error("drop opendir");
+	    continue;
+	}
+	while ((de = readdir(dp)) != NULL) {
+	    object_path(path, r, de->d_name);
+	    if (drop_scratch(path, de->d_name))
+		continue;
+	    if (!is_key(de->d_name) || lstat(path, &st) < 0)
+		continue;
+	    home = layout_home(l, de->d_name);
+	    if (l->order[home] != r && (!S_ISREG(st.st_mode) || l->unit == 0)) {
+		remove_object(path, &st);
+		COUNT(dropped, 1);
+	    } else if (l->unit != 0 && S_ISREG(st.st_mode)) {
+		object_path(homepath, l->order[home], de->d_name);
+		if (lstat(homepath, &hst) == 0)
+		    trim_piece(path, l, l->slot_of[r], home, hst.st_size);
+		else
+		    unlink(path);	// the file is gone
+	    }
+	}
+	closedir(dp);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// I/O threads
+
+static void do_io(struct kvfs_rootio *io)
+{
+    struct rootq *q = &queues[io->root];
+    ssize_t n;
+
+    if (io->call != NULL) {
+	n = io->call(io);
+	io->result = n;
+    } else {
+	if (io->write)
+	    n = pwrite(io->fd, io->buf, io->len, io->off);
+	else
+	    n = pread(io->fd, io->buf, io->len, io->off);
+	io->result = n < 0 ? -errno : n;
+    }
+    COUNT(q->ios, 1);
+    if (n > 0)
+	COUNT(q->bytes, n);
+    __atomic_fetch_sub(&q->depth, 1, __ATOMIC_RELAXED);
+}
+
+static void *rootq_main(void *arg)
+{
+    struct rootq *q = arg;
+    struct kvfs_rootio *io;
+    struct rootio_batch *batch;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+	while (q->head == NULL && !q->stop)
+	    pthread_cond_wait(&q->wake, &q->lock);
+	if (q->head == NULL)
+	    break;
+	io = q->head;
+	q->head = io->next;
+	if (q->head == NULL)
+	    q->tail = NULL;
+	pthread_mutex_unlock(&q->lock);
+
+	batch = io->batch;
+	do_io(io);
+	pthread_mutex_lock(&batch->lock);
+	if (--batch->pending == 0)
+	    pthread_cond_signal(&batch->done);
+	pthread_mutex_unlock(&batch->lock);
+
+	pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+void kvfs_rootio_run(struct kvfs_rootio *io, int n)
+{
+    struct rootio_batch batch;
+    struct rootq *q;
+    int i;
+
+    for (i = 0; i < n; i++)
+	__atomic_fetch_add(&queues[io[i].root].depth, 1, __ATOMIC_RELAXED);
+    if (n == 1 || !threads_running) {
+	for (i = 0; i < n; i++)
+	    do_io(&io[i]);
+	return;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = n - 1;
+    for (i = 1; i < n; i++) {
+	q = &queues[io[i].root];
+	io[i].batch = &batch;
+	io[i].next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail != NULL)
+	    q->tail->next = &io[i];
+	else
+	    q->head = &io[i];
+	q->tail = &io[i];
+	pthread_cond_signal(&q->wake);
+	pthread_mutex_unlock(&q->lock);
+    }
+    // the calling thread takes the first itself
+    do_io(&io[0]);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0)
+	pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    pthread_mutex_destroy(&batch.lock);
+}
+
+unsigned int kvfs_rootio_depth(int root)
+{
+    return __atomic_load_n(&queues[root].depth, __ATOMIC_RELAXED);
+}
+
+static void start_threads(unsigned int nthreads)
+{
+    struct rootq *q;
+    int r, i;
+
+    for (r = 0; r < nroots; r++) {
+	q = &queues[r];
+	q->threads = calloc(nthreads, sizeof(pthread_t));
+	if (q->threads == NULL)
+	    return;
+	for (i = 0; i < (int) nthreads; i++) {
+	    if (pthread_create(&q->threads[i], NULL, rootq_main, q) != 0) {
+		log_error("roots pthread_create");
+		break;
+	    }
+	    q->nthreads++;
+	}
+	threads_running |= q->nthreads > 0;
+    }
+}
+
+static void stop_threads(void)
+{
+    struct rootq *q;
+    int r, i;
+
+    for (r = 0; r < nroots; r++) {
+	q = &queues[r];
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->wake);
+	pthread_mutex_unlock(&q->lock);
+	for (i = 0; i < q->nthreads; i++)
+	    pthread_join(q->threads[i], NULL);
+	free(q->threads);
+	q->threads = NULL;
+	q->nthreads = 0;
+    }
+    threads_running = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+static void roots_report(FILE *out)
+{
+    int r;
+
+    for (r = 0; r < nroots; r++)
+	fprintf(out, "    %s: %llu I/O(s), %.1f MiB, %u in flight\n", root_dirs[r],
+		(unsigned long long) queues[r].ios, queues[r].bytes / 1048576.0,
+		kvfs_rootio_depth(r));
+    if (moved_objects > 0 || dropped > 0)
+	fprintf(out, "    %llu object(s) moved, %.1f MiB copied, %llu old cop(ies) dropped\n",
+		(unsigned long long) moved_objects, moved_bytes / 1048576.0,
+		(unsigned long long) dropped);
+}
+
+int kvfs_roots_init(struct kvfs_state *state)
+{
+    char err[2 * PATH_MAX], path[PATH_MAX];
+    char (*ids)[ID_LEN];
+    struct layout old;
+    int *members, n, clean, was_tiered, r, found, retstat;
+    size_t unit;
+    struct dirent *de;
+    DIR *dp;
+
+    moved_objects = moved_bytes = dropped = 0;
+    if (load_roots(state, err, sizeof(err)) < 0) {
+	log_msg("    roots: %s\n", err);
+	return -EINVAL;
+    }
+
+    queues = calloc(nroots, sizeof(*queues));
+    members = malloc(nroots * sizeof(int));
+    if (queues == NULL || members == NULL)
+	return -ENOMEM;
+    for (r = 0; r < nroots; r++) {
+	pthread_mutex_init(&queues[r].lock, NULL);
+	pthread_cond_init(&queues[r].wake, NULL);
+	members[r] = r;
+    }
+    // mirrors are copies of the first root, not places of their own;
+    // tiers are both places, but not by key
+    tiered = state->tier;
+    if ((state->mirror || tiered) && nroots > 1 && state->stripe != 0)
+	log_msg("    roots: stripe ignored, the roots are %s\n", tiered ? "tiers" : "mirrors");
+    if (state->mirror)
+	retstat = build_layout(&current, members, 1, 0);
+    else if (tiered)
+	retstat = build_layout(&current, members, nroots, 0);
+    else
+	retstat = build_layout(&current, members, nroots, (size_t) state->stripe << 10);
+    if (retstat < 0)
+	return retstat;
+    log_msg("    roots: %d, %zu byte stripe units%s\n", nroots, current.unit,
+	    state->mirror ? ", mirrored" : tiered ? ", tiered" : "");
+
+    // a tree from before kvfs knew of roots is one root of whole files
+    found = read_members(&ids, &n, &unit, &clean, &was_tiered) == 0;
+    if (!found) {
+	n = 1;
+	unit = 0;
+	clean = 1;
+	members[0] = 0;
+    } else if (n > nroots || find_members(ids, n, members) >= 0) {
+	log_msg("    roots: some of the last mount's roots are missing\n");
+	free(ids);
+	return -ENOENT;
+    }
+    free(ids);
+
+    // Nothing moves into tiers: an object of a ring of whole files is
+    // on one root or the other, and tier.c finds it there.  Only a
+    // move it had under way when the last mount died is cleaned up.
+    if (tiered) {
+	free(members);
+	if (found && !was_tiered && unit != 0) {
+	    log_msg("    roots: files are striped, they cannot be tiers\n");
+	    return -EINVAL;
+	}
+	for (r = 0; r < nroots; r++) {
+	    dp = opendir(root_dirs[r]);
+	    while (dp != NULL && (de = readdir(dp)) != NULL) {
+		object_path(path, r, de->d_name);
+		drop_scratch(path, de->d_name);
+	    }
+	    if (dp != NULL)
+		closedir(dp);
+	}
+	write_members(&current, 1);
+	kvfs_stats_register("roots", roots_report);
+	return 0;
+    }
+
+    memset(&old, 0, sizeof(old));
+    retstat = build_layout(&old, members, n, unit);
+    free(members);
+    if (retstat < 0)
+	return retstat;
+
+    if (!same_layout(&old, &current)) {
+	log_msg("    roots: moving objects from %d root(s) with %zu byte units\n", old.n, old.unit);
+	// old copies stay until every object has a new one
+	retstat = relayout_all(&old, &current);
+	if (retstat == 0)
+	    retstat = write_members(&current, 0);
+	if (retstat == 0) {
+	    drop_old(&current);
+	    write_members(&current, 1);
+	}
+	log_msg("    roots: %llu object(s) moved, %llu byte(s) copied, %llu dropped\n",
+		(unsigned long long) moved_objects, (unsigned long long) moved_bytes,
+		(unsigned long long) dropped);
+    } else if (!clean) {
+	drop_old(&current);
+	write_members(&current, 1);
+    } else if (!found) {
+	write_members(&current, 1);
+    }
+    free_layout(&old);
+
+    if ((current.unit != 0 || (state->mirror && nroots > 1)) && state->root_threads > 0)
+	start_threads(state->root_threads);
+    kvfs_stats_register("roots", roots_report);
+    return 0;
+}
+
+void kvfs_roots_destroy(struct kvfs_state *state)
+{
+    int r;
+
+    (void) state;
+    kvfs_stats_unregister("roots");
+    if (queues != NULL) {
+	stop_threads();
+	for (r = 0; r < nroots; r++) {
+	    pthread_cond_destroy(&queues[r].wake);
+	    pthread_mutex_destroy(&queues[r].lock);
+	}
+    }
+    free(queues);
+    queues = NULL;
+    free_layout(&current);
+    free(root_ids);
+    root_ids = NULL;
+}
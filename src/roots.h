@@ -0,0 +1,73 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _ROOTS_H_
+#define _ROOTS_H_
+
+#include <limits.h>
+#include <sys/types.h>
+
+struct kvfs_state;
+
+// Make sure the roots on the command line belong together, before
+// anything is mounted; complaints go to stderr.
+int  kvfs_roots_check(struct kvfs_state *state);
+int  kvfs_roots_init(struct kvfs_state *state);
+void kvfs_roots_destroy(struct kvfs_state *state);
+
+int  kvfs_roots_count(void);
+const char *kvfs_root_dir(int root);
+const char *kvfs_root_id(int root);
+
+// stripe unit in bytes; 0 when files are kept whole on their home root
+size_t kvfs_roots_stripe(void);
+
+// the root the object at key lives on, and its path there
+int  kvfs_root_home(const char *key);
+void kvfs_root_path(char path[PATH_MAX], const char *key);
+
+// the root holding byte off of a file homed on root home; *end is
+// where that root's run of the file ends
+int  kvfs_root_piece(int home, off_t off, off_t *end);
+
+// whether readdir of "/" should list name, found in root's directory
+int  kvfs_roots_listed(int root, const char *name);
+
+// rename() and link() for objects that may be on different roots
+int  kvfs_roots_rename(const char *key, const char *actual_path,
+		       const char *newkey, const char *actual_newpath);
+int  kvfs_roots_link(const char *key, const char *actual_path,
+		     const char *newkey, const char *actual_newpath);
+
+// make the object at dst the same as the one at src, or remove the
+// one at path; both 0 or -errno
+int  kvfs_roots_sync(const char *src, const char *dst);
+int  kvfs_roots_remove(const char *path);
+
+// I/O handed to the threads of the root it goes to: a pread() or
+// pwrite() of fd, or call if it is set
+struct kvfs_rootio {
+    int root;
+    int fd;
+    char *buf;
+    size_t len;
+    off_t off;
+    int write;
+    ssize_t (*call)(struct kvfs_rootio *io);	// returns the result
+    const void *arg;
+    ssize_t result;			// bytes, or -errno
+    struct kvfs_rootio *next;		// private to roots.c
+    struct rootio_batch *batch;
+};
+
+// run io[0..n-1] in parallel, each on its root's threads; returns
+// once all are done
+void kvfs_rootio_run(struct kvfs_rootio *io, int n);
+
+// I/Os queued or running on root
+unsigned int kvfs_rootio_depth(int root);
+
+#endif
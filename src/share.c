@@ -0,0 +1,672 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Fair sharing of I/O.  With -o share=uid (or gid, or pid) every call
+  is put in the class of the caller's uid (gid, pid) from
+  fuse_get_context(), so one batch job cannot starve everybody else
+  on a shared mount.
+
+  Metadata calls are only counted: they never wait behind bulk data,
+  which is what keeps ls and stat snappy while a job streams.  Reads,
+  writes, fsync and fallocate are data calls and go through two
+  stages:
+
+  - a token bucket per class (-o share_rate=MB, off by default).  A
+    class may go up to a second's worth of bytes into debt; a call
+    that leaves it in debt sleeps until the bucket would be refilled.
+
+  - start-time fair queuing between the classes.  At most
+    -o share_slots data calls are in progress at once.  Each call gets
+    a start tag, the later of the current virtual time and the finish
+    tag of its class's previous call, and its class's finish tag moves
+    on by its cost over the class's weight (1, or as given with
+    -o share_weights=ID=W:ID=W...).  A free slot goes to the waiting
+    call with the smallest start tag, so busy classes share the slots
+    in proportion to their weights and an idle class earns no credit.
+
+  The cost of a call is its size in bytes, at least MIN_COST; fsync
+  and fallocate count as SYNC_COST, whatever range they cover.  A waiting call holds its FUSE worker thread,
+  so -o workers should stay well above share_slots.  A read_buf
+  reply may be spliced from the backing file after its slot is given
+  back.
+
+  There are at most MAX_CLASSES classes; later callers share one more.
+  Per-class counts are in the statistics report, to tune weights and
+  rates by.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "share.h"
+#include "stats.h"
+
+#define MAX_CLASSES	256		// a power of two
+#define MAX_WEIGHTS	64
+#define MIN_COST	4096
+#define SYNC_COST	(1 << 20)
+
+enum share_by { BY_UID, BY_GID, BY_PID };
+
+struct share_waiter {
+    struct share_waiter *next;
+    double start;			// start tag
+    pthread_cond_t go;
+    int granted;
+};
+
+struct share_class {
+    long id;				// -1 for the class of everyone else
+    unsigned int weight;
+
+    double tokens;			// bytes; negative is debt
+    uint64_t refilled;			// usec
+
+    double last_finish;			// finish tag of the latest call
+    struct share_waiter *head, *tail;	// calls waiting for a slot
+    struct share_class *next_waiting;	// on the list of classes with calls waiting
+
+    uint64_t meta, data, bytes;
+    uint64_t queued, queue_usec, throttled, throttle_usec;
+};
+
+static struct fuse_operations next;
+static struct fuse_operations shared;
+
+static enum share_by by;
+static const char *by_name;
+static double rate;			// bytes per second per class; 0 is no limit
+static unsigned int slots;
+
+static long weight_ids[MAX_WEIGHTS];
+static unsigned int weights[MAX_WEIGHTS];
+static int nweights;
+
+// open addressing on the id; found without the lock, added with it
+static struct share_class *classes[MAX_CLASSES];
+static struct share_class *others;
+static int nclasses;
+
+static pthread_mutex_t share_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct share_class *waiting;	// classes with calls waiting
+static unsigned int busy;		// slots in use
+static double vtime;			// start tag of the latest call let in
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct share_class *new_class(long id)
+{
+    struct share_class *c = calloc(1, sizeof(*c));
+    int i;
+
+    if (c == NULL)
+	return NULL;
+    c->id = id;
+    c->weight = 1;
+    for (i = 0; i < nweights; i++)
+	if (weight_ids[i] == id)
+	    c->weight = weights[i];
+    c->tokens = rate;
+    c->refilled = now_usec();
+    return c;
+}
+
+// the class of the calling process
+static struct share_class *caller_class(void)
+{
+    struct fuse_context *ctx = fuse_get_context();
+    struct share_class *c;
+    long id;
+    unsigned int i, n;
+
+    id = by == BY_UID ? (long) ctx->uid : by == BY_GID ? (long) ctx->gid : (long) ctx->pid;
+    i = (unsigned long) id * 2654435761UL % MAX_CLASSES;
+    for (n = 0; n < MAX_CLASSES; n++, i = (i + 1) % MAX_CLASSES) {
+	c = __atomic_load_n(&classes[i], __ATOMIC_ACQUIRE);
+	if (c == NULL)
+	    break;
+	if (c->id == id)
+	    return c;
+    }
+
+    pthread_mutex_lock(&share_lock);
+    // someone may have added it meanwhile, in this slot or a later one
+    for (; n < MAX_CLASSES; n++, i = (i + 1) % MAX_CLASSES) {
+	c = classes[i];
+	if (c == NULL || c->id == id)
+	    break;
+    }
+    if (c == NULL && nclasses < MAX_CLASSES * 3 / 4) {
+	c = new_class(id);
+	if (c != NULL) {
+	    __atomic_store_n(&classes[i], c, __ATOMIC_RELEASE);
+	    nclasses++;
+	}
+    }
+    pthread_mutex_unlock(&share_lock);
+    return c != NULL ? c : others;
+}
+
+static void sleep_usec(uint64_t usec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	;
+}
+
+// with share_lock held: hand free slots to the waiting calls with the
+// smallest start tags
+static void dispatch(void)
+{
+    struct share_class *c, **best, **pc;
+    struct share_waiter *w;
+
+    while (busy < slots && waiting != NULL) {
+	best = &waiting;
+	for (pc = &waiting; *pc != NULL; pc = &(*pc)->next_waiting)
+	    if ((*pc)->head->start < (*best)->head->start)
+		best = pc;
+	c = *best;
+	w = c->head;
+	c->head = w->next;
+	if (c->head == NULL) {
+	    c->tail = NULL;
+	    *best = c->next_waiting;
+	}
+	vtime = w->start;
+	busy++;
+	w->granted = 1;
+	pthread_cond_signal(&w->go);
+    }
+}
+
+// wait until a data call of size bytes, costing cost, may go ahead
+static void enter(size_t size, double cost)
+{
+    struct share_class *c = caller_class();
+    struct share_waiter w;
+    uint64_t t0, wait;
+
+    COUNT(c->data, 1);
+    COUNT(c->bytes, size);
+    pthread_mutex_lock(&share_lock);
+    if (rate > 0) {
+	t0 = now_usec();
+	c->tokens += (t0 - c->refilled) * rate / 1e6;
+	if (c->tokens > rate)
+	    c->tokens = rate;
+	c->refilled = t0;
+	c->tokens -= cost;
+	if (c->tokens < 0) {
+	    wait = -c->tokens * 1e6 / rate;
+	    c->throttled++;
+	    c->throttle_usec += wait;
+	    pthread_mutex_unlock(&share_lock);
+	    sleep_usec(wait);
+	    pthread_mutex_lock(&share_lock);
+	}
+    }
+
+    w.start = c->last_finish > vtime ? c->last_finish : vtime;
+    c->last_finish = w.start + cost / c->weight;
+    if (busy < slots && waiting == NULL) {
+	vtime = w.start;
+	busy++;
+	pthread_mutex_unlock(&share_lock);
+	return;
+    }
+
+    w.next = NULL;
+    w.granted = 0;
+    pthread_cond_init(&w.go, NULL);
+    if (c->tail != NULL) {
+	c->tail->next = &w;
+    } else {
+	c->head = &w;
+	c->next_waiting = waiting;
+	waiting = c;
+    }
+    c->tail = &w;
+    t0 = now_usec();
+    while (!w.granted)
+	pthread_cond_wait(&w.go, &share_lock);
+    c->queued++;
+    c->queue_usec += now_usec() - t0;
+    pthread_mutex_unlock(&share_lock);
+    pthread_cond_destroy(&w.go);
+}
+
+static void leave(void)
+{
+    pthread_mutex_lock(&share_lock);
+    busy--;
+    dispatch();
+    pthread_mutex_unlock(&share_lock);
+}
+
+static void meta(void)
+{
+    struct share_class *c = caller_class();
+
+    COUNT(c->meta, 1);
+}
+
+static size_t bufvec_size(const struct fuse_bufvec *bufv)
+{
+    size_t i, size = 0;
+
+    for (i = 0; i < bufv->count; i++)
+	size += bufv->buf[i].size;
+    return size;
+}
+
+static double size_cost(size_t size)
+{
+    return size < MIN_COST ? MIN_COST : size;
+}
+
+static int share_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+    int ret;
+
+    enter(size, size_cost(size));
+    ret = next.read(path, buf, size, offset, fi);
+    leave();
+    return ret;
+}
+
+static int share_write(const char *path, const char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+    int ret;
+
+    enter(size, size_cost(size));
+    ret = next.write(path, buf, size, offset, fi);
+    leave();
+    return ret;
+}
+
+static int share_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+    int ret;
+
+    enter(size, size_cost(size));
+    ret = next.read_buf(path, bufp, size, offset, fi);
+    leave();
+    return ret;
+}
+
+static int share_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+			   struct fuse_file_info *fi)
+{
+    size_t size = bufvec_size(buf);
+    int ret;
+
+    enter(size, size_cost(size));
+    ret = next.write_buf(path, buf, offset, fi);
+    leave();
+    return ret;
+}
+
+static int share_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int ret;
+
+    enter(0, SYNC_COST);
+    ret = next.fsync(path, datasync, fi);
+    leave();
+    return ret;
+}
+
+static int share_fallocate(const char *path, int mode, off_t offset, off_t len,
+			   struct fuse_file_info *fi)
+{
+    int ret;
+
+    // allocating or punching a range moves no data: the length is not
+    // what it costs
+    enter(0, SYNC_COST);
+    ret = next.fallocate(path, mode, offset, len, fi);
+    leave();
+    return ret;
+}
+
+// the metadata calls are counted and passed straight on
+
+static int share_getattr(const char *path, struct stat *statbuf)
+{
+    meta();
+    return next.getattr(path, statbuf);
+}
+
+static int share_readlink(const char *path, char *link, size_t size)
+{
+    meta();
+    return next.readlink(path, link, size);
+}
+
+static int share_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    meta();
+    return next.mknod(path, mode, dev);
+}
+
+static int share_mkdir(const char *path, mode_t mode)
+{
+    meta();
+    return next.mkdir(path, mode);
+}
+
+static int share_unlink(const char *path)
+{
+    meta();
+    return next.unlink(path);
+}
+
+static int share_rmdir(const char *path)
+{
+    meta();
+    return next.rmdir(path);
+}
+
+static int share_symlink(const char *path, const char *link)
+{
+    meta();
+    return next.symlink(path, link);
+}
+
+static int share_rename(const char *path, const char *newpath)
+{
+    meta();
+    return next.rename(path, newpath);
+}
+
+static int share_link(const char *path, const char *newpath)
+{
+    meta();
+    return next.link(path, newpath);
+}
+
+static int share_chmod(const char *path, mode_t mode)
+{
+    meta();
+    return next.chmod(path, mode);
+}
+
+static int share_chown(const char *path, uid_t uid, gid_t gid)
+{
+    meta();
+    return next.chown(path, uid, gid);
+}
+
+static int share_truncate(const char *path, off_t newsize)
+{
+    meta();
+    return next.truncate(path, newsize);
+}
+
+static int share_utime(const char *path, struct utimbuf *ubuf)
+{
+    meta();
+    return next.utime(path, ubuf);
+}
+
+static int share_open(const char *path, struct fuse_file_info *fi)
+{
+    meta();
+    return next.open(path, fi);
+}
+
+static int share_statfs(const char *path, struct statvfs *statv)
+{
+    meta();
+    return next.statfs(path, statv);
+}
+
+static int share_flush(const char *path, struct fuse_file_info *fi)
+{
+    meta();
+    return next.flush(path, fi);
+}
+
+static int share_release(const char *path, struct fuse_file_info *fi)
+{
+    meta();
+    return next.release(path, fi);
+}
+
+static int share_setxattr(const char *path, const char *name, const char *value,
+			  size_t size, int flags)
+{
+    meta();
+    return next.setxattr(path, name, value, size, flags);
+}
+
+static int share_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    meta();
+    return next.getxattr(path, name, value, size);
+}
+
+static int share_listxattr(const char *path, char *list, size_t size)
+{
+    meta();
+    return next.listxattr(path, list, size);
+}
+
+static int share_removexattr(const char *path, const char *name)
+{
+    meta();
+    return next.removexattr(path, name);
+}
+
+static int share_opendir(const char *path, struct fuse_file_info *fi)
+{
+    meta();
+    return next.opendir(path, fi);
+}
+
+static int share_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+			 struct fuse_file_info *fi)
+{
+    meta();
+    return next.readdir(path, buf, filler, offset, fi);
+}
+
+static int share_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    meta();
+    return next.releasedir(path, fi);
+}
+
+static int share_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    meta();
+    return next.fsyncdir(path, datasync, fi);
+}
+
+static int share_access(const char *path, int mask)
+{
+    meta();
+    return next.access(path, mask);
+}
+
+static int share_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    meta();
+    return next.ftruncate(path, offset, fi);
+}
+
+static int share_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+    meta();
+    return next.fgetattr(path, statbuf, fi);
+}
+
+static void report_class(FILE *out, struct share_class *c)
+{
+    if (c->id < 0)
+	fprintf(out, "    everyone else");
+    else
+	fprintf(out, "    %s %ld", by_name, c->id);
+    fprintf(out, ", weight %u: %llu metadata, %llu data call(s), %.1f MiB; "
+	    "%llu queued %.2f s, %llu throttled %.2f s\n",
+	    c->weight, (unsigned long long) c->meta, (unsigned long long) c->data,
+	    c->bytes / 1048576.0, (unsigned long long) c->queued, c->queue_usec / 1e6,
+	    (unsigned long long) c->throttled, c->throttle_usec / 1e6);
+}
+
+static void share_report(FILE *out)
+{
+    int i;
+
+    pthread_mutex_lock(&share_lock);
+    fprintf(out, "    by %s, %u slot(s), ", by_name, slots);
+    if (rate > 0)
+	fprintf(out, "%.1f MB/s per class\n", rate / 1e6);
+    else
+	fprintf(out, "no rate limit\n");
+    for (i = 0; i < MAX_CLASSES; i++)
+	if (classes[i] != NULL)
+	    report_class(out, classes[i]);
+    if (others->meta + others->data > 0)
+	report_class(out, others);
+    pthread_mutex_unlock(&share_lock);
+}
+
+static void share_destroy(void *userdata)
+{
+    int i;
+
+    if (next.destroy != NULL)
+	next.destroy(userdata);
+    kvfs_stats_unregister("share");
+    for (i = 0; i < MAX_CLASSES; i++) {
+	free(classes[i]);
+	classes[i] = NULL;
+    }
+    free(others);
+    others = NULL;
+    nclasses = 0;
+}
+
+// ID=W:ID=W...
+static int parse_weights(const char *s)
+{
+    char *end;
+    long id, w;
+
+    nweights = 0;
+    while (s != NULL && *s != '\0') {
+	id = strtol(s, &end, 10);
+	if (end == s || *end != '=')
+	    return -1;
+	s = end + 1;
+	w = strtol(s, &end, 10);
+	if (end == s || w < 1 || (*end != ':' && *end != '\0') || nweights == MAX_WEIGHTS)
+	    return -1;
+	weight_ids[nweights] = id;
+	weights[nweights] = w;
+	nweights++;
+	s = *end == ':' ? end + 1 : end;
+    }
+    return 0;
+}
+
+// every call kvfs implements is wrapped; the rest stay NULL
+#define WRAP(op) shared.op = next.op != NULL ? share_##op : NULL
+
+struct fuse_operations *kvfs_share_wrap(const struct fuse_operations *ops, struct kvfs_state *state)
+{
+    if (strcmp(state->share, "uid") == 0) {
+	by = BY_UID;
+    } else if (strcmp(state->share, "gid") == 0) {
+	by = BY_GID;
+    } else if (strcmp(state->share, "pid") == 0) {
+	by = BY_PID;
+    } else {
+	fprintf(stderr, "kvfs: share=%s: share by uid, gid or pid\n", state->share);
+	return NULL;
+    }
+    by_name = state->share;
+    if (parse_weights(state->share_weights) < 0) {
+	fprintf(stderr, "kvfs: share_weights=%s: give ID=WEIGHT:ID=WEIGHT..., weights 1 or more\n",
+		state->share_weights);
+	return NULL;
+    }
+    if (state->share_slots == 0) {
+	fprintf(stderr, "kvfs: share_slots=0: at least one call has to be let in\n");
+	return NULL;
+    }
+    rate = state->share_rate * 1e6;
+    slots = state->share_slots;
+    others = new_class(-1);
+    if (others == NULL) {
+	perror("kvfs share");
+	return NULL;
+    }
+    waiting = NULL;
+    busy = 0;
+    vtime = 0;
+
+    next = *ops;
+    shared = *ops;
+    WRAP(getattr);
+    WRAP(readlink);
+    WRAP(mknod);
+    WRAP(mkdir);
+    WRAP(unlink);
+    WRAP(rmdir);
+    WRAP(symlink);
+    WRAP(rename);
+    WRAP(link);
+    WRAP(chmod);
+    WRAP(chown);
+    WRAP(truncate);
+    WRAP(utime);
+    WRAP(open);
+    WRAP(read);
+    WRAP(write);
+    WRAP(read_buf);
+    WRAP(write_buf);
+    WRAP(statfs);
+    WRAP(flush);
+    WRAP(release);
+    WRAP(fsync);
+    WRAP(setxattr);
+    WRAP(getxattr);
+    WRAP(listxattr);
+    WRAP(removexattr);
+    WRAP(opendir);
+    WRAP(readdir);
+    WRAP(releasedir);
+    WRAP(fsyncdir);
+    WRAP(access);
+    WRAP(ftruncate);
+    WRAP(fgetattr);
+    WRAP(fallocate);
+    shared.destroy = share_destroy;
+
+    kvfs_stats_register("share", share_report);
+    return &shared;
+}
@@ -0,0 +1,21 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Fair sharing of I/O between users, groups or processes (-o share=),
+  see share.c.
+*/
+
+#ifndef _SHARE_H_
+#define _SHARE_H_
+
+struct fuse_operations;
+struct kvfs_state;
+
+// Return an operations table that queues the reads and writes of
+// every class of caller fairly before passing them on to ops; NULL,
+// after saying why on stderr, if state's share options are bad.
+struct fuse_operations *kvfs_share_wrap(const struct fuse_operations *ops, struct kvfs_state *state);
+
+#endif
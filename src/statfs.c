@@ -0,0 +1,226 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Cached statfs().
+
+  Every object lives on the backing filesystems of the roots, so
+  statfs() has the same answer whatever path it is asked about: the
+  sum over the roots, counting a filesystem shared by several once
+  and scaled to the first root's block size.  Mirrored roots each
+  hold everything, so there free space is the smallest of theirs.  df
+  and monitoring agents poll it constantly; rather than a statvfs()
+  per call, a refresher thread keeps a copy in kvfs_state and statfs()
+  just copies that out.
+
+  The copy is refreshed every statfs_interval seconds, and early once
+  statfs_dirty MiB have been written since the last refresh, so free
+  space does not lag far behind a large write.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "mirror.h"
+#include "roots.h"
+#include "stats.h"
+#include "statfs.h"
+
+static struct kvfs_state *statfs_state;
+static pthread_t refresh_thread;
+static pthread_cond_t refresh_wake = PTHREAD_COND_INITIALIZER;
+static int refresh_running;
+static int refresh_stop;		// under statfs_lock
+static int wake_pending;		// likewise; a write crossed statfs_dirty
+
+static uint64_t dirty_max;		// bytes
+static uint64_t dirty_bytes;		// written since the last refresh, atomic
+
+static uint64_t hits, refreshes, early_refreshes;
+
+int kvfs_statfs_roots(struct statvfs *statv)
+{
+    struct statvfs sv;
+    unsigned long fsids[64];
+    uint64_t bfree, bavail;
+    int r, i, n = 0;
+
+    if (statvfs(kvfs_root_dir(0), statv) < 0)
+	return -errno;
+    fsids[n++] = statv->f_fsid;
+    for (r = 1; r < kvfs_roots_count(); r++) {
+	if (statvfs(kvfs_root_dir(r), &sv) < 0)
+	    return -errno;
+	if (kvfs_mirroring()) {
+	    // the fullest copy decides what still fits
+	    bfree = (uint64_t) sv.f_bfree * sv.f_frsize / statv->f_frsize;
+	    bavail = (uint64_t) sv.f_bavail * sv.f_frsize / statv->f_frsize;
+	    if (bfree < statv->f_bfree)
+		statv->f_bfree = bfree;
+	    if (bavail < statv->f_bavail)
+		statv->f_bavail = bavail;
+	    if (sv.f_ffree < statv->f_ffree)
+		statv->f_ffree = sv.f_ffree;
+	    if (sv.f_favail < statv->f_favail)
+		statv->f_favail = sv.f_favail;
+	    continue;
+	}
+	for (i = 0; i < n && fsids[i] != sv.f_fsid; i++)
+	    ;
+	if (i < n)
+	    continue;
+	if (n < (int) (sizeof(fsids) / sizeof(fsids[0])))
+	    fsids[n++] = sv.f_fsid;
+	// block counts are in f_frsize units
+	statv->f_blocks += (uint64_t) sv.f_blocks * sv.f_frsize / statv->f_frsize;
+	statv->f_bfree += (uint64_t) sv.f_bfree * sv.f_frsize / statv->f_frsize;
+	statv->f_bavail += (uint64_t) sv.f_bavail * sv.f_frsize / statv->f_frsize;
+	statv->f_files += sv.f_files;
+	statv->f_ffree += sv.f_ffree;
+	statv->f_favail += sv.f_favail;
+    }
+    return 0;
+}
+
+static void refresh(struct kvfs_state *state)
+{
+    struct statvfs sv;
+    int retstat;
+
+    // an early refresh accounts for everything written so far
+    __atomic_store_n(&dirty_bytes, 0, __ATOMIC_RELAXED);
+    retstat = kvfs_statfs_roots(&sv);
+
+    pthread_mutex_lock(&state->statfs_lock);
+    if (retstat == 0) {
+	state->statfs_cache = sv;
+	state->statfs_valid = 1;
+    }
+    refreshes++;
+    pthread_mutex_unlock(&state->statfs_lock);
+
+    if (retstat < 0)
+	log_msg("    ERROR statfs refresh statvfs: %s\n", strerror(-retstat));
+}
+
+static void *refresh_main(void *arg)
+{
+    struct kvfs_state *state = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&state->statfs_lock);
+    while (!refresh_stop) {
+	// a wakeup sent while the last refresh ran is not lost
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += state->statfs_interval;
+	while (!wake_pending && !refresh_stop)
+	    if (pthread_cond_timedwait(&refresh_wake, &state->statfs_lock, &deadline) == ETIMEDOUT)
+		break;
+	if (refresh_stop)
+	    break;
+	if (wake_pending)
+	    early_refreshes++;
+	wake_pending = 0;
+	pthread_mutex_unlock(&state->statfs_lock);
+	refresh(state);
+	pthread_mutex_lock(&state->statfs_lock);
+    }
+    pthread_mutex_unlock(&state->statfs_lock);
+    return NULL;
+}
+
+static void statfs_report(FILE *out)
+{
+    struct kvfs_state *state = statfs_state;
+
+    pthread_mutex_lock(&state->statfs_lock);
+    fprintf(out, "    %llu call(s) from the cache, %llu refresh(es), %llu after writes\n",
+	    (unsigned long long) hits, (unsigned long long) refreshes,
+	    (unsigned long long) early_refreshes);
+    pthread_mutex_unlock(&state->statfs_lock);
+}
+
+int kvfs_statfs_init(struct kvfs_state *state)
+{
+    statfs_state = state;
+    pthread_mutex_init(&state->statfs_lock, NULL);
+    state->statfs_valid = 0;
+    hits = refreshes = early_refreshes = 0;
+    dirty_max = (uint64_t) state->statfs_dirty << 20;
+    dirty_bytes = 0;
+    refresh_stop = 0;
+    wake_pending = 0;
+
+    if (state->statfs_interval == 0)
+	return 0;
+
+    // the first statfs() should not have to wait for the thread
+    refresh(state);
+    if (pthread_create(&refresh_thread, NULL, refresh_main, state) != 0)
+	return log_error("statfs pthread_create");
+    refresh_running = 1;
+
+    log_msg("    statfs cache: interval = %u s, dirty = %u MiB\n",
+	    state->statfs_interval, state->statfs_dirty);
+    kvfs_stats_register("statfs", statfs_report);
+    return 0;
+}
+
+void kvfs_statfs_destroy(struct kvfs_state *state)
+{
+    if (!refresh_running)
+	return;
+
+    pthread_mutex_lock(&state->statfs_lock);
+    refresh_stop = 1;
+    pthread_cond_signal(&refresh_wake);
+    pthread_mutex_unlock(&state->statfs_lock);
+    pthread_join(refresh_thread, NULL);
+    refresh_running = 0;
+
+    kvfs_stats_unregister("statfs");
+    state->statfs_valid = 0;
+}
+
+int kvfs_statfs_cached(struct statvfs *statv)
+{
+    struct kvfs_state *state = statfs_state;
+    int retstat = -EAGAIN;
+
+    if (state == NULL || !refresh_running)
+	return retstat;
+
+    pthread_mutex_lock(&state->statfs_lock);
+    if (state->statfs_valid) {
+	*statv = state->statfs_cache;
+	hits++;
+	retstat = 0;
+    }
+    pthread_mutex_unlock(&state->statfs_lock);
+    return retstat;
+}
+
+void kvfs_statfs_written(ssize_t bytes)
+{
+    uint64_t total;
+
+    if (bytes <= 0 || dirty_max == 0 || !refresh_running)
+	return;
+
+    // only the write that crosses the threshold wakes the refresher,
+    // which finds wake_pending set if it was refreshing just then
+    total = __atomic_add_fetch(&dirty_bytes, bytes, __ATOMIC_RELAXED);
+    if (total >= dirty_max && total - bytes < dirty_max) {
+	pthread_mutex_lock(&statfs_state->statfs_lock);
+	wake_pending = 1;
+	pthread_cond_signal(&refresh_wake);
+	pthread_mutex_unlock(&statfs_state->statfs_lock);
+    }
+}
@@ -0,0 +1,29 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _STATFS_H_
+#define _STATFS_H_
+
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+struct kvfs_state;
+
+int  kvfs_statfs_init(struct kvfs_state *state);
+void kvfs_statfs_destroy(struct kvfs_state *state);
+
+// copy the cached statvfs to statv; -EAGAIN if there is none (the
+// cache is off or the first refresh failed), and the caller should
+// ask the backing filesystem itself
+int  kvfs_statfs_cached(struct statvfs *statv);
+
+// statvfs of every root together
+int  kvfs_statfs_roots(struct statvfs *statv);
+
+// count bytes written; enough of them bring the next refresh forward
+void kvfs_statfs_written(ssize_t bytes);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Runtime statistics, see stats.h.
+
+  SIGUSR1 is blocked in main() before fuse starts any threads, so it
+  is only ever delivered here, to a thread sitting in sigwait(); the
+  reports therefore run in an ordinary thread and may take locks.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "stats.h"
+
+#define MAX_REPORTS 32
+
+struct report {
+    const char *name;
+    kvfs_stats_report fn;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct report reports[MAX_REPORTS];
+static int nreports;
+
+static FILE *stats_out;
+static pthread_t signal_thread;
+static int signal_running;
+static volatile int signal_stop;
+
+void kvfs_stats_register(const char *name, kvfs_stats_report fn)
+{
+    pthread_mutex_lock(&stats_lock);
+    if (nreports < MAX_REPORTS) {
+	reports[nreports].name = name;
+	reports[nreports].fn = fn;
+	nreports++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void kvfs_stats_unregister(const char *name)
+{
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < nreports; i++) {
+	if (strcmp(reports[i].name, name) == 0) {
+	    memmove(&reports[i], &reports[i + 1], (nreports - i - 1) * sizeof(reports[0]));
+	    nreports--;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void kvfs_stats_dump(FILE *out)
+{
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    fprintf(out, "\nkvfs statistics\n");
+    for (i = 0; i < nreports; i++) {
+	fprintf(out, "  %s:\n", reports[i].name);
+	reports[i].fn(out);
+    }
+    fflush(out);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void *signal_main(void *arg)
+{
+    sigset_t set;
+    int sig;
+
+    (void) arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (sigwait(&set, &sig) == 0 && !signal_stop)
+	kvfs_stats_dump(stats_out);
+    return NULL;
+}
+
+int kvfs_stats_init(struct kvfs_state *state)
+{
+    stats_out = state->logfile;
+    signal_stop = 0;
+    if (pthread_create(&signal_thread, NULL, signal_main, NULL) != 0)
+	return log_error("stats pthread_create");
+    signal_running = 1;
+    return 0;
+}
+
+void kvfs_stats_destroy(struct kvfs_state *state)
+{
+    (void) state;
+
+    if (signal_running) {
+	signal_stop = 1;
+	pthread_kill(signal_thread, SIGUSR1);
+	pthread_join(signal_thread, NULL);
+	signal_running = 0;
+    }
+    kvfs_stats_dump(stats_out);
+}
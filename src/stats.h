@@ -0,0 +1,27 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Runtime statistics.  Subsystems register a report function; every
+  report is written to the logfile when the filesystem is unmounted,
+  and on demand when kvfs receives SIGUSR1.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+
+struct kvfs_state;
+
+typedef void (*kvfs_stats_report)(FILE *out);
+
+int  kvfs_stats_init(struct kvfs_state *state);
+void kvfs_stats_destroy(struct kvfs_state *state);
+
+void kvfs_stats_register(const char *name, kvfs_stats_report report);
+void kvfs_stats_unregister(const char *name);
+void kvfs_stats_dump(FILE *out);
+
+#endif
@@ -0,0 +1,846 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Generic half of the object stores: picks the backend named by
+  -o backend=, keeps the table of open objects and turns FUSE's
+  byte-range reads and writes into whole-value backend calls.
+
+  A value being written is held in memory whole and put back whole on
+  flush, so two kinds of value are moved out to a backing file under
+  rootdir instead, where writes and fsyncs only touch what changed:
+  one over -o value_max MiB, before the first write or truncate pulls
+  it into memory (copied across a chunk at a time), and one that
+  fsync keeps rewriting.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mirror.h"
+#include "roots.h"
+#include "store.h"
+#include "stripe.h"
+#include "sync.h"
+
+static struct kvfs_store_ops *store_backends[] = {
+    &kvfs_log_store,
+    &kvfs_lsm_store,
+    &kvfs_dedup_store,
+    NULL
+};
+
+static struct kvfs_store_ops *store;
+
+// nonzero when the store only holds files up to inline_max bytes
+static int promote;
+static off_t inline_max;
+
+// fsyncs that put a whole value before it moves to a backing file;
+// values smaller than FSYNC_PROMOTE_MIN are cheap to rewrite and stay
+#define FSYNC_PROMOTE_MIN 65536
+static unsigned int fsync_promote;
+
+// values bigger than this are not written in memory; 0 if any size is
+static off_t value_max;
+
+// how much of a value promote_object() copies at a time
+#define PROMOTE_CHUNK	(1 << 20)
+
+// objects with at least one open handle
+static struct htable open_objects;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void meta_to_stat(const struct kvfs_meta *meta, struct stat *statbuf)
+{
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_mode = meta->mode;
+    statbuf->st_nlink = 1;
+    statbuf->st_uid = meta->uid;
+    statbuf->st_gid = meta->gid;
+    statbuf->st_size = meta->size;
+    statbuf->st_blksize = 4096;
+    statbuf->st_blocks = (meta->size + 511) / 512;
+    statbuf->st_atime = meta->atime;
+    statbuf->st_mtime = meta->mtime;
+    statbuf->st_ctime = meta->ctime;
+}
+
+// FNV-1a, used by the backends to catch torn or damaged records
+uint32_t kvfs_store_sum(uint32_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len--) {
+	h ^= *p++;
+	h *= 16777619;
+    }
+    return h;
+}
+
+void kvfs_meta_pack(const struct kvfs_meta *meta, struct kvfs_disk_meta *dm)
+{
+    memset(dm, 0, sizeof(*dm));
+    dm->mode = meta->mode;
+    dm->uid = meta->uid;
+    dm->gid = meta->gid;
+    dm->size = meta->size;
+    dm->atime = meta->atime;
+    dm->mtime = meta->mtime;
+    dm->ctime = meta->ctime;
+}
+
+void kvfs_meta_unpack(const struct kvfs_disk_meta *dm, struct kvfs_meta *meta)
+{
+    meta->mode = dm->mode;
+    meta->uid = dm->uid;
+    meta->gid = dm->gid;
+    meta->size = dm->size;
+    meta->atime = dm->atime;
+    meta->mtime = dm->mtime;
+    meta->ctime = dm->ctime;
+}
+
+int kvfs_store_init(struct kvfs_state *state)
+{
+    struct kvfs_store_ops *backend;
+    int i, retstat;
+
+    state->store = NULL;
+    inline_max = state->inline_max;
+    promote = 0;
+    // a backing file is on one root, see promote_object()
+    fsync_promote = kvfs_striping() ? 0 : state->fsync_promote;
+    value_max = kvfs_striping() ? 0 : (off_t) state->value_max << 20;
+
+    // the store's files are its own, and only objects are mirrored
+    if (kvfs_mirroring() && ((state->backend != NULL && strcmp(state->backend, "file") != 0) ||
+			     inline_max != 0)) {
+	log_msg("    object store ignored: the roots are mirrors\n");
+	return 0;
+    }
+
+    if (state->backend == NULL || strcmp(state->backend, "file") == 0) {
+	if (inline_max == 0) {
+	    if (state->compress != NULL)
+		log_msg("    compress=%s needs an object store backend, ignored\n", state->compress);
+	    return 0;
+	}
+	// a promoted file keeps writing through its own fd, which
+	// knows nothing of the other roots' pieces
+	if (kvfs_striping()) {
+	    log_msg("    inline_max ignored: files are striped\n");
+	    return 0;
+	}
+	// tiny files live in the log store's index until they grow
+	for (i = 0; store_backends[i] != NULL; i++)
+	    if (store_backends[i] == &kvfs_log_store)
+		break;
+	promote = 1;
+    } else {
+	for (i = 0; store_backends[i] != NULL; i++)
+	    if (strcmp(store_backends[i]->name, state->backend) == 0)
+		break;
+    }
+    if (store_backends[i] == NULL) {
+	log_msg("    unknown backend \"%s\", using plain files\n", state->backend);
+	return -EINVAL;
+    }
+
+    backend = store_backends[i];
+    if (state->compress != NULL) {
+	if (promote) {
+	    log_msg("    compress=%s ignored: inline files are too small to bother\n", state->compress);
+	} else if ((backend = kvfs_compress_wrap(store_backends[i], state->compress)) == NULL) {
+	    log_msg("    compress=%s: unknown or not compiled in\n", state->compress);
+	    return -EINVAL;
+	}
+    }
+
+    if (htable_init(&open_objects, 256) < 0)
+	return -ENOMEM;
+
+    retstat = backend->open(state);
+    if (retstat < 0) {
+	log_msg("    backend %s failed to open: %s\n", state->backend, strerror(-retstat));
+	htable_free(&open_objects, NULL);
+	return retstat;
+    }
+
+    store = state->store = backend;
+    log_msg("    backend: %s%s%s%s\n", store_backends[i]->name,
+	    promote ? " (files up to inline_max only)" : "",
+	    backend != store_backends[i] ? ", compressed with " : "",
+	    backend != store_backends[i] ? state->compress : "");
+    if (fsync_promote)
+	log_msg("    values rewritten by %u fsyncs move to backing files\n", fsync_promote);
+    if (value_max && !promote)
+	log_msg("    values over %u MiB move to backing files when written\n", state->value_max);
+    return 0;
+}
+
+void kvfs_store_destroy(struct kvfs_state *state)
+{
+    if (store == NULL)
+	return;
+    store->close();
+    htable_free(&open_objects, NULL);
+    store = state->store = NULL;
+}
+
+static int load_object(struct kvfs_object *obj, size_t need);
+
+// look up an object that is currently open; caller holds open_lock
+static struct kvfs_object *find_open(const char *key)
+{
+    return (struct kvfs_object *) htable_lookup(&open_objects, key);
+}
+
+int kvfs_store_getattr(const char *key, struct stat *statbuf)
+{
+    struct kvfs_object *obj;
+    struct kvfs_meta meta;
+    int retstat;
+
+    pthread_mutex_lock(&open_lock);
+    obj = find_open(key);
+    if (obj != NULL) {
+	pthread_mutex_lock(&obj->lock);
+	meta = obj->meta;
+	retstat = obj->fd >= 0 ? -ENOENT : 0;	// promoted: ask rootdir
+	pthread_mutex_unlock(&obj->lock);
+	pthread_mutex_unlock(&open_lock);
+	if (retstat < 0)
+	    return retstat;
+    } else {
+	pthread_mutex_unlock(&open_lock);
+	retstat = store->lookup(key, &meta);
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    meta_to_stat(&meta, statbuf);
+    return 0;
+}
+
+int kvfs_store_create(const char *key, mode_t mode)
+{
+    struct fuse_context *context = fuse_get_context();
+    struct kvfs_meta meta;
+
+    if (store->lookup(key, &meta) == 0)
+	return -EEXIST;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.mode = mode;
+    meta.uid = context->uid;
+    meta.gid = context->gid;
+    meta.atime = meta.mtime = meta.ctime = time(NULL);
+
+    return store->put(key, &meta, "");
+}
+
+// An open object whose key goes away keeps serving its handles from
+// memory, so its value is pulled in before the backend drops it.
+// Caller holds open_lock.
+static void preload_open(const char *key)
+{
+    struct kvfs_object *obj = find_open(key);
+
+    if (obj == NULL)
+	return;
+    pthread_mutex_lock(&obj->lock);
+    load_object(obj, 0);
+    pthread_mutex_unlock(&obj->lock);
+}
+
+// ...and once it is gone, the object must never be put back under
+// that key.  Caller holds open_lock.
+static void detach_open(const char *key)
+{
+    struct kvfs_object *obj = (struct kvfs_object *) htable_remove(&open_objects, key);
+
+    if (obj == NULL)
+	return;
+    pthread_mutex_lock(&obj->lock);
+    obj->unlinked = 1;
+    obj->dirty = 0;
+    pthread_mutex_unlock(&obj->lock);
+}
+
+int kvfs_store_unlink(const char *key)
+{
+    int retstat;
+
+    pthread_mutex_lock(&open_lock);
+    preload_open(key);
+    retstat = store->remove(key);
+    if (retstat == 0)
+	detach_open(key);
+    pthread_mutex_unlock(&open_lock);
+
+    return retstat;
+}
+
+// The backing file of a promoted object was unlinked or renamed
+// under rootdir: its handles keep using their descriptor, but the key
+// no longer leads to it.
+void kvfs_store_forget(const char *key)
+{
+    pthread_mutex_lock(&open_lock);
+    detach_open(key);
+    pthread_mutex_unlock(&open_lock);
+}
+
+int kvfs_store_rename(const char *key, const char *newkey)
+{
+    struct kvfs_object *obj;
+    int retstat;
+
+    // pending writes have to reach the backend under the old name
+    // first, or they would be put back under it on release
+    pthread_mutex_lock(&open_lock);
+    obj = find_open(key);
+    if (obj != NULL) {
+	retstat = kvfs_store_flush(obj);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&open_lock);
+	    return retstat;
+	}
+    }
+
+    preload_open(newkey);
+    retstat = store->rename(key, newkey);
+    if (retstat == 0)
+	detach_open(newkey);
+    if (retstat == 0 && obj != NULL) {
+	htable_remove(&open_objects, key);
+	strcpy(obj->node.key, newkey);
+	htable_insert(&open_objects, &obj->node);
+    }
+    pthread_mutex_unlock(&open_lock);
+
+    return retstat;
+}
+
+// apply fn to the metadata of key, in the open object if there is one
+static int update_meta(const char *key, void (*fn)(struct kvfs_meta *meta, const void *arg),
+		       const void *arg)
+{
+    struct kvfs_object *obj;
+    struct kvfs_meta meta;
+    int retstat;
+
+    pthread_mutex_lock(&open_lock);
+    obj = find_open(key);
+    if (obj != NULL) {
+	pthread_mutex_lock(&obj->lock);
+	fn(&obj->meta, arg);
+	obj->meta.ctime = time(NULL);
+	meta = obj->meta;
+	// a dirty object carries its metadata along on the next flush
+	retstat = obj->dirty ? 0 : store->put(key, &meta, NULL);
+	pthread_mutex_unlock(&obj->lock);
+	pthread_mutex_unlock(&open_lock);
+	return retstat;
+    }
+    pthread_mutex_unlock(&open_lock);
+
+    retstat = store->lookup(key, &meta);
+    if (retstat < 0)
+	return retstat;
+    fn(&meta, arg);
+    meta.ctime = time(NULL);
+    return store->put(key, &meta, NULL);
+}
+
+static void set_mode(struct kvfs_meta *meta, const void *arg)
+{
+    meta->mode = (meta->mode & S_IFMT) | (*(const mode_t *) arg & ~S_IFMT);
+}
+
+static void set_owner(struct kvfs_meta *meta, const void *arg)
+{
+    const uid_t *ids = arg;
+
+    if (ids[0] != (uid_t) -1)
+	meta->uid = ids[0];
+    if (ids[1] != (uid_t) -1)
+	meta->gid = (gid_t) ids[1];
+}
+
+static void set_times(struct kvfs_meta *meta, const void *arg)
+{
+    const time_t *times = arg;
+
+    meta->atime = times[0];
+    meta->mtime = times[1];
+}
+
+int kvfs_store_chmod(const char *key, mode_t mode)
+{
+    return update_meta(key, set_mode, &mode);
+}
+
+int kvfs_store_chown(const char *key, uid_t uid, gid_t gid)
+{
+    uid_t ids[2] = { uid, (uid_t) gid };
+
+    return update_meta(key, set_owner, ids);
+}
+
+int kvfs_store_utime(const char *key, time_t atime, time_t mtime)
+{
+    time_t times[2] = { atime, mtime };
+
+    return update_meta(key, set_times, times);
+}
+
+int kvfs_store_truncate(const char *key, off_t newsize)
+{
+    struct kvfs_object *obj;
+    int retstat;
+
+    retstat = kvfs_store_open(key, &obj);
+    if (retstat < 0)
+	return retstat;
+    retstat = kvfs_store_ftruncate(obj, newsize);
+    if (retstat == 0)
+	retstat = kvfs_store_release(obj);
+    else
+	kvfs_store_release(obj);
+    return retstat;
+}
+
+int kvfs_store_open(const char *key, struct kvfs_object **objp)
+{
+    struct kvfs_object *obj;
+    struct kvfs_meta meta;
+    int retstat;
+
+    pthread_mutex_lock(&open_lock);
+    obj = find_open(key);
+    if (obj == NULL) {
+	retstat = store->lookup(key, &meta);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&open_lock);
+	    return retstat;
+	}
+	obj = calloc(1, sizeof(*obj));
+	if (obj == NULL) {
+	    pthread_mutex_unlock(&open_lock);
+	    return -ENOMEM;
+	}
+	strcpy(obj->node.key, key);
+	pthread_mutex_init(&obj->lock, NULL);
+	obj->meta = meta;
+	obj->fd = -1;
+	htable_insert(&open_objects, &obj->node);
+    }
+    obj->refs++;
+    pthread_mutex_unlock(&open_lock);
+
+    *objp = obj;
+    return 0;
+}
+
+// pull the whole value into memory before the first write;
+// caller holds obj->lock
+static int load_object(struct kvfs_object *obj, size_t need)
+{
+    size_t capacity;
+    char *data;
+    int retstat;
+
+    if (obj->data != NULL && need <= obj->capacity)
+	return 0;
+
+    capacity = obj->capacity ? obj->capacity : 4096;
+    while (capacity < need || capacity < (size_t) obj->meta.size)
+	capacity *= 2;
+
+    data = realloc(obj->data, capacity);
+    if (data == NULL)
+	return -ENOMEM;
+
+    if (obj->data == NULL && obj->meta.size > 0) {
+	retstat = store->read(obj->node.key, data, obj->meta.size, 0);
+	if (retstat < 0) {
+	    free(data);
+	    return retstat;
+	}
+    }
+    obj->data = data;
+    obj->capacity = capacity;
+    return 0;
+}
+
+// fsync a directory, so the names made in it are on disk
+static int sync_dir(const char *dir)
+{
+    int fd, retstat = 0;
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+	return log_error("promote open dir");
+    if (fsync(fd) < 0)
+	retstat = log_error("promote fsync dir");
+    close(fd);
+    return retstat;
+}
+
+// Copy a value that is not in memory out of the store into fd, a
+// chunk at a time.
+static int copy_out(struct kvfs_object *obj, int fd)
+{
+    char *buf;
+    off_t off;
+    int n, retstat = 0;
+
+    buf = malloc(PROMOTE_CHUNK);
+    if (buf == NULL)
+	return -ENOMEM;
+    for (off = 0; off < obj->meta.size; off += n) {
+	n = store->read(obj->node.key, buf, PROMOTE_CHUNK, off);
+	if (n <= 0) {
+	    retstat = n < 0 ? n : -EIO;
+	    break;
+	}
+	if (pwrite(fd, buf, n, off) != n) {
+	    retstat = log_error("promote pwrite");
+	    break;
+	}
+    }
+    free(buf);
+    return retstat;
+}
+
+// Move an object that outgrew inline_max or value_max, or that fsync
+// keeps rewriting, out to its own backing file.  Caller holds
+// obj->lock.
+static int promote_object(struct kvfs_object *obj)
+{
+    char path[PATH_MAX];
+    int fd, retstat = 0;
+
+    kvfs_root_path(path, obj->node.key);
+    fd = log_syscall("open", open(path, O_CREAT | O_EXCL | O_RDWR, obj->meta.mode & 07777), 0);
+    if (fd < 0)
+	return fd;
+
+    if (obj->data == NULL)
+	retstat = copy_out(obj, fd);
+    else if (obj->meta.size > 0 &&
+	     pwrite(fd, obj->data, obj->meta.size, 0) != obj->meta.size)
+	retstat = log_error("promote pwrite");
+    if (retstat < 0)
+	goto fail;
+    // open() applied our umask; ownership only sticks for root
+    fchmod(fd, obj->meta.mode & 07777);
+    if (fchown(fd, obj->meta.uid, obj->meta.gid) < 0)
+	log_error("promote fchown");
+
+    // the file and its name are on disk before the store forgets the
+    // value, or a crash in between would lose both
+    if (fsync(fd) < 0) {
+	retstat = log_error("promote fsync");
+	goto fail;
+    }
+    retstat = sync_dir(kvfs_root_dir(kvfs_root_home(obj->node.key)));
+    if (retstat < 0)
+	goto fail;
+
+    retstat = store->remove(obj->node.key);
+    if (retstat < 0)
+	goto fail;
+
+    log_msg("    promoted %s (%lld bytes) to a backing file\n",
+	    obj->node.key, (long long) obj->meta.size);
+    obj->fd = fd;
+    obj->dirty = 0;
+    free(obj->data);
+    obj->data = NULL;
+    obj->capacity = 0;
+    return 0;
+
+fail:
+    close(fd);
+    unlink(path);
+    return retstat;
+}
+
+// Does this write or truncate push the object out of the store?
+// Caller holds obj->lock.
+static int outgrows_store(struct kvfs_object *obj, off_t newsize)
+{
+    if (obj->unlinked || obj->fd >= 0)
+	return 0;
+    if (promote && newsize > inline_max)
+	return 1;
+    // not even a small write pulls a big value into memory
+    return value_max && (newsize > value_max || obj->meta.size > value_max);
+}
+
+int kvfs_store_read(struct kvfs_object *obj, char *buf, size_t size, off_t offset)
+{
+    int retstat;
+
+    pthread_mutex_lock(&obj->lock);
+    if (obj->fd >= 0) {
+	pthread_mutex_unlock(&obj->lock);
+	return log_syscall("pread", pread(obj->fd, buf, size, offset), 0);
+    }
+    if (obj->data == NULL) {
+	pthread_mutex_unlock(&obj->lock);
+	return store->read(obj->node.key, buf, size, offset);
+    }
+
+    if (offset >= obj->meta.size) {
+	retstat = 0;
+    } else {
+	if ((off_t) size > obj->meta.size - offset)
+	    size = obj->meta.size - offset;
+	memcpy(buf, obj->data + offset, size);
+	retstat = size;
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    return retstat;
+}
+
+int kvfs_store_write(struct kvfs_object *obj, const char *buf, size_t size, off_t offset)
+{
+    int retstat;
+
+    pthread_mutex_lock(&obj->lock);
+    if (outgrows_store(obj, offset + size)) {
+	retstat = promote_object(obj);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&obj->lock);
+	    return retstat;
+	}
+    }
+    if (obj->fd >= 0) {
+	pthread_mutex_unlock(&obj->lock);
+	return log_syscall("pwrite", pwrite(obj->fd, buf, size, offset), 0);
+    }
+
+    retstat = load_object(obj, offset + size);
+    if (retstat == 0) {
+	// writing past the end leaves a hole of zeroes
+	if (offset > obj->meta.size)
+	    memset(obj->data + obj->meta.size, 0, offset - obj->meta.size);
+	memcpy(obj->data + offset, buf, size);
+	if (offset + (off_t) size > obj->meta.size)
+	    obj->meta.size = offset + size;
+	obj->meta.mtime = obj->meta.ctime = time(NULL);
+	obj->dirty = 1;
+	retstat = size;
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    return retstat;
+}
+
+int kvfs_store_ftruncate(struct kvfs_object *obj, off_t newsize)
+{
+    int retstat;
+
+    pthread_mutex_lock(&obj->lock);
+    if (outgrows_store(obj, newsize)) {
+	retstat = promote_object(obj);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&obj->lock);
+	    return retstat;
+	}
+    }
+    if (obj->fd >= 0) {
+	pthread_mutex_unlock(&obj->lock);
+	return log_syscall("ftruncate", ftruncate(obj->fd, newsize), 0);
+    }
+
+    retstat = load_object(obj, newsize);
+    if (retstat == 0) {
+	if (newsize > obj->meta.size)
+	    memset(obj->data + obj->meta.size, 0, newsize - obj->meta.size);
+	obj->meta.size = newsize;
+	obj->meta.mtime = obj->meta.ctime = time(NULL);
+	obj->dirty = 1;
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    return retstat;
+}
+
+#ifdef HAVE_FALLOCATE
+// Values in the store have no blocks to reserve: preallocating only
+// sets the size, and punching or zeroing a range writes zeroes into
+// the in-memory copy, which the backend stores like any other value.
+int kvfs_store_fallocate(struct kvfs_object *obj, int mode, off_t offset, off_t len)
+{
+    off_t end = offset + len, newsize, zero_end;
+    int retstat;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+	return -EOPNOTSUPP;
+
+    pthread_mutex_lock(&obj->lock);
+    newsize = obj->meta.size;
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > newsize)
+	newsize = end;
+    if (outgrows_store(obj, newsize)) {
+	retstat = promote_object(obj);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&obj->lock);
+	    return retstat;
+	}
+    }
+    if (obj->fd >= 0) {
+	pthread_mutex_unlock(&obj->lock);
+	return log_syscall("fallocate", fallocate(obj->fd, mode, offset, len), 0);
+    }
+
+    retstat = load_object(obj, newsize);
+    if (retstat == 0) {
+	if (newsize > obj->meta.size)
+	    memset(obj->data + obj->meta.size, 0, newsize - obj->meta.size);
+	zero_end = end < newsize ? end : newsize;
+	if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) && offset < zero_end)
+	    memset(obj->data + offset, 0, zero_end - offset);
+	if (newsize != obj->meta.size || (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))) {
+	    obj->meta.size = newsize;
+	    obj->meta.mtime = obj->meta.ctime = time(NULL);
+	    obj->dirty = 1;
+	}
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    return retstat;
+}
+#endif
+
+// SEEK_DATA/SEEK_HOLE.  The store doesn't track holes, so a value is
+// all data with the implicit hole at its end.
+off_t kvfs_store_lseek(struct kvfs_object *obj, off_t offset, int whence)
+{
+    off_t size, retstat;
+
+    if (obj->fd >= 0) {
+	// ENXIO past the last data is the normal end of a walk, not
+	// worth logging
+	retstat = lseek(obj->fd, offset, whence);
+	return retstat < 0 ? -errno : retstat;
+    }
+
+    pthread_mutex_lock(&obj->lock);
+    size = obj->meta.size;
+    pthread_mutex_unlock(&obj->lock);
+
+    if (offset < 0)
+	return -EINVAL;
+    if (offset >= size)
+	return -ENXIO;
+    switch (whence) {
+    case SEEK_DATA:
+	return offset;
+    case SEEK_HOLE:
+	return size;
+    }
+    return -EINVAL;
+}
+
+int kvfs_store_fgetattr(struct kvfs_object *obj, struct stat *statbuf)
+{
+    if (obj->fd >= 0)
+	return log_syscall("fstat", fstat(obj->fd, statbuf), 0);
+
+    pthread_mutex_lock(&obj->lock);
+    meta_to_stat(&obj->meta, statbuf);
+    pthread_mutex_unlock(&obj->lock);
+    return 0;
+}
+
+int kvfs_store_flush(struct kvfs_object *obj)
+{
+    int retstat = 0;
+
+    pthread_mutex_lock(&obj->lock);
+    if (obj->dirty && !obj->unlinked) {
+	retstat = store->put(obj->node.key, &obj->meta, obj->data);
+	if (retstat == 0)
+	    obj->dirty = 0;
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    return retstat;
+}
+
+// Would this fsync put the whole value once too often?  Then it is
+// better off in a backing file, whose fsyncs only write what changed.
+// Caller holds obj->lock.
+static int fsynced_out_of_store(struct kvfs_object *obj)
+{
+    if (fsync_promote == 0 || obj->fd >= 0 || obj->unlinked || !obj->dirty)
+	return 0;
+    if (obj->meta.size < FSYNC_PROMOTE_MIN)
+	return 0;
+    return ++obj->fsyncs >= fsync_promote;
+}
+
+int kvfs_store_fsync(struct kvfs_object *obj, int datasync)
+{
+    int retstat;
+
+    pthread_mutex_lock(&obj->lock);
+    if (fsynced_out_of_store(obj)) {
+	retstat = promote_object(obj);
+	if (retstat < 0) {
+	    pthread_mutex_unlock(&obj->lock);
+	    return retstat;
+	}
+	pthread_mutex_unlock(&obj->lock);
+	// the value's removal from the store must not outlast the
+	// file, or a crash would bring the older value back
+	retstat = kvfs_sync_commit(obj->fd, datasync);
+	if (retstat < 0)
+	    return retstat;
+	return store->sync(datasync);
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    if (obj->fd >= 0)
+	return kvfs_sync_commit(obj->fd, datasync);
+
+    retstat = kvfs_store_flush(obj);
+
+    if (retstat < 0)
+	return retstat;
+    return store->sync(datasync);
+}
+
+int kvfs_store_release(struct kvfs_object *obj)
+{
+    int retstat = kvfs_store_flush(obj);
+
+    pthread_mutex_lock(&open_lock);
+    if (--obj->refs == 0) {
+	if (!obj->unlinked)
+	    htable_remove(&open_objects, obj->node.key);
+	pthread_mutex_destroy(&obj->lock);
+	if (obj->fd >= 0)
+	    close(obj->fd);
+	free(obj->data);
+	free(obj);
+    }
+    pthread_mutex_unlock(&open_lock);
+
+    return retstat;
+}
@@ -0,0 +1,146 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Object stores.  By default every kvfs object is its own file under
+  rootdir.  With -o backend=NAME, regular files are kept in an object
+  store instead: a backend that maps a key (the md5 digest) to a value
+  (the file contents) plus its metadata.  Directories, symlinks and
+  special files stay in rootdir either way.
+
+  store.c sits between the kvfs_*_impl functions and the backend.  It
+  keeps an in-memory copy of every object that is open for writing and
+  hands the whole value back to the backend on flush, fsync or the
+  last release, so backends only need whole-value puts and ranged
+  reads.  An object that keeps being changed and fsynced (a log, a
+  database) would be rewritten whole every time; after -o
+  fsync_promote such fsyncs it is moved out to a backing file of its
+  own under rootdir, where each fsync only syncs what changed.  So is
+  a value over -o value_max MiB, before a write would pull it into
+  memory.
+
+  With the default backend and -o inline_max=BYTES, the log store is
+  used as an index for tiny files only: new files start out there and
+  are served from memory, and a file that grows past inline_max is
+  promoted to an ordinary backing file under rootdir.
+*/
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "htable.h"
+
+struct kvfs_state;
+
+struct kvfs_meta {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+};
+
+// fixed-width form of struct kvfs_meta for on-disk records
+struct kvfs_disk_meta {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pad;
+    uint64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+};
+
+struct kvfs_store_ops {
+    const char *name;
+
+    /** Called from kvfs_init() with the mount options in place */
+    int  (*open)(struct kvfs_state *state);
+
+    /** Called from kvfs_destroy() */
+    void (*close)(void);
+
+    /** Fill in meta, or return -ENOENT */
+    int  (*lookup)(const char *key, struct kvfs_meta *meta);
+
+    /** Read up to size bytes of the value at offset; returns the
+        count, which is short only at the end of the value */
+    int  (*read)(const char *key, char *buf, size_t size, off_t offset);
+
+    /** Replace the value (meta->size bytes of data) and metadata.
+        With data == NULL only the metadata changes. */
+    int  (*put)(const char *key, const struct kvfs_meta *meta, const char *data);
+
+    int  (*remove)(const char *key);
+
+    /** Move key to newkey, replacing whatever newkey held */
+    int  (*rename)(const char *key, const char *newkey);
+
+    /** Make everything put so far durable */
+    int  (*sync)(int datasync);
+};
+
+// an object held open through the FUSE open()/release() pair
+struct kvfs_object {
+    struct hnode node;		// keyed by digest, must be first
+    pthread_mutex_t lock;
+    int refs;
+    int dirty;
+    int unlinked;		// removed while open; never put back
+    unsigned int fsyncs;	// whole-value puts made by fsync since open
+    int fd;			// promoted to a backing file, else -1
+    struct kvfs_meta meta;
+    char *data;			// whole value once loaded, else NULL
+    size_t capacity;
+};
+
+extern struct kvfs_store_ops kvfs_log_store;
+extern struct kvfs_store_ops kvfs_lsm_store;
+extern struct kvfs_store_ops kvfs_dedup_store;
+
+// compress.c: put -o compress=CODEC in front of a backend; NULL if
+// the codec is unknown or was not compiled in
+struct kvfs_store_ops *kvfs_compress_wrap(struct kvfs_store_ops *backend, const char *codec);
+
+// helpers shared by the backends
+#define KVFS_SUM_INIT 2166136261u
+uint32_t kvfs_store_sum(uint32_t h, const void *buf, size_t len);
+void kvfs_meta_pack(const struct kvfs_meta *meta, struct kvfs_disk_meta *dm);
+void kvfs_meta_unpack(const struct kvfs_disk_meta *dm, struct kvfs_meta *meta);
+
+int  kvfs_store_init(struct kvfs_state *state);
+void kvfs_store_destroy(struct kvfs_state *state);
+
+int  kvfs_store_getattr(const char *key, struct stat *statbuf);
+int  kvfs_store_create(const char *key, mode_t mode);
+int  kvfs_store_unlink(const char *key);
+int  kvfs_store_rename(const char *key, const char *newkey);
+int  kvfs_store_chmod(const char *key, mode_t mode);
+int  kvfs_store_chown(const char *key, uid_t uid, gid_t gid);
+int  kvfs_store_utime(const char *key, time_t atime, time_t mtime);
+int  kvfs_store_truncate(const char *key, off_t newsize);
+
+int  kvfs_store_open(const char *key, struct kvfs_object **objp);
+int  kvfs_store_read(struct kvfs_object *obj, char *buf, size_t size, off_t offset);
+int  kvfs_store_write(struct kvfs_object *obj, const char *buf, size_t size, off_t offset);
+int  kvfs_store_ftruncate(struct kvfs_object *obj, off_t newsize);
+int  kvfs_store_fallocate(struct kvfs_object *obj, int mode, off_t offset, off_t len);
+off_t kvfs_store_lseek(struct kvfs_object *obj, off_t offset, int whence);
+int  kvfs_store_fgetattr(struct kvfs_object *obj, struct stat *statbuf);
+int  kvfs_store_flush(struct kvfs_object *obj);
+int  kvfs_store_fsync(struct kvfs_object *obj, int datasync);
+int  kvfs_store_release(struct kvfs_object *obj);
+
+void kvfs_store_forget(const char *key);
+
+#endif
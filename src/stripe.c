@@ -0,0 +1,423 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Regular files striped across the roots (-o stripe=KB, with more
+  than one root; see roots.c for the layout).
+
+  Every root holding part of a file keeps it in a file named by the
+  key, each stripe unit at its own offset and the rest left as holes.
+  The copy on the home root is always as long as the whole file: a
+  write that ends on another root extends it with ftruncate(), so
+  its size, and so lstat() of it, answers for the file.  The other
+  pieces are made the first time something is written to them; until
+  then their units read as zeros, as holes would.
+
+  A request that covers units on several roots is split, and the
+  parts go to those roots' I/O threads to run at once.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "roots.h"
+#include "stripe.h"
+
+#define NLOCKS		64
+#define MAX_PARTS	16		// split on the stack; more are malloc'ed
+
+struct kvfs_stripe_file {
+    char *key;
+    int home;
+    int accmode;
+    pthread_mutex_t *size_lock;		// shared by every handle on the inode
+    pthread_mutex_t lock;		// for making pieces
+    int fds[];				// one per root; fds[home] is the handle's own,
+					// -1 for a piece not made (or not seen) yet
+};
+
+static pthread_mutex_t size_locks[NLOCKS] = {
+    [0 ... NLOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+int kvfs_striping(void)
+{
+    return kvfs_roots_stripe() != 0;
+}
+
+static void piece_path(char path[PATH_MAX], int root, const char *key)
+{
+    snprintf(path, PATH_MAX, "%s/%s", kvfs_root_dir(root), key);
+}
+
+// the piece on root; made if create is set
+static int piece(struct kvfs_stripe_file *sp, int root, int create)
+{
+    char path[PATH_MAX];
+    int fd = __atomic_load_n(&sp->fds[root], __ATOMIC_ACQUIRE);
+
+    if (fd >= 0)
+	return fd;
+    pthread_mutex_lock(&sp->lock);
+    fd = sp->fds[root];
+    if (fd < 0) {
+	// another handle may have made it meanwhile
+	piece_path(path, root, sp->key);
+	fd = open(path, (create ? O_CREAT | O_RDWR : sp->accmode) | O_NOFOLLOW, 0600);
+	if (fd < 0 && (create || errno != ENOENT))
+	    log_error("stripe open");
+	if (fd >= 0)
+	    __atomic_store_n(&sp->fds[root], fd, __ATOMIC_RELEASE);
+	else
+	    fd = -errno;
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return fd;
+}
+
+int kvfs_stripe_open(const char *key, int fd, int flags, struct kvfs_stripe_file **sp)
+{
+    struct kvfs_stripe_file *s;
+    struct stat st;
+    int r, n = kvfs_roots_count();
+
+    *sp = NULL;
+    if (!kvfs_striping())
+	return 0;
+    if (fstat(fd, &st) < 0)
+	return log_error("stripe fstat");
+    if (!S_ISREG(st.st_mode))
+	return 0;
+
+    s = malloc(sizeof(*s) + n * sizeof(int));
+    if (s == NULL || (s->key = strdup(key)) == NULL) {
+	free(s);
+	return -ENOMEM;
+    }
+    s->home = kvfs_root_home(key);
+    s->accmode = flags & O_ACCMODE;
+    s->size_lock = &size_locks[st.st_ino % NLOCKS];
+    pthread_mutex_init(&s->lock, NULL);
+    for (r = 0; r < n; r++)
+	s->fds[r] = -1;
+    s->fds[s->home] = fd;
+
+    // open() just truncated the home; the rest go the same way
+    if (flags & O_TRUNC)
+	for (r = 0; r < n; r++)
+	    if (r != s->home && piece(s, r, 0) >= 0)
+		ftruncate(s->fds[r], 0);
+
+    *sp = s;
+    return 0;
+}
+
+void kvfs_stripe_close(struct kvfs_stripe_file *sp)
+{
+    int r;
+
+    if (sp == NULL)
+	return;
+    for (r = 0; r < kvfs_roots_count(); r++)
+	if (r != sp->home && sp->fds[r] >= 0)
+	    close(sp->fds[r]);
+    pthread_mutex_destroy(&sp->lock);
+    free(sp->key);
+    free(sp);
+}
+
+static off_t file_size(struct kvfs_stripe_file *sp)
+{
+    struct stat st;
+
+    if (fstat(sp->fds[sp->home], &st) < 0)
+	return log_error("stripe fstat");
+    return st.st_size;
+}
+
+// make the home at least end bytes long
+static int extend(struct kvfs_stripe_file *sp, off_t end)
+{
+    off_t size;
+    int retstat = 0;
+
+    pthread_mutex_lock(sp->size_lock);
+    size = file_size(sp);
+    if (size < 0)
+	retstat = size;
+    else if (size < end && ftruncate(sp->fds[sp->home], end) < 0)
+	retstat = log_error("stripe ftruncate");
+    pthread_mutex_unlock(sp->size_lock);
+    return retstat;
+}
+
+// cut [offset, offset + size) into one part per stripe unit; parts on
+// roots with no piece yet get fd -1 (or one is made, for writes)
+static int split(struct kvfs_stripe_file *sp, char *buf, size_t size, off_t offset, int write,
+		 struct kvfs_rootio *parts, int max)
+{
+    off_t pos, end;
+    int n, r;
+
+    for (n = 0, pos = offset; pos < offset + (off_t) size; pos = end, n++) {
+	if (n == max)
+	    return -E2BIG;
+	r = kvfs_root_piece(sp->home, pos, &end);
+	if (end > offset + (off_t) size)
+	    end = offset + size;
+	parts[n].root = r;
+	parts[n].fd = piece(sp, r, write);
+	if (parts[n].fd < 0 && (write || parts[n].fd != -ENOENT))
+	    return parts[n].fd;
+	parts[n].buf = buf + (pos - offset);
+	parts[n].len = end - pos;
+	parts[n].off = pos;
+	parts[n].write = write;
+	parts[n].call = NULL;
+	parts[n].result = 0;
+    }
+    return n;
+}
+
+static int count_parts(size_t size, off_t offset)
+{
+    size_t unit = kvfs_roots_stripe();
+
+    return (offset + size + unit - 1) / unit - offset / unit;
+}
+
+// split and run a request; reads of missing pieces are zeros
+static ssize_t stripe_io(struct kvfs_stripe_file *sp, char *buf, size_t size, off_t offset, int write)
+{
+    struct kvfs_rootio stack[MAX_PARTS], *parts = stack, *io;
+    int i, j, n, max = count_parts(size, offset);
+    ssize_t retstat = size;
+
+    if (size == 0)
+	return 0;
+    if (max > MAX_PARTS) {
+	parts = malloc(max * sizeof(*parts));
+	if (parts == NULL)
+	    return -ENOMEM;
+    }
+    n = split(sp, buf, size, offset, write, parts, max);
+    if (n < 0) {
+	retstat = n;
+	goto out;
+    }
+
+    // parts with nothing to read from need no thread
+    for (i = j = 0; i < n; i++) {
+	if (parts[i].fd >= 0)
+	    parts[j++] = parts[i];
+	else
+	    memset(parts[i].buf, 0, parts[i].len);
+    }
+    if (j > 0)
+	kvfs_rootio_run(parts, j);
+
+    for (i = 0; i < j; i++) {
+	io = &parts[i];
+	if (io->result < 0) {
+	    retstat = io->result;
+	    break;
+	}
+	if ((size_t) io->result < io->len) {
+	    // a short write is an error; a short read is a piece that
+	    // ends before the file does
+	    if (write) {
+		retstat = -EIO;
+		break;
+	    }
+	    memset(io->buf + io->result, 0, io->len - io->result);
+	}
+    }
+out:
+    if (parts != stack)
+	free(parts);
+    return retstat;
+}
+
+ssize_t kvfs_stripe_pread(struct kvfs_stripe_file *sp, char *buf, size_t size, off_t offset)
+{
+    off_t fsize = file_size(sp);
+
+    if (fsize < 0)
+	return fsize;
+    if (offset >= fsize)
+	return 0;
+    if ((off_t) size > fsize - offset)
+	size = fsize - offset;
+    return stripe_io(sp, buf, size, offset, 0);
+}
+
+ssize_t kvfs_stripe_pwrite(struct kvfs_stripe_file *sp, const char *buf, size_t size, off_t offset)
+{
+    ssize_t retstat;
+    off_t end;
+
+    retstat = stripe_io(sp, (char *) buf, size, offset, 1);
+    if (retstat <= 0)
+	return retstat;
+
+    // a write ending on the home extended it already
+    if (kvfs_root_piece(sp->home, offset + size - 1, &end) != sp->home) {
+	end = extend(sp, offset + size);
+	if (end < 0)
+	    return end;
+    }
+    return retstat;
+}
+
+int kvfs_stripe_ftruncate(struct kvfs_stripe_file *sp, off_t size)
+{
+    struct stat st;
+    int r, fd, retstat;
+
+    pthread_mutex_lock(sp->size_lock);
+    retstat = log_syscall("ftruncate", ftruncate(sp->fds[sp->home], size), 0);
+    for (r = 0; r < kvfs_roots_count() && retstat == 0; r++) {
+	if (r == sp->home || (fd = piece(sp, r, 0)) < 0)
+	    continue;
+	if (fstat(fd, &st) == 0 && st.st_size > size && ftruncate(fd, size) < 0)
+	    retstat = log_error("stripe ftruncate");
+    }
+    pthread_mutex_unlock(sp->size_lock);
+    return retstat;
+}
+
+int kvfs_stripe_truncate(const char *key, const char *actual_path, off_t size)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int r, home, retstat;
+
+    retstat = log_syscall("truncate", truncate(actual_path, size), 0);
+    home = kvfs_root_home(key);
+    for (r = 0; r < kvfs_roots_count() && retstat == 0; r++) {
+	if (r == home)
+	    continue;
+	piece_path(path, r, key);
+	if (lstat(path, &st) == 0 && st.st_size > size && truncate(path, size) < 0)
+	    retstat = log_error("stripe truncate");
+    }
+    return retstat;
+}
+
+#ifdef HAVE_FALLOCATE
+int kvfs_stripe_fallocate(struct kvfs_stripe_file *sp, int mode, off_t offset, off_t len)
+{
+    off_t pos, end;
+    int r, fd, retstat = 0;
+
+    // shifting data would shift it between roots
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+	return -EOPNOTSUPP;
+
+    for (pos = offset; pos < offset + len && retstat == 0; pos = end) {
+	r = kvfs_root_piece(sp->home, pos, &end);
+	if (end > offset + len)
+	    end = offset + len;
+	// nothing to punch in a piece that was never made
+	fd = piece(sp, r, !(mode & FALLOC_FL_PUNCH_HOLE));
+	if (fd == -ENOENT)
+	    continue;
+	if (fd < 0)
+	    retstat = fd;
+	else
+	    retstat = log_syscall("fallocate", fallocate(fd, mode | (r != sp->home ? FALLOC_FL_KEEP_SIZE : 0),
+							 pos, end - pos), 0);
+    }
+    if (retstat == 0 && !(mode & FALLOC_FL_KEEP_SIZE))
+	retstat = extend(sp, offset + len);
+    return retstat;
+}
+#endif
+
+// the pieces can't say where the holes are all together, so the whole
+// file is data
+off_t kvfs_stripe_lseek(struct kvfs_stripe_file *sp, off_t offset, int whence)
+{
+    off_t size;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+	return -EINVAL;
+    size = file_size(sp);
+    if (size < 0)
+	return size;
+    if (offset >= size)
+	return -ENXIO;
+    return whence == SEEK_DATA ? offset : size;
+}
+
+int kvfs_stripe_fsync(struct kvfs_stripe_file *sp, int datasync)
+{
+    int r, fd, retstat = 0;
+
+    for (r = 0; r < kvfs_roots_count(); r++) {
+	fd = __atomic_load_n(&sp->fds[r], __ATOMIC_ACQUIRE);
+	if (r == sp->home || fd < 0)
+	    continue;
+#ifdef HAVE_FDATASYNC
+	if (datasync ? fdatasync(fd) < 0 : fsync(fd) < 0)
+#else
+	if (fsync(fd) < 0)
+#endif
+	    retstat = log_error("stripe fsync");
+    }
+    return retstat;
+}
+
+void kvfs_stripe_fstat(struct kvfs_stripe_file *sp, struct stat *statbuf)
+{
+    struct stat st;
+    int r, fd;
+
+    for (r = 0; r < kvfs_roots_count(); r++) {
+	fd = __atomic_load_n(&sp->fds[r], __ATOMIC_ACQUIRE);
+	if (r != sp->home && fd >= 0 && fstat(fd, &st) == 0)
+	    statbuf->st_blocks += st.st_blocks;
+    }
+}
+
+void kvfs_stripe_stat(const char *key, struct stat *statbuf)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int r, home;
+
+    // a file within its first unit has nothing elsewhere
+    if (!kvfs_striping() || !S_ISREG(statbuf->st_mode) || statbuf->st_size <= (off_t) kvfs_roots_stripe())
+	return;
+    home = kvfs_root_home(key);
+    for (r = 0; r < kvfs_roots_count(); r++) {
+	piece_path(path, r, key);
+	if (r != home && lstat(path, &st) == 0)
+	    statbuf->st_blocks += st.st_blocks;
+    }
+}
+
+void kvfs_stripe_unlink(const char *key)
+{
+    char path[PATH_MAX];
+    int r, home;
+
+    if (!kvfs_striping())
+	return;
+    home = kvfs_root_home(key);
+    for (r = 0; r < kvfs_roots_count(); r++) {
+	if (r == home)
+	    continue;
+	piece_path(path, r, key);
+	unlink(path);
+    }
+}
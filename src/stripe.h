@@ -0,0 +1,43 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _STRIPE_H_
+#define _STRIPE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// an open file striped across the roots
+struct kvfs_stripe_file;
+
+// whether regular files are striped on this mount
+int  kvfs_striping(void);
+
+// Start striping the backing file at key, just opened as fd (on its
+// home root) with flags.  *sp is left NULL when it is not striped.
+int  kvfs_stripe_open(const char *key, int fd, int flags, struct kvfs_stripe_file **sp);
+void kvfs_stripe_close(struct kvfs_stripe_file *sp);
+
+ssize_t kvfs_stripe_pread(struct kvfs_stripe_file *sp, char *buf, size_t size, off_t offset);
+ssize_t kvfs_stripe_pwrite(struct kvfs_stripe_file *sp, const char *buf, size_t size, off_t offset);
+int  kvfs_stripe_ftruncate(struct kvfs_stripe_file *sp, off_t size);
+int  kvfs_stripe_truncate(const char *key, const char *actual_path, off_t size);
+#ifdef HAVE_FALLOCATE
+int  kvfs_stripe_fallocate(struct kvfs_stripe_file *sp, int mode, off_t offset, off_t len);
+#endif
+off_t kvfs_stripe_lseek(struct kvfs_stripe_file *sp, off_t offset, int whence);
+
+// the pieces off the home root; the caller syncs the home itself
+int  kvfs_stripe_fsync(struct kvfs_stripe_file *sp, int datasync);
+
+// add the blocks of the other pieces to the home's stat
+void kvfs_stripe_fstat(struct kvfs_stripe_file *sp, struct stat *statbuf);
+void kvfs_stripe_stat(const char *key, struct stat *statbuf);
+
+// drop the other pieces once the home is unlinked
+void kvfs_stripe_unlink(const char *key);
+
+#endif
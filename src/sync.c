@@ -0,0 +1,214 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Group commit for fsync() and fdatasync().
+
+  Every object lives in the backing filesystems of the roots, so one
+  syncfs() per root makes all of them durable at once.  Instead of
+  issuing one fsync() per request, the first caller to arrive opens a
+  batch and becomes its leader; callers arriving while the batch is
+  open simply join it.  The leader waits up to
+  group_commit_delay microseconds (or until group_commit_batch
+  callers have joined), closes the batch, flushes once and hands the
+  result to everybody in it.
+
+  A batch with a single member is flushed with fsync()/fdatasync() on
+  its own descriptor, so a lone writer never pays for a filesystem
+  wide sync.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "roots.h"
+#include "sync.h"
+
+struct commit_batch {
+    int nmembers;
+    int datasync;		// nonzero while every member asked for fdatasync
+    int done;
+    int result;
+    int refs;
+    int fds[];			// one per member, used when syncfs() is not available
+};
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+static struct commit_batch *open_batch;
+
+static unsigned int commit_delay;
+static unsigned int commit_max;
+static int commit_rootfd = -1;
+static int *commit_rootfds;	// the other roots', when there are any
+static int commit_nroots;
+
+static int sync_one(int fd, int datasync)
+{
+#ifdef HAVE_FDATASYNC
+    if (datasync)
+	return log_syscall("fdatasync", fdatasync(fd), 0);
+#endif
+    return log_syscall("fsync", fsync(fd), 0);
+}
+
+static int flush_batch(struct commit_batch *batch)
+{
+    int i, retstat = 0;
+
+    if (batch->nmembers == 1)
+	return sync_one(batch->fds[0], batch->datasync);
+
+#ifdef HAVE_SYNCFS
+    if (commit_rootfd >= 0) {
+	retstat = log_syscall("syncfs", syncfs(commit_rootfd), 0);
+	for (i = 1; i < commit_nroots; i++) {
+	    int ret = log_syscall("syncfs", syncfs(commit_rootfds[i]), 0);
+	    if (ret < 0 && retstat == 0)
+		retstat = ret;
+	}
+	return retstat;
+    }
+#endif
+
+    // No syncfs(): still flush everything the batch asked for, we
+    // only lose the coalescing.
+    for (i = 0; i < batch->nmembers; i++) {
+	int ret = sync_one(batch->fds[i], batch->datasync);
+	if (ret < 0 && retstat == 0)
+	    retstat = ret;
+    }
+    return retstat;
+}
+
+static void put_batch(struct commit_batch *batch)
+{
+    if (--batch->refs == 0)
+	free(batch);
+}
+
+int kvfs_sync_init(struct kvfs_state *state)
+{
+    commit_delay = state->group_commit_delay;
+    commit_max = state->group_commit_batch ? state->group_commit_batch : 1;
+
+    state->rootfd = open(state->rootdir, O_RDONLY | O_DIRECTORY);
+    if (state->rootfd < 0)
+	return log_error("kvfs_sync_init open");
+    commit_rootfd = state->rootfd;
+
+    commit_nroots = kvfs_roots_count();
+    if (commit_nroots > 1) {
+	int r;
+
+	commit_rootfds = calloc(commit_nroots, sizeof(int));
+	if (commit_rootfds == NULL) {
+	    commit_nroots = 0;
+	    return -ENOMEM;
+	}
+	commit_rootfds[0] = state->rootfd;
+	for (r = 1; r < commit_nroots; r++) {
+	    commit_rootfds[r] = open(kvfs_root_dir(r), O_RDONLY | O_DIRECTORY);
+	    if (commit_rootfds[r] < 0) {
+		commit_nroots = r;
+		return log_error("kvfs_sync_init open");
+	    }
+	}
+    }
+
+    log_msg("    group commit: delay = %u usec, batch = %u\n",
+	    commit_delay, commit_max);
+    return 0;
+}
+
+void kvfs_sync_destroy(struct kvfs_state *state)
+{
+    if (state->rootfd >= 0)
+	close(state->rootfd);
+    state->rootfd = -1;
+    commit_rootfd = -1;
+    while (commit_nroots > 1)
+	close(commit_rootfds[--commit_nroots]);
+    commit_nroots = 0;
+    free(commit_rootfds);
+    commit_rootfds = NULL;
+}
+
+int kvfs_sync_commit(int fd, int datasync)
+{
+    struct commit_batch *batch;
+    struct timespec deadline;
+    int leader = 0;
+    int retstat;
+
+    if (commit_delay == 0 || commit_max == 1)
+	return sync_one(fd, datasync);
+
+    pthread_mutex_lock(&commit_lock);
+
+    batch = open_batch;
+    if (batch == NULL) {
+	batch = malloc(sizeof(*batch) + commit_max * sizeof(int));
+	if (batch == NULL) {
+	    pthread_mutex_unlock(&commit_lock);
+	    return sync_one(fd, datasync);
+	}
+	memset(batch, 0, sizeof(*batch));
+	batch->datasync = 1;
+	open_batch = batch;
+	leader = 1;
+    }
+
+    batch->fds[batch->nmembers++] = fd;
+    batch->datasync &= (datasync != 0);
+    batch->refs++;
+
+    if (batch->nmembers >= commit_max) {
+	// nobody else fits; let the leader flush right away
+	open_batch = NULL;
+	pthread_cond_broadcast(&batch_full);
+    }
+
+    if (leader) {
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += (long) (commit_delay % 1000000) * 1000;
+	deadline.tv_sec += commit_delay / 1000000 + deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+
+	while (open_batch == batch)
+	    if (pthread_cond_timedwait(&batch_full, &commit_lock, &deadline) == ETIMEDOUT)
+		break;
+	if (open_batch == batch)
+	    open_batch = NULL;
+
+	pthread_mutex_unlock(&commit_lock);
+	retstat = flush_batch(batch);
+	pthread_mutex_lock(&commit_lock);
+
+	log_msg("    group commit flushed %d request(s), returned %d\n",
+		batch->nmembers, retstat);
+	batch->result = retstat;
+	batch->done = 1;
+	pthread_cond_broadcast(&batch_done);
+    } else {
+	while (!batch->done)
+	    pthread_cond_wait(&batch_done, &commit_lock);
+	retstat = batch->result;
+    }
+
+    put_batch(batch);
+    pthread_mutex_unlock(&commit_lock);
+
+    return retstat;
+}
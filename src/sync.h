@@ -0,0 +1,14 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+int  kvfs_sync_init(struct kvfs_state *state);
+void kvfs_sync_destroy(struct kvfs_state *state);
+int  kvfs_sync_commit(int fd, int datasync);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  kvfs-test: what "make check" runs.  Calls kvfs_oper in-process (see
+  harness.c) on a scratch root and checks what it answers against
+  what a filesystem has to: directories with something in them are
+  not removed or renamed over, and a directory that lost its id is
+  not quietly given another.  Each check prints its name and FAIL or
+  ok; the exit status is 1 if any failed.
+
+  usage: kvfs-test [scratchdir]
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "dirid.h"
+#include "harness.h"
+
+static char scratch[PATH_MAX / 2];
+static int failed;
+
+static void expect(const char *what, int got, int want)
+{
+    if (got == want) {
+	printf("ok    %s\n", what);
+	return;
+    }
+    printf("FAIL  %s: %d (%s), wanted %d\n", what, got, got < 0 ? strerror(-got) : "", want);
+    failed++;
+}
+
+static int make(const char *path)
+{
+    return kvfs_oper.mknod(path, S_IFREG | 0644, 0);
+}
+
+static int getattr(const char *path)
+{
+    struct stat st;
+
+    return kvfs_oper.getattr(path, &st);
+}
+
+// the backing file of what is at path, by hand
+static void backing(char actual_path[PATH_MAX], const char *path, const char *file)
+{
+    char dir[PATH_MAX];
+
+    kvfs_bench_real_path(dir, kvfs_path2key(path));
+    kvfs_arena_reset();
+    snprintf(actual_path, PATH_MAX, "%.*s/%s", PATH_MAX / 2, dir, file);
+}
+
+static void rmdir_nonempty(void)
+{
+    expect("mkdir /e", kvfs_oper.mkdir("/e", 0755), 0);
+    expect("mknod /e/f", make("/e/f"), 0);
+    expect("rmdir /e with /e/f in it", kvfs_oper.rmdir("/e"), -ENOTEMPTY);
+    expect("/e/f is still there", getattr("/e/f"), 0);
+    expect("mkdir /e/d", kvfs_oper.mkdir("/e/d", 0755), 0);
+    expect("mknod /e/d/g", make("/e/d/g"), 0);
+    expect("rmdir /e/d with /e/d/g in it", kvfs_oper.rmdir("/e/d"), -ENOTEMPTY);
+    expect("unlink /e/d/g", kvfs_oper.unlink("/e/d/g"), 0);
+    expect("rmdir /e/d", kvfs_oper.rmdir("/e/d"), 0);
+    expect("unlink /e/f", kvfs_oper.unlink("/e/f"), 0);
+    expect("rmdir /e once empty", kvfs_oper.rmdir("/e"), 0);
+    expect("mknod /e/f after /e is gone", make("/e/f"), -ENOENT);
+}
+
+static void rename_nonempty(void)
+{
+    expect("mkdir /a", kvfs_oper.mkdir("/a", 0755), 0);
+    expect("mkdir /b", kvfs_oper.mkdir("/b", 0755), 0);
+    expect("mknod /a/x", make("/a/x"), 0);
+    expect("mknod /b/y", make("/b/y"), 0);
+    expect("rename /a over /b with /b/y in it", kvfs_oper.rename("/a", "/b"), -ENOTEMPTY);
+    expect("/a/x is still there", getattr("/a/x"), 0);
+    expect("/b/y is still there", getattr("/b/y"), 0);
+    expect("rename /b/y to /a/y", kvfs_oper.rename("/b/y", "/a/y"), 0);
+    expect("rename /a over /b once empty", kvfs_oper.rename("/a", "/b"), 0);
+    expect("/b/x came along", getattr("/b/x"), 0);
+    expect("/b/y came along", getattr("/b/y"), 0);
+    expect("rmdir /b with two in it", kvfs_oper.rmdir("/b"), -ENOTEMPTY);
+}
+
+static void lost_id(void)
+{
+    char path[PATH_MAX];
+
+    expect("mkdir /i", kvfs_oper.mkdir("/i", 0755), 0);
+    expect("mknod /i/f", make("/i/f"), 0);
+    backing(path, "/i", KVFS_DIRID_FILE);
+    expect("unlink the id of /i by hand", unlink(path) < 0 ? -errno : 0, 0);
+    // a fresh mount has nothing cached
+    harness_unmount();
+    if (harness_mount(scratch) < 0)
+	exit(EXIT_FAILURE);
+    harness_enter(0);
+    expect("/i/f without the id of /i", getattr("/i/f"), -ENOENT);
+    expect("mknod /i/g without the id of /i", make("/i/g"), -ENOENT);
+    expect("/i is not given another id", access(path, F_OK) < 0 ? -errno : 0, -ENOENT);
+}
+
+static void stray_entry(void)
+{
+    char path[PATH_MAX];
+    FILE *f;
+
+    expect("mkdir /s", kvfs_oper.mkdir("/s", 0755), 0);
+    // what a crash between making the entry and the object leaves
+    backing(path, "/s", "ghost");
+    f = fopen(path, "w");
+    if (f != NULL)
+	fclose(f);
+    expect("rmdir /s with only a stray entry in it", kvfs_oper.rmdir("/s"), 0);
+}
+
+static int remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    snprintf(scratch, sizeof(scratch), "%s/kvfs-test.XXXXXX", argc > 1 ? argv[1] : ".");
+    if (mkdtemp(scratch) == NULL) {
+	fprintf(stderr, "kvfs-test: %s: %s\n", scratch, strerror(errno));
+	return EXIT_FAILURE;
+    }
+    if (harness_setup("kvfs-test") < 0 || harness_mount(scratch) < 0)
+	return EXIT_FAILURE;
+    harness_enter(0);
+
+    rmdir_nonempty();
+    rename_nonempty();
+    stray_entry();
+    lost_id();
+
+    harness_unmount();
+    nftw(scratch, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
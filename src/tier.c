@@ -0,0 +1,728 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Hot and cold tiers (-o tier=1).
+
+  Of the two roots, the first is the fast tier (NVMe, say) and the
+  second the slow one (disks).  New objects go to the fast tier.
+  Opens and reads are counted per object, and a migrator thread
+  halves the counts every -o tier_interval seconds, so they measure
+  recent use.  On each of those passes it
+
+    - demotes the fast tier's least used files, those untouched
+      longest first, once the tier is over 90% full, down to 80%;
+    - promotes slow files used at least PROMOTE_HEAT times lately,
+      most used first, while they fit under 80%, demoting fast files
+      used less than half as much to make room.
+
+  Full means -o tier_fast MiB of objects, or with 0 the fast root's
+  whole filesystem.  Moves copy at most -o tier_budget MB/s.
+
+  Where an object is comes from an index of the slow tier's keys,
+  read at mount from its directory: keys are digests and the backing
+  namespace is flat, so that one listing is all of it.  Lookups of a
+  key wait while it is being moved.  A file is not moved while open
+  or while it has several links, and directories, symlinks and the
+  like stay on the tier they were made on.  A copy is thrown away if
+  the object changed while it was made.  An object a crash left on
+  both tiers keeps the copy with the later mtime.
+*/
+
+#include "kvfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "htable.h"
+#include "log.h"
+#include "roots.h"
+#include "stats.h"
+#include "tier.h"
+
+#define FAST		0		// the roots
+#define SLOW		1
+#define NSHARDS		64
+#define PROMOTE_HEAT	4		// uses, halved every pass
+#define HIGH_WATER	90		// % of the fast tier: start demoting
+#define LOW_WATER	80		// demote down to, promote up to
+
+struct kvfs_tier_object {
+    struct hnode node;
+    struct shard *shard;		// changes with the key on rename
+    int root;				// FAST or SLOW
+    unsigned int heat;			// opens and reads, halved each pass; atomic
+    unsigned int pins;			// open handles, and a move under way
+    int moving;
+    int detached;			// out of the table, freed once unpinned
+};
+
+// Every key on the slow tier has an entry, and so does every key that
+// was used lately, wherever it is.
+struct shard {
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+    struct htable objects;
+};
+
+// a file the migrator might move
+struct candidate {
+    char key[KVFS_KEY_LEN];
+    unsigned int heat;
+    time_t atime;
+    uint64_t bytes;
+};
+
+struct candidates {
+    struct candidate *v;
+    int n, cap;
+};
+
+static int tier_on;
+static struct shard shards[NSHARDS];
+static uint64_t fast_max;		// bytes of objects; 0 goes by the filesystem
+static uint64_t budget;			// bytes per second
+static unsigned int interval;		// seconds
+static pthread_t migrate_thread;
+static pthread_mutex_t migrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t migrate_wake = PTHREAD_COND_INITIALIZER;
+static int migrate_running, migrate_stop;
+
+static uint64_t promoted, demoted, copied_bytes, dropped, waits, passes;
+static uint64_t fast_used, fast_size;	// as of the last pass
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+int kvfs_tiering(void)
+{
+    return tier_on;
+}
+
+// not htable's FNV, so a shard's keys still spread over its buckets
+static struct shard *shard_of(const char *key)
+{
+    unsigned int h = 0;
+
+    for (; *key != '\0'; key++)
+	h = h * 31 + (unsigned char) *key;
+    return &shards[h % NSHARDS];
+}
+
+static void root_path(char path[PATH_MAX], int root, const char *key)
+{
+    snprintf(path, PATH_MAX, "%s/%s", kvfs_root_dir(root), key);
+}
+
+static int is_key(const char *name)
+{
+    int i;
+
+    for (i = 0; i < KVFS_KEY_LEN - 1; i++)
+	if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+	    return 0;
+    return name[i] == '\0';
+}
+
+/////////////////////////////////////////////////////////////////////
+// the index; all of these with the shard locked
+
+static struct kvfs_tier_object *find(struct shard *s, const char *key)
+{
+    return (struct kvfs_tier_object *) htable_lookup(&s->objects, key);
+}
+
+// key's entry once no move of it is under way
+static struct kvfs_tier_object *settled(struct shard *s, const char *key)
+{
+    struct kvfs_tier_object *t;
+
+    while ((t = find(s, key)) != NULL && t->moving) {
+	COUNT(waits, 1);
+	pthread_cond_wait(&s->moved, &s->lock);
+    }
+    return t;
+}
+
+static struct kvfs_tier_object *add(struct shard *s, const char *key, int root)
+{
+    struct kvfs_tier_object *t = calloc(1, sizeof(*t));
+
+    if (t == NULL)
+	return NULL;
+    strcpy(t->node.key, key);
+    t->shard = s;
+    t->root = root;
+    htable_insert(&s->objects, &t->node);
+    return t;
+}
+
+static void drop(struct kvfs_tier_object *t)
+{
+    htable_remove(&t->shard->objects, t->node.key);
+    if (t->pins > 0)
+	t->detached = 1;
+    else
+	free(t);
+}
+
+static void unpin(struct kvfs_tier_object *t)
+{
+    if (--t->pins == 0 && t->detached)
+	free(t);
+}
+
+// t's shard, locked; a rename may move t to another meanwhile
+static struct shard *lock_object(struct kvfs_tier_object *t)
+{
+    struct shard *s;
+
+    for (;;) {
+	s = __atomic_load_n(&t->shard, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&s->lock);
+	if (s == t->shard)
+	    return s;
+	pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// lookups
+
+int kvfs_tier_home(const char *key)
+{
+    struct shard *s = shard_of(key);
+    struct kvfs_tier_object *t;
+    int root;
+
+    pthread_mutex_lock(&s->lock);
+    t = settled(s, key);
+    root = t != NULL ? t->root : FAST;
+    pthread_mutex_unlock(&s->lock);
+    return root;
+}
+
+int kvfs_tier_where(const char *key)
+{
+    struct shard *s = shard_of(key);
+    struct kvfs_tier_object *t;
+    int root;
+
+    pthread_mutex_lock(&s->lock);
+    t = find(s, key);
+    root = t != NULL ? t->root : FAST;
+    pthread_mutex_unlock(&s->lock);
+    return root;
+}
+
+void kvfs_tier_open(const char *key, struct kvfs_tier_object **tp)
+{
+    struct shard *s;
+    struct kvfs_tier_object *t;
+
+    *tp = NULL;
+    if (!tier_on || strlen(key) >= KVFS_KEY_LEN)
+	return;
+    s = shard_of(key);
+    pthread_mutex_lock(&s->lock);
+    t = settled(s, key);
+    if (t == NULL)
+	t = add(s, key, FAST);
+    if (t != NULL) {
+	t->pins++;
+	__atomic_fetch_add(&t->heat, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s->lock);
+    *tp = t;
+}
+
+void kvfs_tier_read(struct kvfs_tier_object *t)
+{
+    if (t != NULL)
+	__atomic_fetch_add(&t->heat, 1, __ATOMIC_RELAXED);
+}
+
+void kvfs_tier_close(struct kvfs_tier_object *t)
+{
+    struct shard *s;
+
+    if (t == NULL)
+	return;
+    s = lock_object(t);
+    unpin(t);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void kvfs_tier_follow(const char *key, const char *newkey)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    struct shard *s;
+    struct kvfs_tier_object *t;
+    int root, at;
+
+    if (!tier_on || strlen(newkey) >= KVFS_KEY_LEN)
+	return;
+    root = kvfs_tier_home(key);
+    s = shard_of(newkey);
+    pthread_mutex_lock(&s->lock);
+    t = settled(s, newkey);
+    at = t != NULL ? t->root : FAST;
+    root_path(path, at, newkey);
+    if (at != root && lstat(path, &st) < 0 && errno == ENOENT) {
+	if (t == NULL)
+	    add(s, newkey, root);
+	else
+	    t->root = root;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void kvfs_tier_unlink(const char *key)
+{
+    struct shard *s;
+    struct kvfs_tier_object *t;
+
+    if (!tier_on)
+	return;
+    s = shard_of(key);
+    pthread_mutex_lock(&s->lock);
+    t = find(s, key);
+    if (t != NULL)
+	drop(t);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void kvfs_tier_rename(const char *key, const char *newkey)
+{
+    struct shard *s, *ns;
+    struct kvfs_tier_object *t, *old;
+
+    if (!tier_on || strlen(newkey) >= KVFS_KEY_LEN || strcmp(key, newkey) == 0)
+	return;
+    s = shard_of(key);
+    ns = shard_of(newkey);
+    // in shard order, so two renames cannot deadlock
+    pthread_mutex_lock(s < ns ? &s->lock : &ns->lock);
+    if (s != ns)
+	pthread_mutex_lock(s < ns ? &ns->lock : &s->lock);
+
+    // A move that started after the rename looked its paths up fails
+    // on its own; the entry is left to it.
+    t = find(s, key);
+    if (t != NULL && !t->moving) {
+	// newkey's entry said where the object was put
+	old = find(ns, newkey);
+	t->root = old != NULL ? old->root : FAST;
+	if (old != NULL)
+	    drop(old);
+	htable_remove(&s->objects, key);
+	strcpy(t->node.key, newkey);
+	__atomic_store_n(&t->shard, ns, __ATOMIC_RELEASE);
+	htable_insert(&ns->objects, &t->node);
+    }
+
+    if (s != ns)
+	pthread_mutex_unlock(&ns->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/////////////////////////////////////////////////////////////////////
+// the migrator
+
+// sleep until bytes done since t0 are within budget; nonzero if asked
+// to stop meanwhile
+static int throttle(const struct timespec *t0, uint64_t bytes)
+{
+    struct timespec now, until;
+    double due, elapsed;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    due = (double) bytes / budget;
+    elapsed = (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+
+    pthread_mutex_lock(&migrate_lock);
+    if (due > elapsed && !migrate_stop) {
+	until.tv_sec = t0->tv_sec + (time_t) due;
+	until.tv_nsec = t0->tv_nsec + (long) ((due - (time_t) due) * 1e9);
+	if (until.tv_nsec >= 1000000000) {
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&migrate_wake, &migrate_lock, &until);
+    }
+    stop = migrate_stop;
+    pthread_mutex_unlock(&migrate_lock);
+    return stop;
+}
+
+static int changed(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino != b->st_ino || a->st_size != b->st_size ||
+	a->st_ctim.tv_sec != b->st_ctim.tv_sec || a->st_ctim.tv_nsec != b->st_ctim.tv_nsec;
+}
+
+// Move key's file from one tier to the other: a rename() if they
+// share a filesystem, else a copy.  0, or -errno when it stays.
+static int move(const char *key, int from, int to, uint64_t *bytes)
+{
+    struct shard *s = shard_of(key);
+    struct kvfs_tier_object *t;
+    char src[PATH_MAX], dst[PATH_MAX];
+    struct stat before, after;
+    int retstat = 0, renamed = 0, copied = 0;
+
+    pthread_mutex_lock(&s->lock);
+    t = find(s, key);
+    if (t == NULL && from == FAST)
+	t = add(s, key, FAST);
+    if (t == NULL || t->root != from || t->pins > 0 || t->moving) {
+	pthread_mutex_unlock(&s->lock);
+	return -EBUSY;
+    }
+    t->pins++;
+    t->moving = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    root_path(src, from, key);
+    root_path(dst, to, key);
+    if (lstat(src, &before) < 0) {
+	retstat = -errno;
+    } else if (!S_ISREG(before.st_mode) || before.st_nlink > 1) {
+	retstat = -EBUSY;
+    } else if (rename(src, dst) == 0) {
+	renamed = 1;
+    } else if (errno != EXDEV) {
+	retstat = log_error("tier rename");
+    } else {
+	retstat = kvfs_roots_sync(src, dst);
+	copied = retstat == 0;
+    }
+
+    s = lock_object(t);
+    // anything done to the file while it was copied changed its ctime
+    if (copied && (lstat(src, &after) < 0 || changed(&before, &after)))
+	retstat = -EAGAIN;
+    if (t->detached && !renamed)
+	retstat = -ENOENT;
+    if (retstat == 0)
+	t->root = to;
+    t->moving = 0;
+    pthread_cond_broadcast(&s->moved);
+    unpin(t);
+    pthread_mutex_unlock(&s->lock);
+
+    if (copied && retstat == 0) {
+	unlink(src);
+	*bytes += before.st_size;
+	COUNT(copied_bytes, before.st_size);
+    } else if (copied) {
+	unlink(dst);
+	COUNT(dropped, 1);
+    }
+    return retstat;
+}
+
+static int push(struct candidates *c, const char *key, unsigned int heat, time_t atime, uint64_t bytes)
+{
+    void *more;
+
+    if (c->n == c->cap) {
+	more = realloc(c->v, (c->cap ? 2 * c->cap : 256) * sizeof(*c->v));
+	if (more == NULL)
+	    return -ENOMEM;
+	c->v = more;
+	c->cap = c->cap ? 2 * c->cap : 256;
+    }
+    strcpy(c->v[c->n].key, key);
+    c->v[c->n].heat = heat;
+    c->v[c->n].atime = atime;
+    c->v[c->n].bytes = bytes;
+    c->n++;
+    return 0;
+}
+
+// least used first, then untouched longest
+static int cmp_colder(const void *a, const void *b)
+{
+    const struct candidate *x = a, *y = b;
+
+    if (x->heat != y->heat)
+	return x->heat < y->heat ? -1 : 1;
+    return x->atime < y->atime ? -1 : x->atime > y->atime;
+}
+
+static int cmp_hotter(const void *a, const void *b)
+{
+    const struct candidate *x = a, *y = b;
+
+    return x->heat > y->heat ? -1 : x->heat < y->heat;
+}
+
+struct decay_arg {
+    struct candidates *hot;
+};
+
+// halve every count, and forget fast objects no longer used; slow
+// ones used enough are the candidates for promotion
+static int decay_one(struct hnode *node, void *arg)
+{
+    struct kvfs_tier_object *t = (struct kvfs_tier_object *) node;
+    struct decay_arg *d = arg;
+    unsigned int heat = __atomic_load_n(&t->heat, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&t->heat, heat / 2, __ATOMIC_RELAXED);
+    if (t->root == FAST && heat / 2 == 0 && t->pins == 0)
+	drop(t);
+    else if (t->root == SLOW && heat >= PROMOTE_HEAT && t->pins == 0)
+	push(d->hot, node->key, heat, 0, 0);
+    return 0;
+}
+
+// the fast tier's files, and the bytes all of its objects take
+static void list_fast(struct candidates *cold, uint64_t *used)
+{
+    char path[PATH_MAX];
+    struct shard *s;
+    struct kvfs_tier_object *t;
+    struct dirent *de;
+    struct stat st;
+    unsigned int heat;
+    DIR *dp;
+    int skip;
+
+    dp = opendir(kvfs_root_dir(FAST));
+    if (dp == NULL) {
+	log_error("tier opendir");
+	return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+	root_path(path, FAST, de->d_name);
+	if (!is_key(de->d_name) || lstat(path, &st) < 0)
+	    continue;
+	*used += (uint64_t) st.st_blocks * 512;
+	if (!S_ISREG(st.st_mode) || st.st_nlink > 1)
+	    continue;
+	s = shard_of(de->d_name);
+	pthread_mutex_lock(&s->lock);
+	t = find(s, de->d_name);
+	skip = t != NULL && (t->root != FAST || t->pins > 0);
+	heat = t != NULL ? t->heat : 0;
+	pthread_mutex_unlock(&s->lock);
+	if (!skip)
+	    push(cold, de->d_name, heat, st.st_atime, (uint64_t) st.st_blocks * 512);
+    }
+    closedir(dp);
+}
+
+static int demote(const struct candidate *c, uint64_t *used, const struct timespec *t0, uint64_t *bytes)
+{
+    if (move(c->key, FAST, SLOW, bytes) == 0) {
+	*used = *used > c->bytes ? *used - c->bytes : 0;
+	COUNT(demoted, 1);
+    }
+    return throttle(t0, *bytes);
+}
+
+// one pass; nonzero if asked to stop meanwhile
+static int pass(const struct timespec *t0, uint64_t *bytes)
+{
+    struct candidates hot = { NULL, 0, 0 }, cold = { NULL, 0, 0 };
+    struct decay_arg d = { &hot };
+    char path[PATH_MAX];
+    struct statvfs sv;
+    struct stat st;
+    uint64_t used = 0, size, low, high, need;
+    int i, h, c = 0, stop = 0;
+
+    for (i = 0; i < NSHARDS; i++) {
+	pthread_mutex_lock(&shards[i].lock);
+	htable_foreach(&shards[i].objects, decay_one, &d);
+	pthread_mutex_unlock(&shards[i].lock);
+    }
+    list_fast(&cold, &used);
+    size = fast_max;
+    if (size == 0) {
+	if (statvfs(kvfs_root_dir(FAST), &sv) < 0) {
+	    log_error("tier statvfs");
+	    goto out;
+	}
+	size = (uint64_t) sv.f_blocks * sv.f_frsize;
+	used = (uint64_t) (sv.f_blocks - sv.f_bfree) * sv.f_frsize;
+    }
+    high = size / 100 * HIGH_WATER;
+    low = size / 100 * LOW_WATER;
+    qsort(hot.v, hot.n, sizeof(*hot.v), cmp_hotter);
+    qsort(cold.v, cold.n, sizeof(*cold.v), cmp_colder);
+
+    if (used > high)
+	while (!stop && used > low && c < cold.n)
+	    stop = demote(&cold.v[c++], &used, t0, bytes);
+
+    for (h = 0; !stop && h < hot.n; h++) {
+	root_path(path, SLOW, hot.v[h].key);
+	if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink > 1)
+	    continue;
+	need = (uint64_t) st.st_blocks * 512;
+	// room is made only for something used much more
+	while (!stop && used + need > low && c < cold.n && cold.v[c].heat * 2 < hot.v[h].heat)
+	    stop = demote(&cold.v[c++], &used, t0, bytes);
+	if (stop || used + need > low)
+	    continue;
+	if (move(hot.v[h].key, SLOW, FAST, bytes) == 0) {
+	    used += need;
+	    COUNT(promoted, 1);
+	}
+	stop = throttle(t0, *bytes);
+    }
+
+out:
+    fast_used = used;
+    fast_size = size;
+    free(hot.v);
+    free(cold.v);
+    return stop;
+}
+
+static void *migrate_main(void *arg)
+{
+    struct timespec t0, until;
+    uint64_t bytes;
+    int stop = 0;
+
+    (void) arg;
+    while (!stop) {
+	pthread_mutex_lock(&migrate_lock);
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += interval;
+	while (!migrate_stop && pthread_cond_timedwait(&migrate_wake, &migrate_lock, &until) != ETIMEDOUT)
+	    ;
+	stop = migrate_stop;
+	pthread_mutex_unlock(&migrate_lock);
+	if (stop)
+	    break;
+
+	clock_gettime(CLOCK_REALTIME, &t0);
+	bytes = 0;
+	stop = pass(&t0, &bytes);
+	COUNT(passes, 1);
+    }
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+// the slow tier's keys, after settling any a crash left on both
+static int load_index(size_t *n)
+{
+    char path[PATH_MAX], fast[PATH_MAX];
+    struct stat st, fst;
+    struct dirent *de;
+    DIR *dp;
+
+    *n = 0;
+    dp = opendir(kvfs_root_dir(SLOW));
+    if (dp == NULL)
+	return log_error("tier opendir");
+    while ((de = readdir(dp)) != NULL) {
+	if (!is_key(de->d_name))
+	    continue;
+	root_path(path, SLOW, de->d_name);
+	root_path(fast, FAST, de->d_name);
+	if (lstat(fast, &fst) == 0 && lstat(path, &st) == 0) {
+	    if (st.st_mtim.tv_sec < fst.st_mtim.tv_sec ||
+		(st.st_mtim.tv_sec == fst.st_mtim.tv_sec && st.st_mtim.tv_nsec <= fst.st_mtim.tv_nsec)) {
+		kvfs_roots_remove(path);
+		continue;
+	    }
+	    kvfs_roots_remove(fast);
+	}
+	if (add(shard_of(de->d_name), de->d_name, SLOW) == NULL) {
+	    closedir(dp);
+	    return -ENOMEM;
+	}
+	(*n)++;
+    }
+    closedir(dp);
+    return 0;
+}
+
+static void tier_report(FILE *out)
+{
+    size_t indexed = 0;
+    int i;
+
+    for (i = 0; i < NSHARDS; i++)
+	indexed += shards[i].objects.count;
+    fprintf(out, "    fast tier %.1f of %.1f MiB, %zu object(s) indexed\n",
+	    fast_used / 1048576.0, fast_size / 1048576.0, indexed);
+    fprintf(out, "    %llu promoted, %llu demoted, %.1f MiB copied, %llu cop(ies) dropped, %llu lookup(s) waited, %llu pass(es)\n",
+	    (unsigned long long) promoted, (unsigned long long) demoted, copied_bytes / 1048576.0,
+	    (unsigned long long) dropped, (unsigned long long) waits, (unsigned long long) passes);
+}
+
+int kvfs_tier_init(struct kvfs_state *state)
+{
+    size_t n;
+    int i, retstat;
+
+    tier_on = 0;
+    if (!state->tier || kvfs_roots_count() != 2)
+	return 0;
+    for (i = 0; i < NSHARDS; i++) {
+	pthread_mutex_init(&shards[i].lock, NULL);
+	pthread_cond_init(&shards[i].moved, NULL);
+	if (htable_init(&shards[i].objects, 1024) < 0)
+	    return -ENOMEM;
+    }
+    retstat = load_index(&n);
+    if (retstat < 0)
+	return retstat;
+
+    fast_max = (uint64_t) state->tier_fast << 20;
+    budget = (uint64_t) state->tier_budget << 20;
+    interval = state->tier_interval;
+    promoted = demoted = copied_bytes = dropped = waits = passes = 0;
+    fast_used = fast_size = 0;
+    tier_on = 1;
+    log_msg("    tier: %s fast, %s slow with %zu object(s); moves at %u MB/s every %u s\n",
+	    kvfs_root_dir(FAST), kvfs_root_dir(SLOW), n, state->tier_budget, interval);
+    kvfs_stats_register("tier", tier_report);
+
+    migrate_stop = 0;
+    if (interval > 0 && budget > 0) {
+	if (pthread_create(&migrate_thread, NULL, migrate_main, NULL) != 0)
+	    return log_error("tier pthread_create");
+	migrate_running = 1;
+    }
+    return 0;
+}
+
+void kvfs_tier_destroy(struct kvfs_state *state)
+{
+    int i;
+
+    (void) state;
+    if (!tier_on)
+	return;
+    if (migrate_running) {
+	pthread_mutex_lock(&migrate_lock);
+	migrate_stop = 1;
+	pthread_cond_broadcast(&migrate_wake);
+	pthread_mutex_unlock(&migrate_lock);
+	pthread_join(migrate_thread, NULL);
+	migrate_running = 0;
+    }
+    kvfs_stats_unregister("tier");
+    tier_on = 0;
+    for (i = 0; i < NSHARDS; i++)
+	htable_free(&shards[i].objects, (void (*)(struct hnode *)) free);
+}
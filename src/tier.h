@@ -0,0 +1,38 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _TIER_H_
+#define _TIER_H_
+
+struct kvfs_state;
+struct kvfs_tier_object;
+
+int  kvfs_tier_init(struct kvfs_state *state);
+void kvfs_tier_destroy(struct kvfs_state *state);
+
+// whether the two roots are a fast and a slow tier on this mount
+int  kvfs_tiering(void);
+
+// The root the object at key is on.  kvfs_tier_home() waits out a move
+// of it that is under way; kvfs_tier_where() does not, for listings.
+int  kvfs_tier_home(const char *key);
+int  kvfs_tier_where(const char *key);
+
+// Count an open of key, before its path is looked up; the object is
+// not moved while *tp is open.  *tp is left NULL when not tiering.
+void kvfs_tier_open(const char *key, struct kvfs_tier_object **tp);
+void kvfs_tier_read(struct kvfs_tier_object *t);
+void kvfs_tier_close(struct kvfs_tier_object *t);
+
+// before a rename() or link() to newkey looks its path up: keep the
+// new name on key's tier, if nothing is at newkey already
+void kvfs_tier_follow(const char *key, const char *newkey);
+
+// after an unlink() or rename() of key succeeded
+void kvfs_tier_unlink(const char *key);
+void kvfs_tier_rename(const char *key, const char *newkey);
+
+#endif
@@ -0,0 +1,501 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Call tracing.  With -o trace=FILE every call FUSE makes into kvfs is
+  written to FILE as one line:
+
+	start dur pid op ret fh path path2 off size mode
+
+  start is microseconds since the mount, dur how long the call took,
+  pid the calling process and ret what kvfs returned.  fh identifies
+  the open file or directory for calls that take one (0 otherwise),
+  so a replayer can tell which open a read belongs to.  Paths are the
+  plaintext paths FUSE passed in, %-escaped, with "-" for none; path2
+  is the second path of rename/link/symlink and the attribute name of
+  the xattr calls.  off and size are the offset and size of reads,
+  writes and fallocate; truncate puts the new size in off, chown the
+  uid and gid in off and size, utime the atime and mtime.  mode is
+  the mode for mknod/mkdir/chmod, the open flags for open, the mask
+  for access, the flags for setxattr and fallocate and datasync for
+  fsync.
+
+  Unlike the debug log this is cheap enough to leave on: one buffered
+  fprintf() per call and no stat dumps.
+*/
+
+#include "kvfs.h"
+
+#include <fuse.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_BUFFER (1 << 20)
+
+static struct fuse_operations next;
+static struct fuse_operations traced;
+static FILE *trace_out;
+static uint64_t trace_start;
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+char *kvfs_trace_escape(const char *path, char *buf, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+
+    if (path == NULL) {
+	snprintf(buf, len, "-");
+	return buf;
+    }
+    for (; *path != '\0' && n + 4 < len; path++) {
+	unsigned char ch = *path;
+
+	if (ch <= ' ' || ch == '%' || ch >= 0x7f || (ch == '-' && n == 0 && path[1] == '\0')) {
+	    buf[n++] = '%';
+	    buf[n++] = hex[ch >> 4];
+	    buf[n++] = hex[ch & 15];
+	} else {
+	    buf[n++] = ch;
+	}
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+void kvfs_trace_unescape(char *s)
+{
+    char *out = s, hexbuf[3] = { 0, 0, 0 };
+
+    for (; *s != '\0'; s++) {
+	if (*s == '%' && s[1] != '\0' && s[2] != '\0') {
+	    hexbuf[0] = s[1];
+	    hexbuf[1] = s[2];
+	    *out++ = strtol(hexbuf, NULL, 16);
+	    s += 2;
+	} else {
+	    *out++ = *s;
+	}
+    }
+    *out = '\0';
+}
+
+static void emit(const char *op, uint64_t t0, int ret, struct fuse_file_info *fi,
+		 const char *path, const char *path2, long long off, unsigned long long size,
+		 long mode)
+{
+    char p1[PATH_MAX * 3 + 1], p2[PATH_MAX * 3 + 1];
+    uint64_t t1 = now_usec();
+
+    // a single fprintf() is atomic with respect to other threads
+    fprintf(trace_out, "%llu %llu %d %s %d %llx %s %s %lld %llu %lo\n",
+	    (unsigned long long) (t0 - trace_start), (unsigned long long) (t1 - t0),
+	    (int) fuse_get_context()->pid, op, ret,
+	    fi != NULL ? (unsigned long long) fi->fh : 0ULL,
+	    kvfs_trace_escape(path, p1, sizeof(p1)), kvfs_trace_escape(path2, p2, sizeof(p2)),
+	    off, size, mode);
+}
+
+static int trace_getattr(const char *path, struct stat *statbuf)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.getattr(path, statbuf);
+
+    emit("getattr", t0, ret, NULL, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_readlink(const char *path, char *link, size_t size)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.readlink(path, link, size);
+
+    emit("readlink", t0, ret, NULL, path, NULL, 0, size, 0);
+    return ret;
+}
+
+static int trace_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.mknod(path, mode, dev);
+
+    emit("mknod", t0, ret, NULL, path, NULL, dev, 0, mode);
+    return ret;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.mkdir(path, mode);
+
+    emit("mkdir", t0, ret, NULL, path, NULL, 0, 0, mode);
+    return ret;
+}
+
+static int trace_unlink(const char *path)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.unlink(path);
+
+    emit("unlink", t0, ret, NULL, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_rmdir(const char *path)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.rmdir(path);
+
+    emit("rmdir", t0, ret, NULL, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_symlink(const char *path, const char *link)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.symlink(path, link);
+
+    emit("symlink", t0, ret, NULL, path, link, 0, 0, 0);
+    return ret;
+}
+
+static int trace_rename(const char *path, const char *newpath)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.rename(path, newpath);
+
+    emit("rename", t0, ret, NULL, path, newpath, 0, 0, 0);
+    return ret;
+}
+
+static int trace_link(const char *path, const char *newpath)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.link(path, newpath);
+
+    emit("link", t0, ret, NULL, path, newpath, 0, 0, 0);
+    return ret;
+}
+
+static int trace_chmod(const char *path, mode_t mode)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.chmod(path, mode);
+
+    emit("chmod", t0, ret, NULL, path, NULL, 0, 0, mode);
+    return ret;
+}
+
+static int trace_chown(const char *path, uid_t uid, gid_t gid)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.chown(path, uid, gid);
+
+    emit("chown", t0, ret, NULL, path, NULL, uid, gid, 0);
+    return ret;
+}
+
+static int trace_truncate(const char *path, off_t newsize)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.truncate(path, newsize);
+
+    emit("truncate", t0, ret, NULL, path, NULL, newsize, 0, 0);
+    return ret;
+}
+
+static int trace_utime(const char *path, struct utimbuf *ubuf)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.utime(path, ubuf);
+
+    emit("utime", t0, ret, NULL, path, NULL, ubuf->actime, ubuf->modtime, 0);
+    return ret;
+}
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.open(path, fi);
+
+    emit("open", t0, ret, fi, path, NULL, 0, 0, fi->flags);
+    return ret;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.read(path, buf, size, offset, fi);
+
+    emit("read", t0, ret, fi, path, NULL, offset, size, 0);
+    return ret;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.write(path, buf, size, offset, fi);
+
+    emit("write", t0, ret, fi, path, NULL, offset, size, 0);
+    return ret;
+}
+
+// read_buf and write_buf are logged as read and write, which is how
+// kvfs-replay plays them back
+
+static size_t bufvec_size(const struct fuse_bufvec *bufv)
+{
+    size_t i, size = 0;
+
+    for (i = 0; i < bufv->count; i++)
+	size += bufv->buf[i].size;
+    return size;
+}
+
+static int trace_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.read_buf(path, bufp, size, offset, fi);
+
+    // an fd buffer is read when FUSE replies, so this is what was asked
+    emit("read", t0, ret < 0 ? ret : (int) bufvec_size(*bufp), fi, path, NULL, offset, size, 0);
+    return ret;
+}
+
+static int trace_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+			   struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    size_t size = bufvec_size(buf);
+    int ret = next.write_buf(path, buf, offset, fi);
+
+    emit("write", t0, ret, fi, path, NULL, offset, size, 0);
+    return ret;
+}
+
+static int trace_statfs(const char *path, struct statvfs *statv)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.statfs(path, statv);
+
+    emit("statfs", t0, ret, NULL, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_flush(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.flush(path, fi);
+
+    emit("flush", t0, ret, fi, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    uint64_t fh = fi->fh;
+    int ret = next.release(path, fi);
+
+    // the handle is gone now; log the one the opener saw
+    fi->fh = fh;
+    emit("release", t0, ret, fi, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.fsync(path, datasync, fi);
+
+    emit("fsync", t0, ret, fi, path, NULL, 0, 0, datasync);
+    return ret;
+}
+
+static int trace_setxattr(const char *path, const char *name, const char *value,
+			  size_t size, int flags)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.setxattr(path, name, value, size, flags);
+
+    emit("setxattr", t0, ret, NULL, path, name, 0, size, flags);
+    return ret;
+}
+
+static int trace_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.getxattr(path, name, value, size);
+
+    emit("getxattr", t0, ret, NULL, path, name, 0, size, 0);
+    return ret;
+}
+
+static int trace_listxattr(const char *path, char *list, size_t size)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.listxattr(path, list, size);
+
+    emit("listxattr", t0, ret, NULL, path, NULL, 0, size, 0);
+    return ret;
+}
+
+static int trace_removexattr(const char *path, const char *name)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.removexattr(path, name);
+
+    emit("removexattr", t0, ret, NULL, path, name, 0, 0, 0);
+    return ret;
+}
+
+static int trace_opendir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.opendir(path, fi);
+
+    emit("opendir", t0, ret, fi, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+			 struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.readdir(path, buf, filler, offset, fi);
+
+    emit("readdir", t0, ret, fi, path, NULL, offset, 0, 0);
+    return ret;
+}
+
+static int trace_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    uint64_t fh = fi->fh;
+    int ret = next.releasedir(path, fi);
+
+    fi->fh = fh;
+    emit("releasedir", t0, ret, fi, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+static int trace_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.fsyncdir(path, datasync, fi);
+
+    emit("fsyncdir", t0, ret, fi, path, NULL, 0, 0, datasync);
+    return ret;
+}
+
+static void trace_destroy(void *userdata)
+{
+    if (next.destroy != NULL)
+	next.destroy(userdata);
+    fclose(trace_out);
+    trace_out = NULL;
+}
+
+static int trace_access(const char *path, int mask)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.access(path, mask);
+
+    emit("access", t0, ret, NULL, path, NULL, 0, 0, mask);
+    return ret;
+}
+
+static int trace_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.ftruncate(path, offset, fi);
+
+    emit("ftruncate", t0, ret, fi, path, NULL, offset, 0, 0);
+    return ret;
+}
+
+static int trace_fallocate(const char *path, int mode, off_t offset, off_t len,
+			   struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.fallocate(path, mode, offset, len, fi);
+
+    emit("fallocate", t0, ret, fi, path, NULL, offset, len, mode);
+    return ret;
+}
+
+static int trace_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+    uint64_t t0 = now_usec();
+    int ret = next.fgetattr(path, statbuf, fi);
+
+    emit("fgetattr", t0, ret, fi, path, NULL, 0, 0, 0);
+    return ret;
+}
+
+// only calls kvfs implements are wrapped; the rest stay NULL
+#define WRAP(op) traced.op = next.op != NULL ? trace_##op : NULL
+
+struct fuse_operations *kvfs_trace_wrap(const struct fuse_operations *ops, FILE *out)
+{
+    next = *ops;
+    traced = *ops;
+    trace_out = out;
+    trace_start = now_usec();
+    setvbuf(out, NULL, _IOFBF, TRACE_BUFFER);
+    fprintf(out, "%s\n# %s\n", TRACE_HEADER, TRACE_COLUMNS);
+    fflush(out);
+
+    WRAP(getattr);
+    WRAP(readlink);
+    WRAP(mknod);
+    WRAP(mkdir);
+    WRAP(unlink);
+    WRAP(rmdir);
+    WRAP(symlink);
+    WRAP(rename);
+    WRAP(link);
+    WRAP(chmod);
+    WRAP(chown);
+    WRAP(truncate);
+    WRAP(utime);
+    WRAP(open);
+    WRAP(read);
+    WRAP(write);
+    WRAP(read_buf);
+    WRAP(write_buf);
+    WRAP(statfs);
+    WRAP(flush);
+    WRAP(release);
+    WRAP(fsync);
+    WRAP(setxattr);
+    WRAP(getxattr);
+    WRAP(listxattr);
+    WRAP(removexattr);
+    WRAP(opendir);
+    WRAP(readdir);
+    WRAP(releasedir);
+    WRAP(fsyncdir);
+    WRAP(access);
+    WRAP(ftruncate);
+    WRAP(fgetattr);
+    WRAP(fallocate);
+    traced.destroy = trace_destroy;
+
+    return &traced;
+}
@@ -0,0 +1,32 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Call tracing (-o trace=FILE), see trace.c.  kvfs-replay reads the
+  traces back.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+
+struct fuse_operations;
+
+#define TRACE_HEADER "# kvfs-trace 1"
+
+// the columns of a trace line, in order
+#define TRACE_COLUMNS "start dur pid op ret fh path path2 off size mode"
+
+// Return an operations table that records every call and then passes
+// it on to ops.  The trace is written to out, which is closed by
+// destroy.
+struct fuse_operations *kvfs_trace_wrap(const struct fuse_operations *ops, FILE *out);
+
+// %-escape a path so it has no whitespace; returns buf
+char *kvfs_trace_escape(const char *path, char *buf, size_t len);
+// undo kvfs_trace_escape in place
+void kvfs_trace_unescape(char *s);
+
+#endif
@@ -0,0 +1,631 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  kvfs's own FUSE session loop, run instead of fuse_loop_mt() unless
+  kvfs is mounted single-threaded (-s).
+
+  fuse_loop_mt() starts another thread whenever all it has are busy
+  and lets idle ones exit again, with nothing tying a thread to a CPU.
+  Here a fixed pool of workers serves requests, one per CPU kvfs may
+  run on unless -o workers says otherwise.  Each one is pinned to a
+  CPU (-o workers_pin=0 leaves them free); the workers on a NUMA node
+  get that node's CPUs next to each other, and every worker allocates
+  its request buffers itself, after pinning, so they come from its
+  own node.
+
+  Requests are handed out by work stealing.  Each worker owns a
+  Chase-Lev deque: it pushes and pops at the bottom without a lock,
+  other workers steal from the top, and only the race for the last
+  entry takes a compare-and-swap.  One idle worker at a time is the
+  reader: it waits on /dev/fuse, then reads whatever is queued there
+  (up to BURST requests) without blocking into its own deque.  For
+  each request read it wakes one sleeping worker, to steal one or
+  become the next reader, and starts on its deque from the newest end
+  while the others take the oldest.  A would-be reader whose buffers
+  are all still queued wakes another worker to read instead, and
+  sleeps.  A worker out of work steals from the workers on its own
+  node before the others, and sleeps when there is nothing to steal
+  and someone else is reading.
+
+  kvfs-bench and the other tools never mount, so none of this is
+  built into them.
+*/
+
+#include "kvfs.h"
+
+#ifndef KVFS_BENCH
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <poll.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "stats.h"
+#include "workers.h"
+
+#define BURST		32	// requests one read pass takes at most; buffers per worker
+#define DEQUE_SIZE	64	// a power of two, at least BURST
+#define STARVED		(-2)	// read_requests(): none of our buffers is free
+
+struct worker;
+
+struct request {
+    struct worker *owner;	// whose buffer this is
+    struct request *next;	// on the owner's free list
+    struct fuse_chan *ch;
+    size_t len;
+    char buf[];
+};
+
+struct worker {
+    // the deque; top and bottom each on a cache line of their own
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    struct request *slots[DEQUE_SIZE];
+
+    pthread_t thread;
+    int cpu;			// pinned to; -1 if not pinned
+    int node;
+    int *victims;		// every other worker, those on our node first
+
+    struct request *bufs[BURST];	// every buffer we allocated
+    int nbufs;
+    pthread_mutex_t free_lock;
+    struct request *free;
+
+    uint64_t served, stolen, passes, read, sleeps;
+};
+
+static struct fuse_session *session;
+static struct fuse_chan *chan;
+static int chan_fd;
+static size_t bufsize;
+static int stop_pipe[2] = { -1, -1 };
+static sem_t finished;
+static int failed;
+
+static struct worker **workers;
+static int nworkers, nnodes, pinned;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static int reading;		// a worker is the reader
+static int nidle;		// workers asleep on pool_wake
+static int stopping;
+
+// what the workers of the last loop did, for the report at unmount
+static uint64_t done_served, done_stolen, done_passes, done_read, done_sleeps;
+static uint64_t done_most, done_least;
+
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// owner only; the deque never holds more than BURST, so it has room
+static void push(struct worker *w, struct request *r)
+{
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&w->slots[b & (DEQUE_SIZE - 1)], r, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+// owner only: the newest request, NULL if there is none
+static struct request *pop(struct worker *w)
+{
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    struct request *r;
+
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+    if (t > b) {
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return NULL;
+    }
+    r = __atomic_load_n(&w->slots[b & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+	// the last one: a thief may be after it too
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	    r = NULL;
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return r;
+}
+
+// anyone: the oldest request of w, NULL if there is none or another
+// thief or w itself got it first
+static struct request *steal(struct worker *w)
+{
+    long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    long b;
+    struct request *r;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+	return NULL;
+    r = __atomic_load_n(&w->slots[t & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+				     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	return NULL;
+    return r;
+}
+
+// a request from another worker's deque, nearest ones first
+static struct request *steal_one(struct worker *w)
+{
+    struct request *r;
+    int i;
+
+    for (i = 0; i < nworkers - 1; i++) {
+	r = steal(workers[w->victims[i]]);
+	if (r != NULL) {
+	    COUNT(w->stolen, 1);
+	    return r;
+	}
+    }
+    return NULL;
+}
+
+// a free buffer of w's, NULL if all BURST are in use
+static struct request *get_buffer(struct worker *w)
+{
+    struct request *r;
+
+    pthread_mutex_lock(&w->free_lock);
+    r = w->free;
+    if (r != NULL)
+	w->free = r->next;
+    pthread_mutex_unlock(&w->free_lock);
+    if (r == NULL && w->nbufs < BURST) {
+	r = malloc(sizeof(*r) + bufsize);
+	if (r != NULL) {
+	    r->owner = w;
+	    w->bufs[w->nbufs++] = r;
+	}
+    }
+    return r;
+}
+
+static void put_buffer(struct request *r)
+{
+    struct worker *w = r->owner;
+
+    pthread_mutex_lock(&w->free_lock);
+    r->next = w->free;
+    w->free = r;
+    pthread_mutex_unlock(&w->free_lock);
+}
+
+// with pool_lock held: tell every worker and the loop to stop
+static void finish(void)
+{
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool_wake);
+    sem_post(&finished);
+}
+
+// Wait for requests and read those queued into w's deque; how many
+// were read, -1 once the session is over, or STARVED without waiting
+// if all of w's buffers are still being served.
+static int read_requests(struct worker *w)
+{
+    struct pollfd fds[2];
+    struct request *r;
+    int n = 0, res;
+
+    r = get_buffer(w);
+    if (r == NULL)
+	return STARVED;
+
+    fds[0].fd = chan_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_pipe[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+	if (errno == EINTR) {
+	    put_buffer(r);
+	    return 0;
+	}
+	log_error("workers poll");
+	failed = 1;
+	put_buffer(r);
+	return -1;
+    }
+    if (fds[1].revents != 0) {
+	put_buffer(r);
+	return -1;
+    }
+
+    COUNT(w->passes, 1);
+    while (n < BURST) {
+	// the rest of ours are being served; what was read will do
+	if (r == NULL && (r = get_buffer(w)) == NULL)
+	    break;
+	r->ch = chan;
+	res = fuse_chan_recv(&r->ch, r->buf, bufsize);
+	if (res == -EAGAIN || res == -EINTR) {
+	    put_buffer(r);
+	    break;
+	}
+	if (res <= 0) {
+	    // unmounted, or fuse_chan_recv() said what went wrong; what
+	    // was read before is served first
+	    put_buffer(r);
+	    if (res < 0)
+		failed = 1;
+	    fuse_session_exit(session);
+	    if (n == 0)
+		return -1;
+	    break;
+	}
+	r->len = res;
+	push(w, r);
+	r = NULL;
+	n++;
+    }
+    COUNT(w->read, n);
+    return n;
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+static void pin(struct worker *w)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+	log_error("workers sched_setaffinity");
+	w->cpu = -1;
+    }
+}
+#endif
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct request *r;
+    int n, i;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (w->cpu >= 0)
+	pin(w);
+#endif
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+	r = pop(w);
+	if (r == NULL)
+	    r = steal_one(w);
+	if (r != NULL) {
+	    fuse_session_process(session, r->buf, r->len, r->ch);
+	    COUNT(w->served, 1);
+	    put_buffer(r);
+	    continue;
+	}
+
+	// nothing queued anywhere: read more, unless someone already is
+	pthread_mutex_lock(&pool_lock);
+	if (!reading && !stopping) {
+	    reading = 1;
+	    pthread_mutex_unlock(&pool_lock);
+	    n = read_requests(w);
+	    pthread_mutex_lock(&pool_lock);
+	    reading = 0;
+	    if (n == STARVED) {
+		// our buffers are queued behind other workers: let one
+		// with buffers to spare read, and wait for its wakeup
+		// rather than spin until ours come back
+		pthread_cond_signal(&pool_wake);
+		if (!stopping) {
+		    nidle++;
+		    COUNT(w->sleeps, 1);
+		    pthread_cond_wait(&pool_wake, &pool_lock);
+		    nidle--;
+		}
+	    } else if (n < 0)
+		finish();
+	    for (i = 0; i < n && i < nidle; i++)
+		pthread_cond_signal(&pool_wake);
+	} else if (!stopping) {
+	    nidle++;
+	    COUNT(w->sleeps, 1);
+	    pthread_cond_wait(&pool_wake, &pool_lock);
+	    nidle--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+// the NUMA node of cpu, from sysfs; 0 if there is no telling
+static int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *de;
+    DIR *dir;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL)
+	return 0;
+    while ((de = readdir(dir)) != NULL)
+	if (sscanf(de->d_name, "node%d", &node) == 1)
+	    break;
+    closedir(dir);
+    return node;
+}
+
+struct place {
+    int cpu, node;
+};
+
+static int by_node(const void *a, const void *b)
+{
+    const struct place *pa = a, *pb = b;
+
+    if (pa->node != pb->node)
+	return pa->node < pb->node ? -1 : 1;
+    return pa->cpu < pb->cpu ? -1 : pa->cpu > pb->cpu;
+}
+
+// The CPUs kvfs may run on, a node's next to each other; *n of them.
+// Without affinity calls every CPU is on node 0 and none is pinned to.
+static struct place *list_cpus(int *n)
+{
+    struct place *cpus;
+    int i, count = 0;
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+	cpus = calloc(CPU_COUNT(&set), sizeof(*cpus));
+	if (cpus == NULL)
+	    return NULL;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+	    if (CPU_ISSET(i, &set)) {
+		cpus[count].cpu = i;
+		cpus[count].node = cpu_node(i);
+		count++;
+	    }
+	}
+	qsort(cpus, count, sizeof(*cpus), by_node);
+	*n = count;
+	return cpus;
+    }
+#endif
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1)
+	count = 1;
+    cpus = calloc(count, sizeof(*cpus));
+    if (cpus == NULL)
+	return NULL;
+    for (i = 0; i < count; i++)
+	cpus[i].cpu = -1;
+    *n = count;
+    return cpus;
+}
+
+static void free_workers(void)
+{
+    struct worker *w;
+    int i, j;
+
+    for (i = 0; i < nworkers; i++) {
+	w = workers[i];
+	if (w == NULL)
+	    continue;
+	for (j = 0; j < w->nbufs; j++)
+	    free(w->bufs[j]);
+	pthread_mutex_destroy(&w->free_lock);
+	free(w->victims);
+	free(w);
+    }
+    free(workers);
+    workers = NULL;
+}
+
+static int make_workers(struct kvfs_state *state)
+{
+    struct place *cpus;
+    struct worker *w;
+    int ncpus, i, j, k, last_node = -1;
+
+    cpus = list_cpus(&ncpus);
+    if (cpus == NULL)
+	return -ENOMEM;
+    nworkers = state->workers > 0 ? (int) state->workers : ncpus;
+    pinned = state->workers_pin && cpus[0].cpu >= 0;
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL) {
+	free(cpus);
+	return -ENOMEM;
+    }
+
+    // more workers than CPUs share them round robin
+    nnodes = 0;
+    for (i = 0; i < nworkers; i++) {
+	if (posix_memalign((void **) &w, 64, sizeof(*w)) != 0)
+	    goto nomem;
+	memset(w, 0, sizeof(*w));
+	workers[i] = w;
+	w->cpu = pinned ? cpus[i % ncpus].cpu : -1;
+	w->node = cpus[i % ncpus].node;
+	if (i < ncpus && w->node != last_node) {
+	    nnodes++;
+	    last_node = w->node;
+	}
+	pthread_mutex_init(&w->free_lock, NULL);
+	w->victims = calloc(nworkers, sizeof(int));
+	if (w->victims == NULL)
+	    goto nomem;
+    }
+    free(cpus);
+
+    // steal from our node's workers first, the next ones up first
+    for (i = 0; i < nworkers; i++) {
+	k = 0;
+	for (j = 1; j < nworkers; j++)
+	    if (workers[(i + j) % nworkers]->node == workers[i]->node)
+		workers[i]->victims[k++] = (i + j) % nworkers;
+	for (j = 1; j < nworkers; j++)
+	    if (workers[(i + j) % nworkers]->node != workers[i]->node)
+		workers[i]->victims[k++] = (i + j) % nworkers;
+    }
+    return 0;
+
+nomem:
+    free(cpus);
+    free_workers();
+    return -ENOMEM;
+}
+
+// add the workers' counters to the last loop's; with pool_lock held
+static void fold_counters(void)
+{
+    struct worker *w;
+    int i;
+
+    done_most = 0;
+    done_least = nworkers > 0 ? UINT64_MAX : 0;
+    for (i = 0; i < nworkers; i++) {
+	w = workers[i];
+	done_served += w->served;
+	done_stolen += w->stolen;
+	done_passes += w->passes;
+	done_read += w->read;
+	done_sleeps += w->sleeps;
+	if (w->served > done_most)
+	    done_most = w->served;
+	if (w->served < done_least)
+	    done_least = w->served;
+    }
+}
+
+static void workers_report(FILE *out)
+{
+    uint64_t served, stolen, passes, read, sleeps, most, least;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    if (workers != NULL) {
+	served = stolen = passes = read = sleeps = most = 0;
+	least = UINT64_MAX;
+	for (i = 0; i < nworkers; i++) {
+	    struct worker *w = workers[i];
+	    uint64_t n = __atomic_load_n(&w->served, __ATOMIC_RELAXED);
+
+	    served += n;
+	    stolen += __atomic_load_n(&w->stolen, __ATOMIC_RELAXED);
+	    passes += __atomic_load_n(&w->passes, __ATOMIC_RELAXED);
+	    read += __atomic_load_n(&w->read, __ATOMIC_RELAXED);
+	    sleeps += __atomic_load_n(&w->sleeps, __ATOMIC_RELAXED);
+	    if (n > most)
+		most = n;
+	    if (n < least)
+		least = n;
+	}
+    } else {
+	served = done_served;
+	stolen = done_stolen;
+	passes = done_passes;
+	read = done_read;
+	sleeps = done_sleeps;
+	most = done_most;
+	least = done_least;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    fprintf(out, "    %d worker(s) on %d node(s), %s\n", nworkers, nnodes,
+	    pinned ? "pinned" : "not pinned");
+    fprintf(out, "    %llu request(s), %llu stolen; the busiest worker served %llu, the idlest %llu\n",
+	    (unsigned long long) served, (unsigned long long) stolen,
+	    (unsigned long long) most, (unsigned long long) least);
+    fprintf(out, "    %llu read pass(es), %.1f request(s) each; %llu sleep(s)\n",
+	    (unsigned long long) passes, passes ? (double) read / passes : 0.0,
+	    (unsigned long long) sleeps);
+}
+
+int kvfs_workers_loop(struct fuse *fuse, struct kvfs_state *state)
+{
+    sigset_t sigs, old;
+    int flags, started, retstat;
+
+    session = fuse_get_session(fuse);
+    chan = fuse_session_next_chan(session, NULL);
+    chan_fd = fuse_chan_fd(chan);
+    bufsize = fuse_chan_bufsize(chan);
+    flags = fcntl(chan_fd, F_GETFL);
+    if (flags < 0 || fcntl(chan_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	return log_error("workers fcntl");
+    if (pipe(stop_pipe) < 0)
+	return log_error("workers pipe");
+    retstat = make_workers(state);
+    if (retstat < 0) {
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	return retstat;
+    }
+    sem_init(&finished, 0, 0);
+    failed = 0;
+    stopping = 0;
+    reading = 0;
+    nidle = 0;
+    log_msg("    workers: %d on %d node(s), %s\n", nworkers, nnodes, pinned ? "pinned" : "not pinned");
+    kvfs_stats_register("workers", workers_report);
+
+    retstat = fuse_start_cleanup_thread(fuse);
+    if (retstat < 0)
+	failed = 1;
+
+    // fuse's exit handler is for this thread, waiting below
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old);
+    for (started = 0; !failed && started < nworkers; started++) {
+	if (pthread_create(&workers[started]->thread, NULL, worker_main, workers[started]) != 0) {
+	    log_error("workers pthread_create");
+	    failed = 1;
+	    break;
+	}
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    while (!failed && !fuse_session_exited(session) && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+	sem_wait(&finished);
+
+    pthread_mutex_lock(&pool_lock);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+    if (write(stop_pipe[1], "", 1) < 0)
+	log_error("workers write");
+    while (started > 0)
+	pthread_join(workers[--started]->thread, NULL);
+    if (retstat == 0)
+	fuse_stop_cleanup_thread(fuse);
+
+    pthread_mutex_lock(&pool_lock);
+    fold_counters();
+    free_workers();
+    pthread_mutex_unlock(&pool_lock);
+    sem_destroy(&finished);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    fuse_session_reset(session);
+    return failed ? -1 : 0;
+}
+#endif
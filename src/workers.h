@@ -0,0 +1,18 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+struct fuse;
+struct kvfs_state;
+
+// Serve fuse until it is unmounted or kvfs is told to exit, with
+// state->workers workers of our own instead of fuse_loop_mt()'s
+// threads; returns like fuse_loop_mt().
+int kvfs_workers_loop(struct fuse *fuse, struct kvfs_state *state);
+
+#endif
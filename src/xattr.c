@@ -0,0 +1,320 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Extended attribute cache.
+
+  ls, cp -a, rsync and anything SELinux or ACL aware ask every file
+  for security.selinux, system.posix_acl_access and friends, nearly
+  always to be told ENODATA, and ask again the next time round.  The
+  answers are kept here per object, absent attributes included, so a
+  repeated probe is a hash lookup rather than a syscall.
+
+  Entries are dropped when the object is recreated, removed, renamed
+  or has its mode or owner changed (chmod rewrites the ACL mask).
+  setxattr and removexattr clear the whole cache: a hard link is a
+  second key for the same attributes.  security.capability is only
+  cached when absent, since the kernel strips it on write and
+  truncate without telling us.  When the table reaches xattr_cache
+  objects it is cleared and refilled from scratch.
+
+  A getxattr that read the backing file before a concurrent change
+  must not cache what it read after the change dropped the entry.
+  Each miss hands out the generation of the object's stripe of
+  GEN_STRIPES counters, plus that of the whole cache; forgetting an
+  object bumps its stripe, a flush the whole cache, and a put whose
+  generation has moved is dropped.
+*/
+
+#include "kvfs.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htable.h"
+#include "log.h"
+#include "stats.h"
+#include "xattr.h"
+
+#define MAX_ATTRS 32			// per object; the rest are not cached
+#define MAX_VALUE 256			// larger values are not cached
+#define GEN_STRIPES 256			// generation counters objects hash to
+
+struct xattr_attr {
+    struct xattr_attr *next;
+    ssize_t len;			// -ENODATA if the file has no such attribute
+    char *name;				// follows value
+    char value[];
+};
+
+struct xattr_obj {
+    struct hnode node;
+    struct xattr_attr *attrs;
+    int nattrs;
+    ssize_t list_len;			// -1 until listxattr has been asked
+    char *list;
+};
+
+static pthread_mutex_t xattr_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable xattr_cache;
+static size_t xattr_max;		// objects; 0 disables the cache
+
+// under xattr_lock, and only ever go up
+static uint64_t gens[GEN_STRIPES];
+static uint64_t flush_gen;
+
+static uint64_t hits, negative_hits, misses, flushes, stale;
+
+static void free_obj(struct hnode *node)
+{
+    struct xattr_obj *obj = (struct xattr_obj *) node;
+    struct xattr_attr *a, *next;
+
+    for (a = obj->attrs; a != NULL; a = next) {
+	next = a->next;
+	free(a);
+    }
+    free(obj->list);
+    free(obj);
+}
+
+static int drop_obj(struct hnode *node, void *arg)
+{
+    (void) arg;
+    htable_remove(&xattr_cache, node->key);
+    free_obj(node);
+    return 0;
+}
+
+// with xattr_lock held
+static struct xattr_obj *get_obj(const char *key, int create)
+{
+    struct xattr_obj *obj = (struct xattr_obj *) htable_lookup(&xattr_cache, key);
+
+    if (obj != NULL || !create)
+	return obj;
+    if (xattr_cache.count >= xattr_max) {
+	htable_foreach(&xattr_cache, drop_obj, NULL);
+	flushes++;
+    }
+    obj = calloc(1, sizeof(*obj));
+    if (obj == NULL)
+	return NULL;
+    strncpy(obj->node.key, key, KVFS_KEY_LEN - 1);
+    obj->list_len = -1;
+    htable_insert(&xattr_cache, &obj->node);
+    return obj;
+}
+
+static uint64_t *stripe_gen(const char *key)
+{
+    unsigned int h = 0;
+
+    while (*key)
+	h = h * 31 + (unsigned char) *key++;
+    return &gens[h % GEN_STRIPES];
+}
+
+// with xattr_lock held
+static uint64_t current_gen(const char *key)
+{
+    return *stripe_gen(key) + flush_gen;
+}
+
+// with xattr_lock held
+static int is_stale(const char *key, uint64_t gen)
+{
+    if (current_gen(key) == gen)
+	return 0;
+    stale++;
+    return 1;
+}
+
+// what getxattr/listxattr return for a value of len bytes
+static ssize_t reply(char *buf, size_t size, const char *value, ssize_t len)
+{
+    if (len < 0 || size == 0)
+	return len;
+    if (size < (size_t) len)
+	return -ERANGE;
+    memcpy(buf, value, len);
+    return len;
+}
+
+static void xattr_report(FILE *out)
+{
+    pthread_mutex_lock(&xattr_lock);
+    fprintf(out, "    %zu object(s) cached, %llu hit(s) (%llu absent), %llu miss(es), %llu flush(es), "
+	    "%llu stale answer(s) not cached\n",
+	    xattr_cache.count, (unsigned long long) hits, (unsigned long long) negative_hits,
+	    (unsigned long long) misses, (unsigned long long) flushes, (unsigned long long) stale);
+    pthread_mutex_unlock(&xattr_lock);
+}
+
+int kvfs_xattr_init(struct kvfs_state *state)
+{
+    xattr_max = state->xattr_cache;
+    hits = negative_hits = misses = flushes = stale = 0;
+    if (xattr_max == 0)
+	return 0;
+    if (htable_init(&xattr_cache, xattr_max) < 0) {
+	xattr_max = 0;
+	return log_error("xattr cache htable_init");
+    }
+    log_msg("    xattr cache: %zu objects\n", xattr_max);
+    kvfs_stats_register("xattr", xattr_report);
+    return 0;
+}
+
+void kvfs_xattr_destroy(struct kvfs_state *state)
+{
+    (void) state;
+
+    if (xattr_max == 0)
+	return;
+    kvfs_stats_unregister("xattr");
+    pthread_mutex_lock(&xattr_lock);
+    htable_free(&xattr_cache, free_obj);
+    xattr_max = 0;
+    pthread_mutex_unlock(&xattr_lock);
+}
+
+int kvfs_xattr_get(const char *key, const char *name, char *value, size_t size,
+		   ssize_t *retstat, uint64_t *gen)
+{
+    struct xattr_obj *obj;
+    struct xattr_attr *a = NULL;
+
+    *gen = 0;
+    if (xattr_max == 0)
+	return 0;
+
+    pthread_mutex_lock(&xattr_lock);
+    obj = get_obj(key, 0);
+    if (obj != NULL)
+	for (a = obj->attrs; a != NULL && strcmp(a->name, name) != 0; a = a->next)
+	    ;
+    if (a == NULL) {
+	misses++;
+	*gen = current_gen(key);
+	pthread_mutex_unlock(&xattr_lock);
+	return 0;
+    }
+    hits++;
+    if (a->len < 0)
+	negative_hits++;
+    *retstat = reply(value, size, a->value, a->len);
+    pthread_mutex_unlock(&xattr_lock);
+    return 1;
+}
+
+int kvfs_xattr_list(const char *key, char *list, size_t size, ssize_t *retstat, uint64_t *gen)
+{
+    struct xattr_obj *obj;
+
+    *gen = 0;
+    if (xattr_max == 0)
+	return 0;
+
+    pthread_mutex_lock(&xattr_lock);
+    obj = get_obj(key, 0);
+    if (obj == NULL || obj->list_len < 0) {
+	misses++;
+	*gen = current_gen(key);
+	pthread_mutex_unlock(&xattr_lock);
+	return 0;
+    }
+    hits++;
+    *retstat = reply(list, size, obj->list, obj->list_len);
+    pthread_mutex_unlock(&xattr_lock);
+    return 1;
+}
+
+void kvfs_xattr_put(const char *key, const char *name, const char *value, ssize_t len,
+		    uint64_t gen)
+{
+    struct xattr_obj *obj;
+    struct xattr_attr *a;
+    size_t vlen = len > 0 ? len : 0;
+
+    if (xattr_max == 0 || len > MAX_VALUE || (len < 0 && len != -ENODATA))
+	return;
+    if (len >= 0 && strcmp(name, "security.capability") == 0)
+	return;
+
+    pthread_mutex_lock(&xattr_lock);
+    if (is_stale(key, gen))
+	goto out;
+    obj = get_obj(key, 1);
+    if (obj == NULL || obj->nattrs >= MAX_ATTRS)
+	goto out;
+    for (a = obj->attrs; a != NULL; a = a->next)
+	if (strcmp(a->name, name) == 0)
+	    goto out;
+    a = malloc(sizeof(*a) + vlen + strlen(name) + 1);
+    if (a == NULL)
+	goto out;
+    a->len = len;
+    memcpy(a->value, value, vlen);
+    a->name = a->value + vlen;
+    strcpy(a->name, name);
+    a->next = obj->attrs;
+    obj->attrs = a;
+    obj->nattrs++;
+out:
+    pthread_mutex_unlock(&xattr_lock);
+}
+
+void kvfs_xattr_put_list(const char *key, const char *list, ssize_t len, uint64_t gen)
+{
+    struct xattr_obj *obj;
+    char *copy = NULL;
+
+    if (xattr_max == 0 || len < 0)
+	return;
+    if (len > 0) {
+	copy = malloc(len);
+	if (copy == NULL)
+	    return;
+	memcpy(copy, list, len);
+    }
+
+    pthread_mutex_lock(&xattr_lock);
+    obj = is_stale(key, gen) ? NULL : get_obj(key, 1);
+    if (obj != NULL && obj->list_len < 0) {
+	obj->list = copy;
+	obj->list_len = len;
+	copy = NULL;
+    }
+    pthread_mutex_unlock(&xattr_lock);
+    free(copy);
+}
+
+void kvfs_xattr_forget(const char *key)
+{
+    struct hnode *node;
+
+    if (xattr_max == 0)
+	return;
+    pthread_mutex_lock(&xattr_lock);
+    (*stripe_gen(key))++;
+    node = htable_remove(&xattr_cache, key);
+    if (node != NULL)
+	free_obj(node);
+    pthread_mutex_unlock(&xattr_lock);
+}
+
+void kvfs_xattr_flush(void)
+{
+    if (xattr_max == 0)
+	return;
+    pthread_mutex_lock(&xattr_lock);
+    htable_foreach(&xattr_cache, drop_obj, NULL);
+    flush_gen++;
+    flushes++;
+    pthread_mutex_unlock(&xattr_lock);
+}
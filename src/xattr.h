@@ -0,0 +1,40 @@
+/*
+  Key Value System
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _XATTR_H_
+#define _XATTR_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct kvfs_state;
+
+int  kvfs_xattr_init(struct kvfs_state *state);
+void kvfs_xattr_destroy(struct kvfs_state *state);
+
+// Answer getxattr/listxattr for object key from the cache.  Returns 1
+// and sets *retstat (a length or -errno, as the syscall would) on a
+// hit, 0 if the caller has to ask the backing file; then *gen is to
+// be handed back to kvfs_xattr_put*() with the answer.
+int  kvfs_xattr_get(const char *key, const char *name, char *value, size_t size,
+		    ssize_t *retstat, uint64_t *gen);
+int  kvfs_xattr_list(const char *key, char *list, size_t size, ssize_t *retstat, uint64_t *gen);
+
+// Remember what the backing file answered; len is a length, or
+// -ENODATA for an attribute it does not have.  Dropped if the object
+// was forgotten or flushed since gen was taken: the answer may be
+// from before the change.
+void kvfs_xattr_put(const char *key, const char *name, const char *value, ssize_t len,
+		    uint64_t gen);
+void kvfs_xattr_put_list(const char *key, const char *list, ssize_t len, uint64_t gen);
+
+// the object changed under key: created, removed, renamed, chmod'ed
+void kvfs_xattr_forget(const char *key);
+// an attribute was set or removed; hard links share them, so
+// everything goes
+void kvfs_xattr_flush(void);
+
+#endif